@@ -1419,6 +1419,29 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_CREATEINFO_XEND_SUSPEND_EVTCHN_COMPAT
 
+/*
+ * LIBXL_HAVE_SUSPEND_WORKERS
+ *
+ * libxl_domain_suspend() accepts a number of worker threads for preparing
+ * page data, as LIBXL_SUSPEND_WORKERS(n) in its flags.
+ */
+#define LIBXL_HAVE_SUSPEND_WORKERS
+
+/*
+ * LIBXL_HAVE_SUSPEND_ENCODE
+ *
+ * libxl_domain_suspend() accepts LIBXL_SUSPEND_ENCODE_* flags, to send page
+ * data in encoded form.
+ */
+#define LIBXL_HAVE_SUSPEND_ENCODE
+
+/*
+ * LIBXL_HAVE_SUSPEND_ADAPTIVE_PRECOPY
+ *
+ * libxl_domain_suspend() accepts LIBXL_SUSPEND_ADAPTIVE_PRECOPY.
+ */
+#define LIBXL_HAVE_SUSPEND_ADAPTIVE_PRECOPY
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1781,6 +1804,23 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+/*
+ * Send page data encoded, which the restoring side must support: elide
+ * all-zero pages, send only the changed words of resent pages, deflate.
+ */
+#define LIBXL_SUSPEND_ENCODE_ZERO 4
+#define LIBXL_SUSPEND_ENCODE_DELTA 8
+#define LIBXL_SUSPEND_ENCODE_COMPRESS 16
+/*
+ * Finish precopy based on the predicted downtime rather than on fixed
+ * thresholds, throttling the domain's vcpus if precopy doesn't converge.
+ */
+#define LIBXL_SUSPEND_ADAPTIVE_PRECOPY 32
+/* Threads mapping and preparing page data in parallel, 0 for none. */
+#define LIBXL_SUSPEND_WORKERS_SHIFT 8
+#define LIBXL_SUSPEND_WORKERS_MASK  (0xff << LIBXL_SUSPEND_WORKERS_SHIFT)
+#define LIBXL_SUSPEND_WORKERS(n) \
+    (((n) << LIBXL_SUSPEND_WORKERS_SHIFT) & LIBXL_SUSPEND_WORKERS_MASK)
 
 /*
  * Only suspend domain, do not save its state to file, do not destroy it.
@@ -892,6 +892,34 @@ long long xc_logdirty_control(xc_interface *xch,
                               unsigned long pages,
                               unsigned int mode,
                               xc_shadow_op_stats_t *stats);
+/*
+ * As xc_logdirty_control(), but Xen returns the dirty pages as a list of
+ * pfns in @dirty_pfns if there are no more than *@nr_pfns of them.  On
+ * success, *@nr_pfns is updated with the number of pfns in the list, or set
+ * to XC_LOGDIRTY_NO_PFN_LIST if Xen filled @dirty_bitmap instead.
+ */
+#define XC_LOGDIRTY_NO_PFN_LIST (~0U)
+long long xc_logdirty_control_pfns(xc_interface *xch,
+                                   uint32_t domid,
+                                   unsigned int sop,
+                                   xc_hypercall_buffer_t *dirty_bitmap,
+                                   unsigned long pages,
+                                   xc_hypercall_buffer_t *dirty_pfns,
+                                   unsigned int *nr_pfns,
+                                   unsigned int mode,
+                                   xc_shadow_op_stats_t *stats);
+
+/*
+ * Per-vCPU dirty rings, see XEN_DOMCTL_SHADOW_OP_DIRTY_RING_ENABLE.  The ring
+ * of a vCPU is mapped with xenforeignmemory_map_resource(), as resource
+ * XENMEM_resource_dirty_ring with the vCPU as id, and spans
+ * XC_DIRTY_RING_FRAMES(@entries) frames.
+ */
+#define XC_DIRTY_RING_FRAMES(entries) \
+    (1 + (entries) / (XC_PAGE_SIZE / sizeof(uint64_t)))
+int xc_dirty_ring_enable(xc_interface *xch, uint32_t domid,
+                         unsigned int entries);
+int xc_dirty_ring_reset(xc_interface *xch, uint32_t domid);
 
 int xc_get_paging_mempool_size(xc_interface *xch, uint32_t domid, uint64_t *size);
 int xc_set_paging_mempool_size(xc_interface *xch, uint32_t domid, uint64_t size);
@@ -1476,6 +1504,18 @@ long xc_get_tot_pages(xc_interface *xch, uint32_t domid);
 int xc_availheap(xc_interface *xch, int min_width, int max_width, int node,
                  uint64_t *bytes);
 
+/**
+ * This function returns the number of free pages still to be scrubbed.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm node the node to query (-1 for all)
+ * @parm wait only return once all pages are scrubbed, helping meanwhile
+ * @parm *pages caller variable to put the number of pages
+ * @return 0 on success, <0 on failure.
+ */
+int xc_scrub_pending(xc_interface *xch, int node, bool wait,
+                     uint64_t *pages);
+
 /*
  * Trace Buffer Operations
  */
@@ -22,6 +22,7 @@
 #include <xen/xen.h>
 #include <xen/hvm/dm_op.h>
 #include <xen/hvm/hvm_op.h>
+#include <xen/hvm/ioreq.h>
 
 /* Callers who don't care don't need to #include <xentoollog.h> */
 struct xentoollog_logger;
@@ -51,6 +52,40 @@ int xendevicemodel_create_ioreq_server(
     xendevicemodel_handle *dmod, domid_t domid, int handle_bufioreq,
     ioservid_t *id);
 
+/**
+ * This function instantiates an IOREQ Server handling buffered requests
+ * through a multi-frame ring (HVM_IOREQSRV_BUFIOREQ_RING).
+ *
+ * The ring has to be mapped using xenforeignmemory_map_resource(), from
+ * frame XENMEM_resource_ioreq_server_frame_bufring(0) of the IOREQ Server
+ * resource, for (1 + (1 << order)) frames.  It is consumed using
+ * xendevicemodel_bufioreq_drain().
+ *
+ * @parm dmod a handle to an open devicemodel interface.
+ * @parm domid the domain id to be serviced
+ * @parm order log2 of the number of frames of ring slots.
+ * @parm id pointer to an ioservid_t to receive the IOREQ Server id.
+ * @return 0 on success, -1 on failure.
+ */
+int xendevicemodel_create_ioreq_server_ring(
+    xendevicemodel_handle *dmod, domid_t domid, unsigned int order,
+    ioservid_t *id);
+
+/**
+ * This function takes pending requests off a buffered ioreq ring, releasing
+ * their slots to Xen at once.  If it empties the ring, it asks Xen for a
+ * notification of the next request, and the caller can then wait on the
+ * buffered ioreq event channel.  If it returns @p nr, the ring may not be
+ * empty yet, and the caller has to call it again before waiting.
+ *
+ * @parm ring the mapped ring.
+ * @parm reqs array to receive the requests, decoded as ioreq_t.
+ * @parm nr the size of @p reqs.
+ * @return the number of requests taken.
+ */
+unsigned int xendevicemodel_bufioreq_drain(
+    buffered_ioreq_ring_t *ring, ioreq_t reqs[], unsigned int nr);
+
 /**
  * This function retrieves the necessary information to allow an
  * emulator to use an IOREQ Server.
@@ -109,6 +109,16 @@ int xenevtchn_fd(xenevtchn_handle *xce);
  */
 int xenevtchn_notify(xenevtchn_handle *xce, evtchn_port_t port);
 
+/*
+ * Notify each of the given event channels, in order, stopping at the first
+ * one which can't be notified.  Only on Mini-OS is this done with a single
+ * hypercall: the evtchn drivers of other systems have no batched notify, so
+ * the ports get notified one at a time there.  Returns -1 on failure, in
+ * which case errno will be set appropriately.
+ */
+int xenevtchn_notify_batch(xenevtchn_handle *xce, const evtchn_port_t *ports,
+                           unsigned int nr_ports);
+
 /*
  * Returns a new event port awaiting interdomain connection from the given
  * domain ID, or -1 on failure, in which case errno will be set appropriately.
@@ -27,6 +27,47 @@
 #define XCFLAGS_LIVE      (1 << 0)
 #define XCFLAGS_DEBUG     (1 << 1)
 
+/*
+ * Send page data as ENCODED_PAGE_DATA records, which the restorer must
+ * understand.  ZERO elides all-zero pages, DELTA sends only the changed
+ * words of pages resent during live migration, and COMPRESS deflates each
+ * record.
+ */
+#define XCFLAGS_ENCODE_ZERO     (1 << 2)
+#define XCFLAGS_ENCODE_DELTA    (1 << 3)
+#define XCFLAGS_ENCODE_COMPRESS (1 << 4)
+
+/*
+ * Permit a live migration to finish in postcopy mode, where the guest is
+ * resumed on the restoring side before all of its memory has been sent.
+ * Only supported for HVM guests, and requires a back channel from the
+ * restorer.  See XGS_POLICY_POSTCOPY.
+ *
+ * This is only available to direct users of libxenguest: libxl doesn't
+ * request it, as it only unpauses a restored guest once the whole stream
+ * has been received, and sets up a back channel for COLO only.
+ */
+#define XCFLAGS_POSTCOPY        (1 << 5)
+
+/*
+ * In the absence of a precopy_policy callback, use the adaptive policy
+ * rather than fixed thresholds.  It finishes precopy once the predicted
+ * downtime is small enough, and if precopy stops converging, caps the
+ * guest's vcpus through the scheduler before giving up.
+ */
+#define XCFLAGS_ADAPTIVE_PRECOPY (1 << 6)
+
+/*
+ * Number of worker threads xc_domain_save() uses to map and prepare page
+ * data in parallel.  0 (the default) sends pages from the calling thread.
+ */
+#define XCFLAGS_SAVE_WORKERS_SHIFT 8
+#define XCFLAGS_SAVE_WORKERS_MASK  (0xffU << XCFLAGS_SAVE_WORKERS_SHIFT)
+#define XCFLAGS_SAVE_WORKERS(n) \
+    (((n) << XCFLAGS_SAVE_WORKERS_SHIFT) & XCFLAGS_SAVE_WORKERS_MASK)
+#define XCFLAGS_SAVE_WORKERS_COUNT(f) \
+    (((f) & XCFLAGS_SAVE_WORKERS_MASK) >> XCFLAGS_SAVE_WORKERS_SHIFT)
+
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
 
@@ -439,6 +480,13 @@ struct precopy_stats
     unsigned int iteration;
     unsigned long total_written;
     long dirty_count; /* -1 if unknown */
+
+    /* Measured over the last iteration.  0 if unknown. */
+    unsigned long dirty_rate;        /* Pages dirtied per second. */
+    unsigned long send_rate;         /* Pages sent per second. */
+    unsigned long expected_downtime; /* Of stopping now, in ms. */
+
+    unsigned int throttle;           /* % of vcpu time withheld. */
 };
 
 /*
@@ -467,6 +515,11 @@ struct save_callbacks {
 #define XGS_POLICY_CONTINUE_PRECOPY 0  /* Remain in the precopy phase. */
 #define XGS_POLICY_STOP_AND_COPY    1  /* Immediately suspend and transmit the
                                         * remaining dirty pages. */
+#define XGS_POLICY_POSTCOPY         2  /* Immediately suspend, and transmit the
+                                        * remaining dirty pages after the
+                                        * guest has been resumed on the
+                                        * restoring side.  Needs
+                                        * XCFLAGS_POSTCOPY. */
     precopy_policy_t precopy_policy;
 
     /*
@@ -526,8 +579,8 @@ typedef enum {
  * @param flags XCFLAGS_xxx
  * @param stream_type XC_STREAM_PLAIN if the far end of the stream
  *        doesn't use checkpointing
- * @param recv_fd Only used for XC_STREAM_COLO.  Contains backchannel from
- *        the destination side.
+ * @param recv_fd Only used for XC_STREAM_COLO and XCFLAGS_POSTCOPY.
+ *        Contains backchannel from the destination side.
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
@@ -575,6 +628,15 @@ struct restore_callbacks {
      */
     int (*wait_checkpoint)(void *data);
 
+    /*
+     * Called in a postcopy migration once all state other than outstanding
+     * memory has been restored, and after restore_results.  Should resume
+     * the guest and its device model, and return 0 on success, after which
+     * xc_domain_restore continues to fetch the outstanding memory.  If NULL,
+     * the domain is simply unpaused.
+     */
+    int (*postcopy_transition)(void *data);
+
     /*
      * callback to send store gfn and console gfn to xl
      * if we want to resume vm before xc_domain_save()
@@ -605,8 +667,8 @@ struct restore_callbacks {
  *        checkpointing
  * @param callbacks non-NULL to receive a callback to restore toolstack
  *        specific data
- * @param send_back_fd Only used for XC_STREAM_COLO.  Contains backchannel to
- *        the source side.
+ * @param send_back_fd Only used for XC_STREAM_COLO and postcopy migrations.
+ *        Contains backchannel to the source side.
  * @return 0 on success, -1 on failure
  */
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
@@ -167,6 +167,34 @@ bool xs_set_permissions(struct xs_handle *h, xs_transaction_t t,
 			const char *path, struct xs_permissions *perms,
 			unsigned int num_perms);
 
+/* One operation of a batch executed by xs_multi(). */
+struct xs_multi_op {
+	/* XS_READ, XS_WRITE, XS_MKDIR, XS_RM or XS_SET_PERMS. */
+	enum xsd_sockmsg_type type;
+	const char *path;
+	/* Value for XS_WRITE. */
+	const void *data;
+	unsigned int len;
+	/* Permissions for XS_SET_PERMS. */
+	const struct xs_permissions *perms;
+	unsigned int num_perms;
+
+	/* Set by xs_multi(): 0, errno value, or ECANCELED if not executed. */
+	int err;
+	/* Set by xs_multi(): malloced XS_READ value with extra nul. */
+	void *result;
+	unsigned int result_len;
+};
+
+/* Execute a batch of operations with a single request, stopping at the first
+ * failing one.  Outside a transaction either all operations take effect or
+ * none does.  The result of each successful XS_READ must be freed by the
+ * caller, even if xs_multi() fails.
+ * Returns false on failure, with errno set to the failing operation's err.
+ */
+bool xs_multi(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_multi_op *ops, unsigned int num_ops);
+
 /* Watch a node for changes (poll on fd to detect, or call read_watch()).
  * When the node (or any child) changes, fd will become readable.
  * Token is returned when watch is read, to allow matching.
@@ -71,6 +71,44 @@ static inline int test_and_set_bit(unsigned long nr, void *addr)
     return oldbit;
 }
 
+/*
+ * Find the first set bit at or after @nr, or @nr_bits if there is none.
+ * Whole zero longs and zero bytes are skipped, so sparse bitmaps are cheap
+ * to walk.
+ */
+static inline unsigned long find_next_bit(const void *_addr,
+                                          unsigned long nr_bits,
+                                          unsigned long nr)
+{
+    const unsigned char *addr = _addr;
+    unsigned long word;
+    unsigned char byte;
+
+    while ( nr < nr_bits )
+    {
+        if ( !(nr % BITS_PER_LONG) && nr + BITS_PER_LONG <= nr_bits )
+        {
+            memcpy(&word, &BITMAP_ENTRY(nr, addr), sizeof(word));
+            if ( !word )
+            {
+                nr += BITS_PER_LONG;
+                continue;
+            }
+        }
+
+        byte = BITMAP_ENTRY(nr, addr) >> BITMAP_SHIFT(nr);
+        if ( byte )
+        {
+            nr += __builtin_ctz(byte);
+            break;
+        }
+
+        nr = (nr | 7) + 1;
+    }
+
+    return nr < nr_bits ? nr : nr_bits;
+}
+
 static inline void bitmap_or(void *_dst, const void *_other,
                              unsigned long nr_bits)
 {
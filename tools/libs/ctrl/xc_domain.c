@@ -706,6 +706,78 @@ long long xc_logdirty_control(xc_interface *xch,
     return (rc == 0) ? domctl.u.shadow_op.pages : rc;
 }
 
+long long xc_logdirty_control_pfns(xc_interface *xch,
+                                   uint32_t domid,
+                                   unsigned int sop,
+                                   xc_hypercall_buffer_t *dirty_bitmap,
+                                   unsigned long pages,
+                                   xc_hypercall_buffer_t *dirty_pfns,
+                                   unsigned int *nr_pfns,
+                                   unsigned int mode,
+                                   xc_shadow_op_stats_t *stats)
+{
+    int rc;
+    struct xen_domctl domctl = {
+        .cmd         = XEN_DOMCTL_shadow_op,
+        .domain      = domid,
+        .u.shadow_op = {
+            .op            = sop,
+            .pages         = pages,
+            .mode          = mode | XEN_DOMCTL_SHADOW_LOGDIRTY_PFN_LIST,
+            .nr_dirty_pfns = *nr_pfns,
+        }
+    };
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(dirty_bitmap);
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(dirty_pfns);
+
+    if ( dirty_bitmap )
+        set_xen_guest_handle(domctl.u.shadow_op.dirty_bitmap,
+                             dirty_bitmap);
+    set_xen_guest_handle(domctl.u.shadow_op.dirty_pfns, dirty_pfns);
+
+    rc = do_domctl(xch, &domctl);
+
+    if ( stats )
+        memcpy(stats, &domctl.u.shadow_op.stats,
+               sizeof(xc_shadow_op_stats_t));
+
+    if ( rc )
+        return rc;
+
+    *nr_pfns = (domctl.u.shadow_op.mode & XEN_DOMCTL_SHADOW_LOGDIRTY_PFN_LIST)
+        ? domctl.u.shadow_op.nr_dirty_pfns : XC_LOGDIRTY_NO_PFN_LIST;
+
+    return domctl.u.shadow_op.pages;
+}
+
+int xc_dirty_ring_enable(xc_interface *xch, uint32_t domid,
+                         unsigned int entries)
+{
+    struct xen_domctl domctl = {
+        .cmd         = XEN_DOMCTL_shadow_op,
+        .domain      = domid,
+        .u.shadow_op = {
+            .op    = XEN_DOMCTL_SHADOW_OP_DIRTY_RING_ENABLE,
+            .pages = entries,
+        },
+    };
+
+    return do_domctl(xch, &domctl);
+}
+
+int xc_dirty_ring_reset(xc_interface *xch, uint32_t domid)
+{
+    struct xen_domctl domctl = {
+        .cmd         = XEN_DOMCTL_shadow_op,
+        .domain      = domid,
+        .u.shadow_op = {
+            .op = XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET,
+        },
+    };
+
+    return do_domctl(xch, &domctl);
+}
+
 int xc_get_paging_mempool_size(xc_interface *xch, uint32_t domid, uint64_t *size)
 {
     int rc;
@@ -1404,6 +1476,23 @@ int xc_availheap(xc_interface *xch,
     return rc;
 }
 
+int xc_scrub_pending(xc_interface *xch, int node, bool wait,
+                     uint64_t *pages)
+{
+    DECLARE_SYSCTL;
+    int rc;
+
+    sysctl.cmd = XEN_SYSCTL_scrub_op;
+    sysctl.u.scrub_op.flags = wait ? XEN_SYSCTL_SCRUB_WAIT : 0;
+    sysctl.u.scrub_op.node = node;
+
+    rc = xc_sysctl(xch, &sysctl);
+    if ( !rc )
+        *pages = sysctl.u.scrub_op.pending;
+
+    return rc;
+}
+
 int xc_vcpu_setcontext(xc_interface *xch,
                        uint32_t domid,
                        uint32_t vcpu,
@@ -189,6 +189,84 @@ int xendevicemodel_create_ioreq_server(
     return 0;
 }
 
+int xendevicemodel_create_ioreq_server_ring(
+    xendevicemodel_handle *dmod, domid_t domid, unsigned int order,
+    ioservid_t *id)
+{
+    struct xen_dm_op op;
+    struct xen_dm_op_create_ioreq_server *data;
+    int rc;
+
+    if (order > IOREQ_BUFFER_RING_MAX_ORDER) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&op, 0, sizeof(op));
+
+    op.op = XEN_DMOP_create_ioreq_server;
+    data = &op.u.create_ioreq_server;
+
+    data->handle_bufioreq = HVM_IOREQSRV_BUFIOREQ_RING;
+    data->bufioreq_order = order;
+
+    rc = xendevicemodel_op(dmod, domid, 1, &op, sizeof(op));
+    if (rc)
+        return rc;
+
+    *id = data->id;
+
+    return 0;
+}
+
+unsigned int xendevicemodel_bufioreq_drain(
+    buffered_ioreq_ring_t *ring, ioreq_t reqs[], unsigned int nr)
+{
+    const buf_ioreq_t *slot = IOREQ_BUFFER_RING_SLOTS(ring);
+    uint32_t mask = ring->nr_slots - 1;
+    uint32_t rp = ring->read_pointer, wp;
+    unsigned int n = 0;
+
+    for (;;) {
+        /* Read write_pointer /before/ the slots it covers. */
+        wp = __atomic_load_n(&ring->write_pointer, __ATOMIC_ACQUIRE);
+
+        while (rp != wp && n < nr) {
+            const buf_ioreq_t *buf = &slot[rp++ & mask];
+            ioreq_t *req = &reqs[n++];
+
+            memset(req, 0, sizeof(*req));
+            req->size = 1U << buf->size;
+            req->count = 1;
+            req->addr = buf->addr;
+            req->data = buf->data;
+            req->state = STATE_IOREQ_READY;
+            req->dir = buf->dir;
+            req->type = buf->type;
+
+            /* 8-byte requests carry the upper half in the next slot. */
+            if (req->size == 8)
+                req->data |= (uint64_t)slot[rp++ & mask].data << 32;
+        }
+
+        /* Hand all consumed slots back at once, /after/ reading them. */
+        __atomic_store_n(&ring->read_pointer, rp, __ATOMIC_RELEASE);
+
+        if (n == nr)
+            return n;
+
+        /*
+         * The ring is empty: ask for a notification, then check once more
+         * for a request which raced with doing so.
+         */
+        ring->event_pointer = rp + 1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&ring->write_pointer, __ATOMIC_RELAXED) == rp)
+            return n;
+    }
+}
+
 int xendevicemodel_get_ioreq_server_info(
     xendevicemodel_handle *dmod, domid_t domid, ioservid_t id,
     xen_pfn_t *ioreq_gfn, xen_pfn_t *bufioreq_gfn,
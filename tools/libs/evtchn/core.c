@@ -130,6 +130,26 @@ int xenevtchn_restrict(xenevtchn_handle *xce, domid_t domid)
     return osdep_evtchn_restrict(xce, domid);
 }
 
+int xenevtchn_notify_batch(xenevtchn_handle *xce, const evtchn_port_t *ports,
+                           unsigned int nr_ports)
+{
+    unsigned int i;
+    int rc = osdep_evtchn_notify_batch(xce, ports, nr_ports);
+
+    if ( rc == 0 || (errno != EOPNOTSUPP && errno != ENOSYS) )
+        return rc;
+
+    /* No batched notifications available: send them one by one. */
+    for ( i = 0; i < nr_ports; i++ )
+    {
+        rc = xenevtchn_notify(xce, ports[i]);
+        if ( rc )
+            break;
+    }
+
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
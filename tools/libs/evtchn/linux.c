@@ -66,6 +66,16 @@ int osdep_evtchn_restrict(xenevtchn_handle *xce, domid_t domid)
     return ioctl(xce->fd, IOCTL_EVTCHN_RESTRICT_DOMID, &restrict_domid);
 }
 
+int osdep_evtchn_notify_batch(xenevtchn_handle *xce,
+                              const evtchn_port_t *ports,
+                              unsigned int nr_ports)
+{
+    /* The evtchn driver has no vectored notify: let the caller loop. */
+    errno = EOPNOTSUPP;
+
+    return -1;
+}
+
 int xenevtchn_notify(xenevtchn_handle *xce, evtchn_port_t port)
 {
     int fd = xce->fd;
@@ -32,6 +32,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <malloc.h>
@@ -148,6 +149,40 @@ int osdep_evtchn_restrict(xenevtchn_handle *xce, domid_t domid)
     return -1;
 }
 
+/* Maximum number of ports passed to one EVTCHNOP_send_batch. */
+#define NOTIFY_BATCH_MAX 64
+
+int osdep_evtchn_notify_batch(xenevtchn_handle *xce,
+                              const evtchn_port_t *ports,
+                              unsigned int nr_ports)
+{
+    uint32_t buf[2 + NOTIFY_BATCH_MAX];
+    struct evtchn_send_batch *batch = (struct evtchn_send_batch *)buf;
+    unsigned int nr;
+    int ret;
+
+    while ( nr_ports )
+    {
+        nr = nr_ports < NOTIFY_BATCH_MAX ? nr_ports : NOTIFY_BATCH_MAX;
+
+        batch->nr_ports = nr;
+        batch->done = 0;
+        memcpy(batch->ports, ports, nr * sizeof(*ports));
+
+        ret = HYPERVISOR_event_channel_op(EVTCHNOP_send_batch, batch);
+        if ( ret < 0 )
+        {
+            errno = -ret;
+            return -1;
+        }
+
+        ports += nr;
+        nr_ports -= nr;
+    }
+
+    return 0;
+}
+
 int xenevtchn_notify(xenevtchn_handle *xce, evtchn_port_t port)
 {
     int ret;
@@ -211,6 +211,54 @@ static inline int update_blob(struct xc_sr_blob *blob,
     return 0;
 }
 
+/*
+ * Working state for building a single PAGE_DATA record on the save side.  The
+ * scratch arrays are allocated once, sized for MAX_BATCH_SIZE pfns, and
+ * reused for every batch.
+ */
+struct xc_sr_save_batch
+{
+    xen_pfn_t *pfns;
+    unsigned int nr_pfns;
+
+    xen_pfn_t *mfns, *types;
+    int *errors;
+    /* Pointers to page data to send.  Mapped gfns or local allocations. */
+    void **guest_data;
+    /* Pointers to locally allocated pages.  Need freeing. */
+    void **local_pages;
+    uint64_t *rec_pfns;
+    struct iovec *iov;
+    int iovcnt;
+
+    /* Record header and PAGE_DATA header, referenced by iov[]. */
+    uint32_t rec_type, rec_length;
+    struct xc_sr_rec_page_data_header hdr;
+
+    /* Foreign mapping of the pages in the batch which have stream data. */
+    void *guest_mapping;
+    unsigned int nr_pages, nr_pages_mapped;
+
+    /* Pfns to be retried later.  Merged into deferred_pages once written. */
+    xen_pfn_t *deferred_pfns;
+    unsigned int nr_deferred_pfns;
+
+    /*
+     * ENCODED_PAGE_DATA state, only allocated when encoding.  When delta
+     * encoding or compressing, the record data is gathered into enc_data,
+     * and compressed from there into zdata.  snapshot is a scratch page for
+     * delta encoding.
+     */
+    struct xc_sr_rec_encoded_page_data_header ehdr;
+    uint8_t *encodings;
+    void *enc_data, *zdata, *snapshot;
+    size_t zdata_size;
+};
+
+struct xc_sr_save_pipeline;
+struct xc_sr_delta_cache;
+struct xc_sr_postcopy_pager;
+
 struct xc_sr_context
 {
     xc_interface *xch;
@@ -241,11 +289,52 @@ struct xc_sr_context
 
             struct precopy_stats stats;
 
+            /* Use adaptive_precopy_policy() by default. */
+            bool adaptive;
+            /* Iterations in a row for which precopy hasn't converged. */
+            unsigned int nr_stalled;
+            /*
+             * Scheduler cap in place while the guest's vcpus are throttled.
+             * stats.throttle is nonzero while it is.
+             */
+            uint32_t throttle_sched_id;
+            uint16_t throttle_orig_cap;
+
             xen_pfn_t *batch_pfns;
             unsigned int nr_batch_pfns;
+            struct xc_sr_save_batch batch;
+
+            /*
+             * Number of threads preparing batches in parallel.  0 means
+             * batches are prepared and written by the calling thread.
+             */
+            unsigned int nr_workers;
+            struct xc_sr_save_pipeline *pipeline;
+
+            /* Page encodings to use.  See XCFLAGS_ENCODE_*. */
+            bool encode_zero, encode_delta, compress;
+            /* Copies of recently sent pages, for DELTA encoding. */
+            struct xc_sr_delta_cache *delta_cache;
+
+            /*
+             * Whether the precopy policy may choose postcopy, and whether it
+             * has.  Once active, the dirty bitmap tracks the pages which the
+             * restorer has yet to be sent.
+             */
+            bool postcopy, postcopy_active;
+
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /*
+             * Sparse alternative to the dirty bitmap, used by Xen when few
+             * pages are dirty.  nr_dirty_pfns is XC_LOGDIRTY_NO_PFN_LIST
+             * when the dirty bitmap is current instead.
+             */
+            xc_hypercall_buffer_t dirty_pfns_hbuf;
+            unsigned int max_dirty_pfns;
+            unsigned int nr_dirty_pfns;
         } save;
 
         struct /* Restore data. */
@@ -297,6 +386,25 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Postcopy state, from POSTCOPY_BEGIN onwards. */
+            struct
+            {
+                bool active;
+                /* Set once the guest has been resumed. */
+                bool resumed;
+
+                /*
+                 * Pfns whose contents are yet to arrive, and those of them
+                 * which have been requested from the saver.
+                 */
+                unsigned long *outstanding, *requested;
+                xen_pfn_t max_pfn;
+                unsigned long nr_outstanding;
+
+                /* Handles guest accesses to outstanding pfns. */
+                struct xc_sr_postcopy_pager *pager;
+            } postcopy;
         } restore;
     };
 
@@ -452,6 +560,12 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
 int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
                   const xen_pfn_t *original_pfns, const uint32_t *types);
 
+/*
+ * Drop pfn from the set to be fetched in a postcopy restore, as its contents
+ * are being set up by the restorer.  Must be called before the transition.
+ */
+void postcopy_forget_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn);
+
 /* Handle a STATIC_DATA_END record. */
 int handle_static_data_end(struct xc_sr_context *ctx);
 
@@ -1,6 +1,11 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
+#include <zlib.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
 
 #include "xg_sr_common.h"
 
@@ -195,28 +200,212 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned int count,
     return rc;
 }
 
+/*
+ * Decode the stream data for one page, given the guest's current contents of
+ * it.  Returns a pointer to the page contents, either within the stream data
+ * or in scratch, and advances *data and *len past the data consumed.  Returns
+ * NULL if the data is malformed.
+ */
+static void *decode_page(struct xc_sr_context *ctx, xen_pfn_t pfn,
+                         uint32_t type, uint8_t encoding,
+                         const void *guest_page, void *scratch,
+                         void **data, size_t *len)
+{
+    xc_interface *xch = ctx->xch;
+    const unsigned int nr_words = PAGE_SIZE / sizeof(uint64_t);
+    struct xc_sr_page_delta_run run;
+    unsigned int word = 0;
+    uint16_t nr_runs;
+    void *page;
+
+    switch ( encoding )
+    {
+    case PAGE_ENCODING_RAW:
+        if ( *len < PAGE_SIZE )
+            goto truncated;
+        page = *data;
+        *data += PAGE_SIZE;
+        *len -= PAGE_SIZE;
+        return page;
+
+    case PAGE_ENCODING_ZERO:
+        return memset(scratch, 0, PAGE_SIZE);
+
+    case PAGE_ENCODING_DELTA:
+        if ( type != XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            ERROR("DELTA encoding for pfn %#"PRIpfn" of type %#"PRIx32,
+                  pfn, type >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            return NULL;
+        }
+
+        if ( !guest_page )
+        {
+            ERROR("DELTA encoding for outstanding postcopy pfn %#"PRIpfn,
+                  pfn);
+            return NULL;
+        }
+
+        if ( *len < sizeof(nr_runs) )
+            goto truncated;
+        memcpy(&nr_runs, *data, sizeof(nr_runs));
+        *data += sizeof(nr_runs);
+        *len -= sizeof(nr_runs);
+
+        memcpy(scratch, guest_page, PAGE_SIZE);
+
+        while ( nr_runs-- )
+        {
+            if ( *len < sizeof(run) )
+                goto truncated;
+            memcpy(&run, *data, sizeof(run));
+            *data += sizeof(run);
+            *len -= sizeof(run);
+
+            word += run.skip;
+            if ( word + run.len > nr_words )
+            {
+                ERROR("DELTA run for pfn %#"PRIpfn" overflows the page", pfn);
+                return NULL;
+            }
+
+            if ( *len < run.len * sizeof(uint64_t) )
+                goto truncated;
+            memcpy(scratch + word * sizeof(uint64_t), *data,
+                   run.len * sizeof(uint64_t));
+            *data += run.len * sizeof(uint64_t);
+            *len -= run.len * sizeof(uint64_t);
+
+            word += run.len;
+        }
+
+        return scratch;
+
+    default:
+        ERROR("Unknown encoding %#x for pfn %#"PRIpfn, encoding, pfn);
+        return NULL;
+    }
+
+ truncated:
+    ERROR("Page data truncated at pfn %#"PRIpfn" (encoding %#x)",
+          pfn, encoding);
+    return NULL;
+}
+
+static bool postcopy_pfn_outstanding(const struct xc_sr_context *ctx,
+                                     xen_pfn_t pfn)
+{
+    return ctx->restore.postcopy.outstanding &&
+        pfn <= ctx->restore.postcopy.max_pfn &&
+        test_bit(pfn, ctx->restore.postcopy.outstanding);
+}
+
+/*
+ * Page data in the postcopy phase.  Outstanding pages have been evicted, so
+ * are loaded back in through the paging interface rather than mapped, which
+ * also lets any vcpus waiting on them continue.  Pages no longer outstanding
+ * are ignored.
+ */
+static int postcopy_load_pages(struct xc_sr_context *ctx, unsigned int count,
+                               const xen_pfn_t *pfns, const uint32_t *types,
+                               void *page_data, const uint8_t *encodings,
+                               size_t data_len)
+{
+    xc_interface *xch = ctx->xch;
+    void *scratch = malloc(PAGE_SIZE), *page;
+    unsigned int i;
+    int rc = -1;
+
+    if ( !scratch )
+    {
+        ERROR("Unable to allocate scratch page");
+        return -1;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !page_type_has_stream_data(types[i]) )
+            continue;
+
+        page = decode_page(ctx, pfns[i], types[i],
+                           encodings ? encodings[i] : PAGE_ENCODING_RAW,
+                           NULL, scratch, &page_data, &data_len);
+        if ( !page )
+            goto err;
+
+        if ( !postcopy_pfn_outstanding(ctx, pfns[i]) )
+            continue;
+
+        rc = ctx->restore.ops.localise_page(ctx, types[i], page);
+        if ( rc )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            goto err;
+        }
+
+        rc = xc_mem_paging_load(xch, ctx->domid,
+                                ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]),
+                                page);
+        if ( rc )
+        {
+            PERROR("Failed to load postcopy pfn %#"PRIpfn, pfns[i]);
+            goto err;
+        }
+        rc = -1;
+
+        clear_bit(pfns[i], ctx->restore.postcopy.outstanding);
+        ctx->restore.postcopy.nr_outstanding--;
+    }
+
+    if ( data_len )
+    {
+        ERROR("%zu octets of unused page data", data_len);
+        goto err;
+    }
+
+    rc = 0;
+
+ err:
+    free(scratch);
+
+    return rc;
+}
+
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  encodings, if not NULL, gives the encoding of the
+ * data for each page, which is otherwise PAGE_ENCODING_RAW.
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+                             xen_pfn_t *pfns, uint32_t *types, void *page_data,
+                             const uint8_t *encodings, size_t data_len)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
-    int *map_errs = malloc(count * sizeof(*map_errs));
+    xen_pfn_t *mfns;
+    int *map_errs;
+    void *scratch;
     int rc;
-    void *mapping = NULL, *guest_page = NULL;
+    void *mapping = NULL, *guest_page = NULL, *page;
     unsigned int i, /* i indexes the pfns from the record. */
         j,          /* j indexes the subset of pfns we decide to map. */
         nr_pages = 0;
 
-    if ( !mfns || !map_errs )
+    if ( ctx->restore.postcopy.resumed )
+        return postcopy_load_pages(ctx, count, pfns, types, page_data,
+                                   encodings, data_len);
+
+    mfns = malloc(count * sizeof(*mfns));
+    map_errs = malloc(count * sizeof(*map_errs));
+    scratch = encodings ? malloc(PAGE_SIZE) : NULL;
+
+    if ( !mfns || !map_errs || (encodings && !scratch) )
     {
         rc = -1;
         ERROR("Failed to allocate %zu bytes to process page data",
-              count * (sizeof(*mfns) + sizeof(*map_errs)));
+              count * (sizeof(*mfns) + sizeof(*map_errs)) +
+              (encodings ? PAGE_SIZE : 0));
         goto err;
     }
 
@@ -263,8 +452,17 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
             goto err;
         }
 
+        page = decode_page(ctx, pfns[i], types[i],
+                           encodings ? encodings[i] : PAGE_ENCODING_RAW,
+                           guest_page, scratch, &page_data, &data_len);
+        if ( !page )
+        {
+            rc = -1;
+            goto err;
+        }
+
         /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        rc = ctx->restore.ops.localise_page(ctx, types[i], page);
         if ( rc )
         {
             ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
@@ -275,34 +473,83 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
         if ( ctx->restore.verify )
         {
             /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+            if ( memcmp(guest_page, page, PAGE_SIZE) )
                 ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
                       pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
         }
         else
         {
             /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
+            memcpy(guest_page, page, PAGE_SIZE);
         }
 
         ++j;
         guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
     }
 
  done:
+    if ( data_len )
+    {
+        rc = -1;
+        ERROR("%zu octets of unused page data", data_len);
+        goto err;
+    }
+
     rc = 0;
 
  err:
     if ( mapping )
         xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
 
+    free(scratch);
     free(map_errs);
     free(mfns);
 
     return rc;
 }
 
+/*
+ * Validate the pfn array of a PAGE_DATA or ENCODED_PAGE_DATA record, and
+ * split it into pfns and types.  Counts the pages which have data.
+ */
+static int parse_page_data_pfns(struct xc_sr_context *ctx, unsigned int count,
+                                const uint64_t *rec_pfns, xen_pfn_t *pfns,
+                                uint32_t *types, unsigned int *pages_of_data)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+    xen_pfn_t pfn;
+    uint32_t type;
+
+    for ( i = 0; i < count; ++i )
+    {
+        pfn = rec_pfns[i] & PAGE_DATA_PFN_MASK;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            return -1;
+        }
+
+        type = (rec_pfns[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( !is_known_page_type(type) )
+        {
+            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            return -1;
+        }
+
+        if ( page_type_has_stream_data(type) )
+            /* NOTAB and all L1 through L4 tables (including pinned) should
+             * have a page worth of data in the record. */
+            (*pages_of_data)++;
+
+        pfns[i] = pfn;
+        types[i] = type;
+    }
+
+    return 0;
+}
+
 /*
  * Validate a PAGE_DATA record from the stream, and pass the results to
  * process_page_data() to actually perform the legwork.
@@ -311,11 +558,11 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned int i, pages_of_data = 0;
+    unsigned int pages_of_data = 0;
     int rc = -1;
 
-    xen_pfn_t *pfns = NULL, pfn;
-    uint32_t *types = NULL, type;
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
 
     /*
      * v2 compatibility only exists for x86 streams.  This is a bit of a
@@ -371,45 +618,159 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         goto err;
     }
 
+    if ( parse_page_data_pfns(ctx, pages->count, pages->pfn, pfns, types,
+                              &pages_of_data) )
+        goto err;
+
+    if ( rec->length != (sizeof(*pages) +
+                         (sizeof(uint64_t) * pages->count) +
+                         (PAGE_SIZE * pages_of_data)) )
+    {
+        ERROR("PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %lu", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        goto err;
+    }
+
+    rc = process_page_data(ctx, pages->count, pfns, types,
+                           &pages->pfn[pages->count], NULL,
+                           PAGE_SIZE * pages_of_data);
+ err:
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Validate an ENCODED_PAGE_DATA record from the stream, decompress it if
+ * necessary, and pass the results to process_page_data() for decoding.
+ */
+static int handle_encoded_page_data(struct xc_sr_context *ctx,
+                                    struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_encoded_page_data_header *pages = rec->data;
+    unsigned int i, pages_of_data = 0;
+    size_t hdr_len, enc_len, data_len;
+    uint8_t *encodings;
+    void *data, *buf = NULL;
+    uLongf buf_len;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+#if defined(__i386__) || defined(__x86_64__)
+    if ( !ctx->restore.seen_static_data_end )
+    {
+        ERROR("No STATIC_DATA_END seen");
+        goto err;
+    }
+#endif
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("ENCODED_PAGE_DATA record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+
+    if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in ENCODED_PAGE_DATA record");
+        goto err;
+    }
+
+    enc_len = ROUNDUP(pages->count, REC_ALIGN_ORDER);
+    hdr_len = sizeof(*pages) + (pages->count * sizeof(uint64_t)) + enc_len;
+    if ( rec->length < hdr_len )
+    {
+        ERROR("ENCODED_PAGE_DATA record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    if ( parse_page_data_pfns(ctx, pages->count, pages->pfn, pfns, types,
+                              &pages_of_data) )
+        goto err;
+
+    encodings = (uint8_t *)&pages->pfn[pages->count];
     for ( i = 0; i < pages->count; ++i )
     {
-        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
-        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        if ( !page_type_has_stream_data(types[i]) &&
+             encodings[i] != PAGE_ENCODING_RAW )
         {
-            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            ERROR("Encoding %#x for pfn %#"PRIpfn" without data",
+                  encodings[i], pfns[i]);
             goto err;
         }
+    }
 
-        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
-        if ( !is_known_page_type(type) )
+    data = encodings + enc_len;
+    data_len = rec->length - hdr_len;
+
+    switch ( pages->compression )
+    {
+    case ENCODED_PAGE_DATA_COMPRESSION_NONE:
+        if ( data_len != pages->data_length )
         {
-            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
-                  type, pfn, i);
+            ERROR("ENCODED_PAGE_DATA record wrong size: length %u, expected"
+                  " %zu + %u", rec->length, hdr_len, pages->data_length);
             goto err;
         }
+        break;
 
-        if ( page_type_has_stream_data(type) )
-            /* NOTAB and all L1 through L4 tables (including pinned) should
-             * have a page worth of data in the record. */
-            pages_of_data++;
+    case ENCODED_PAGE_DATA_COMPRESSION_ZLIB:
+        /* No encoding is larger than a page and a bit. */
+        if ( pages->data_length > pages_of_data * 2 * PAGE_SIZE )
+        {
+            ERROR("ENCODED_PAGE_DATA data length %u too large for %u pages",
+                  pages->data_length, pages_of_data);
+            goto err;
+        }
 
-        pfns[i] = pfn;
-        types[i] = type;
-    }
+        buf_len = pages->data_length;
+        buf = malloc(buf_len ?: 1);
+        if ( !buf )
+        {
+            ERROR("Unable to allocate %lu bytes for page data", buf_len);
+            goto err;
+        }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
-    {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
-              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        rc = uncompress(buf, &buf_len, data, data_len);
+        if ( rc != Z_OK || buf_len != pages->data_length )
+        {
+            ERROR("Failed to decompress page data: %d, %lu of %u octets",
+                  rc, buf_len, pages->data_length);
+            rc = -1;
+            goto err;
+        }
+        rc = -1;
+
+        data = buf;
+        data_len = buf_len;
+        break;
+
+    default:
+        ERROR("Unknown ENCODED_PAGE_DATA compression %#x",
+              pages->compression);
         goto err;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    rc = process_page_data(ctx, pages->count, pfns, types, data,
+                           encodings, data_len);
  err:
+    free(buf);
     free(types);
     free(pfns);
 
@@ -643,40 +1004,642 @@ int handle_static_data_end(struct xc_sr_context *ctx)
     return rc;
 }
 
-static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+/*
+ * Postcopy restore.
+ *
+ * Memory listed in POSTCOPY_PFNS records is populated and then evicted
+ * through the paging interface once the rest of the guest's state has
+ * arrived, and the guest resumed.  Guest accesses to evicted pfns raise
+ * paging requests on the vm_event ring, which are forwarded to the saver as
+ * POSTCOPY_FAULT records in the back channel.  Page data arriving from the
+ * saver, whether requested or part of its background sweep, is loaded back
+ * in, and the vcpus waiting on it are released.
+ *
+ * Paging is only available to HVM guests, for which pfns and gfns are the
+ * same thing.
+ */
+struct xc_sr_postcopy_pager
+{
+    xenevtchn_handle *xce;
+    xenevtchn_port_or_error_t port;
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+
+    /* Paging requests waiting for their pfn to arrive. */
+    vm_event_request_t *waiting;
+    unsigned int nr_waiting, max_waiting;
+
+    /* Pfns to request in the next POSTCOPY_FAULT record. */
+    uint64_t faults[MAX_BATCH_SIZE];
+    unsigned int nr_faults;
+};
+
+static int postcopy_mark_outstanding(struct xc_sr_context *ctx,
+                                     xen_pfn_t pfn)
 {
     xc_interface *xch = ctx->xch;
-    int rc = 0;
+    xen_pfn_t new_max = ctx->restore.postcopy.max_pfn;
+    size_t old_sz, new_sz;
+    unsigned long *o, *r;
 
-    switch ( rec->type )
+    if ( !ctx->restore.postcopy.outstanding || pfn > new_max )
     {
-    case REC_TYPE_END:
-        break;
-
-    case REC_TYPE_PAGE_DATA:
-        rc = handle_page_data(ctx, rec);
-        break;
-
-    case REC_TYPE_VERIFY:
-        DPRINTF("Verify mode enabled");
-        ctx->restore.verify = true;
-        break;
+        old_sz = ctx->restore.postcopy.outstanding
+            ? bitmap_size(new_max + 1) : 0;
 
-    case REC_TYPE_CHECKPOINT:
-        rc = handle_checkpoint(ctx);
-        break;
+        /* Size for all populated pfns, to avoid reallocating often. */
+        new_max = max(pfn, ctx->restore.max_populated_pfn);
+        new_sz = bitmap_size(new_max + 1);
 
-    case REC_TYPE_STATIC_DATA_END:
-        rc = handle_static_data_end(ctx);
-        break;
+        o = realloc(ctx->restore.postcopy.outstanding, new_sz);
+        if ( o )
+            ctx->restore.postcopy.outstanding = o;
+        r = realloc(ctx->restore.postcopy.requested, new_sz);
+        if ( r )
+            ctx->restore.postcopy.requested = r;
+        if ( !o || !r )
+        {
+            ERROR("Failed to realloc postcopy bitmaps");
+            errno = ENOMEM;
+            return -1;
+        }
 
-    default:
-        rc = ctx->restore.ops.process_record(ctx, rec);
-        break;
+        memset((uint8_t *)o + old_sz, 0, new_sz - old_sz);
+        memset((uint8_t *)r + old_sz, 0, new_sz - old_sz);
+        ctx->restore.postcopy.max_pfn = new_max;
     }
 
-    free(rec->data);
-    rec->data = NULL;
+    if ( !test_and_set_bit(pfn, ctx->restore.postcopy.outstanding) )
+        ctx->restore.postcopy.nr_outstanding++;
+
+    return 0;
+}
+
+void postcopy_forget_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    if ( postcopy_pfn_outstanding(ctx, pfn) )
+    {
+        clear_bit(pfn, ctx->restore.postcopy.outstanding);
+        ctx->restore.postcopy.nr_outstanding--;
+    }
+}
+
+static int handle_postcopy_begin(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( ctx->restore.postcopy.active )
+    {
+        ERROR("Duplicate POSTCOPY_BEGIN record");
+        return -1;
+    }
+
+    if ( ctx->stream_type != XC_STREAM_PLAIN || !ctx->dominfo.hvm ||
+         ctx->restore.send_back_fd < 0 )
+    {
+        ERROR("Postcopy needs a plain stream of an HVM guest, with a back"
+              " channel");
+        return -1;
+    }
+
+    if ( ctx->restore.verify )
+    {
+        ERROR("Postcopy can't be used in verify mode");
+        return -1;
+    }
+
+    IPRINTF("Postcopy migration");
+    ctx->restore.postcopy.active = true;
+
+    return 0;
+}
+
+/*
+ * Populate the pfns of a POSTCOPY_PFNS record and note those with contents
+ * still to come.
+ */
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns_header *hdr = rec->data;
+    unsigned int i, pages_of_data = 0;
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+    int rc = -1;
+
+    if ( !ctx->restore.postcopy.active || ctx->restore.postcopy.resumed )
+    {
+        ERROR("POSTCOPY_PFNS record outside of postcopy setup");
+        goto err;
+    }
+
+    if ( rec->length < sizeof(*hdr) ||
+         rec->length != sizeof(*hdr) + hdr->count * sizeof(*hdr->pfn) )
+    {
+        ERROR("POSTCOPY_PFNS record wrong size: length %u", rec->length);
+        goto err;
+    }
+
+    pfns = malloc(hdr->count * sizeof(*pfns));
+    types = malloc(hdr->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns", hdr->count);
+        goto err;
+    }
+
+    if ( parse_page_data_pfns(ctx, hdr->count, hdr->pfn, pfns, types,
+                              &pages_of_data) )
+        goto err;
+
+    rc = populate_pfns(ctx, hdr->count, pfns, types);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for batch of %u pages", hdr->count);
+        goto err;
+    }
+
+    for ( i = 0; i < hdr->count; ++i )
+    {
+        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+
+        if ( page_type_has_stream_data(types[i]) )
+        {
+            rc = postcopy_mark_outstanding(ctx, pfns[i]);
+            if ( rc )
+                goto err;
+        }
+    }
+
+ err:
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+static void postcopy_pager_destroy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy_pager *pager = ctx->restore.postcopy.pager;
+
+    if ( !pager )
+        return;
+
+    if ( pager->ring_page )
+    {
+        if ( xc_mem_paging_disable(xch, ctx->domid) )
+            PERROR("Failed to disable paging");
+        xenforeignmemory_unmap(xch->fmem, pager->ring_page, 1);
+    }
+
+    if ( pager->xce )
+    {
+        if ( pager->port >= 0 )
+            xenevtchn_unbind(pager->xce, pager->port);
+        xenevtchn_close(pager->xce);
+    }
+
+    free(pager->waiting);
+    free(pager);
+
+    ctx->restore.postcopy.pager = NULL;
+}
+
+static int postcopy_pager_create(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy_pager *pager;
+    uint32_t remote_port;
+
+    pager = calloc(1, sizeof(*pager));
+    if ( !pager )
+    {
+        ERROR("Unable to allocate postcopy pager");
+        return -1;
+    }
+
+    pager->port = -1;
+    ctx->restore.postcopy.pager = pager;
+
+    pager->ring_page = xc_vm_event_enable(xch, ctx->domid,
+                                          HVM_PARAM_PAGING_RING_PFN,
+                                          &remote_port);
+    if ( !pager->ring_page )
+    {
+        PERROR("Failed to enable paging");
+        goto err;
+    }
+
+    pager->xce = xenevtchn_open(NULL, 0);
+    if ( !pager->xce )
+    {
+        PERROR("Failed to open event channel handle");
+        goto err;
+    }
+
+    pager->port = xenevtchn_bind_interdomain(pager->xce, ctx->domid,
+                                             remote_port);
+    if ( pager->port < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        goto err;
+    }
+
+    SHARED_RING_INIT((vm_event_sring_t *)pager->ring_page);
+    BACK_RING_INIT(&pager->back_ring, (vm_event_sring_t *)pager->ring_page,
+                   XC_PAGE_SIZE);
+
+    return 0;
+
+ err:
+    postcopy_pager_destroy(ctx);
+    return -1;
+}
+
+static void postcopy_put_response(struct xc_sr_postcopy_pager *pager,
+                                  const vm_event_request_t *req)
+{
+    vm_event_back_ring_t *back_ring = &pager->back_ring;
+    vm_event_response_t rsp = {
+        .version = VM_EVENT_INTERFACE_VERSION,
+        .vcpu_id = req->vcpu_id,
+        .flags = req->flags & VM_EVENT_FLAG_VCPU_PAUSED,
+        .reason = req->reason,
+        .u.mem_paging.gfn = req->u.mem_paging.gfn,
+    };
+
+    memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt), &rsp,
+           sizeof(rsp));
+    back_ring->rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(back_ring);
+}
+
+/*
+ * Release the paging requests waiting on pfns which have since arrived.
+ */
+static int postcopy_respond(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy_pager *pager = ctx->restore.postcopy.pager;
+    unsigned int i = 0, nr_responses = 0;
+
+    while ( i < pager->nr_waiting )
+    {
+        if ( postcopy_pfn_outstanding(
+                 ctx, pager->waiting[i].u.mem_paging.gfn) )
+        {
+            ++i;
+            continue;
+        }
+
+        postcopy_put_response(pager, &pager->waiting[i]);
+        pager->waiting[i] = pager->waiting[--pager->nr_waiting];
+        ++nr_responses;
+    }
+
+    if ( nr_responses && xenevtchn_notify(pager->xce, pager->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Ask the saver for the pfns the guest is waiting on.
+ */
+static int postcopy_send_faults(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy_pager *pager = ctx->restore.postcopy.pager;
+    struct xc_sr_rec_postcopy_pfns_header hdr = {
+        .count = pager->nr_faults,
+    };
+    struct xc_sr_rhdr rhdr = {
+        .type = REC_TYPE_POSTCOPY_FAULT,
+        .length = sizeof(hdr) + pager->nr_faults * sizeof(*pager->faults),
+    };
+    struct iovec iov[] = {
+        { &rhdr, sizeof(rhdr) },
+        { &hdr, sizeof(hdr) },
+        { pager->faults, pager->nr_faults * sizeof(*pager->faults) },
+    };
+
+    if ( !pager->nr_faults )
+        return 0;
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to write postcopy faults to back channel");
+        return -1;
+    }
+
+    pager->nr_faults = 0;
+
+    return 0;
+}
+
+/*
+ * Consume the requests on the paging ring.  Requests for pfns which have
+ * already arrived are answered immediately, and the rest wait.
+ */
+static int postcopy_handle_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy_pager *pager = ctx->restore.postcopy.pager;
+    vm_event_back_ring_t *back_ring = &pager->back_ring;
+    vm_event_request_t req, *w;
+    xenevtchn_port_or_error_t port;
+    xen_pfn_t pfn;
+    int rc;
+
+    port = xenevtchn_pending(pager->xce);
+    if ( port < 0 )
+    {
+        PERROR("Failed to read paging event channel");
+        return -1;
+    }
+
+    if ( xenevtchn_unmask(pager->xce, port) )
+    {
+        PERROR("Failed to unmask paging event channel");
+        return -1;
+    }
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION ||
+             req.reason != VM_EVENT_REASON_MEM_PAGING )
+        {
+            ERROR("Unexpected paging request: version %#x, reason %u",
+                  req.version, req.reason);
+            return -1;
+        }
+
+        pfn = req.u.mem_paging.gfn;
+
+        /* The guest has released the pfn.  It needs no contents. */
+        if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+        {
+            postcopy_forget_pfn(ctx, pfn);
+            continue;
+        }
+
+        if ( !postcopy_pfn_outstanding(ctx, pfn) )
+        {
+            postcopy_put_response(pager, &req);
+            continue;
+        }
+
+        if ( pager->nr_waiting == pager->max_waiting )
+        {
+            unsigned int max = pager->max_waiting * 2 ?: 64;
+
+            w = realloc(pager->waiting, max * sizeof(*w));
+            if ( !w )
+            {
+                ERROR("Unable to allocate memory for paging requests");
+                return -1;
+            }
+
+            pager->waiting = w;
+            pager->max_waiting = max;
+        }
+        pager->waiting[pager->nr_waiting++] = req;
+
+        if ( test_and_set_bit(pfn, ctx->restore.postcopy.requested) )
+            continue;
+
+        pager->faults[pager->nr_faults++] = pfn;
+        if ( pager->nr_faults == ARRAY_SIZE(pager->faults) )
+        {
+            rc = postcopy_send_faults(ctx);
+            if ( rc )
+                return rc;
+        }
+    }
+
+    if ( xenevtchn_notify(pager->xce, pager->port) )
+    {
+        PERROR("Failed to notify paging event channel");
+        return -1;
+    }
+
+    return postcopy_send_faults(ctx);
+}
+
+/*
+ * The postcopy phase.  Serve guest paging requests while receiving the
+ * outstanding memory, until the END record.
+ */
+static int postcopy_serve(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy_pager *pager = ctx->restore.postcopy.pager;
+    struct pollfd pfds[] = {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(pager->xce), .events = POLLIN },
+    };
+    struct xc_sr_record rec;
+    int rc;
+
+    for ( ; ; )
+    {
+        rc = poll(pfds, ARRAY_SIZE(pfds), -1);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll in postcopy phase");
+            return -1;
+        }
+
+        if ( pfds[1].revents )
+        {
+            rc = postcopy_handle_requests(ctx);
+            if ( rc )
+                return rc;
+        }
+
+        if ( !pfds[0].revents )
+            continue;
+
+        rc = read_record(ctx, ctx->fd, &rec);
+        if ( rc )
+            return rc;
+
+        if ( rec.type == REC_TYPE_END )
+        {
+            free(rec.data);
+            break;
+        }
+
+        if ( rec.type != REC_TYPE_PAGE_DATA &&
+             rec.type != REC_TYPE_ENCODED_PAGE_DATA )
+        {
+            ERROR("Unexpected record %#x (%s) in postcopy phase",
+                  rec.type, rec_type_to_str(rec.type));
+            free(rec.data);
+            return -1;
+        }
+
+        rc = process_record(ctx, &rec);
+        if ( rc )
+            return rc;
+
+        rc = postcopy_respond(ctx);
+        if ( rc )
+            return rc;
+    }
+
+    if ( ctx->restore.postcopy.nr_outstanding )
+    {
+        ERROR("Stream ended with %lu pfns outstanding",
+              ctx->restore.postcopy.nr_outstanding);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Everything but the outstanding memory has arrived.  Evict the outstanding
+ * pfns, resume the guest, and fetch them.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct restore_callbacks *cbs = ctx->restore.callbacks;
+    uint64_t ring_pfn;
+    xen_pfn_t pfn, gfn;
+    int rc;
+
+    if ( !ctx->restore.postcopy.active || ctx->restore.postcopy.resumed )
+    {
+        ERROR("POSTCOPY_TRANSITION record outside of postcopy setup");
+        return -1;
+    }
+
+    /* The paging ring is taken out of the guest's physmap. */
+    rc = xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_PAGING_RING_PFN,
+                          &ring_pfn);
+    if ( rc )
+    {
+        PERROR("Failed to get paging ring pfn");
+        return rc;
+    }
+
+    if ( !ring_pfn )
+    {
+        ERROR("No paging ring pfn for postcopy");
+        return -1;
+    }
+    postcopy_forget_pfn(ctx, ring_pfn);
+
+    rc = postcopy_pager_create(ctx);
+    if ( rc )
+        return rc;
+
+    for ( pfn = 0; pfn <= ctx->restore.postcopy.max_pfn; ++pfn )
+    {
+        if ( !postcopy_pfn_outstanding(ctx, pfn) )
+            continue;
+
+        gfn = ctx->restore.ops.pfn_to_gfn(ctx, pfn);
+        rc = xc_mem_paging_nominate(xch, ctx->domid, gfn) ?:
+            xc_mem_paging_evict(xch, ctx->domid, gfn);
+        if ( rc )
+        {
+            PERROR("Failed to evict postcopy pfn %#"PRIpfn, pfn);
+            return rc;
+        }
+    }
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    if ( cbs && cbs->restore_results )
+        cbs->restore_results(ctx->restore.xenstore_gfn,
+                             ctx->restore.console_gfn, cbs->data);
+
+    IPRINTF("Resuming guest with %lu pfns outstanding",
+            ctx->restore.postcopy.nr_outstanding);
+
+    if ( cbs && cbs->postcopy_transition )
+        rc = cbs->postcopy_transition(cbs->data);
+    else
+        rc = xc_domain_unpause(xch, ctx->domid);
+    if ( rc )
+    {
+        PERROR("Failed to resume guest");
+        return rc;
+    }
+
+    ctx->restore.postcopy.resumed = true;
+
+    return postcopy_serve(ctx);
+}
+
+static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    int rc = 0;
+
+    switch ( rec->type )
+    {
+    case REC_TYPE_END:
+        break;
+
+    case REC_TYPE_PAGE_DATA:
+        rc = handle_page_data(ctx, rec);
+        break;
+
+    case REC_TYPE_ENCODED_PAGE_DATA:
+        rc = handle_encoded_page_data(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_BEGIN:
+        rc = handle_postcopy_begin(ctx);
+        break;
+
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
+    case REC_TYPE_VERIFY:
+        DPRINTF("Verify mode enabled");
+        ctx->restore.verify = true;
+        break;
+
+    case REC_TYPE_CHECKPOINT:
+        rc = handle_checkpoint(ctx);
+        break;
+
+    case REC_TYPE_STATIC_DATA_END:
+        rc = handle_static_data_end(ctx);
+        break;
+
+    default:
+        rc = ctx->restore.ops.process_record(ctx, rec);
+        break;
+    }
+
+    free(rec->data);
+    rec->data = NULL;
 
     return rc;
 }
@@ -743,6 +1706,10 @@ static void cleanup(struct xc_sr_context *ctx)
         xc_hypercall_buffer_free_pages(
             xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->restore.p2m_size)));
 
+    postcopy_pager_destroy(ctx);
+    free(ctx->restore.postcopy.requested);
+    free(ctx->restore.postcopy.outstanding);
+
     free(ctx->restore.buffered_records);
     free(ctx->restore.populated_pfns);
 
@@ -806,7 +1773,14 @@ static int restore(struct xc_sr_context *ctx)
                 goto err;
         }
 
-    } while ( rec.type != REC_TYPE_END );
+    } while ( rec.type != REC_TYPE_END && !ctx->restore.postcopy.resumed );
+
+    if ( ctx->restore.postcopy.resumed )
+    {
+        /* stream_complete() was called before resuming the guest. */
+        IPRINTF("Postcopy restore successful");
+        goto done;
+    }
 
  remus_failover:
     if ( ctx->stream_type == XC_STREAM_COLO )
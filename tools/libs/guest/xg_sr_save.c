@@ -1,4 +1,8 @@
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
 #include <arpa/inet.h>
 
 #include "xg_sr_common.h"
@@ -75,68 +79,543 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
+ * Whether page data is sent as ENCODED_PAGE_DATA rather than PAGE_DATA.
+ */
+static bool save_encodes_pages(const struct xc_sr_context *ctx)
+{
+    return ctx->save.encode_zero || ctx->save.encode_delta ||
+        ctx->save.compress;
+}
+
+/*
+ * Copies of the NOTAB pages most recently sent, against which pages sent
+ * again can be DELTA encoded.  Direct mapped by pfn.
  *
- * This function:
- * - gets the types for each pfn in the batch.
- * - for each pfn with real data:
- *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * Batches may be prepared concurrently by the save pipeline, so slots are
+ * protected by striped locks.  A pfn is never in two batches being prepared
+ * at once, as each iteration sends a pfn at most once and the pipeline is
+ * drained between iterations, so the cached copy of a pfn always matches the
+ * data the restorer has for it.
  */
-static int write_batch(struct xc_sr_context *ctx)
+#define DELTA_CACHE_PAGES (1U << 14)
+#define DELTA_CACHE_LOCKS 64U
+
+struct xc_sr_delta_cache
+{
+    unsigned int nr_slots;
+    xen_pfn_t *tags;
+    void *pages;
+    pthread_mutex_t locks[DELTA_CACHE_LOCKS];
+};
+
+static void delta_cache_destroy(struct xc_sr_context *ctx)
+{
+    struct xc_sr_delta_cache *dc = ctx->save.delta_cache;
+    unsigned int i;
+
+    if ( !dc )
+        return;
+
+    for ( i = 0; i < DELTA_CACHE_LOCKS; ++i )
+        pthread_mutex_destroy(&dc->locks[i]);
+
+    free(dc->pages);
+    free(dc->tags);
+    free(dc);
+
+    ctx->save.delta_cache = NULL;
+}
+
+static int delta_cache_create(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned int i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned int nr_pfns = ctx->save.nr_batch_pfns;
-    void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec = {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    struct xc_sr_delta_cache *dc;
+    unsigned int i;
 
-    assert(nr_pfns != 0);
+    dc = calloc(1, sizeof(*dc));
+    if ( !dc )
+        goto enomem;
+
+    for ( i = 0; i < DELTA_CACHE_LOCKS; ++i )
+        pthread_mutex_init(&dc->locks[i], NULL);
+    ctx->save.delta_cache = dc;
+
+    dc->nr_slots = min_t(unsigned long, DELTA_CACHE_PAGES, ctx->save.p2m_size);
+    dc->tags = malloc(dc->nr_slots * sizeof(*dc->tags));
+    dc->pages = malloc((size_t)dc->nr_slots * PAGE_SIZE);
+    if ( !dc->tags || !dc->pages )
+        goto enomem;
+
+    for ( i = 0; i < dc->nr_slots; ++i )
+        dc->tags[i] = INVALID_PFN;
+
+    return 0;
+
+ enomem:
+    ERROR("Unable to allocate memory for delta cache");
+    delta_cache_destroy(ctx);
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * DELTA encode page against prev into out, using at most max octets.
+ * Returns the length of the encoding, or 0 if it doesn't fit.
+ */
+static size_t delta_encode_page(const uint64_t *page, const uint64_t *prev,
+                                void *out, size_t max)
+{
+    const unsigned int nr_words = PAGE_SIZE / sizeof(*page);
+    struct xc_sr_page_delta_run run;
+    unsigned int i = 0, skip, len;
+    uint16_t nr_runs = 0;
+    size_t used = sizeof(nr_runs);
+
+    for ( ; ; )
+    {
+        for ( skip = 0; i < nr_words && page[i] == prev[i]; ++i )
+            ++skip;
+
+        if ( i == nr_words )
+            break;
+
+        for ( len = 0; i + len < nr_words && page[i + len] != prev[i + len]; )
+            ++len;
+
+        if ( used + sizeof(run) + len * sizeof(*page) > max )
+            return 0;
+
+        run = (struct xc_sr_page_delta_run){ .skip = skip, .len = len };
+        memcpy(out + used, &run, sizeof(run));
+        used += sizeof(run);
+        memcpy(out + used, &page[i], len * sizeof(*page));
+        used += len * sizeof(*page);
+
+        i += len;
+        ++nr_runs;
+    }
+
+    memcpy(out, &nr_runs, sizeof(nr_runs));
+
+    return used;
+}
+
+static bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); ++i )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
+
+/*
+ * Encode one NOTAB page with the help of the delta cache.  The guest may
+ * still be writing to the page, so it is snapshotted first, and the snapshot
+ * is both what gets sent and what gets cached.  Returns the encoding, having
+ * appended any data for it at *out.
+ */
+static uint8_t encode_page_delta(struct xc_sr_context *ctx,
+                                 struct xc_sr_save_batch *batch,
+                                 xen_pfn_t pfn, const void *page,
+                                 void **out)
+{
+    struct xc_sr_delta_cache *dc = ctx->save.delta_cache;
+    unsigned int slot = pfn % dc->nr_slots;
+    void *cached = dc->pages + (size_t)slot * PAGE_SIZE;
+    void *snap = batch->snapshot;
+    uint8_t enc;
+    size_t len;
+
+    memcpy(snap, page, PAGE_SIZE);
 
+    pthread_mutex_lock(&dc->locks[slot % DELTA_CACHE_LOCKS]);
+
+    if ( ctx->save.encode_zero && page_is_zero(snap) )
+    {
+        enc = PAGE_ENCODING_ZERO;
+        memset(cached, 0, PAGE_SIZE);
+    }
+    else
+    {
+        len = 0;
+        if ( dc->tags[slot] == pfn )
+            len = delta_encode_page(snap, cached, *out, PAGE_SIZE / 2);
+
+        if ( len )
+            enc = PAGE_ENCODING_DELTA;
+        else
+        {
+            enc = PAGE_ENCODING_RAW;
+            len = PAGE_SIZE;
+            memcpy(*out, snap, PAGE_SIZE);
+        }
+
+        *out += len;
+        memcpy(cached, snap, PAGE_SIZE);
+    }
+
+    dc->tags[slot] = pfn;
+
+    pthread_mutex_unlock(&dc->locks[slot % DELTA_CACHE_LOCKS]);
+
+    return enc;
+}
+
+/*
+ * The restorer's copy of pfn is about to stop matching the delta cache.
+ */
+static void delta_cache_invalidate(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_delta_cache *dc = ctx->save.delta_cache;
+    unsigned int slot = pfn % dc->nr_slots;
+
+    pthread_mutex_lock(&dc->locks[slot % DELTA_CACHE_LOCKS]);
+    if ( dc->tags[slot] == pfn )
+        dc->tags[slot] = INVALID_PFN;
+    pthread_mutex_unlock(&dc->locks[slot % DELTA_CACHE_LOCKS]);
+}
+
+/*
+ * Allocate the scratch arrays of a batch, sized for MAX_BATCH_SIZE pfns.
+ */
+static int alloc_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
     /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
+    batch->mfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->mfns));
     /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
+    batch->types = malloc(MAX_BATCH_SIZE * sizeof(*batch->types));
     /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
-    /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
-    /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
+    batch->errors = malloc(MAX_BATCH_SIZE * sizeof(*batch->errors));
+    batch->guest_data = calloc(MAX_BATCH_SIZE, sizeof(*batch->guest_data));
+    batch->local_pages = calloc(MAX_BATCH_SIZE, sizeof(*batch->local_pages));
+    /* Page data pfn list of the record. */
+    batch->rec_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->rec_pfns));
     /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    batch->iov = malloc((MAX_BATCH_SIZE + 8) * sizeof(*batch->iov));
+    batch->deferred_pfns = malloc(MAX_BATCH_SIZE *
+                                  sizeof(*batch->deferred_pfns));
+
+    if ( !batch->mfns || !batch->types || !batch->errors ||
+         !batch->guest_data || !batch->local_pages || !batch->rec_pfns ||
+         !batch->iov || !batch->deferred_pfns )
+        goto enomem;
+
+    if ( !save_encodes_pages(ctx) )
+        return 0;
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    /* Encodings, padded to 8 octets. */
+    batch->encodings = malloc(ROUNDUP(MAX_BATCH_SIZE, REC_ALIGN_ORDER));
+    if ( !batch->encodings )
+        goto enomem;
+
+    if ( ctx->save.encode_delta || ctx->save.compress )
     {
-        ERROR("Unable to allocate arrays for a batch of %u pages",
-              nr_pfns);
-        goto err;
+        batch->enc_data = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+        if ( !batch->enc_data )
+            goto enomem;
+    }
+
+    if ( ctx->save.encode_delta )
+    {
+        batch->snapshot = malloc(PAGE_SIZE);
+        if ( !batch->snapshot )
+            goto enomem;
+    }
+
+    if ( ctx->save.compress )
+    {
+        batch->zdata_size = compressBound(MAX_BATCH_SIZE * PAGE_SIZE);
+        batch->zdata = malloc(batch->zdata_size);
+        if ( !batch->zdata )
+            goto enomem;
+    }
+
+    return 0;
+
+ enomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+static void free_batch(struct xc_sr_save_batch *batch)
+{
+    free(batch->snapshot);
+    free(batch->zdata);
+    free(batch->enc_data);
+    free(batch->encodings);
+    free(batch->deferred_pfns);
+    free(batch->iov);
+    free(batch->rec_pfns);
+    free(batch->local_pages);
+    free(batch->guest_data);
+    free(batch->errors);
+    free(batch->types);
+    free(batch->mfns);
+}
+
+/*
+ * Drop the guest mapping and any local pages held by a prepared batch.
+ */
+static void release_batch(struct xc_sr_context *ctx,
+                          struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    batch->guest_mapping = NULL;
+    batch->nr_pages_mapped = 0;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        free(batch->local_pages[i]);
+        batch->local_pages[i] = NULL;
+    }
+}
+
+static void defer_pfn(struct xc_sr_save_batch *batch, xen_pfn_t pfn)
+{
+    batch->deferred_pfns[batch->nr_deferred_pfns++] = pfn;
+}
+
+/*
+ * Construct the iovec[] for a PAGE_DATA record of a prepared batch.
+ */
+static void build_page_data_record(struct xc_sr_save_batch *batch)
+{
+    void **guest_data = batch->guest_data;
+    uint64_t *rec_pfns = batch->rec_pfns;
+    struct iovec *iov = batch->iov;
+    unsigned int i, nr_pfns = batch->nr_pfns, nr_pages = batch->nr_pages;
+    int iovcnt;
+
+    batch->hdr = (struct xc_sr_rec_page_data_header){ .count = nr_pfns };
+
+    batch->rec_type = REC_TYPE_PAGE_DATA;
+    batch->rec_length = sizeof(batch->hdr);
+    batch->rec_length += nr_pfns * sizeof(*rec_pfns);
+    batch->rec_length += nr_pages * PAGE_SIZE;
+
+    iov[0].iov_base = &batch->rec_type;
+    iov[0].iov_len = sizeof(batch->rec_type);
+
+    iov[1].iov_base = &batch->rec_length;
+    iov[1].iov_len = sizeof(batch->rec_length);
+
+    iov[2].iov_base = &batch->hdr;
+    iov[2].iov_len = sizeof(batch->hdr);
+
+    iov[3].iov_base = rec_pfns;
+    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+
+    iovcnt = 4;
+
+    if ( nr_pages )
+    {
+        for ( i = 0; i < nr_pfns; ++i )
+        {
+            if ( guest_data[i] )
+            {
+                iov[iovcnt].iov_base = guest_data[i];
+                iov[iovcnt].iov_len = PAGE_SIZE;
+                iovcnt++;
+                --nr_pages;
+            }
+        }
     }
 
+    /* Sanity check we have found all the pages we expected to. */
+    assert(nr_pages == 0);
+    batch->iovcnt = iovcnt;
+}
+
+/*
+ * Construct the iovec[] for an ENCODED_PAGE_DATA record of a prepared batch,
+ * encoding and compressing its page data as configured.
+ */
+static int build_encoded_page_data_record(struct xc_sr_context *ctx,
+                                          struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    static const uint8_t zeroes[(1U << REC_ALIGN_ORDER) - 1] = { 0 };
+    bool gather = ctx->save.encode_delta || ctx->save.compress;
+    struct iovec *iov = batch->iov;
+    unsigned int i, nr_pfns = batch->nr_pfns;
+    size_t enc_len = ROUNDUP(nr_pfns, REC_ALIGN_ORDER);
+    size_t data_length = 0, payload_len;
+    void *page, *out = batch->enc_data, *payload;
+    uint8_t enc;
+    int iovcnt, rc;
+
+    batch->ehdr = (struct xc_sr_rec_encoded_page_data_header){
+        .count = nr_pfns,
+        .compression = ENCODED_PAGE_DATA_COMPRESSION_NONE,
+    };
+
+    iov[0].iov_base = &batch->rec_type;
+    iov[0].iov_len = sizeof(batch->rec_type);
+
+    iov[1].iov_base = &batch->rec_length;
+    iov[1].iov_len = sizeof(batch->rec_length);
+
+    iov[2].iov_base = &batch->ehdr;
+    iov[2].iov_len = sizeof(batch->ehdr);
+
+    iov[3].iov_base = batch->rec_pfns;
+    iov[3].iov_len = nr_pfns * sizeof(*batch->rec_pfns);
+
+    iov[4].iov_base = batch->encodings;
+    iov[4].iov_len = enc_len;
+
+    iovcnt = 5;
+
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        page = batch->guest_data[i];
+        enc = PAGE_ENCODING_RAW;
 
-        /* Likely a ballooned page. */
-        if ( mfns[i] == INVALID_MFN )
+        if ( !page || batch->types[i] != XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            if ( ctx->save.encode_delta )
+                delta_cache_invalidate(ctx, batch->pfns[i]);
+        }
+        else if ( ctx->save.encode_delta )
+        {
+            enc = encode_page_delta(ctx, batch, batch->pfns[i], page, &out);
+            page = NULL;
+        }
+        else if ( ctx->save.encode_zero && page_is_zero(page) )
+        {
+            enc = PAGE_ENCODING_ZERO;
+            page = NULL;
+        }
+
+        batch->encodings[i] = enc;
+
+        if ( !page )
+            continue;
+
+        if ( gather )
         {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
+            memcpy(out, page, PAGE_SIZE);
+            out += PAGE_SIZE;
+        }
+        else
+        {
+            iov[iovcnt].iov_base = page;
+            iov[iovcnt].iov_len = PAGE_SIZE;
+            iovcnt++;
+            data_length += PAGE_SIZE;
         }
     }
 
+    memset(&batch->encodings[nr_pfns], 0, enc_len - nr_pfns);
+    payload_len = data_length;
+
+    if ( gather )
+    {
+        data_length = payload_len = out - batch->enc_data;
+        payload = batch->enc_data;
+
+        if ( ctx->save.compress && data_length )
+        {
+            uLongf zlen = batch->zdata_size;
+
+            rc = compress2(batch->zdata, &zlen, batch->enc_data, data_length,
+                           Z_BEST_SPEED);
+            if ( rc != Z_OK )
+            {
+                ERROR("Failed to compress %zu octets of page data: %d",
+                      data_length, rc);
+                return -1;
+            }
+
+            /* Incompressible data is sent as is. */
+            if ( zlen < data_length )
+            {
+                batch->ehdr.compression = ENCODED_PAGE_DATA_COMPRESSION_ZLIB;
+                payload = batch->zdata;
+                payload_len = zlen;
+            }
+        }
+
+        if ( payload_len )
+        {
+            iov[iovcnt].iov_base = payload;
+            iov[iovcnt].iov_len = payload_len;
+            iovcnt++;
+        }
+    }
+
+    batch->ehdr.data_length = data_length;
+
+    batch->rec_type = REC_TYPE_ENCODED_PAGE_DATA;
+    batch->rec_length = sizeof(batch->ehdr);
+    batch->rec_length += nr_pfns * sizeof(*batch->rec_pfns);
+    batch->rec_length += enc_len + payload_len;
+
+    if ( batch->rec_length != ROUNDUP(batch->rec_length, REC_ALIGN_ORDER) )
+    {
+        iov[iovcnt].iov_base = (void *)zeroes;
+        iov[iovcnt].iov_len = ROUNDUP(batch->rec_length, REC_ALIGN_ORDER) -
+            batch->rec_length;
+        iovcnt++;
+    }
+
+    batch->iovcnt = iovcnt;
+
+    return 0;
+}
+
+/*
+ * Prepare a batch of memory for sending as a PAGE_DATA or ENCODED_PAGE_DATA
+ * record.  The batch is constructed in batch->pfns.
+ *
+ * This function:
+ * - gets the types for each pfn in the batch.
+ * - for each pfn with real data:
+ *   - maps and attempts to localise the pages.
+ * - constructs the iovec[] for the record.
+ *
+ * It only reads state in ctx which is constant for the duration of an
+ * iteration, other than the internally locked delta cache, so may be called
+ * concurrently for different batches.  On success, the batch keeps its guest
+ * mapping until release_batch().
+ */
+static int prepare_batch(struct xc_sr_context *ctx,
+                         struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = batch->mfns, *types = batch->types;
+    int *errors = batch->errors, rc = -1;
+    void **guest_data = batch->guest_data;
+    void **local_pages = batch->local_pages;
+    unsigned int i, p, nr_pages = 0;
+    unsigned int nr_pfns = batch->nr_pfns;
+    void *page, *orig_page;
+    uint64_t *rec_pfns = batch->rec_pfns;
+
+    assert(nr_pfns != 0);
+
+    batch->nr_deferred_pfns = 0;
+    memset(guest_data, 0, nr_pfns * sizeof(*guest_data));
+
+    for ( i = 0; i < nr_pfns; ++i )
+    {
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch->pfns[i]);
+
+        /* Likely a ballooned page. */
+        if ( mfns[i] == INVALID_MFN )
+            defer_pfn(batch, batch->pfns[i]);
+    }
+
     rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
     if ( rc )
     {
@@ -161,14 +640,14 @@ static int write_batch(struct xc_sr_context *ctx)
 
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(
+        batch->guest_mapping = xenforeignmemory_map(
             xch->fmem, ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
             goto err;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = nr_pages;
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -178,11 +657,11 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
+                      batch->pfns[i], mfns[p], errors[p]);
                 goto err;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
@@ -192,8 +671,7 @@ static int write_batch(struct xc_sr_context *ctx)
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    defer_pfn(batch, batch->pfns[i]);
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
@@ -208,79 +686,370 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
-    {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
+    batch->nr_pages = nr_pages;
+
+    for ( i = 0; i < nr_pfns; ++i )
+        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | batch->pfns[i];
+
+    if ( !save_encodes_pages(ctx) )
+        build_page_data_record(batch);
+    else if ( build_encoded_page_data_record(ctx, batch) )
         goto err;
+
+    return 0;
+
+ err:
+    release_batch(ctx, batch);
+
+    return rc;
+}
+
+/*
+ * Write a prepared batch into the stream as a PAGE_DATA record, and account
+ * for any pages which need retrying.  Releases the batch in all cases.
+ */
+static int write_prepared_batch(struct xc_sr_context *ctx,
+                                struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+    int rc = 0;
+
+    for ( i = 0; i < batch->nr_deferred_pfns; ++i )
+        set_bit(batch->deferred_pfns[i], ctx->save.deferred_pages);
+    ctx->save.nr_deferred_pages += batch->nr_deferred_pfns;
+
+    if ( writev_exact(ctx->fd, batch->iov, batch->iovcnt) )
+    {
+        PERROR("Failed to write page data to stream");
+        rc = -1;
     }
 
-    hdr.count = nr_pfns;
+    release_batch(ctx, batch);
 
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+    return rc;
+}
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+/*
+ * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
+ * is constructed in ctx->save.batch_pfns.
+ */
+static int write_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch = &ctx->save.batch;
+    int rc;
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+    batch->pfns = ctx->save.batch_pfns;
+    batch->nr_pfns = ctx->save.nr_batch_pfns;
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    rc = prepare_batch(ctx, batch);
+    if ( !rc )
+        rc = write_prepared_batch(ctx, batch);
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    if ( !rc )
+        ctx->save.nr_batch_pfns = 0;
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    return rc;
+}
 
-    iovcnt = 4;
+/*
+ * Pipelined saving of page data.
+ *
+ * The thread walking the dirty bitmap (the scanner) fills batches of pfns
+ * and submits them into a ring of slots.  A pool of worker threads prepares
+ * submitted batches in parallel (type lookup, foreign mapping and
+ * normalisation), and a single writer thread emits prepared batches into the
+ * stream strictly in submission order.  A slot is only reused once its batch
+ * has been written, so the ring bounds the amount of guest memory mapped at
+ * once.
+ *
+ * The stream contents are identical to those produced by write_batch(), so
+ * the restore side needs no knowledge of the pipeline.  Nothing else may
+ * write to the stream until the pipeline has been drained.
+ */
+#define MAX_SAVE_WORKERS 64
 
-    if ( nr_pages )
+enum {
+    SLOT_FREE,      /* Owned by the scanner. */
+    SLOT_FILLED,    /* Submitted, waiting for a worker. */
+    SLOT_PREPARING, /* Owned by a worker. */
+    SLOT_READY,     /* Prepared, waiting for the writer. */
+};
+
+struct xc_sr_save_pipeline
+{
+    struct xc_sr_context *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Workers, followed by the writer. */
+    pthread_t *threads;
+    unsigned int nr_threads;
+
+    struct xc_sr_save_batch *slots;
+    unsigned int *state;
+    unsigned int nr_slots;
+
+    /* Sequence numbers of the next batch to submit, prepare and write. */
+    unsigned long submit_seq, prepare_seq, write_seq;
+
+    bool exiting;
+    /* First error encountered by any thread.  The pipeline is then dead. */
+    int rc, err;
+};
+
+/* Called with the lock held. */
+static void pipeline_fail(struct xc_sr_save_pipeline *pl, int err)
+{
+    if ( !pl->rc )
     {
-        for ( i = 0; i < nr_pfns; ++i )
-        {
-            if ( guest_data[i] )
-            {
-                iov[iovcnt].iov_base = guest_data[i];
-                iov[iovcnt].iov_len = PAGE_SIZE;
-                iovcnt++;
-                --nr_pages;
-            }
-        }
+        pl->rc = -1;
+        pl->err = err;
     }
+    pthread_cond_broadcast(&pl->cond);
+}
+
+static void *pipeline_worker(void *arg)
+{
+    struct xc_sr_save_pipeline *pl = arg;
+    unsigned int idx;
+    int rc;
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    pthread_mutex_lock(&pl->lock);
+
+    for ( ; ; )
     {
-        PERROR("Failed to write page data to stream");
-        goto err;
+        while ( !pl->exiting && !pl->rc && pl->prepare_seq == pl->submit_seq )
+            pthread_cond_wait(&pl->cond, &pl->lock);
+
+        if ( pl->exiting || pl->rc )
+            break;
+
+        idx = pl->prepare_seq++ % pl->nr_slots;
+        pl->state[idx] = SLOT_PREPARING;
+        pthread_mutex_unlock(&pl->lock);
+
+        rc = prepare_batch(pl->ctx, &pl->slots[idx]);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc )
+            pipeline_fail(pl, errno);
+        pl->state[idx] = SLOT_READY;
+        pthread_cond_broadcast(&pl->cond);
     }
 
-    /* Sanity check we have sent all the pages we expected to. */
-    assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+    pthread_mutex_unlock(&pl->lock);
 
- err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
-    free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
+    return NULL;
+}
+
+static void *pipeline_writer(void *arg)
+{
+    struct xc_sr_save_pipeline *pl = arg;
+    unsigned int idx;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+
+    for ( ; ; )
+    {
+        /*
+         * The slot for write_seq can only hold batch write_seq, as the
+         * previous occupant has been written and the next can't be submitted
+         * until this one is freed.
+         */
+        idx = pl->write_seq % pl->nr_slots;
+
+        while ( !pl->exiting && !pl->rc && pl->state[idx] != SLOT_READY )
+            pthread_cond_wait(&pl->cond, &pl->lock);
+
+        if ( pl->exiting || pl->rc )
+            break;
+
+        pthread_mutex_unlock(&pl->lock);
+
+        rc = write_prepared_batch(pl->ctx, &pl->slots[idx]);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc )
+            pipeline_fail(pl, errno);
+        pl->state[idx] = SLOT_FREE;
+        pl->write_seq++;
+        pthread_cond_broadcast(&pl->cond);
+    }
+
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/*
+ * Hand the batch in ctx->save.batch_pfns to the pipeline.  Blocks while the
+ * ring is full.
+ */
+static int pipeline_submit(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+    unsigned int idx;
+
+    pthread_mutex_lock(&pl->lock);
+
+    idx = pl->submit_seq % pl->nr_slots;
+    while ( !pl->rc && pl->state[idx] != SLOT_FREE )
+        pthread_cond_wait(&pl->cond, &pl->lock);
+
+    if ( pl->rc )
+    {
+        pthread_mutex_unlock(&pl->lock);
+        errno = pl->err;
+        return -1;
+    }
+
+    pthread_mutex_unlock(&pl->lock);
+
+    batch = &pl->slots[idx];
+    memcpy(batch->pfns, ctx->save.batch_pfns,
+           ctx->save.nr_batch_pfns * sizeof(*batch->pfns));
+    batch->nr_pfns = ctx->save.nr_batch_pfns;
+    ctx->save.nr_batch_pfns = 0;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->state[idx] = SLOT_FILLED;
+    pl->submit_seq++;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    return 0;
+}
+
+/*
+ * Wait for every submitted batch to be written into the stream.
+ */
+static int pipeline_drain(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+
+    while ( !pl->rc && pl->write_seq != pl->submit_seq )
+        pthread_cond_wait(&pl->cond, &pl->lock);
+
+    rc = pl->rc;
+    if ( rc )
+        errno = pl->err;
+
+    pthread_mutex_unlock(&pl->lock);
 
     return rc;
 }
 
+static void pipeline_destroy(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    unsigned int i;
+
+    if ( !pl )
+        return;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->exiting = true;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_threads; ++i )
+        pthread_join(pl->threads[i], NULL);
+
+    /* Either may be missing if pipeline_create() failed to allocate it. */
+    for ( i = 0; pl->slots && pl->state && i < pl->nr_slots; ++i )
+    {
+        /* Batches left behind by an error may still hold mappings. */
+        if ( pl->state[i] == SLOT_READY )
+            release_batch(ctx, &pl->slots[i]);
+        free(pl->slots[i].pfns);
+        free_batch(&pl->slots[i]);
+    }
+
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl->state);
+    free(pl->slots);
+    free(pl->threads);
+    free(pl);
+
+    ctx->save.pipeline = NULL;
+}
+
+static int pipeline_create(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pl;
+    unsigned int i, nr_workers = ctx->save.nr_workers;
+    int rc;
+
+    if ( nr_workers > MAX_SAVE_WORKERS )
+        nr_workers = MAX_SAVE_WORKERS;
+
+    pl = calloc(1, sizeof(*pl));
+    if ( !pl )
+    {
+        ERROR("Unable to allocate save pipeline");
+        return -1;
+    }
+
+    pl->ctx = ctx;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+    ctx->save.pipeline = pl;
+
+    /* Enough slots to keep every worker busy while the writer catches up. */
+    pl->nr_slots = nr_workers * 2;
+    pl->slots = calloc(pl->nr_slots, sizeof(*pl->slots));
+    pl->state = calloc(pl->nr_slots, sizeof(*pl->state));
+    pl->threads = calloc(nr_workers + 1, sizeof(*pl->threads));
+
+    if ( !pl->slots || !pl->state || !pl->threads )
+        goto enomem;
+
+    for ( i = 0; i < pl->nr_slots; ++i )
+    {
+        pl->slots[i].pfns = malloc(MAX_BATCH_SIZE * sizeof(*pl->slots[i].pfns));
+        if ( !pl->slots[i].pfns || alloc_batch(ctx, &pl->slots[i]) )
+            goto enomem;
+    }
+
+    for ( i = 0; i <= nr_workers; ++i )
+    {
+        rc = pthread_create(&pl->threads[i], NULL,
+                            i < nr_workers ? pipeline_worker : pipeline_writer,
+                            pl);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create save pipeline thread");
+            goto err;
+        }
+        pl->nr_threads++;
+    }
+
+    DPRINTF("Save pipeline: %u workers, %u slots", nr_workers, pl->nr_slots);
+
+    return 0;
+
+ enomem:
+    ERROR("Unable to allocate memory for save pipeline");
+    errno = ENOMEM;
+ err:
+    pipeline_destroy(ctx);
+    delta_cache_destroy(ctx);
+    return -1;
+}
+
 /*
- * Flush a batch of pfns into the stream.
+ * Flush a batch of pfns into the stream.  When the save pipeline is in use,
+ * the batch is only queued; see pipeline_drain().
  */
 static int flush_batch(struct xc_sr_context *ctx)
 {
@@ -289,7 +1058,10 @@ static int flush_batch(struct xc_sr_context *ctx)
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
-    rc = write_batch(ctx);
+    if ( ctx->save.pipeline )
+        rc = pipeline_submit(ctx);
+    else
+        rc = write_batch(ctx);
 
     if ( !rc )
     {
@@ -358,8 +1130,36 @@ static int suspend_domain(struct xc_sr_context *ctx)
 }
 
 /*
- * Send a subset of pages in the guests p2m, according to the dirty bitmap.
- * Used for each subsequent iteration of the live migration loop.
+ * Return the next dirty pfn to send, or p2m_size once there are no more.
+ * @cursor is 0 for the first call, and is updated for the next.
+ */
+static xen_pfn_t next_dirty_pfn(struct xc_sr_context *ctx,
+                                unsigned long *cursor)
+{
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_pfns,
+                                    &ctx->save.dirty_pfns_hbuf);
+    xen_pfn_t pfn;
+
+    if ( ctx->save.nr_dirty_pfns != XC_LOGDIRTY_NO_PFN_LIST )
+    {
+        if ( *cursor >= ctx->save.nr_dirty_pfns )
+            return ctx->save.p2m_size;
+
+        return dirty_pfns[(*cursor)++];
+    }
+
+    pfn = find_next_bit(dirty_bitmap, ctx->save.p2m_size, *cursor);
+    *cursor = pfn + 1;
+
+    return pfn;
+}
+
+/*
+ * Send a subset of pages in the guests p2m, according to the dirty bitmap, or
+ * the dirty pfn list if Xen returned one.  Used for each subsequent iteration
+ * of the live migration loop.
  *
  * Bitmap is bounded by p2m_size.
  */
@@ -368,16 +1168,12 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
 {
     xc_interface *xch = ctx->xch;
     xen_pfn_t p;
-    unsigned long written;
+    unsigned long cursor = 0, written;
     int rc;
-    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
-                                    &ctx->save.dirty_bitmap_hbuf);
 
-    for ( p = 0, written = 0; p < ctx->save.p2m_size; ++p )
+    for ( written = 0;
+          (p = next_dirty_pfn(ctx, &cursor)) < ctx->save.p2m_size; )
     {
-        if ( !test_bit(p, dirty_bitmap) )
-            continue;
-
         rc = add_to_batch(ctx, p);
         if ( rc )
             return rc;
@@ -393,9 +1189,22 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     if ( rc )
         return rc;
 
+    if ( ctx->save.pipeline )
+    {
+        rc = pipeline_drain(ctx);
+        if ( rc )
+        {
+            PERROR("Failed to send page data");
+            return rc;
+        }
+    }
+
     if ( written > entries )
         DPRINTF("Bitmap contained more entries than expected...");
 
+    /* The pfn list is only valid for the iteration it was collected for. */
+    ctx->save.nr_dirty_pfns = XC_LOGDIRTY_NO_PFN_LIST;
+
     xc_report_progress_step(xch, entries, entries);
 
     return ctx->save.ops.check_vm_state(ctx);
@@ -446,48 +1255,208 @@ static int enable_logdirty(struct xc_sr_context *ctx)
         }
     }
 
-    return 0;
-}
+    return 0;
+}
+
+static int update_progress_string(struct xc_sr_context *ctx, char **str)
+{
+    xc_interface *xch = ctx->xch;
+    char *new_str = NULL;
+    unsigned int iter = ctx->save.stats.iteration;
+
+    if ( asprintf(&new_str, "Frames iteration %u", iter) == -1 )
+    {
+        PERROR("Unable to allocate new progress string");
+        return -1;
+    }
+
+    free(*str);
+    *str = new_str;
+
+    xc_set_progress_prefix(xch, *str);
+    return 0;
+}
+
+/*
+ * This is the live migration precopy policy - it's called periodically during
+ * the precopy phase of live migrations, and is responsible for deciding when
+ * the precopy phase should terminate and what should be done next.
+ *
+ * The policy implemented here behaves identically to the policy previously
+ * hard-coded into xc_domain_save() - it proceeds to the stop-and-copy phase of
+ * the live migration when there are either fewer than 50 dirty pages, or more
+ * than 5 precopy rounds have completed.
+ */
+#define SPP_MAX_ITERATIONS      5
+#define SPP_TARGET_DIRTY_COUNT 50
+
+static int simple_precopy_policy(struct precopy_stats stats, void *user)
+{
+    return ((stats.dirty_count >= 0 &&
+             stats.dirty_count < SPP_TARGET_DIRTY_COUNT) ||
+            stats.iteration >= SPP_MAX_ITERATIONS)
+        ? XGS_POLICY_STOP_AND_COPY
+        : XGS_POLICY_CONTINUE_PRECOPY;
+}
+
+/*
+ * As simple_precopy_policy(), but resorts to postcopy rather than a long
+ * stop and copy if the migration doesn't converge.
+ */
+static int simple_postcopy_policy(struct precopy_stats stats, void *user)
+{
+    if ( stats.dirty_count >= 0 && stats.dirty_count < SPP_TARGET_DIRTY_COUNT )
+        return XGS_POLICY_STOP_AND_COPY;
+
+    return stats.iteration >= SPP_MAX_ITERATIONS
+        ? XGS_POLICY_POSTCOPY
+        : XGS_POLICY_CONTINUE_PRECOPY;
+}
+
+/*
+ * Cap the guest's vcpus to (100 - throttle)% of their full allocation, or
+ * of their existing cap, through the scheduler.  A throttle of 0 restores
+ * the original cap.  Only the credit schedulers support caps.
+ */
+static int throttle_vcpus(struct xc_sr_context *ctx, unsigned int throttle)
+{
+    xc_interface *xch = ctx->xch;
+    struct xen_domctl_sched_credit credit;
+    struct xen_domctl_sched_credit2 credit2;
+    xc_cpupoolinfo_t *pool;
+    unsigned int full;
+    uint16_t *cap;
+    int rc;
+
+    if ( !ctx->save.stats.throttle )
+    {
+        if ( !throttle )
+            return 0;
+
+        pool = xc_cpupool_getinfo(xch, ctx->dominfo.cpupool);
+        if ( !pool )
+        {
+            PERROR("Failed to get cpupool info");
+            return -1;
+        }
+        ctx->save.throttle_sched_id = pool->sched_id;
+        xc_cpupool_infofree(xch, pool);
+    }
+
+    switch ( ctx->save.throttle_sched_id )
+    {
+    case XEN_SCHEDULER_CREDIT:
+        rc = xc_sched_credit_domain_get(xch, ctx->domid, &credit);
+        cap = &credit.cap;
+        break;
+
+    case XEN_SCHEDULER_CREDIT2:
+        rc = xc_sched_credit2_domain_get(xch, ctx->domid, &credit2);
+        cap = &credit2.cap;
+        break;
+
+    default:
+        DPRINTF("Scheduler %u can't throttle vcpus",
+                ctx->save.throttle_sched_id);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if ( rc )
+    {
+        PERROR("Failed to get scheduler parameters");
+        return rc;
+    }
 
-static int update_progress_string(struct xc_sr_context *ctx, char **str)
-{
-    xc_interface *xch = ctx->xch;
-    char *new_str = NULL;
-    unsigned int iter = ctx->save.stats.iteration;
+    if ( !ctx->save.stats.throttle )
+        ctx->save.throttle_orig_cap = *cap;
 
-    if ( asprintf(&new_str, "Frames iteration %u", iter) == -1 )
+    if ( throttle )
     {
-        PERROR("Unable to allocate new progress string");
-        return -1;
+        full = ctx->save.throttle_orig_cap ?:
+            (ctx->dominfo.max_vcpu_id + 1) * 100;
+        full = full * (100 - throttle) / 100;
+        /* Caps are 16 bits: very large guests may only be capped less. */
+        *cap = min(max(full, 1U), (unsigned int)UINT16_MAX);
     }
+    else
+        *cap = ctx->save.throttle_orig_cap;
 
-    free(*str);
-    *str = new_str;
+    if ( ctx->save.throttle_sched_id == XEN_SCHEDULER_CREDIT )
+        rc = xc_sched_credit_domain_set(xch, ctx->domid, &credit);
+    else
+        rc = xc_sched_credit2_domain_set(xch, ctx->domid, &credit2);
+
+    if ( rc )
+    {
+        PERROR("Failed to set scheduler cap %u", *cap);
+        return rc;
+    }
+
+    ctx->save.stats.throttle = throttle;
 
-    xc_set_progress_prefix(xch, *str);
     return 0;
 }
 
 /*
- * This is the live migration precopy policy - it's called periodically during
- * the precopy phase of live migrations, and is responsible for deciding when
- * the precopy phase should terminate and what should be done next.
- *
- * The policy implemented here behaves identically to the policy previously
- * hard-coded into xc_domain_save() - it proceeds to the stop-and-copy phase of
- * the live migration when there are either fewer than 50 dirty pages, or more
- * than 5 precopy rounds have completed.
+ * The adaptive precopy policy.  It continues while the guest dirties
+ * memory more slowly than it can be sent, and finishes once the pages
+ * still dirty could be sent within a target downtime.  When the dirty rate
+ * keeps up with the send rate, the guest's vcpus are progressively
+ * throttled, and if that doesn't help, the migration is finished anyway,
+ * in postcopy mode if available.
  */
-#define SPP_MAX_ITERATIONS      5
-#define SPP_TARGET_DIRTY_COUNT 50
+#define APP_TARGET_DOWNTIME_MS 300
+#define APP_MAX_ITERATIONS      30
+#define APP_STALL_ITERATIONS     2
+#define APP_THROTTLE_STEP       20
+#define APP_MAX_THROTTLE        80
 
-static int simple_precopy_policy(struct precopy_stats stats, void *user)
+static int adaptive_precopy_policy(struct precopy_stats stats, void *user)
 {
-    return ((stats.dirty_count >= 0 &&
-             stats.dirty_count < SPP_TARGET_DIRTY_COUNT) ||
-            stats.iteration >= SPP_MAX_ITERATIONS)
-        ? XGS_POLICY_STOP_AND_COPY
-        : XGS_POLICY_CONTINUE_PRECOPY;
+    struct xc_sr_context *ctx = user;
+    int finish = ctx->save.postcopy ? XGS_POLICY_POSTCOPY
+                                    : XGS_POLICY_STOP_AND_COPY;
+
+    if ( stats.dirty_count >= 0 &&
+         (stats.dirty_count < SPP_TARGET_DIRTY_COUNT ||
+          (stats.send_rate &&
+           stats.expected_downtime <= APP_TARGET_DOWNTIME_MS)) )
+        return XGS_POLICY_STOP_AND_COPY;
+
+    if ( stats.iteration >= APP_MAX_ITERATIONS )
+        return finish;
+
+    /* Nothing new is known until the next dirty bitmap. */
+    if ( stats.dirty_count < 0 || !stats.send_rate )
+        return XGS_POLICY_CONTINUE_PRECOPY;
+
+    /* Converging, with the dirty rate under 90% of the send rate. */
+    if ( stats.dirty_rate < stats.send_rate / 10 * 9 )
+    {
+        ctx->save.nr_stalled = 0;
+        return XGS_POLICY_CONTINUE_PRECOPY;
+    }
+
+    if ( ++ctx->save.nr_stalled < APP_STALL_ITERATIONS )
+        return XGS_POLICY_CONTINUE_PRECOPY;
+
+    ctx->save.nr_stalled = 0;
+
+    if ( stats.throttle < APP_MAX_THROTTLE &&
+         !throttle_vcpus(ctx, stats.throttle + APP_THROTTLE_STEP) )
+        return XGS_POLICY_CONTINUE_PRECOPY;
+
+    return finish;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
 }
 
 /*
@@ -509,6 +1478,7 @@ static int send_memory_live(struct xc_sr_context *ctx)
     void *data = ctx->save.callbacks->data;
 
     struct precopy_stats *policy_stats;
+    uint64_t last_clean, start, elapsed;
 
     rc = update_progress_string(ctx, &progress_str);
     if ( rc )
@@ -519,10 +1489,17 @@ static int send_memory_live(struct xc_sr_context *ctx)
     };
     policy_stats = &ctx->save.stats;
 
-    if ( precopy_policy == NULL )
-        precopy_policy = simple_precopy_policy;
+    if ( precopy_policy == NULL && ctx->save.adaptive )
+    {
+        precopy_policy = adaptive_precopy_policy;
+        data = ctx;
+    }
+    else if ( precopy_policy == NULL )
+        precopy_policy = ctx->save.postcopy ? simple_postcopy_policy
+                                            : simple_precopy_policy;
 
     bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+    last_clean = now_us();
 
     for ( ; ; )
     {
@@ -535,9 +1512,14 @@ static int send_memory_live(struct xc_sr_context *ctx)
             if ( rc )
                 goto out;
 
+            start = now_us();
             rc = send_dirty_pages(ctx, stats.dirty_count);
             if ( rc )
                 goto out;
+
+            elapsed = now_us() - start;
+            policy_stats->send_rate =
+                stats.dirty_count * 1000000ULL / (elapsed ?: 1);
         }
 
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
@@ -546,15 +1528,19 @@ static int send_memory_live(struct xc_sr_context *ctx)
         policy_stats->iteration     = x;
         policy_stats->total_written += policy_stats->dirty_count;
         policy_stats->dirty_count   = -1;
+        policy_stats->expected_downtime = 0;
 
         policy_decision = precopy_policy(*policy_stats, data);
 
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
             break;
 
-        if ( xc_logdirty_control(
+        ctx->save.nr_dirty_pfns = ctx->save.max_dirty_pfns;
+
+        if ( xc_logdirty_control_pfns(
                  xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
                  &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
+                 &ctx->save.dirty_pfns_hbuf, &ctx->save.nr_dirty_pfns,
                  0, &stats) != ctx->save.p2m_size )
         {
             PERROR("Failed to retrieve logdirty bitmap");
@@ -564,6 +1550,28 @@ static int send_memory_live(struct xc_sr_context *ctx)
 
         policy_stats->dirty_count = stats.dirty_count;
 
+        /* A pfn list is exact, unlike the statistics. */
+        if ( ctx->save.nr_dirty_pfns != XC_LOGDIRTY_NO_PFN_LIST )
+        {
+            stats.dirty_count = ctx->save.nr_dirty_pfns;
+            policy_stats->dirty_count = ctx->save.nr_dirty_pfns;
+        }
+
+        start = now_us();
+        elapsed = start - last_clean;
+        last_clean = start;
+
+        policy_stats->dirty_rate =
+            stats.dirty_count * 1000000ULL / (elapsed ?: 1);
+        if ( policy_stats->send_rate )
+            policy_stats->expected_downtime =
+                stats.dirty_count * 1000ULL / policy_stats->send_rate;
+
+        IPRINTF("Precopy iteration %u: %u pages dirty, dirty rate %lu/s, "
+                "send rate %lu/s, expected downtime %lums, throttle %u%%",
+                x, stats.dirty_count, policy_stats->dirty_rate,
+                policy_stats->send_rate, policy_stats->expected_downtime,
+                policy_stats->throttle);
     }
 
     if ( policy_decision == XGS_POLICY_ABORT )
@@ -573,6 +1581,18 @@ static int send_memory_live(struct xc_sr_context *ctx)
         goto out;
     }
 
+    if ( policy_decision == XGS_POLICY_POSTCOPY )
+    {
+        if ( !ctx->save.postcopy )
+        {
+            ERROR("Precopy policy chose postcopy, which is not enabled");
+            rc = -1;
+            goto out;
+        }
+
+        ctx->save.postcopy_active = true;
+    }
+
  out:
     xc_set_progress_prefix(xch, NULL);
     free(progress_str);
@@ -694,6 +1714,247 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Write POSTCOPY_PFNS records describing the given pfns.
+ */
+static int write_postcopy_pfns(struct xc_sr_context *ctx, xen_pfn_t *pfns,
+                               unsigned int count)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_batch *batch = &ctx->save.batch;
+    struct xc_sr_rec_postcopy_pfns_header hdr = { .count = count };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_POSTCOPY_PFNS,
+        .length = sizeof(hdr),
+        .data = &hdr,
+    };
+    xen_pfn_t *types = batch->types;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < count; ++i )
+        types[i] = ctx->save.ops.pfn_to_gfn(ctx, pfns[i]);
+
+    rc = xc_get_pfn_type_batch(xch, ctx->domid, count, types);
+    if ( rc )
+    {
+        PERROR("Failed to get types for pfn batch");
+        return rc;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !is_known_page_type(types[i]) )
+        {
+            ERROR("Unknown type %#"PRIpfn" for pfn %#"PRIpfn,
+                  types[i], pfns[i]);
+            return -1;
+        }
+
+        batch->rec_pfns[i] = ((uint64_t)(types[i]) << 32) | pfns[i];
+    }
+
+    return write_split_record(ctx, &rec, batch->rec_pfns,
+                              count * sizeof(*batch->rec_pfns));
+}
+
+/*
+ * Suspend the domain and, instead of sending the remaining dirty memory,
+ * tell the restorer which pfns are to follow in the postcopy phase.  The
+ * dirty bitmap is left holding those pfns.
+ */
+static int suspend_and_begin_postcopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_BEGIN };
+    xen_pfn_t *pfns = ctx->save.batch_pfns, pfn;
+    unsigned int nr_pfns = 0;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = suspend_domain(ctx);
+    if ( rc )
+        return rc;
+
+    if ( xc_logdirty_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
+         ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        return -1;
+    }
+
+    bitmap_or(dirty_bitmap, ctx->save.deferred_pages, ctx->save.p2m_size);
+    bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
+    ctx->save.nr_deferred_pages = 0;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        return rc;
+
+    assert(ctx->save.nr_batch_pfns == 0);
+
+    for ( pfn = find_next_bit(dirty_bitmap, ctx->save.p2m_size, 0);
+          pfn < ctx->save.p2m_size;
+          pfn = find_next_bit(dirty_bitmap, ctx->save.p2m_size, pfn + 1) )
+    {
+        pfns[nr_pfns++] = pfn;
+
+        if ( nr_pfns == MAX_BATCH_SIZE )
+        {
+            rc = write_postcopy_pfns(ctx, pfns, nr_pfns);
+            if ( rc )
+                return rc;
+            nr_pfns = 0;
+        }
+    }
+
+    if ( nr_pfns )
+        rc = write_postcopy_pfns(ctx, pfns, nr_pfns);
+
+    return rc;
+}
+
+/*
+ * Queue the outstanding pfns requested by a POSTCOPY_FAULT record from the
+ * restorer for sending, ahead of the background sweep.
+ */
+static int handle_postcopy_fault(struct xc_sr_context *ctx,
+                                 unsigned long *nr_outstanding)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns_header *fault;
+    struct xc_sr_record rec;
+    unsigned int i;
+    uint64_t pfn;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        return rc;
+
+    rc = -1;
+    if ( rec.type != REC_TYPE_POSTCOPY_FAULT )
+    {
+        ERROR("Expected POSTCOPY_FAULT record, got %#x (%s)",
+              rec.type, rec_type_to_str(rec.type));
+        goto err;
+    }
+
+    fault = rec.data;
+    if ( rec.length < sizeof(*fault) ||
+         rec.length != sizeof(*fault) + fault->count * sizeof(*fault->pfn) )
+    {
+        ERROR("POSTCOPY_FAULT record wrong size: length %u", rec.length);
+        goto err;
+    }
+
+    for ( i = 0; i < fault->count; ++i )
+    {
+        pfn = fault->pfn[i];
+        if ( pfn >= ctx->save.p2m_size )
+        {
+            ERROR("Postcopy fault for invalid pfn %#"PRIx64, pfn);
+            goto err;
+        }
+
+        if ( !test_and_clear_bit(pfn, dirty_bitmap) )
+            continue;
+
+        rc = add_to_batch(ctx, pfn);
+        if ( rc )
+            goto err;
+        rc = -1;
+
+        --*nr_outstanding;
+    }
+
+    rc = flush_batch(ctx);
+
+ err:
+    free(rec.data);
+    return rc;
+}
+
+/*
+ * The postcopy phase.  Send the outstanding pages, those requested by the
+ * restorer first, and the rest in pfn order in the meantime.
+ */
+static int send_memory_postcopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_TRANSITION };
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long nr_outstanding = 0, total, cursor = 0;
+    xen_pfn_t pfn;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    for ( pfn = find_next_bit(dirty_bitmap, ctx->save.p2m_size, 0);
+          pfn < ctx->save.p2m_size;
+          pfn = find_next_bit(dirty_bitmap, ctx->save.p2m_size, pfn + 1) )
+        ++nr_outstanding;
+    total = nr_outstanding;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        return rc;
+
+    /* The restorer has no copy of outstanding pages to DELTA encode from. */
+    ctx->save.encode_delta = false;
+
+    xc_set_progress_prefix(xch, "Postcopy");
+
+    while ( nr_outstanding )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll for postcopy faults");
+            goto out;
+        }
+
+        if ( rc )
+            rc = handle_postcopy_fault(ctx, &nr_outstanding);
+        else
+        {
+            while ( ctx->save.nr_batch_pfns < MAX_BATCH_SIZE &&
+                    (pfn = find_next_bit(dirty_bitmap, ctx->save.p2m_size,
+                                         cursor)) < ctx->save.p2m_size )
+            {
+                clear_bit(pfn, dirty_bitmap);
+                ctx->save.batch_pfns[ctx->save.nr_batch_pfns++] = pfn;
+                --nr_outstanding;
+                cursor = pfn + 1;
+            }
+
+            rc = flush_batch(ctx);
+        }
+
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, total - nr_outstanding, total);
+    }
+
+    if ( ctx->save.pipeline )
+        rc = pipeline_drain(ctx);
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    return rc;
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -744,6 +2005,12 @@ static int send_domain_memory_live(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
+    if ( ctx->save.postcopy_active )
+    {
+        rc = suspend_and_begin_postcopy(ctx);
+        goto out;
+    }
+
     rc = suspend_and_send_dirty(ctx);
     if ( rc )
         goto out;
@@ -790,24 +2057,48 @@ static int send_domain_memory_nonlive(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * A pfn list costs 64 bits per dirty page, against 1 bit per page of guest
+ * for the bitmap, so is only worth having for iterations where fewer than 1
+ * in 64 pages are dirty.  Cap the buffer at 2MB.
+ */
+#define MAX_DIRTY_PFNS (1U << 18)
+
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_pfns,
+                                    &ctx->save.dirty_pfns_hbuf);
 
     rc = ctx->save.ops.setup(ctx);
     if ( rc )
         goto err;
 
+    ctx->save.nr_dirty_pfns = XC_LOGDIRTY_NO_PFN_LIST;
+    ctx->save.max_dirty_pfns = min_t(unsigned long, MAX_DIRTY_PFNS,
+                                     ctx->save.p2m_size / 64);
+    if ( ctx->save.live && ctx->save.max_dirty_pfns )
+    {
+        dirty_pfns = xc_hypercall_buffer_alloc_pages(
+            xch, dirty_pfns,
+            NRPAGES(ctx->save.max_dirty_pfns * sizeof(*dirty_pfns)));
+        if ( !dirty_pfns )
+            ctx->save.max_dirty_pfns = 0;
+    }
+    else
+        ctx->save.max_dirty_pfns = 0;
+
     dirty_bitmap = xc_hypercall_buffer_alloc_pages(
         xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->save.p2m_size)));
     ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
                                   sizeof(*ctx->save.batch_pfns));
     ctx->save.deferred_pages = bitmap_alloc(ctx->save.p2m_size);
 
-    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages )
+    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages ||
+         alloc_batch(ctx, &ctx->save.batch) )
     {
         ERROR("Unable to allocate memory for dirty bitmaps, batch pfns and"
               " deferred pages");
@@ -816,6 +2107,20 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    if ( ctx->save.encode_delta )
+    {
+        rc = delta_cache_create(ctx);
+        if ( rc )
+            goto err;
+    }
+
+    if ( ctx->save.nr_workers )
+    {
+        rc = pipeline_create(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = 0;
 
  err:
@@ -827,7 +2132,15 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_pfns,
+                                    &ctx->save.dirty_pfns_hbuf);
+
 
+    pipeline_destroy(ctx);
+    delta_cache_destroy(ctx);
+
+    if ( throttle_vcpus(ctx, 0) )
+        PERROR("Failed to restore scheduler cap");
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0);
@@ -837,7 +2150,12 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    if ( ctx->save.max_dirty_pfns )
+        xc_hypercall_buffer_free_pages(
+            xch, dirty_pfns,
+            NRPAGES(ctx->save.max_dirty_pfns * sizeof(*dirty_pfns)));
     free(ctx->save.deferred_pages);
+    free_batch(&ctx->save.batch);
     free(ctx->save.batch_pfns);
 }
 
@@ -905,6 +2223,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy_active )
+        {
+            rc = send_memory_postcopy(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->stream_type != XC_STREAM_PLAIN )
         {
             /*
@@ -994,6 +2319,17 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.nr_workers = XCFLAGS_SAVE_WORKERS_COUNT(flags);
+    ctx.save.encode_zero = !!(flags & XCFLAGS_ENCODE_ZERO);
+    ctx.save.compress = !!(flags & XCFLAGS_ENCODE_COMPRESS);
+    /*
+     * In checkpointed streams, the secondary's copy of memory may be rolled
+     * back or run in the meantime, so can't be a basis for DELTA encoding.
+     */
+    ctx.save.encode_delta = (flags & XCFLAGS_ENCODE_DELTA) &&
+        stream_type == XC_STREAM_PLAIN;
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
+    ctx.save.adaptive = !!(flags & XCFLAGS_ADAPTIVE_PRECOPY);
     ctx.save.recv_fd = recv_fd;
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
@@ -1027,8 +2363,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
         break;
     }
 
-    DPRINTF("fd %d, dom %u, flags %u, hvm %d",
-            io_fd, dom, flags, ctx.dominfo.hvm);
+    if ( ctx.save.postcopy &&
+         (!ctx.save.live || stream_type != XC_STREAM_PLAIN ||
+          !ctx.dominfo.hvm || recv_fd < 0) )
+    {
+        ERROR("Postcopy needs a live, plain migration of an HVM guest,"
+              " with a back channel");
+        errno = EINVAL;
+        return -1;
+    }
+
+    DPRINTF("fd %d, dom %u, flags %#x, hvm %d, workers %u",
+            io_fd, dom, flags, ctx.dominfo.hvm, ctx.save.nr_workers);
 
     ctx.domid = dom;
 
@@ -76,6 +76,11 @@ struct xc_sr_rhdr
 #define REC_TYPE_STATIC_DATA_END            0x00000010U
 #define REC_TYPE_X86_CPUID_POLICY           0x00000011U
 #define REC_TYPE_X86_MSR_POLICY             0x00000012U
+#define REC_TYPE_ENCODED_PAGE_DATA          0x00000013U
+#define REC_TYPE_POSTCOPY_BEGIN             0x00000014U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000015U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000016U
+#define REC_TYPE_POSTCOPY_FAULT             0x00000017U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +95,41 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/* ENCODED_PAGE_DATA */
+struct xc_sr_rec_encoded_page_data_header
+{
+    uint32_t count;
+    uint8_t compression;
+    uint8_t _res1[3];
+    uint32_t data_length;
+    uint32_t _res2;
+    uint64_t pfn[0];
+    /* uint8_t encoding[count], padded to 8 octets. */
+    /* Page data. */
+};
+
+#define ENCODED_PAGE_DATA_COMPRESSION_NONE 0x00U
+#define ENCODED_PAGE_DATA_COMPRESSION_ZLIB 0x01U
+
+#define PAGE_ENCODING_RAW   0x00U
+#define PAGE_ENCODING_ZERO  0x01U
+#define PAGE_ENCODING_DELTA 0x02U
+
+/* A DELTA encoded page: nr_runs * { skip, len, uint64_t word[len] }. */
+struct xc_sr_page_delta_run
+{
+    uint16_t skip;
+    uint16_t len;
+};
+
+/* POSTCOPY_PFNS, POSTCOPY_FAULT */
+struct xc_sr_rec_postcopy_pfns_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
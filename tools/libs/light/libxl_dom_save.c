@@ -409,7 +409,16 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     if (rc) goto out;
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
-          | (debug ? XCFLAGS_DEBUG : 0);
+          | (debug ? XCFLAGS_DEBUG : 0)
+          | XCFLAGS_SAVE_WORKERS(dss->save_workers);
+    if (dss->encode & LIBXL_SUSPEND_ENCODE_ZERO)
+        dss->xcflags |= XCFLAGS_ENCODE_ZERO;
+    if (dss->encode & LIBXL_SUSPEND_ENCODE_DELTA)
+        dss->xcflags |= XCFLAGS_ENCODE_DELTA;
+    if (dss->encode & LIBXL_SUSPEND_ENCODE_COMPRESS)
+        dss->xcflags |= XCFLAGS_ENCODE_COMPRESS;
+    if (dss->adaptive_precopy)
+        dss->xcflags |= XCFLAGS_ADAPTIVE_PRECOPY;
 
     /* Disallow saving a guest with vNUMA configured because migration
      * stream does not preserve node information.
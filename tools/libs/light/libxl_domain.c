@@ -529,6 +529,12 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->save_workers = (flags & LIBXL_SUSPEND_WORKERS_MASK) >>
+                        LIBXL_SUSPEND_WORKERS_SHIFT;
+    dss->encode = flags & (LIBXL_SUSPEND_ENCODE_ZERO |
+                           LIBXL_SUSPEND_ENCODE_DELTA |
+                           LIBXL_SUSPEND_ENCODE_COMPRESS);
+    dss->adaptive_precopy = flags & LIBXL_SUSPEND_ADAPTIVE_PRECOPY;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
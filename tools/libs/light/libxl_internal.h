@@ -674,6 +674,7 @@ struct libxl__ctx {
     xentoollog_logger *lg;
     xc_interface *xch;
     struct xs_handle *xsh;
+    bool xs_no_multi; /* xenstored doesn't support XS_MULTI */
     libxl__gc nogc_gc;
 
     const libxl_event_hooks *event_hooks;
@@ -1078,6 +1079,41 @@ int libxl__xs_transaction_start(libxl__gc *gc, xs_transaction_t *t);
 int libxl__xs_transaction_commit(libxl__gc *gc, xs_transaction_t *t);
 void libxl__xs_transaction_abort(libxl__gc *gc, xs_transaction_t *t);
 
+/*----- batched xenstore updates -----*/
+/* Updates added to a batch are sent with as few XS_MULTI requests as
+ * possible, or one by one if xenstored doesn't support XS_MULTI.  A
+ * full batch is flushed early, so use a transaction if the updates
+ * need to be atomic.  Paths, values and permissions must remain valid
+ * until the batch has been flushed.
+ *
+ * The first error is remembered and makes all later calls no-ops;
+ * it is logged and returned (as ERROR_FAIL) by libxl__xs_batch_flush.
+ */
+typedef struct {
+    xs_transaction_t t;
+    struct xs_multi_op *ops;
+    unsigned int num_ops, max_ops;
+    unsigned int len; /* upper bound of the request or reply size */
+    int rc;
+} libxl__xs_batch;
+
+_hidden void libxl__xs_batch_init(libxl__xs_batch *batch, xs_transaction_t t);
+/* Does not include a trailing null. */
+_hidden void libxl__xs_batch_write(libxl__gc *gc, libxl__xs_batch *batch,
+                                   const char *path, const char *string);
+_hidden void libxl__xs_batch_mkdir(libxl__gc *gc, libxl__xs_batch *batch,
+                                   const char *path);
+_hidden void libxl__xs_batch_set_perms(libxl__gc *gc, libxl__xs_batch *batch,
+                                       const char *path,
+                                       const struct xs_permissions *perms,
+                                       unsigned int num_perms);
+/* as libxl__xs_writev_perms; perms may be NULL */
+_hidden void libxl__xs_batch_writev_perms(libxl__gc *gc, libxl__xs_batch *batch,
+                                          const char *dir, char *kvs[],
+                                          const struct xs_permissions *perms,
+                                          unsigned int num_perms);
+_hidden int libxl__xs_batch_flush(libxl__gc *gc, libxl__xs_batch *batch);
+
 
 
 /*
@@ -3657,6 +3693,9 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    unsigned int save_workers;
+    int encode; /* LIBXL_SUSPEND_ENCODE_* */
+    int adaptive_precopy;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     /* private */
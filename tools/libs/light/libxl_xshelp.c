@@ -240,6 +240,152 @@ int libxl__xs_rm_checked(libxl__gc *gc, xs_transaction_t t, const char *path)
     return 0;
 }
 
+void libxl__xs_batch_init(libxl__xs_batch *batch, xs_transaction_t t)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->t = t;
+}
+
+static void xs_batch_add(libxl__gc *gc, libxl__xs_batch *batch,
+                         const struct xs_multi_op *op, unsigned int size)
+{
+    /* Each operation needs a header; a successful reply is just "OK". */
+    size += sizeof(struct xsd_sockmsg) + strlen(op->path) + 1;
+    if (size < sizeof(struct xsd_sockmsg) + 3)
+        size = sizeof(struct xsd_sockmsg) + 3;
+
+    if (batch->len + size > XENSTORE_PAYLOAD_MAX)
+        libxl__xs_batch_flush(gc, batch);
+    if (batch->rc)
+        return;
+
+    if (batch->num_ops == batch->max_ops) {
+        batch->max_ops = batch->max_ops ? batch->max_ops * 2 : 16;
+        GCREALLOC_ARRAY(batch->ops, batch->max_ops);
+    }
+    batch->ops[batch->num_ops++] = *op;
+    batch->len += size;
+}
+
+void libxl__xs_batch_write(libxl__gc *gc, libxl__xs_batch *batch,
+                           const char *path, const char *string)
+{
+    struct xs_multi_op op = {
+        .type = XS_WRITE,
+        .path = path,
+        .data = string,
+        .len = strlen(string),
+    };
+
+    xs_batch_add(gc, batch, &op, op.len);
+}
+
+void libxl__xs_batch_mkdir(libxl__gc *gc, libxl__xs_batch *batch,
+                           const char *path)
+{
+    struct xs_multi_op op = { .type = XS_MKDIR, .path = path };
+
+    xs_batch_add(gc, batch, &op, 0);
+}
+
+void libxl__xs_batch_set_perms(libxl__gc *gc, libxl__xs_batch *batch,
+                               const char *path,
+                               const struct xs_permissions *perms,
+                               unsigned int num_perms)
+{
+    struct xs_multi_op op = {
+        .type = XS_SET_PERMS,
+        .path = path,
+        .perms = perms,
+        .num_perms = num_perms,
+    };
+
+    /* Each permission is a letter, a domid and a nul. */
+    xs_batch_add(gc, batch, &op, num_perms * (2 + MAX_STRLEN(unsigned int)));
+}
+
+void libxl__xs_batch_writev_perms(libxl__gc *gc, libxl__xs_batch *batch,
+                                  const char *dir, char *kvs[],
+                                  const struct xs_permissions *perms,
+                                  unsigned int num_perms)
+{
+    char *path;
+    int i;
+
+    if (!kvs)
+        return;
+
+    for (i = 0; kvs[i] != NULL; i += 2) {
+        if (!kvs[i + 1])
+            continue;
+        path = GCSPRINTF("%s/%s", dir, kvs[i]);
+        libxl__xs_batch_write(gc, batch, path, kvs[i + 1]);
+        if (perms)
+            libxl__xs_batch_set_perms(gc, batch, path, perms, num_perms);
+    }
+}
+
+static bool xs_batch_op(libxl__gc *gc, xs_transaction_t t,
+                        const struct xs_multi_op *op)
+{
+    switch (op->type) {
+    case XS_WRITE:
+        return xs_write(CTX->xsh, t, op->path, op->data, op->len);
+    case XS_MKDIR:
+        return xs_mkdir(CTX->xsh, t, op->path);
+    case XS_SET_PERMS:
+        return xs_set_permissions(CTX->xsh, t, op->path,
+                                  (struct xs_permissions *)op->perms,
+                                  op->num_perms);
+    default:
+        abort();
+    }
+}
+
+int libxl__xs_batch_flush(libxl__gc *gc, libxl__xs_batch *batch)
+{
+    struct xs_multi_op *op = NULL;
+    unsigned int i;
+
+    if (batch->rc || !batch->num_ops)
+        return batch->rc;
+
+    if (!CTX->xs_no_multi) {
+        if (xs_multi(CTX->xsh, batch->t, batch->ops, batch->num_ops))
+            goto done;
+        if (errno != ENOSYS || batch->ops[0].err != ECANCELED) {
+            for (i = 0; i < batch->num_ops && !op; i++)
+                if (batch->ops[i].err != 0)
+                    op = &batch->ops[i];
+            goto fail;
+        }
+        CTX->xs_no_multi = true;
+    }
+
+    for (i = 0; i < batch->num_ops; i++) {
+        if (!xs_batch_op(gc, batch->t, &batch->ops[i])) {
+            op = &batch->ops[i];
+            goto fail;
+        }
+    }
+
+ done:
+    batch->num_ops = 0;
+    batch->len = 0;
+    return 0;
+
+ fail:
+    if (op && op->err != ECANCELED)
+        LOGE(ERROR, "xenstore %s failed on `%s'",
+             op->type == XS_WRITE ? "write" :
+             op->type == XS_MKDIR ? "mkdir" : "set permissions", op->path);
+    else
+        LOGE(ERROR, "xenstore batch of %u operations failed",
+             batch->num_ops);
+    batch->rc = ERROR_FAIL;
+    return batch->rc;
+}
+
 int libxl__xs_transaction_start(libxl__gc *gc, xs_transaction_t *t)
 {
     assert(!*t);
@@ -795,6 +795,131 @@ unwind:
 	return false;
 }
 
+/* Append data to an XS_MULTI request, failing if it doesn't fit. */
+static bool multi_append(char *buf, unsigned int *len,
+			 const void *data, unsigned int size)
+{
+	if (size > XENSTORE_PAYLOAD_MAX - *len) {
+		errno = E2BIG;
+		return false;
+	}
+	memcpy(buf + *len, data, size);
+	*len += size;
+	return true;
+}
+
+static bool multi_add_op(char *buf, unsigned int *len,
+			 const struct xs_multi_op *op)
+{
+	struct xsd_sockmsg hdr = { .type = op->type };
+	unsigned int i, start = *len;
+	char buffer[MAX_STRLEN(unsigned int)+1];
+
+	if (!multi_append(buf, len, &hdr, sizeof(hdr)) ||
+	    !multi_append(buf, len, op->path, strlen(op->path) + 1))
+		return false;
+
+	switch (op->type) {
+	case XS_READ:
+	case XS_MKDIR:
+	case XS_RM:
+		break;
+	case XS_WRITE:
+		if (!multi_append(buf, len, op->data, op->len))
+			return false;
+		break;
+	case XS_SET_PERMS:
+		for (i = 0; i < op->num_perms; i++) {
+			if (!xs_perm_to_string(&op->perms[i], buffer,
+					       sizeof(buffer)) ||
+			    !multi_append(buf, len, buffer, strlen(buffer) + 1))
+				return false;
+		}
+		break;
+	default:
+		errno = EINVAL;
+		return false;
+	}
+
+	hdr.len = *len - start - sizeof(hdr);
+	memcpy(buf + start, &hdr, sizeof(hdr));
+	return true;
+}
+
+bool xs_multi(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_multi_op *ops, unsigned int num_ops)
+{
+	struct xsd_sockmsg hdr;
+	struct iovec iovec;
+	unsigned int i, len = 0, off;
+	char *buf, *reply, *data;
+
+	for (i = 0; i < num_ops; i++) {
+		ops[i].err = ECANCELED;
+		ops[i].result = NULL;
+		ops[i].result_len = 0;
+	}
+
+	buf = malloc(XENSTORE_PAYLOAD_MAX);
+	if (!buf)
+		return false;
+
+	for (i = 0; i < num_ops; i++) {
+		if (!multi_add_op(buf, &len, &ops[i])) {
+			free_no_errno(buf);
+			return false;
+		}
+	}
+
+	iovec.iov_base = buf;
+	iovec.iov_len = len;
+	reply = xs_talkv(h, t, XS_MULTI, &iovec, 1, &len);
+	free_no_errno(buf);
+	if (!reply)
+		return false;
+
+	/* One sub-reply per executed operation, the last one might be an error. */
+	for (i = 0, off = 0; i < num_ops; i++, off += sizeof(hdr) + hdr.len) {
+		if (len - off < sizeof(hdr))
+			break;
+		memcpy(&hdr, reply + off, sizeof(hdr));
+		data = reply + off + sizeof(hdr);
+		if (hdr.len > len - off - sizeof(hdr))
+			break;
+
+		if (hdr.type == XS_ERROR) {
+			if (!hdr.len || data[hdr.len - 1])
+				break;
+			ops[i].err = get_error(data);
+			free(reply);
+			errno = ops[i].err;
+			return false;
+		}
+		if (hdr.type != ops[i].type)
+			break;
+
+		if (hdr.type == XS_READ) {
+			ops[i].result = malloc(hdr.len + 1);
+			if (!ops[i].result) {
+				free_no_errno(reply);
+				return false;
+			}
+			memcpy(ops[i].result, data, hdr.len);
+			((char *)ops[i].result)[hdr.len] = 0;
+			ops[i].result_len = hdr.len;
+		}
+		ops[i].err = 0;
+	}
+
+	free(reply);
+	if (i < num_ops || off != len) {
+		errno = EBADF;
+		return false;
+	}
+
+	return true;
+}
+
 /* Always return false a functionality has been removed in Xen 4.9 */
 bool xs_restrict(struct xs_handle *h, unsigned domid)
 {
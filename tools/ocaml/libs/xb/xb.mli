@@ -23,6 +23,7 @@ sig
     | Resume
     | Set_target
     | Reset_watches
+    | Multi
     | Invalid
   val operation_c_mapping : operation array
   val size : int
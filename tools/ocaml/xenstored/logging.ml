@@ -247,6 +247,7 @@ let string_of_access_type = function
     | Xenbus.Xb.Op.Setperms          -> "setperms "
     | Xenbus.Xb.Op.Reset_watches     -> "reset watches"
     | Xenbus.Xb.Op.Set_target        -> "settarget"
+    | Xenbus.Xb.Op.Multi             -> "multi    "
 
     | Xenbus.Xb.Op.Error             -> "error    "
     | Xenbus.Xb.Op.Watchevent        -> "w event  "
@@ -374,7 +374,7 @@ let reply_none fct con t doms cons data =
   fct con t doms cons data
 
 (* Functions for 'simple' operations that cannot be part of a transaction *)
-let function_of_type_simple_op ty =
+let rec function_of_type_simple_op ty =
   match ty with
   | Xenbus.Xb.Op.Debug
   | Xenbus.Xb.Op.Watch
@@ -397,9 +397,10 @@ let function_of_type_simple_op ty =
   | Xenbus.Xb.Op.Mkdir             -> reply_ack do_mkdir
   | Xenbus.Xb.Op.Rm                -> reply_ack do_rm
   | Xenbus.Xb.Op.Setperms          -> reply_ack do_setperms
+  | Xenbus.Xb.Op.Multi             -> reply_data do_multi
   | _                              -> reply_ack do_error
 
-let input_handle_error ~cons ~doms ~fct ~con ~t ~req =
+and input_handle_error ~cons ~doms ~fct ~con ~t ~req =
   let reply_error e =
     Packet.Error e in
   try
@@ -423,6 +424,60 @@ let input_handle_error ~cons ~doms ~fct ~con ~t ~req =
   | (Failure "int_of_string")    -> reply_error "EINVAL"
   | Define.Unknown_operation     -> reply_error "ENOSYS"
 
+(* Execute the sub-requests of a Multi request in order, stopping at the first
+   failing one. Outside of a transaction they are run on a copy of the store,
+   which is only installed if all of them succeeded. *)
+and do_multi con t doms cons data =
+  let hsize = Xenbus.Partial.header_size () in
+  let rec parse off =
+    if off = String.length data then []
+    else begin
+      if String.length data - off < hsize then raise Invalid_Cmd_Args;
+      let _tid, _rid, opint, len =
+        Xenbus.Partial.header_of_string_internal (String.sub data off hsize) in
+      if len > String.length data - off - hsize then raise Invalid_Cmd_Args;
+      let ty = Xenbus.Xb.Op.of_cval opint in
+      (match ty with
+       | Xenbus.Xb.Op.Read | Xenbus.Xb.Op.Write | Xenbus.Xb.Op.Mkdir
+       | Xenbus.Xb.Op.Rm | Xenbus.Xb.Op.Setperms -> ()
+       | _ -> raise Invalid_Cmd_Args);
+      (ty, String.sub data (off + hsize) len) :: parse (off + hsize + len)
+    end
+  in
+  let ops = parse 0 in
+  let store = Transaction.get_store t in
+  let implicit = Transaction.get_id t = Transaction.none in
+  let mt =
+    if implicit then
+      Transaction.make ~internal:true Transaction.none (Store.copy store)
+    else t
+  in
+  let replies = Buffer.create 64 in
+  let add_reply ty data =
+    Buffer.add_string replies
+      (Xenbus.Xb.Packet.to_string (Xenbus.Xb.Packet.create 0 0 ty data))
+  in
+  let rec execute = function
+    | [] -> true
+    | (ty, data) :: rest ->
+      let req = {Packet.tid=Transaction.get_id t; Packet.rid=0; Packet.ty=ty; Packet.data=data} in
+      let fct = function_of_type_simple_op ty in
+      match input_handle_error ~cons ~doms ~fct ~con ~t:mt ~req with
+      | Packet.Ack _   -> add_reply ty "OK\000"; execute rest
+      | Packet.Reply x -> add_reply ty x; execute rest
+      | Packet.Error e -> add_reply Xenbus.Xb.Op.Error (e ^ "\000"); false
+  in
+  let success = execute ops in
+  if Buffer.length replies > Xenbus.Partial.xenstore_payload_max then
+    raise Quota.Data_too_big;
+  if implicit && success then begin
+    let mstore = Transaction.get_store mt in
+    Store.set_root store (Store.get_root mstore);
+    Store.set_quota store (Store.get_quota mstore);
+    process_watch con mt cons
+  end;
+  Buffer.contents replies
+
 let write_access_log ~ty ~tid ~con ~data =
   Logging.xb_op ~ty ~tid ~con data
 
@@ -636,7 +691,8 @@ let retain_op_in_history ty =
   | Xenbus.Xb.Op.Write
   | Xenbus.Xb.Op.Mkdir
   | Xenbus.Xb.Op.Rm
-  | Xenbus.Xb.Op.Setperms          -> true
+  | Xenbus.Xb.Op.Setperms
+  | Xenbus.Xb.Op.Multi             -> true
   | Xenbus.Xb.Op.Debug
   | Xenbus.Xb.Op.Directory
   | Xenbus.Xb.Op.Read
@@ -0,0 +1,362 @@
+/*
+ * Tests for the per-vCPU dirty rings.
+ *
+ * Run a vCPU writing to twice as many pages as its ring holds, harvest and
+ * RESET the ring as it fills up, and check that each page is reported once
+ * without the ring overflowing, the vCPU being stalled meanwhile.  Also check
+ * that pages dirtied on behalf of the domain only flag the ring as
+ * overflowed, and are collected with CLEAN.
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+#include <xendevicemodel.h>
+#include <xen-tools/common-macros.h>
+
+#include <xen/hvm/save.h>
+
+#define NR_ENTRIES    XEN_DIRTY_RING_MIN_ENTRIES
+
+/* A page of code, followed by the pages it writes to. */
+#define CODE_PFN      0
+#define DATA_PFN      1
+#define NR_DATA_PAGES (2 * NR_ENTRIES)
+#define NR_PAGES      (DATA_PFN + NR_DATA_PAGES)
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fmem;
+static xendevicemodel_handle *dmod;
+static uint32_t domid;
+
+static struct xen_domctl_createdomain create = {
+    .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+    .max_vcpus = 1,
+    .max_grant_frames = 1,
+    .grant_opts = XEN_DOMCTL_GRANT_version(1),
+
+    .arch = {
+        .emulation_flags = XEN_X86_EMU_LAPIC,
+    },
+};
+
+/* Write to each data page in turn, then take the vCPU offline. */
+static void write_code(uint8_t *p)
+{
+    static const uint8_t loop[] = {
+        0x89, 0x07,                         /* 1: mov  %eax, (%edi)  */
+        0x81, 0xc7, 0x00, 0x10, 0x00, 0x00, /*    add  $4096, %edi   */
+        0xe2, 0xf6,                         /*    loop 1b            */
+        0xfa,                               /*    cli                */
+        0xf4,                               /*    hlt                */
+    };
+    uint32_t data = DATA_PFN << XC_PAGE_SHIFT, nr = NR_DATA_PAGES;
+
+    *p++ = 0xbf;                            /*    mov  $data, %edi   */
+    memcpy(p, &data, sizeof(data));
+    p += sizeof(data);
+    *p++ = 0xb9;                            /*    mov  $nr, %ecx     */
+    memcpy(p, &nr, sizeof(nr));
+    p += sizeof(nr);
+    memcpy(p, loop, sizeof(loop));
+}
+
+/* Start the vCPU at the code page, in flat 32-bit protected mode. */
+static int init_vcpu(void)
+{
+    struct {
+        struct hvm_save_descriptor header_d;
+        HVM_SAVE_TYPE(HEADER) header;
+        struct hvm_save_descriptor cpu_d;
+        HVM_SAVE_TYPE(CPU) cpu;
+        struct hvm_save_descriptor end_d;
+        HVM_SAVE_TYPE(END) end;
+    } ctx = {
+        .cpu_d = {
+            .typecode = HVM_SAVE_CODE(CPU),
+            .length = HVM_SAVE_LENGTH(CPU),
+        },
+        .cpu = {
+            .cs_limit = ~0u,
+            .ds_limit = ~0u,
+            .es_limit = ~0u,
+            .ss_limit = ~0u,
+            .tr_limit = 0x67,
+            .cs_arbytes = 0xc9b,
+            .ds_arbytes = 0xc93,
+            .es_arbytes = 0xc93,
+            .ss_arbytes = 0xc93,
+            .tr_arbytes = 0x8b,
+            .cr0 = 0x11,                    /* PE | ET */
+            .rip = CODE_PFN << XC_PAGE_SHIFT,
+            .dr6 = 0xffff0ff0,
+            .dr7 = 0x400,
+        },
+        .end_d = {
+            .typecode = HVM_SAVE_CODE(END),
+            .length = HVM_SAVE_LENGTH(END),
+        },
+    };
+    uint8_t *full_ctx;
+    int size;
+
+    /*
+     * The header can't be crafted, as Xen alters CPUID: take it from the
+     * domain's context, where it comes first.
+     */
+    size = xc_domain_hvm_getcontext(xch, domid, NULL, 0);
+    if ( size <= 0 )
+        return -1;
+
+    full_ctx = malloc(size);
+    if ( !full_ctx )
+        return -1;
+
+    size = xc_domain_hvm_getcontext(xch, domid, full_ctx, size);
+    if ( size > 0 )
+        memcpy(&ctx, full_ctx, sizeof(ctx.header_d) + sizeof(ctx.header));
+    free(full_ctx);
+    if ( size <= 0 )
+        return -1;
+
+    return xc_domain_hvm_setcontext(xch, domid, (uint8_t *)&ctx, sizeof(ctx));
+}
+
+/* Xen updates prod as the vCPU runs. */
+static uint32_t read_prod(const struct xen_dirty_ring *ring)
+{
+    return *(const volatile uint32_t *)&ring->prod;
+}
+
+static void test_overflow(struct xen_dirty_ring *ring)
+{
+    DECLARE_HYPERCALL_BUFFER(uint8_t, bitmap);
+    long long rc;
+
+    printf("Test pages dirtied on behalf of the domain\n");
+
+    if ( xendevicemodel_modified_memory(dmod, domid, CODE_PFN, 1) )
+        return fail("  Fail: modified memory: %d - %s\n",
+                    errno, strerror(errno));
+
+    if ( !(ring->flags & XEN_DIRTY_RING_OVERFLOW) )
+        fail("  Fail: ring not flagged as overflowed\n");
+    if ( ring->prod )
+        fail("  Fail: %u entries appended\n", ring->prod);
+
+    bitmap = xc_hypercall_buffer_alloc(xch, bitmap, NR_PAGES / 8 + 1);
+    if ( !bitmap )
+        return fail("  Fail: bitmap alloc: %d - %s\n", errno, strerror(errno));
+
+    rc = xc_logdirty_control(xch, domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                             HYPERCALL_BUFFER(bitmap), NR_PAGES, 0, NULL);
+    if ( rc < 0 )
+        fail("  Fail: clean: %d - %s\n", errno, strerror(errno));
+    else if ( !(bitmap[CODE_PFN / 8] & (1u << (CODE_PFN % 8))) )
+        fail("  Fail: pfn %#x not collected by clean\n", CODE_PFN);
+    else if ( ring->flags & XEN_DIRTY_RING_OVERFLOW )
+        fail("  Fail: overflow flag not cleared by clean\n");
+
+    xc_hypercall_buffer_free(xch, bitmap);
+}
+
+static void test_harvest(struct xen_dirty_ring *ring)
+{
+    const uint64_t *entries = XEN_DIRTY_RING_ENTRIES(ring);
+    bool seen[NR_PAGES] = {};
+    unsigned int cons = 0, prod, nr_seen = 0;
+    time_t deadline = time(NULL) + 10;
+
+    printf("Test harvesting %u pages with %u entries\n",
+           NR_DATA_PAGES, NR_ENTRIES);
+
+    if ( xc_domain_unpause(xch, domid) )
+        return fail("  Fail: unpause: %d - %s\n", errno, strerror(errno));
+
+    for ( ; ; )
+    {
+        prod = read_prod(ring);
+        xen_rmb();
+
+        if ( prod - cons > NR_ENTRIES )
+            return fail("  Fail: %u entries pending\n", prod - cons);
+
+        for ( ; cons != prod; cons++ )
+        {
+            uint64_t pfn = entries[cons & (NR_ENTRIES - 1)];
+
+            if ( pfn < DATA_PFN || pfn >= NR_PAGES )
+                fail("  Fail: unexpected pfn %#"PRIx64" reported\n", pfn);
+            else if ( seen[pfn] )
+                fail("  Fail: pfn %#"PRIx64" reported twice\n", pfn);
+            else
+            {
+                seen[pfn] = true;
+                nr_seen++;
+            }
+        }
+
+        /* Also flushes the pages cached by hardware to the ring. */
+        ring->cons = cons;
+        if ( xc_dirty_ring_reset(xch, domid) )
+            return fail("  Fail: reset: %d - %s\n", errno, strerror(errno));
+
+        if ( nr_seen == NR_DATA_PAGES )
+            break;
+
+        if ( read_prod(ring) == cons )
+        {
+            if ( time(NULL) > deadline )
+                return fail("  Fail: %u of %u pages reported\n",
+                            nr_seen, NR_DATA_PAGES);
+            usleep(1000);
+        }
+    }
+
+    if ( ring->flags & XEN_DIRTY_RING_OVERFLOW )
+        fail("  Fail: ring overflowed\n");
+}
+
+static void run_tests(void)
+{
+    xenforeignmemory_resource_handle *res;
+    struct xen_dirty_ring *ring = NULL;
+    xen_pfn_t pfns[NR_PAGES];
+    unsigned int i;
+    void *code;
+    int rc;
+
+    for ( i = 0; i < NR_PAGES; i++ )
+        pfns[i] = i;
+
+    rc = xc_domain_setmaxmem(xch, domid, -1);
+    if ( rc )
+        return fail("  Fail: setmaxmem: %d - %s\n", errno, strerror(errno));
+
+    rc = xc_domain_populate_physmap_exact(xch, domid, NR_PAGES, 0, 0, pfns);
+    if ( rc )
+        return fail("  Fail: populate physmap: %d - %s\n",
+                    errno, strerror(errno));
+
+    code = xenforeignmemory_map(fmem, domid, PROT_READ | PROT_WRITE, 1,
+                                &pfns[CODE_PFN], NULL);
+    if ( !code )
+        return fail("  Fail: map code: %d - %s\n", errno, strerror(errno));
+    write_code(code);
+    xenforeignmemory_unmap(fmem, code, 1);
+
+    if ( init_vcpu() )
+        return fail("  Fail: init vcpu: %d - %s\n", errno, strerror(errno));
+
+    printf("Test enabling the rings\n");
+
+    rc = xc_dirty_ring_enable(xch, domid, NR_ENTRIES);
+    if ( rc != -1 || errno != EINVAL )
+        return fail("  Fail: enable without log-dirty: expected -1/EINVAL, got %d/%d - %s\n",
+                    rc, errno, strerror(errno));
+
+    rc = xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                           NULL, 0);
+    if ( rc )
+        return fail("  Fail: enable log-dirty: %d - %s\n",
+                    errno, strerror(errno));
+
+    rc = xc_dirty_ring_enable(xch, domid, NR_ENTRIES + 1);
+    if ( rc != -1 || errno != EINVAL )
+        return fail("  Fail: bad size: expected -1/EINVAL, got %d/%d - %s\n",
+                    rc, errno, strerror(errno));
+
+    rc = xc_dirty_ring_enable(xch, domid, NR_ENTRIES);
+    if ( rc )
+        return fail("  Fail: enable: %d - %s\n", errno, strerror(errno));
+
+    rc = xc_dirty_ring_enable(xch, domid, NR_ENTRIES);
+    if ( rc != -1 || errno != EEXIST )
+        return fail("  Fail: enable again: expected -1/EEXIST, got %d/%d - %s\n",
+                    rc, errno, strerror(errno));
+
+    res = xenforeignmemory_map_resource(
+        fmem, domid, XENMEM_resource_dirty_ring, 0, 0,
+        XC_DIRTY_RING_FRAMES(NR_ENTRIES), (void **)&ring,
+        PROT_READ | PROT_WRITE, 0);
+    if ( !res )
+        return fail("  Fail: map ring: %d - %s\n", errno, strerror(errno));
+
+    if ( ring->nr_entries != NR_ENTRIES || ring->prod || ring->flags )
+        fail("  Fail: ring of %u entries, prod %u, flags %#x\n",
+             ring->nr_entries, ring->prod, ring->flags);
+    else
+    {
+        test_overflow(ring);
+        test_harvest(ring);
+    }
+
+    xenforeignmemory_unmap_resource(fmem, res);
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+
+    printf("Dirty ring tests\n");
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+        err(1, "xc_interface_open");
+
+    fmem = xenforeignmemory_open(NULL, 0);
+    if ( !fmem )
+        err(1, "xenforeignmemory_open");
+
+    dmod = xendevicemodel_open(NULL, 0);
+    if ( !dmod )
+        err(1, "xendevicemodel_open");
+
+    rc = xc_domain_create(xch, &domid, &create);
+    if ( rc )
+    {
+        if ( errno == EINVAL || errno == EOPNOTSUPP )
+            printf("  Skip: %d - %s\n", errno, strerror(errno));
+        else
+            fail("  Domain create failure: %d - %s\n",
+                 errno, strerror(errno));
+        goto out;
+    }
+
+    printf("  Created d%u\n", domid);
+
+    run_tests();
+
+    rc = xc_domain_destroy(xch, domid);
+    if ( rc )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+ out:
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,155 @@
+/*
+ * Microbenchmark for event channel port allocation.
+ *
+ * Fill the port space of a fresh domain with unbound ports, timing each
+ * batch of allocations.  The cost of an allocation shouldn't depend on the
+ * number of ports already in use.
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <xenctrl.h>
+#include <xen-tools/common-macros.h>
+
+/* Limit of the 2-level ABI, which the new domain is using. */
+#define NR_PORTS 4096
+#define BATCH    256
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static xc_interface *xch;
+static uint32_t domid;
+
+static struct xen_domctl_createdomain create = {
+    .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+    .max_vcpus = 1,
+    .max_evtchn_port = NR_PORTS - 1,
+    .max_grant_frames = 1,
+    .grant_opts = XEN_DOMCTL_GRANT_version(1),
+
+    .arch = {
+#if defined(__x86_64__) || defined(__i386__)
+        .emulation_flags = XEN_X86_EMU_LAPIC,
+#endif
+    },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Allocate ports until the space is exhausted.  Ports are handed out
+ * lowest first, and port 0 is reserved.
+ */
+static unsigned int fill_ports(bool verbose)
+{
+    unsigned int nr = 0;
+    uint64_t start = now_ns();
+
+    for ( ; ; )
+    {
+        int port = xc_evtchn_alloc_unbound(xch, domid, 0);
+
+        if ( port < 0 )
+        {
+            if ( errno != ENOSPC )
+                fail("  Fail: alloc port %u: %d - %s\n",
+                     nr + 1, errno, strerror(errno));
+            break;
+        }
+
+        if ( port != nr + 1 )
+            fail("  Fail: got port %d, expected %u\n", port, nr + 1);
+
+        if ( !(++nr % BATCH) && verbose )
+        {
+            uint64_t end = now_ns();
+
+            printf("  ports %4u-%4u: %5"PRIu64" ns per allocation\n",
+                   nr - BATCH + 1, nr, (end - start) / BATCH);
+            start = end;
+        }
+    }
+
+    return nr;
+}
+
+static void run_tests(void)
+{
+    unsigned int nr;
+
+    printf("Test allocating %u ports\n", NR_PORTS - 1);
+
+    nr = fill_ports(true);
+    if ( nr != NR_PORTS - 1 )
+        fail("  Fail: allocated %u ports, expected %u\n", nr, NR_PORTS - 1);
+
+    printf("Test reallocating after reset\n");
+
+    if ( xc_evtchn_reset(xch, domid) )
+        return fail("  Fail: reset: %d - %s\n", errno, strerror(errno));
+
+    nr = fill_ports(false);
+    if ( nr != NR_PORTS - 1 )
+        fail("  Fail: reallocated %u ports, expected %u\n",
+             nr, NR_PORTS - 1);
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+
+    printf("Event channel allocation tests\n");
+
+    xch = xc_interface_open(NULL, NULL, 0);
+
+    if ( !xch )
+        err(1, "xc_interface_open");
+
+    rc = xc_domain_create(xch, &domid, &create);
+    if ( rc )
+    {
+        if ( errno == EINVAL || errno == EOPNOTSUPP )
+            printf("  Skip: %d - %s\n", errno, strerror(errno));
+        else
+            fail("  Domain create failure: %d - %s\n",
+                 errno, strerror(errno));
+        goto out;
+    }
+
+    printf("  Created d%u\n", domid);
+
+    run_tests();
+
+    rc = xc_domain_destroy(xch, domid);
+    if ( rc )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+ out:
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
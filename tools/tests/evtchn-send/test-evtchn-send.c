@@ -0,0 +1,249 @@
+/*
+ * Tests for EVTCHNOP_send_batch.
+ *
+ * Bind pairs of event channels looping back to this domain, notify them in
+ * batches, and check that exactly the ports of the batch become pending.
+ * Also compare the cost per port with that of single notifications.
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xencall.h>
+#include <xenevtchn.h>
+#include <xen-tools/common-macros.h>
+
+#include <xen/xen.h>
+#include <xen/event_channel.h>
+
+/* More than one chunk of ports processed between preemption checks. */
+#define NR_PAIRS 256
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static xenevtchn_handle *xce;
+static xencall_handle *xcall;
+
+/* Local ports to notify, and the ports these notifications arrive at. */
+static evtchn_port_t send_port[NR_PAIRS], recv_port[NR_PAIRS];
+
+static struct evtchn_send_batch *batch;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int send_batch(const evtchn_port_t *ports, unsigned int nr)
+{
+    batch->nr_ports = nr;
+    batch->done = 0;
+    memcpy(batch->ports, ports, nr * sizeof(*ports));
+
+    return xencall2(xcall, __HYPERVISOR_event_channel_op, EVTCHNOP_send_batch,
+                    (uintptr_t)batch);
+}
+
+/*
+ * Collect pending notifications, until none arrived for a while, and check
+ * that the ports of recv_port[] flagged in @expect, and only those, were
+ * notified.
+ */
+static void check_pending(const bool *expect)
+{
+    bool seen[NR_PAIRS] = {};
+    struct pollfd pfd = {
+        .fd = xenevtchn_fd(xce),
+        .events = POLLIN,
+    };
+    unsigned int i;
+
+    while ( poll(&pfd, 1, 100) > 0 )
+    {
+        xenevtchn_port_or_error_t port = xenevtchn_pending(xce);
+
+        if ( port < 0 )
+            break;
+
+        for ( i = 0; i < NR_PAIRS; i++ )
+            if ( recv_port[i] == (evtchn_port_t)port )
+                break;
+
+        if ( i == NR_PAIRS )
+            fail("  Fail: unexpected port %d pending\n", port);
+        else if ( !expect[i] || seen[i] )
+            fail("  Fail: port %d (pair %u) pending unexpectedly\n", port, i);
+        else
+            seen[i] = true;
+
+        xenevtchn_unmask(xce, port);
+    }
+
+    for ( i = 0; i < NR_PAIRS; i++ )
+        if ( expect[i] && !seen[i] )
+            fail("  Fail: port %u (pair %u) not notified\n", recv_port[i], i);
+}
+
+static void test_all(void)
+{
+    bool expect[NR_PAIRS];
+    unsigned int i;
+
+    printf("Test notifying %u ports\n", NR_PAIRS);
+
+    if ( send_batch(send_port, NR_PAIRS) )
+        return fail("  Fail: send_batch: %d - %s\n", errno, strerror(errno));
+
+    if ( batch->done != NR_PAIRS )
+        fail("  Fail: done %u, expected %u\n", batch->done, NR_PAIRS);
+
+    for ( i = 0; i < NR_PAIRS; i++ )
+        expect[i] = true;
+    check_pending(expect);
+}
+
+static void test_bad_port(void)
+{
+    evtchn_port_t ports[] = {
+        send_port[0], send_port[1], 0 /* reserved */, send_port[2],
+    };
+    bool expect[NR_PAIRS] = { [0] = true, [1] = true };
+
+    printf("Test stopping at a bad port\n");
+
+    if ( !send_batch(ports, ARRAY_SIZE(ports)) )
+        fail("  Fail: send_batch succeeded\n");
+    else if ( errno != EINVAL )
+        fail("  Fail: send_batch: %d - %s, expected EINVAL\n",
+             errno, strerror(errno));
+
+    if ( batch->done != 2 )
+        fail("  Fail: done %u, expected 2\n", batch->done);
+
+    check_pending(expect);
+}
+
+static void test_cost(void)
+{
+    bool expect[NR_PAIRS];
+    unsigned int i;
+    uint64_t start, single, batched;
+
+    printf("Test cost per port\n");
+
+    start = now_ns();
+    for ( i = 0; i < NR_PAIRS; i++ )
+        if ( xenevtchn_notify(xce, send_port[i]) )
+            return fail("  Fail: notify: %d - %s\n", errno, strerror(errno));
+    single = now_ns() - start;
+
+    for ( i = 0; i < NR_PAIRS; i++ )
+        expect[i] = true;
+    check_pending(expect);
+
+    start = now_ns();
+    if ( send_batch(send_port, NR_PAIRS) )
+        return fail("  Fail: send_batch: %d - %s\n", errno, strerror(errno));
+    batched = now_ns() - start;
+
+    check_pending(expect);
+
+    printf("  %"PRIu64" ns per port notified singly, %"PRIu64" batched\n",
+           single / NR_PAIRS, batched / NR_PAIRS);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int i, nr = 0;
+
+    printf("Event channel batched notification tests\n");
+
+    xce = xenevtchn_open(NULL, 0);
+    if ( !xce )
+        err(1, "xenevtchn_open");
+
+    xcall = xencall_open(NULL, 0);
+    if ( !xcall )
+        err(1, "xencall_open");
+
+    batch = xencall_alloc_buffer(xcall, sizeof(*batch) +
+                                 NR_PAIRS * sizeof(batch->ports[0]));
+    if ( !batch )
+        err(1, "xencall_alloc_buffer");
+
+    for ( ; nr < NR_PAIRS; nr++ )
+    {
+        xenevtchn_port_or_error_t port;
+
+        port = xenevtchn_bind_unbound_port(xce, DOMID_SELF);
+        if ( port < 0 )
+            break;
+        recv_port[nr] = port;
+
+        port = xenevtchn_bind_interdomain(xce, DOMID_SELF, recv_port[nr]);
+        if ( port < 0 )
+        {
+            xenevtchn_unbind(xce, recv_port[nr]);
+            break;
+        }
+        send_port[nr] = port;
+    }
+
+    if ( nr < NR_PAIRS )
+    {
+        fail("  Fail: bind pair %u: %d - %s\n", nr, errno, strerror(errno));
+        goto out;
+    }
+
+    if ( send_batch(send_port, 0) )
+    {
+        if ( errno == ENOSYS )
+            printf("  Skip: %d - %s\n", errno, strerror(errno));
+        else
+            fail("  Fail: empty send_batch: %d - %s\n",
+                 errno, strerror(errno));
+        goto out;
+    }
+
+    test_all();
+    test_bad_port();
+    test_cost();
+
+ out:
+    for ( i = 0; i < nr; i++ )
+    {
+        xenevtchn_unbind(xce, send_port[i]);
+        xenevtchn_unbind(xce, recv_port[i]);
+    }
+
+    xencall_free_buffer(xcall, batch);
+    xencall_close(xcall);
+    xenevtchn_close(xce);
+
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,349 @@
+/*
+ * Loopback test of postcopy live migration.
+ *
+ * A memory-only HVM guest is saved with XCFLAGS_POSTCOPY over one end of a
+ * socketpair, and restored from the other.  Once the restorer has resumed the
+ * new domain, its memory is read through foreign mappings, faulting the
+ * outstanding pfns across the back channel.
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <xenctrl.h>
+#include <xenguest.h>
+#include <xenforeignmemory.h>
+#include <xen-tools/common-macros.h>
+
+#define NR_PAGES 1024
+#define PAGE_SIZE XC_PAGE_SIZE
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static xc_interface *xch;
+static uint32_t src_domid, dst_domid;
+static pthread_t reader;
+static bool reader_started;
+
+static struct xen_domctl_createdomain create = {
+    .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+    .max_vcpus = 1,
+    .max_grant_frames = 1,
+    .grant_opts = XEN_DOMCTL_GRANT_version(1),
+
+    .arch = {
+        .emulation_flags = XEN_X86_EMU_LAPIC,
+    },
+};
+
+/* Every fourth page is left zero, to exercise the zero encoding too. */
+static uint8_t page_pattern(xen_pfn_t pfn)
+{
+    return (pfn & 3) ? (pfn * 7 + 1) | 1 : 0;
+}
+
+static int create_domain(uint32_t *domid)
+{
+    int rc = xc_domain_create(xch, domid, &create);
+
+    if ( rc )
+        return rc;
+
+    return xc_domain_setmaxmem(xch, *domid, -1);
+}
+
+static int fill_source(void)
+{
+    xenforeignmemory_handle *fmem;
+    xen_pfn_t pfns[NR_PAGES];
+    uint8_t *mem;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < NR_PAGES; i++ )
+        pfns[i] = i;
+
+    rc = xc_domain_populate_physmap_exact(xch, src_domid, NR_PAGES, 0, 0,
+                                          pfns);
+    if ( rc )
+        return rc;
+
+    fmem = xenforeignmemory_open(NULL, 0);
+    if ( !fmem )
+        return -1;
+
+    mem = xenforeignmemory_map(fmem, src_domid, PROT_READ | PROT_WRITE,
+                               NR_PAGES, pfns, NULL);
+    if ( !mem )
+    {
+        xenforeignmemory_close(fmem);
+        return -1;
+    }
+
+    for ( i = 0; i < NR_PAGES; i++ )
+        memset(mem + i * PAGE_SIZE, page_pattern(i), PAGE_SIZE);
+
+    xenforeignmemory_unmap(fmem, mem, NR_PAGES);
+    xenforeignmemory_close(fmem);
+
+    return 0;
+}
+
+static int save_suspend(void *data)
+{
+    xc_interface *save_xch = data;
+
+    return !xc_domain_shutdown(save_xch, src_domid, SHUTDOWN_suspend);
+}
+
+static int save_logdirty(uint32_t domid, unsigned int enable, void *data)
+{
+    return 0;
+}
+
+/* One round of precopy, then switch to postcopy. */
+static int save_policy(struct precopy_stats stats, void *data)
+{
+    return stats.iteration ? XGS_POLICY_POSTCOPY
+                           : XGS_POLICY_CONTINUE_PRECOPY;
+}
+
+static int run_save(int fd)
+{
+    xc_interface *save_xch = xc_interface_open(NULL, NULL, 0);
+    struct save_callbacks cbs = {
+        .suspend = save_suspend,
+        .switch_qemu_logdirty = save_logdirty,
+        .precopy_policy = save_policy,
+        .data = save_xch,
+    };
+    int rc;
+
+    if ( !save_xch )
+        return 1;
+
+    rc = xc_domain_save(save_xch, fd, src_domid,
+                        XCFLAGS_LIVE | XCFLAGS_POSTCOPY, &cbs,
+                        XC_STREAM_PLAIN, fd);
+
+    xc_interface_close(save_xch);
+
+    return !!rc;
+}
+
+/*
+ * Read each page of the restored guest while the postcopy phase is running.
+ * Mappings of evicted pages fail with ENOENT until the restorer has paged
+ * them back in.
+ */
+static void *read_guest(void *arg)
+{
+    xenforeignmemory_handle *fmem = xenforeignmemory_open(NULL, 0);
+    unsigned long nr_retries = 0;
+    xen_pfn_t pfn;
+
+    if ( !fmem )
+    {
+        fail("  Fail: foreignmemory open: %d - %s\n", errno, strerror(errno));
+        return NULL;
+    }
+
+    /* Walk backwards, against the direction of the saver's sweep. */
+    for ( pfn = NR_PAGES; pfn-- > 0; )
+    {
+        uint8_t *page, expect = page_pattern(pfn);
+        unsigned int i;
+        int err;
+
+        for ( ; ; )
+        {
+            page = xenforeignmemory_map(fmem, dst_domid, PROT_READ, 1,
+                                        &pfn, &err);
+            if ( page && !err )
+                break;
+
+            if ( page )
+                xenforeignmemory_unmap(fmem, page, 1);
+
+            if ( (page ? err : -errno) != -ENOENT )
+            {
+                fail("  Fail: map pfn %#"PRI_xen_pfn": %d\n", pfn,
+                     page ? err : -errno);
+                goto out;
+            }
+
+            ++nr_retries;
+            usleep(100);
+        }
+
+        for ( i = 0; i < PAGE_SIZE; i++ )
+            if ( page[i] != expect )
+                break;
+
+        if ( i < PAGE_SIZE )
+            fail("  Fail: pfn %#"PRI_xen_pfn" byte %u: %#x != %#x\n",
+                 pfn, i, page[i], expect);
+
+        xenforeignmemory_unmap(fmem, page, 1);
+    }
+
+    printf("  Read guest memory, %lu retries\n", nr_retries);
+
+ out:
+    xenforeignmemory_close(fmem);
+
+    return NULL;
+}
+
+/* The guest never runs, so leave it paused and start reading instead. */
+static int restore_transition(void *data)
+{
+    int rc = pthread_create(&reader, NULL, read_guest, NULL);
+
+    if ( rc )
+    {
+        errno = rc;
+        return -1;
+    }
+    reader_started = true;
+
+    return 0;
+}
+
+static void run_tests(void)
+{
+    struct restore_callbacks cbs = {
+        .postcopy_transition = restore_transition,
+    };
+    unsigned long store_mfn = 0, console_mfn = 0;
+    int sv[2], rc, status;
+    pid_t pid;
+
+    printf("Test postcopy migration of %u pages\n", NR_PAGES);
+
+    if ( fill_source() )
+        return fail("  Fail: populate source: %d - %s\n",
+                    errno, strerror(errno));
+
+    if ( create_domain(&dst_domid) )
+        return fail("  Fail: create destination: %d - %s\n",
+                    errno, strerror(errno));
+
+    printf("  Migrating d%u to d%u\n", src_domid, dst_domid);
+
+    if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) )
+        return fail("  Fail: socketpair: %d - %s\n", errno, strerror(errno));
+
+    pid = fork();
+    if ( pid < 0 )
+        return fail("  Fail: fork: %d - %s\n", errno, strerror(errno));
+
+    if ( pid == 0 )
+    {
+        close(sv[1]);
+        _exit(run_save(sv[0]));
+    }
+
+    close(sv[0]);
+
+    rc = xc_domain_restore(xch, sv[1], dst_domid, 0, &store_mfn, 0, 0,
+                           &console_mfn, 0, XC_STREAM_PLAIN, &cbs, sv[1]);
+    if ( rc )
+        fail("  Fail: restore: %d - %s\n", errno, strerror(errno));
+
+    if ( reader_started )
+        pthread_join(reader, NULL);
+    else if ( !rc )
+        fail("  Fail: postcopy transition not reached\n");
+
+    close(sv[1]);
+
+    if ( waitpid(pid, &status, 0) != pid ||
+         !WIFEXITED(status) || WEXITSTATUS(status) )
+        fail("  Fail: save failed: status %#x\n", status);
+}
+
+/*
+ * Paging is optional in Xen, and needs HAP.  Try enabling it on the source
+ * domain, using the ring pfn the restorer will later use, above RAM.
+ */
+static bool paging_available(void)
+{
+    xen_pfn_t ring_pfn = NR_PAGES;
+    uint32_t port;
+
+    if ( xc_domain_populate_physmap_exact(xch, src_domid, 1, 0, 0,
+                                          &ring_pfn) ||
+         xc_hvm_param_set(xch, src_domid, HVM_PARAM_PAGING_RING_PFN,
+                          ring_pfn) ||
+         xc_mem_paging_enable(xch, src_domid, &port) )
+        return false;
+
+    xc_mem_paging_disable(xch, src_domid);
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+
+    printf("Postcopy migration tests\n");
+
+    xch = xc_interface_open(NULL, NULL, 0);
+
+    if ( !xch )
+        err(1, "xc_interface_open");
+
+    rc = create_domain(&src_domid);
+    if ( rc )
+    {
+        if ( errno == EINVAL || errno == EOPNOTSUPP )
+            printf("  Skip: %d - %s\n", errno, strerror(errno));
+        else
+            fail("  Domain create failure: %d - %s\n",
+                 errno, strerror(errno));
+        goto out;
+    }
+
+    printf("  Created d%u\n", src_domid);
+
+    if ( !paging_available() )
+        printf("  Skip: no memory paging: %d - %s\n", errno, strerror(errno));
+    else
+        run_tests();
+
+    if ( dst_domid && xc_domain_destroy(xch, dst_domid) )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+
+    rc = xc_domain_destroy(xch, src_domid);
+    if ( rc )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+ out:
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,186 @@
+/*
+ * Stress test for single page allocations.
+ *
+ * Several threads concurrently populate and release pages of one domain, as
+ * ballooning does.  This exercises the per-CPU page caches of the allocator,
+ * and checks that no memory goes missing in the process.
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <xenctrl.h>
+#include <xen-tools/common-macros.h>
+
+#define NR_THREADS  8
+#define NR_ROUNDS   20000
+#define BATCH       8
+
+/*
+ * Pages may legitimately remain in the per-CPU caches afterwards, which
+ * don't count as free.  Allow for some per CPU.
+ */
+#define CACHE_SLACK 128
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+static xc_interface *xch;
+static uint32_t domid;
+
+static struct xen_domctl_createdomain create = {
+    .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+    .max_vcpus = 1,
+    .max_grant_frames = 1,
+    .grant_opts = XEN_DOMCTL_GRANT_version(1),
+
+    .arch = {
+#if defined(__x86_64__) || defined(__i386__)
+        .emulation_flags = XEN_X86_EMU_LAPIC,
+#endif
+    },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Each thread uses its own handle, and its own range of gfns. */
+static void *stress(void *arg)
+{
+    unsigned int idx = (unsigned long)arg, round, i;
+    xc_interface *txch = xc_interface_open(NULL, NULL, 0);
+    xen_pfn_t gfns[BATCH];
+
+    if ( !txch )
+    {
+        fail("  Fail: thread %u: xc_interface_open: %d - %s\n",
+             idx, errno, strerror(errno));
+        return NULL;
+    }
+
+    for ( round = 0; round < NR_ROUNDS; round++ )
+    {
+        for ( i = 0; i < BATCH; i++ )
+        {
+            gfns[i] = idx * BATCH + i;
+
+            if ( xc_domain_populate_physmap_exact(txch, domid, 1, 0, 0,
+                                                  &gfns[i]) )
+            {
+                fail("  Fail: thread %u: populate gfn %#"PRI_xen_pfn
+                     ": %d - %s\n", idx, gfns[i], errno, strerror(errno));
+                goto out;
+            }
+        }
+
+        if ( xc_domain_decrease_reservation_exact(txch, domid, BATCH, 0,
+                                                  gfns) )
+        {
+            fail("  Fail: thread %u: release: %d - %s\n",
+                 idx, errno, strerror(errno));
+            goto out;
+        }
+    }
+
+ out:
+    xc_interface_close(txch);
+
+    return NULL;
+}
+
+static void run_tests(void)
+{
+    pthread_t threads[NR_THREADS];
+    xc_physinfo_t before, after;
+    unsigned long i;
+    uint64_t start, ns;
+
+    printf("Test %u threads x %u rounds of %u pages\n",
+           NR_THREADS, NR_ROUNDS, BATCH);
+
+    if ( xc_physinfo(xch, &before) )
+        return fail("  Fail: physinfo: %d - %s\n", errno, strerror(errno));
+
+    start = now_ns();
+
+    for ( i = 0; i < NR_THREADS; i++ )
+        if ( pthread_create(&threads[i], NULL, stress, (void *)i) )
+            return fail("  Fail: pthread_create\n");
+
+    for ( i = 0; i < NR_THREADS; i++ )
+        pthread_join(threads[i], NULL);
+
+    ns = now_ns() - start;
+
+    printf("  %"PRIu64" ns per page allocated and freed\n",
+           ns / ((uint64_t)NR_THREADS * NR_ROUNDS * BATCH));
+
+    if ( xc_physinfo(xch, &after) )
+        return fail("  Fail: physinfo: %d - %s\n", errno, strerror(errno));
+
+    if ( after.free_pages + CACHE_SLACK * after.nr_cpus < before.free_pages )
+        fail("  Fail: free pages %"PRIu64" -> %"PRIu64"\n",
+             before.free_pages, after.free_pages);
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+
+    printf("Page allocation stress tests\n");
+
+    xch = xc_interface_open(NULL, NULL, 0);
+
+    if ( !xch )
+        err(1, "xc_interface_open");
+
+    rc = xc_domain_create(xch, &domid, &create);
+    if ( rc )
+    {
+        if ( errno == EINVAL || errno == EOPNOTSUPP )
+            printf("  Skip: %d - %s\n", errno, strerror(errno));
+        else
+            fail("  Domain create failure: %d - %s\n",
+                 errno, strerror(errno));
+        goto out;
+    }
+
+    printf("  Created d%u\n", domid);
+
+    rc = xc_domain_setmaxmem(xch, domid, -1);
+    if ( rc )
+        fail("  Fail: setmaxmem: %d - %s\n", errno, strerror(errno));
+    else
+        run_tests();
+
+    rc = xc_domain_destroy(xch, domid);
+    if ( rc )
+        fail("  Failed to destroy domain: %d - %s\n",
+             errno, strerror(errno));
+ out:
+    return !!nr_failures;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
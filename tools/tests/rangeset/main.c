@@ -0,0 +1,267 @@
+/*
+ * Unit tests and benchmark for the rangeset code.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "emul.h"
+
+/* Size of the universe the random tests operate in. */
+#define NR_BITS 512
+
+static struct domain d = { .domain_id = 0 };
+
+/* Reference model: one flag per value. */
+static bool model[NR_BITS];
+
+struct check_state {
+    unsigned long next;
+    bool first;
+    unsigned long prev_e;
+};
+
+/*
+ * Called for every range in ascending order.  Each must be a maximal run of
+ * set flags in the model, and all values in between must be clear.
+ */
+static int cf_check check_range(unsigned long s, unsigned long e, void *data)
+{
+    struct check_state *st = data;
+    unsigned long i;
+
+    assert(s <= e && e < NR_BITS);
+    assert(st->first || st->prev_e + 1 < s);
+
+    for ( i = st->next; i < s; i++ )
+        assert(!model[i]);
+    for ( i = s; i <= e; i++ )
+        assert(model[i]);
+
+    st->next = e + 1;
+    st->prev_e = e;
+    st->first = false;
+
+    return 0;
+}
+
+static void check_model(struct rangeset *r)
+{
+    struct check_state st = { .first = true };
+    unsigned long i;
+
+    assert(!rangeset_report_ranges(r, 0, ~0UL, check_range, &st));
+    for ( i = st.next; i < NR_BITS; i++ )
+        assert(!model[i]);
+}
+
+static bool model_contains(unsigned long s, unsigned long e)
+{
+    for ( ; s <= e; s++ )
+        if ( !model[s] )
+            return false;
+
+    return true;
+}
+
+static bool model_overlaps(unsigned long s, unsigned long e)
+{
+    for ( ; s <= e; s++ )
+        if ( model[s] )
+            return true;
+
+    return false;
+}
+
+static void random_range(unsigned long *s, unsigned long *e)
+{
+    unsigned long a = rand() % NR_BITS, b = a + rand() % 16;
+
+    *s = a;
+    *e = b < NR_BITS ? b : NR_BITS - 1;
+}
+
+static void test_random(void)
+{
+    struct rangeset *r = rangeset_new(&d, "random", 0);
+    unsigned int i;
+
+    assert(r && rangeset_is_empty(r));
+
+    for ( i = 0; i < 100000; i++ )
+    {
+        unsigned long s, e, j;
+
+        random_range(&s, &e);
+
+        switch ( rand() % 4 )
+        {
+        case 0:
+        case 1:
+            assert(!rangeset_add_range(r, s, e));
+            for ( j = s; j <= e; j++ )
+                model[j] = true;
+            break;
+
+        case 2:
+            assert(!rangeset_remove_range(r, s, e));
+            for ( j = s; j <= e; j++ )
+                model[j] = false;
+            break;
+
+        case 3:
+            assert(rangeset_contains_range(r, s, e) == model_contains(s, e));
+            assert(rangeset_overlaps_range(r, s, e) == model_overlaps(s, e));
+            break;
+        }
+
+        if ( !(i % 64) )
+            check_model(r);
+    }
+
+    check_model(r);
+    rangeset_destroy(r);
+}
+
+static int cf_check count_range(unsigned long s, unsigned long e, void *data)
+{
+    (*(unsigned int *)data)++;
+
+    return 0;
+}
+
+static int cf_check consume_one(unsigned long s, unsigned long e, void *data,
+                                unsigned long *c)
+{
+    *c = 1;
+
+    return 0;
+}
+
+static void test_edges(void)
+{
+    struct rangeset *r = rangeset_new(&d, "edges", RANGESETF_prettyprint_hex);
+    struct rangeset *o = rangeset_new(&d, "other", 0);
+    unsigned long s;
+    unsigned int n;
+
+    assert(r && o);
+
+    /* Ranges touching the top and bottom of the space. */
+    assert(!rangeset_add_range(r, ~0UL - 15, ~0UL));
+    assert(!rangeset_add_range(r, 0, 15));
+    assert(rangeset_contains_range(r, ~0UL - 15, ~0UL));
+    assert(rangeset_overlaps_range(r, ~0UL - 16, ~0UL - 16) == false);
+    assert(rangeset_contains_singleton(r, 0));
+
+    /* Claims are satisfied from the lowest gap which fits. */
+    assert(!rangeset_claim_range(r, 16, &s) && s == 16);
+    assert(rangeset_contains_range(r, 0, 31));
+    assert(!rangeset_add_range(r, 64, 127));
+    assert(!rangeset_claim_range(r, 32, &s) && s == 32);
+    assert(rangeset_contains_range(r, 0, 63));
+
+    /* Splitting a range, then adding the hole back merges it again. */
+    assert(!rangeset_remove_singleton(r, 64));
+    assert(!rangeset_contains_singleton(r, 64));
+    n = 0;
+    assert(!rangeset_report_ranges(r, 0, 200, count_range, &n) && n == 2);
+    assert(!rangeset_add_singleton(r, 64));
+    n = 0;
+    assert(!rangeset_report_ranges(r, 0, 200, count_range, &n) && n == 1);
+
+    /* Limits apply to the number of ranges only. */
+    rangeset_limit(o, 1);
+    assert(!rangeset_add_range(o, 10, 20));
+    assert(!rangeset_add_range(o, 21, 30));
+    assert(rangeset_add_range(o, 40, 50) == -ENOMEM);
+    assert(rangeset_remove_range(o, 15, 16) == -ENOMEM);
+
+    rangeset_swap(r, o);
+    assert(rangeset_contains_range(r, 10, 30));
+    assert(rangeset_contains_range(o, ~0UL - 15, ~0UL));
+
+    assert(!rangeset_merge(o, r));
+    assert(rangeset_contains_range(o, 10, 30));
+
+    rangeset_domain_printk(&d);
+
+    /* Consuming all values one by one empties the set. */
+    assert(!rangeset_consume_ranges(r, consume_one, NULL));
+    assert(rangeset_is_empty(r));
+
+    rangeset_destroy(r);
+    rangeset_destroy(o);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Time lookups in a set with many disjoint ranges, e.g. MMIO regions. */
+static void bench(unsigned int nr_ranges)
+{
+    struct rangeset *r = rangeset_new(&d, "bench", 0);
+    unsigned int i, hits = 0, nr_lookups = 1000000;
+    uint64_t start, end;
+
+    assert(r);
+
+    for ( i = 0; i < nr_ranges; i++ )
+        assert(!rangeset_add_range(r, i * 4UL, i * 4UL + 1));
+
+    start = now_ns();
+    for ( i = 0; i < nr_lookups; i++ )
+        hits += rangeset_contains_singleton(r, rand() % (nr_ranges * 4UL));
+    end = now_ns();
+
+    printf("%7u ranges: %4"PRIu64" ns per lookup (%u hits)\n", nr_ranges,
+           (end - start) / nr_lookups, hits);
+
+    rangeset_destroy(r);
+}
+
+int main(int argc, char **argv)
+{
+    INIT_LIST_HEAD(&d.rangesets);
+    spin_lock_init(&d.rangesets_lock);
+
+    srand(0);
+
+    test_random();
+    test_edges();
+
+    bench(16);
+    bench(1024);
+    bench(65536);
+
+    rangeset_domain_destroy(&d);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
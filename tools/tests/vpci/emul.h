@@ -26,6 +26,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <xen-tools/common-macros.h>
 
@@ -86,6 +87,7 @@ typedef union {
 
 #define xzalloc(type) ((type *)calloc(1, sizeof(type)))
 #define xmalloc(type) ((type *)malloc(sizeof(type)))
+#define xmalloc_array(type, num) ((type *)malloc(sizeof(type) * (num)))
 #define xfree(p) free(p)
 
 #define pci_get_pdev(...) (&test_pdev)
@@ -16,6 +16,10 @@
  * License along with this program; If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
 #include "emul.h"
 
 /* Single vcpu (current), and single domain with a single PCI device. */
@@ -141,6 +145,94 @@ void multiwrite4_check(unsigned int reg)
     multiread4_check(reg, val);
 }
 
+/* Registers in every dword of the extended config space. */
+#define NR_DWORDS (PCI_CFG_SPACE_EXP_SIZE / 4)
+static uint32_t regs[NR_DWORDS];
+
+static void reset_handlers(void)
+{
+    free(vpci.handlers);
+    vpci.handlers = NULL;
+    vpci.nr_handlers = vpci.max_handlers = 0;
+}
+
+/* Populate the whole config space, adding the registers out of order. */
+static void add_all_regs(void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_DWORDS; i += 2 )
+        VPCI_ADD_REG(vpci_read32, vpci_write32, i * 4, 4, regs[i]);
+    for ( i = NR_DWORDS - 1; i < NR_DWORDS; i -= 2 )
+        VPCI_ADD_REG(vpci_read32, vpci_write32, i * 4, 4, regs[i]);
+}
+
+static void many_regs_check(void)
+{
+    unsigned int i;
+
+    reset_handlers();
+    add_all_regs();
+
+    for ( i = 0; i < NR_DWORDS; i++ )
+        VPCI_WRITE(i * 4, 4, i * 0x01010101);
+    for ( i = 0; i < NR_DWORDS; i++ )
+        assert(regs[i] == i * 0x01010101);
+
+    /* Remove every third register, and check the holes read as 1's. */
+    for ( i = 0; i < NR_DWORDS; i += 3 )
+        VPCI_REMOVE_REG(i * 4, 4);
+    VPCI_REMOVE_INVALID_REG(0, 4);
+
+    for ( i = 0; i < NR_DWORDS; i++ )
+        VPCI_READ_CHECK(i * 4, 4, i % 3 ? i * 0x01010101 : 0xffffffff);
+
+    /* Partial accesses to present and removed registers. */
+    VPCI_READ_CHECK(10, 2, 0x0202);
+    VPCI_READ_CHECK(13, 1, 0xff);
+    VPCI_READ_CHECK(19, 1, 0x04);
+
+    reset_handlers();
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Time accesses to a device with a register in every dword of its config
+ * space, spread over the whole space like e.g. MSI-X and AER accesses.
+ */
+static void bench(void)
+{
+    unsigned int i, nr = 10000000;
+    uint64_t start;
+    uint32_t sum = 0;
+
+    reset_handlers();
+    add_all_regs();
+
+    start = now_ns();
+    for ( i = 0; i < nr; i++ )
+        sum += vpci_read((pci_sbdf_t){ .sbdf = 0 },
+                         ((i * 2654435761u) % NR_DWORDS) * 4, 4);
+    printf("read:  %"PRIu64" ns per access (%#x)\n",
+           (now_ns() - start) / nr, sum);
+
+    start = now_ns();
+    for ( i = 0; i < nr; i++ )
+        vpci_write((pci_sbdf_t){ .sbdf = 0 },
+                   ((i * 2654435761u) % NR_DWORDS) * 4, 4, i);
+    printf("write: %"PRIu64" ns per access\n", (now_ns() - start) / nr);
+
+    reset_handlers();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -157,7 +249,6 @@ main(int argc, char **argv)
     unsigned int i;
     int rc;
 
-    INIT_LIST_HEAD(&vpci.handlers);
     spin_lock_init(&vpci.lock);
 
     VPCI_ADD_REG(vpci_read32, vpci_write32, 0, 4, r0);
@@ -296,6 +387,11 @@ main(int argc, char **argv)
     VPCI_REMOVE_INVALID_REG(16, 2);
     VPCI_REMOVE_INVALID_REG(30, 2);
 
+    many_regs_check();
+
+    if ( argc > 1 && !strcmp(argv[1], "bench") )
+        bench();
+
     return 0;
 }
 
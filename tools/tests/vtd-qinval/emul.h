@@ -0,0 +1,214 @@
+/*
+ * Environment for running the VT-d queued invalidation code in user space,
+ * against a software model of the invalidation queue.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_VTD_QINVAL_
+#define _TEST_VTD_QINVAL_
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xen-tools/common-macros.h>
+
+#define ASSERT(x) assert(x)
+#define WARN() assert(0)
+#define __must_check __attribute__((__warn_unused_result__))
+#define __read_mostly
+#define cf_check
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
+typedef bool bool_t;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint64_t paddr_t;
+typedef int64_t s_time_t;
+typedef unsigned int nodeid_t;
+
+#include "qinval-entry.h"
+
+/* A single CPU, never in interrupt context. */
+#define CONFIG_NR_CPUS 64
+#define num_present_cpus() 1
+#define DEFINE_PER_CPU(type, name) typeof(type) per_cpu__##name
+#define this_cpu(name) per_cpu__##name
+#define in_irq() false
+
+#define perfc_incr(x) ((void)0)
+
+#define XENLOG_ERR
+#define XENLOG_WARNING
+#define XENLOG_INFO
+#define VTDPREFIX "VT-d:"
+#define printk printf
+#define printk_once printf
+#define dprintk(lvl, fmt, ...) printf(fmt, ##__VA_ARGS__)
+
+/* Time doesn't advance: waits never time out. */
+#define NOW() ((s_time_t)0)
+#define MILLISECS(ms) ((s_time_t)(ms) * 1000000)
+extern unsigned int iommu_dev_iotlb_timeout;
+
+typedef bool spinlock_t;
+#define spin_lock_irqsave(l, f) ((f) = 0, ASSERT(!*(l)), *(l) = true)
+#define spin_unlock_irqrestore(l, f) ((void)(f), *(l) = false)
+#define spin_is_locked(l) (*(l))
+
+/* Memory is identity mapped. */
+#define PAGE_SHIFT_4K 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT_4K)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define PFN_DOWN(x) ((x) >> PAGE_SHIFT_4K)
+#define virt_to_maddr(va) ((paddr_t)(uintptr_t)(va))
+#define map_vtd_domain_page(maddr) ((void *)(uintptr_t)(maddr))
+#define unmap_vtd_domain_page(va) ((void)(va))
+
+static inline unsigned int get_order_from_bytes(unsigned long size)
+{
+    unsigned int order = 0;
+
+    while ( (PAGE_SIZE << order) < size )
+        order++;
+
+    return order;
+}
+
+paddr_t alloc_pgtable_maddr(unsigned long npages, nodeid_t node);
+
+/* Register definitions, from iommu.h. */
+#define DMAR_CAP_REG  0x08
+#define DMAR_GCMD_REG 0x18
+#define DMAR_GSTS_REG 0x1c
+#define DMAR_IQH_REG  0x80
+#define DMAR_IQT_REG  0x88
+#define DMAR_IQA_REG  0x90
+
+#define DMA_GCMD_QIE  (1u << 26)
+#define DMA_GSTS_QIES (1u << 26)
+
+#define DMA_TLB_FLUSH_GRANU_OFFSET 60
+#define DMA_TLB_GLOBAL_FLUSH (((u64)1) << 60)
+#define DMA_TLB_DSI_FLUSH (((u64)2) << 60)
+#define DMA_TLB_PSI_FLUSH (((u64)3) << 60)
+#define DMA_CCMD_INVL_GRANU_OFFSET 61
+#define DMA_CCMD_GLOBAL_INVL (((u64)1) << 61)
+#define DMA_CCMD_DOMAIN_INVL (((u64)2) << 61)
+
+#define IEC_GLOBAL_INVL 0
+#define IEC_INDEX_INVL  1
+
+#define cap_read_drain(c)    (((c) >> 55) & 1)
+#define cap_write_drain(c)   (((c) >> 54) & 1)
+#define cap_caching_mode(c)  (((c) >> 7) & 1)
+#define ecap_queued_inval(e) (((e) >> 1) & 1)
+
+extern bool iommu_qinval;
+
+struct vtd_iommu {
+    void *reg;
+    uint32_t index;
+    uint64_t cap;
+    uint64_t ecap;
+    spinlock_t register_lock;
+    nodeid_t node;
+    uint64_t qinval_maddr;
+    struct {
+        int __must_check (*context)(struct vtd_iommu *iommu, u16 did,
+                                    u16 source_id, u8 function_mask, u64 type,
+                                    bool non_present_entry_flush);
+        int __must_check (*iotlb)(struct vtd_iommu *iommu, u16 did, u64 addr,
+                                  unsigned int size_order, u64 type,
+                                  bool flush_non_present_entry,
+                                  bool flush_dev_iotlb);
+    } flush;
+};
+
+#define has_register_based_invalidation(iommu) false
+int cf_check vtd_flush_context_reg(
+    struct vtd_iommu *iommu, uint16_t did, uint16_t source_id,
+    uint8_t function_mask, uint64_t type, bool flush_non_present_entry);
+int cf_check vtd_flush_iotlb_reg(
+    struct vtd_iommu *iommu, uint16_t did, uint64_t addr,
+    unsigned int size_order, uint64_t type, bool flush_non_present_entry,
+    bool flush_dev_iotlb);
+int dev_invalidate_iotlb(struct vtd_iommu *iommu, u16 did, u64 addr,
+                         unsigned int size_order, u64 type);
+
+/* Device IOTLB waits never time out here, so these remain unused. */
+struct domain;
+struct pci_dev {
+    bool broken;
+    struct {
+        unsigned int queue_depth;
+    } ats;
+    struct {
+        uint16_t bdf;
+    } sbdf;
+};
+#define did_to_domain_id(iommu, did) (did)
+#define rcu_lock_domain_by_id(id) ((struct domain *)NULL)
+#define rcu_unlock_domain(d) ((void)(d))
+#define iommu_dev_iotlb_flush_timeout(d, pdev) ((void)(d), (void)(pdev))
+
+/* Accesses to the registers of the modelled IOMMUs. */
+uint32_t model_readl(void *reg, unsigned int offset);
+uint64_t model_readq(void *reg, unsigned int offset);
+void model_writel(void *reg, unsigned int offset, uint32_t val);
+void model_writeq(void *reg, unsigned int offset, uint64_t val);
+#define dmar_readl model_readl
+#define dmar_readq model_readq
+#define dmar_writel model_writel
+#define dmar_writeq model_writeq
+
+#define IOMMU_WAIT_OP(iommu, offset, op, cond, sts) \
+    do {                                            \
+        sts = op((iommu)->reg, offset);             \
+    } while ( !(cond) )
+
+/* The modelled hardware makes progress while the CPU spins. */
+void model_step(void);
+#define cpu_relax() model_step()
+
+/* Interfaces under test, from extern.h. */
+int enable_qinval(struct vtd_iommu *iommu);
+void disable_qinval(struct vtd_iommu *iommu);
+void qinval_batch_begin(void);
+int __must_check qinval_batch_end(void);
+int __must_check iommu_flush_iec_global(struct vtd_iommu *iommu);
+int __must_check iommu_flush_iec_index(struct vtd_iommu *iommu, u8 im,
+                                       u16 iidx);
+int __must_check qinval_device_iotlb_sync(struct vtd_iommu *iommu,
+                                          struct pci_dev *pdev,
+                                          u16 did, u16 size, u64 addr);
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,450 @@
+/*
+ * Unit tests for the VT-d queued invalidation code.
+ *
+ * The invalidation queues of two IOMMUs are modelled in software: each time
+ * the CPU spins, every modelled IOMMU processes one descriptor from its
+ * queue.  Wait descriptors store their status data, and the model records
+ * what it processed for the tests to check.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "emul.h"
+
+#define NR_IOMMUS 2
+
+/* Invalidations which may be queued on an IOMMU without waiting. */
+#define BATCH_LIMIT 16
+
+struct qi_model {
+    uint64_t iqa, iqh, iqt;
+    uint32_t gsts;
+
+    unsigned int nr_inval;      /* Invalidation descriptors processed. */
+    unsigned int nr_dev_iotlb;  /* ... of which device IOTLB ones. */
+    unsigned int nr_wait;       /* Wait descriptors processed. */
+    unsigned int run, max_run;  /* Invalidations between waits. */
+    unsigned int misordered;    /* Device IOTLB before the IOTLB was done. */
+};
+
+static struct qi_model models[NR_IOMMUS];
+static struct vtd_iommu iommus[NR_IOMMUS];
+static unsigned long nr_steps;
+
+static struct pci_dev test_pdev = {
+    .ats.queue_depth = 4,
+    .sbdf.bdf = 0x10,
+};
+
+unsigned int iommu_dev_iotlb_timeout = 1000;
+bool iommu_qinval = true;
+
+static unsigned int nr_failures;
+#define fail(fmt, ...)                          \
+({                                              \
+    nr_failures++;                              \
+    (void)printf(fmt, ##__VA_ARGS__);           \
+})
+
+paddr_t alloc_pgtable_maddr(unsigned long npages, nodeid_t node)
+{
+    void *p = aligned_alloc(PAGE_SIZE, npages * PAGE_SIZE);
+
+    if ( !p )
+        return 0;
+    memset(p, 0, npages * PAGE_SIZE);
+
+    return virt_to_maddr(p);
+}
+
+int cf_check vtd_flush_context_reg(
+    struct vtd_iommu *iommu, uint16_t did, uint16_t source_id,
+    uint8_t function_mask, uint64_t type, bool flush_non_present_entry)
+{
+    assert(0);
+    return -EIO;
+}
+
+int cf_check vtd_flush_iotlb_reg(
+    struct vtd_iommu *iommu, uint16_t did, uint64_t addr,
+    unsigned int size_order, uint64_t type, bool flush_non_present_entry,
+    bool flush_dev_iotlb)
+{
+    assert(0);
+    return -EIO;
+}
+
+/* One ATS capable device behind every IOMMU. */
+int dev_invalidate_iotlb(struct vtd_iommu *iommu, u16 did, u64 addr,
+                         unsigned int size_order, u64 type)
+{
+    return qinval_device_iotlb_sync(iommu, &test_pdev, did, 0, addr);
+}
+
+static struct qi_model *reg_model(void *reg)
+{
+    struct qi_model *m = reg;
+
+    assert(m >= models && m < models + NR_IOMMUS);
+
+    return m;
+}
+
+uint64_t model_readq(void *reg, unsigned int offset)
+{
+    const struct qi_model *m = reg_model(reg);
+
+    switch ( offset )
+    {
+    case DMAR_CAP_REG:  return 0;
+    case DMAR_IQH_REG:  return m->iqh;
+    case DMAR_IQT_REG:  return m->iqt;
+    case DMAR_IQA_REG:  return m->iqa;
+    }
+
+    fail("  Fail: unexpected read of register %#x\n", offset);
+
+    return ~0;
+}
+
+uint32_t model_readl(void *reg, unsigned int offset)
+{
+    if ( offset == DMAR_GSTS_REG )
+        return reg_model(reg)->gsts;
+
+    return model_readq(reg, offset);
+}
+
+void model_writeq(void *reg, unsigned int offset, uint64_t val)
+{
+    struct qi_model *m = reg_model(reg);
+
+    switch ( offset )
+    {
+    case DMAR_IQA_REG:
+        m->iqa = val;
+        m->iqh = m->iqt = 0;
+        break;
+
+    case DMAR_IQT_REG:
+        if ( val & (sizeof(struct qinval_entry) - 1) ||
+             val >= (PAGE_SIZE << (m->iqa & 7)) )
+            fail("  Fail: bad queue tail %#"PRIx64"\n", val);
+        m->iqt = val;
+        break;
+
+    default:
+        fail("  Fail: unexpected write of register %#x\n", offset);
+        break;
+    }
+}
+
+void model_writel(void *reg, unsigned int offset, uint32_t val)
+{
+    struct qi_model *m = reg_model(reg);
+
+    if ( offset != DMAR_GCMD_REG )
+        return model_writeq(reg, offset, val);
+
+    m->gsts = (m->gsts & ~DMA_GSTS_QIES) |
+              ((val & DMA_GCMD_QIE) ? DMA_GSTS_QIES : 0);
+}
+
+/* Process the descriptor at the head of the queue, if any. */
+static void model_process(struct qi_model *m)
+{
+    const struct qinval_entry *e;
+
+    if ( !(m->gsts & DMA_GSTS_QIES) || m->iqh == m->iqt )
+        return;
+
+    e = map_vtd_domain_page((m->iqa & PAGE_MASK) + m->iqh);
+
+    switch ( e->q.inv_wait_dsc.lo.type )
+    {
+    case TYPE_INVAL_WAIT:
+        if ( e->q.inv_wait_dsc.lo.sw )
+            *(volatile uint32_t *)map_vtd_domain_page(
+                e->q.inv_wait_dsc.hi.saddr) = e->q.inv_wait_dsc.lo.sdata;
+        m->nr_wait++;
+        m->run = 0;
+        break;
+
+    case TYPE_INVAL_DEVICE_IOTLB:
+        if ( m->run )
+            m->misordered++;
+        m->nr_dev_iotlb++;
+        /* fallthrough */
+    case TYPE_INVAL_CONTEXT:
+    case TYPE_INVAL_IOTLB:
+    case TYPE_INVAL_IEC:
+        m->nr_inval++;
+        if ( ++m->run > m->max_run )
+            m->max_run = m->run;
+        break;
+
+    default:
+        fail("  Fail: bad descriptor type %u\n",
+             (unsigned int)e->q.inv_wait_dsc.lo.type);
+        break;
+    }
+
+    m->iqh = (m->iqh + sizeof(*e)) % (PAGE_SIZE << (m->iqa & 7));
+}
+
+void model_step(void)
+{
+    unsigned int i;
+
+    nr_steps++;
+    for ( i = 0; i < NR_IOMMUS; i++ )
+        model_process(&models[i]);
+}
+
+static void reset_counters(void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+    {
+        struct qi_model *m = &models[i];
+
+        m->nr_inval = m->nr_dev_iotlb = m->nr_wait = 0;
+        m->run = m->max_run = m->misordered = 0;
+    }
+    nr_steps = 0;
+}
+
+/* Check what each IOMMU processed, and that nothing is left pending. */
+static void check_counters(const char *test, unsigned int nr_inval,
+                           unsigned int nr_wait)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+    {
+        const struct qi_model *m = &models[i];
+
+        if ( m->iqh != m->iqt )
+            fail("  Fail: %s: IOMMU#%u queue not drained\n", test, i);
+        if ( m->nr_inval != nr_inval || m->nr_wait != nr_wait )
+            fail("  Fail: %s: IOMMU#%u %u invalidations %u waits, "
+                 "expected %u %u\n", test, i, m->nr_inval, m->nr_wait,
+                 nr_inval, nr_wait);
+        if ( m->misordered )
+            fail("  Fail: %s: IOMMU#%u device IOTLB invalidated early\n",
+                 test, i);
+    }
+}
+
+static int flush_iotlb(struct vtd_iommu *iommu, bool dev_iotlb)
+{
+    return iommu->flush.iotlb(iommu, 1, 0x1000, 0, DMA_TLB_PSI_FLUSH,
+                              false, dev_iotlb);
+}
+
+static int flush_context(struct vtd_iommu *iommu)
+{
+    return iommu->flush.context(iommu, 1, 0, 0, DMA_CCMD_DOMAIN_INVL, false);
+}
+
+static void test_enable(void)
+{
+    unsigned int i;
+
+    printf("Test enabling queued invalidation\n");
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+    {
+        iommus[i].reg = &models[i];
+        iommus[i].index = i;
+        iommus[i].ecap = 1u << 1;
+
+        if ( enable_qinval(&iommus[i]) )
+            fail("  Fail: IOMMU#%u: enable_qinval\n", i);
+        else if ( !(models[i].gsts & DMA_GSTS_QIES) ||
+                  (models[i].iqa & PAGE_MASK) != iommus[i].qinval_maddr )
+            fail("  Fail: IOMMU#%u: queue not set up\n", i);
+    }
+}
+
+/* Outside of a batch, each invalidation is waited for on its own. */
+static void test_sync(void)
+{
+    unsigned int i, j;
+
+    printf("Test synchronous invalidations\n");
+    reset_counters();
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+        for ( j = 0; j < 3; j++ )
+        {
+            if ( flush_iotlb(&iommus[i], false) )
+                fail("  Fail: IOMMU#%u: IOTLB flush\n", i);
+            if ( models[i].iqh != models[i].iqt )
+                fail("  Fail: IOMMU#%u: flush returned early\n", i);
+        }
+
+    check_counters("sync", 3, 3);
+}
+
+/*
+ * Within a batch, invalidations of all IOMMUs are only queued, and a single
+ * wait descriptor per IOMMU completes them.  All the waits are posted before
+ * polling, so the IOMMUs drain their queues in parallel.
+ */
+static void test_batch(void)
+{
+    unsigned int i, j;
+
+    printf("Test batched invalidations\n");
+    reset_counters();
+
+    qinval_batch_begin();
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+    {
+        if ( flush_context(&iommus[i]) )
+            fail("  Fail: IOMMU#%u: context flush\n", i);
+        for ( j = 0; j < 4; j++ )
+            if ( flush_iotlb(&iommus[i], false) )
+                fail("  Fail: IOMMU#%u: IOTLB flush\n", i);
+    }
+
+    if ( nr_steps )
+        fail("  Fail: waited within the batch\n");
+
+    if ( qinval_batch_end() )
+        fail("  Fail: batch end\n");
+
+    check_counters("batch", 5, 1);
+
+    if ( nr_steps != 5 + 1 )
+        fail("  Fail: batch took %lu steps, expected %u\n", nr_steps, 5 + 1);
+}
+
+/* Only the end of the outermost batch waits. */
+static void test_nested(void)
+{
+    printf("Test nested batches\n");
+    reset_counters();
+
+    qinval_batch_begin();
+    qinval_batch_begin();
+
+    if ( flush_iotlb(&iommus[0], false) || flush_iotlb(&iommus[1], false) )
+        fail("  Fail: IOTLB flush\n");
+
+    if ( qinval_batch_end() )
+        fail("  Fail: inner batch end\n");
+    if ( nr_steps )
+        fail("  Fail: inner batch end waited\n");
+
+    if ( qinval_batch_end() )
+        fail("  Fail: outer batch end\n");
+
+    check_counters("nested", 1, 1);
+}
+
+/* Large batches still wait periodically, to bound the queue usage. */
+static void test_bound(void)
+{
+    unsigned int i, j;
+
+    printf("Test large batches\n");
+    reset_counters();
+
+    qinval_batch_begin();
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+        for ( j = 0; j < 100; j++ )
+            if ( flush_iotlb(&iommus[i], false) )
+                fail("  Fail: IOMMU#%u: IOTLB flush\n", i);
+
+    if ( qinval_batch_end() )
+        fail("  Fail: batch end\n");
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+    {
+        if ( models[i].iqh != models[i].iqt || models[i].nr_inval != 100 )
+            fail("  Fail: IOMMU#%u: %u invalidations\n",
+                 i, models[i].nr_inval);
+        if ( models[i].max_run > BATCH_LIMIT )
+            fail("  Fail: IOMMU#%u: %u invalidations without waiting\n",
+                 i, models[i].max_run);
+    }
+}
+
+/*
+ * Device IOTLB and interrupt entry cache invalidations complete before
+ * returning, even within a batch.  The device IOTLB may only be invalidated
+ * once the IOTLB is.
+ */
+static void test_sync_in_batch(void)
+{
+    unsigned int i;
+
+    printf("Test synchronous invalidations within a batch\n");
+    reset_counters();
+
+    qinval_batch_begin();
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+    {
+        if ( flush_iotlb(&iommus[i], true) )
+            fail("  Fail: IOMMU#%u: IOTLB flush\n", i);
+        if ( iommu_flush_iec_global(&iommus[i]) )
+            fail("  Fail: IOMMU#%u: IEC flush\n", i);
+        if ( models[i].iqh != models[i].iqt )
+            fail("  Fail: IOMMU#%u: flush returned early\n", i);
+    }
+
+    if ( qinval_batch_end() )
+        fail("  Fail: batch end\n");
+
+    check_counters("sync in batch", 3, 3);
+
+    for ( i = 0; i < NR_IOMMUS; i++ )
+        if ( models[i].nr_dev_iotlb != 1 )
+            fail("  Fail: IOMMU#%u: %u device IOTLB invalidations\n",
+                 i, models[i].nr_dev_iotlb);
+}
+
+int main(int argc, char **argv)
+{
+    test_enable();
+    if ( nr_failures )
+        return 1;
+
+    test_sync();
+    test_batch();
+    test_nested();
+    test_bound();
+    test_sync_in_batch();
+
+    if ( nr_failures )
+        return 1;
+
+    printf("All tests passed\n");
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -23,6 +23,7 @@
 #include <err.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,6 +38,8 @@
 #define WRITE_BUFFERS_N    10
 #define WRITE_BUFFERS_SIZE 4000
 #define MAX_TA_LOOPS       100
+#define WATCH_CONNS        8
+#define WATCH_WRITES       100
 
 struct test {
     char *name;
@@ -52,6 +55,7 @@ static char *path;
 static char *paths[WRITE_BUFFERS_N];
 static char write_buffers[WRITE_BUFFERS_N][WRITE_BUFFERS_SIZE];
 static int ta_loops;
+static struct xs_handle *watch_xsh[WATCH_CONNS];
 
 static struct option options[] = {
     { "list-tests", 0, NULL, 'l' },
@@ -405,6 +409,142 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+#define test_multi_init ret0
+
+/* Write par nodes, set permissions and read one of them in one batch. */
+static int test_multi(uintptr_t par)
+{
+    struct xs_permissions perms = { .id = 0, .perms = XS_PERM_READ };
+    struct xs_multi_op ops[WRITE_BUFFERS_N + 3] = { };
+    unsigned int i, n = 0;
+    int ret;
+
+    if ( par > WRITE_BUFFERS_N )
+        return EFBIG;
+
+    for ( i = 0; i < par; i++ )
+    {
+        ops[n].type = XS_WRITE;
+        ops[n].path = paths[i];
+        ops[n].data = write_buffers[i];
+        ops[n++].len = 1;
+    }
+    ops[n].type = XS_MKDIR;
+    ops[n++].path = path;
+    ops[n].type = XS_SET_PERMS;
+    ops[n].path = paths[0];
+    ops[n].perms = &perms;
+    ops[n++].num_perms = 1;
+    ops[n].type = XS_READ;
+    ops[n++].path = paths[0];
+
+    if ( !xs_multi(xsh, XBT_NULL, ops, n) )
+        return errno;
+
+    ret = (ops[n - 1].result_len == 1 &&
+           !memcmp(ops[n - 1].result, write_buffers[0], 1)) ? 0 : ENOENT;
+    free(ops[n - 1].result);
+
+    return ret;
+}
+
+#define test_multi_deinit ret0
+
+static int test_multi_err_init(uintptr_t par)
+{
+    return xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) ? 0 : errno;
+}
+
+/* A failing operation must revert the preceding ones of the batch. */
+static int test_multi_err(uintptr_t par)
+{
+    struct xs_multi_op ops[3] = {
+        { .type = XS_WRITE, .path = paths[0], .data = "b", .len = 1 },
+        { .type = XS_READ, .path = paths[1] },
+        { .type = XS_WRITE, .path = paths[0], .data = "c", .len = 1 },
+    };
+
+    if ( xs_multi(xsh, XBT_NULL, ops, ARRAY_SIZE(ops)) || errno != ENOENT )
+        return EINVAL;
+
+    return (!ops[0].err && ops[1].err == ENOENT &&
+            ops[2].err == ECANCELED) ? 0 : EINVAL;
+}
+
+static int test_multi_err_deinit(uintptr_t par)
+{
+    return verify_node(paths[0], "a", 1);
+}
+
+/*
+ * Spread par watches on unrelated nodes over several connections, plus one
+ * on the parent of the node to be written.
+ */
+static int test_watch_init(uintptr_t par)
+{
+    char *wpath;
+    unsigned int c, i;
+    bool ok;
+
+    for ( c = 0; c < WATCH_CONNS; c++ )
+    {
+        watch_xsh[c] = xs_open(0);
+        if ( !watch_xsh[c] )
+            return errno;
+
+        for ( i = c; i < par; i += WATCH_CONNS )
+        {
+            if ( asprintf(&wpath, "%s/watch/%u", path, i) < 0 )
+                return ENOMEM;
+            ok = xs_watch(watch_xsh[c], wpath, "miss");
+            free(wpath);
+            if ( !ok )
+                return errno;
+        }
+    }
+
+    return xs_watch(watch_xsh[0], path, "hit") ? 0 : errno;
+}
+
+static int test_watch(uintptr_t par)
+{
+    unsigned int i;
+
+    for ( i = 0; i < WATCH_WRITES; i++ )
+        if ( !xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) )
+            return errno;
+
+    return 0;
+}
+
+/* Check the watch on the parent fired for the written node. */
+static int test_watch_deinit(uintptr_t par)
+{
+    struct pollfd pfd = { .fd = xs_fileno(watch_xsh[0]), .events = POLLIN };
+    unsigned int c;
+    char **vec;
+    int ret = ENOENT;
+
+    while ( ret && poll(&pfd, 1, 1000) > 0 )
+    {
+        while ( ret && (vec = xs_check_watch(watch_xsh[0])) )
+        {
+            if ( !strcmp(vec[XS_WATCH_TOKEN], "hit") &&
+                 !strcmp(vec[XS_WATCH_PATH], paths[0]) )
+                ret = 0;
+            free(vec);
+        }
+    }
+
+    for ( c = 0; c < WATCH_CONNS; c++ )
+    {
+        xs_close(watch_xsh[c]);
+        watch_xsh[c] = NULL;
+    }
+
+    return ret;
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
@@ -419,6 +559,10 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("multi", test_multi, WRITE_BUFFERS_N, "Batch of 13 operations"),
+TEST("multi err", test_multi_err, 0, "Batch with failing operation"),
+TEST("watch 100", test_watch, 100, "Writes with 100 other watches set"),
+TEST("watch 10000", test_watch, 10000, "Writes with 10000 other watches set"),
 };
 
 static void cleanup(void)
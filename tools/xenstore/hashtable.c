@@ -6,6 +6,7 @@
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
+#include <errno.h>
 #include <stdarg.h>
 #include "talloc.h"
 
@@ -204,6 +205,33 @@ hashtable_search(const struct hashtable *h, const void *k)
     return NULL;
 }
 
+/*****************************************************************************/
+int
+hashtable_replace(struct hashtable *h, const void *k, void *v)
+{
+    struct entry *e;
+    unsigned int hashvalue, index;
+    hashvalue = hash(h,k);
+    index = indexFor(h->tablelength,hashvalue);
+    e = h->table[index];
+    while (NULL != e)
+    {
+        /* Check hash value to short circuit heavier comparison */
+        if ((hashvalue == e->h) && (h->eqfn(k, e->k)))
+        {
+            if (h->flags & HASHTABLE_FREE_VALUE)
+            {
+                talloc_unlink(e, e->v);
+                talloc_steal(e, v);
+            }
+            e->v = v;
+            return 0;
+        }
+        e = e->next;
+    }
+    return ENOENT;
+}
+
 /*****************************************************************************/
 void
 hashtable_remove(struct hashtable *h, const void *k)
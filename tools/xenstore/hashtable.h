@@ -63,6 +63,21 @@ hashtable_insert(struct hashtable *h, void *k, void *v);
 void *
 hashtable_search(const struct hashtable *h, const void *k);
 
+/*****************************************************************************
+ * hashtable_replace
+
+ * @name        hashtable_replace
+ * @param   h   the hashtable to search
+ * @param   k   the key to search for  - does not claim ownership
+ * @param   v   the new value to associate with the key
+ * @return      0 for successful replacement, ENOENT if no entry was found
+ *
+ * The old value is released as hashtable_remove() would do.
+ */
+
+int
+hashtable_replace(struct hashtable *h, const void *k, void *v);
+
 /*****************************************************************************
  * hashtable_remove
    
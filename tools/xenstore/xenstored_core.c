@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <poll.h>
+#include <sys/uio.h>
 #ifndef NO_SOCKETS
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -64,11 +65,13 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+#if defined(__linux__) && !defined(__MINIOS__)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
 extern xenevtchn_handle *xce_handle; /* in xenstored_domain.c */
-static int xce_pollfd_idx = -1;
-static struct pollfd *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
+static struct poll_entry xce_pe = { .fd = -1, .idx = -1 };
 static unsigned int delayed_requests;
 
 static int sock = -1;
@@ -82,9 +85,9 @@ int tracefd = -1;
 static bool recovery = true;
 bool keep_orphans = false;
 static int reopen_log_pipe[2];
-static int reopen_log_pipe0_pollfd_idx = -1;
+static struct poll_entry reopen_log_pe = { .fd = -1, .idx = -1 };
+static struct poll_entry sock_pe = { .fd = -1, .idx = -1 };
 char *tracefile = NULL;
-TDB_CONTEXT *tdb_ctx = NULL;
 unsigned int trace_flags = TRACE_OBJ | TRACE_IO;
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
@@ -329,50 +332,78 @@ void conn_free_buffered_data(struct connection *conn)
 	conn->timeout_msec = 0;
 }
 
+/* Maximum number of iovecs gathered from the output queue in one write. */
+#define WRITE_IOV_MAX	64
+
+/*
+ * Write as much of the output queue as possible with a single call of the
+ * interface's writev method, so that several pending replies and watch
+ * events cost only one system call or event channel notification.
+ */
 static bool write_messages(struct connection *conn)
 {
+	struct iovec iov[WRITE_IOV_MAX];
+	struct buffered_data *out, *tmp;
+	unsigned int niov = 0, len, done;
 	int ret;
-	struct buffered_data *out;
-
-	out = list_top(&conn->out_list, struct buffered_data, list);
-	if (out == NULL)
-		return true;
-
-	if (out->inhdr) {
-		if (verbose)
-			xprintf("Writing msg %s (%.*s) out to %p\n",
-				sockmsg_string(out->hdr.msg.type),
-				out->hdr.msg.len,
-				out->buffer, conn);
-		ret = conn->funcs->write(conn, out->hdr.raw + out->used,
-					 sizeof(out->hdr) - out->used);
-		if (ret < 0)
-			return false;
 
-		out->used += ret;
-		if (out->used < sizeof(out->hdr))
-			return true;
-
-		out->inhdr = false;
-		out->used = 0;
+	list_for_each_entry(out, &conn->out_list, list) {
+		if (niov + 2 > WRITE_IOV_MAX)
+			break;
 
-		/* Second write might block if non-zero. */
-		if (out->hdr.msg.len && !conn->domain)
-			return true;
+		if (out->inhdr) {
+			if (verbose && !out->used)
+				xprintf("Writing msg %s (%.*s) out to %p\n",
+					sockmsg_string(out->hdr.msg.type),
+					out->hdr.msg.len,
+					out->buffer, conn);
+			iov[niov].iov_base = out->hdr.raw + out->used;
+			iov[niov].iov_len = sizeof(out->hdr) - out->used;
+			niov++;
+			if (out->hdr.msg.len) {
+				iov[niov].iov_base = out->buffer;
+				iov[niov].iov_len = out->hdr.msg.len;
+				niov++;
+			}
+		} else {
+			iov[niov].iov_base = out->buffer + out->used;
+			iov[niov].iov_len = out->hdr.msg.len - out->used;
+			niov++;
+		}
 	}
 
-	ret = conn->funcs->write(conn, out->buffer + out->used,
-				 out->hdr.msg.len - out->used);
+	if (!niov)
+		return true;
+
+	ret = conn->funcs->writev(conn, iov, niov);
 	if (ret < 0)
 		return false;
+	done = ret;
 
-	out->used += ret;
-	if (out->used != out->hdr.msg.len)
-		return true;
+	/* Consume the written bytes, which may end in the middle of a message. */
+	list_for_each_entry_safe(out, tmp, &conn->out_list, list) {
+		if (out->inhdr) {
+			len = sizeof(out->hdr) - out->used;
+			if (done < len) {
+				out->used += done;
+				break;
+			}
+			done -= len;
+			out->inhdr = false;
+			out->used = 0;
+		}
+
+		len = out->hdr.msg.len - out->used;
+		if (done < len) {
+			out->used += done;
+			break;
+		}
+		done -= len;
 
-	trace_io(conn, out, 1);
+		trace_io(conn, out, 1);
 
-	free_buffered_data(out, conn);
+		free_buffered_data(out, conn);
+	}
 
 	return true;
 }
@@ -430,6 +461,148 @@ int delay_request(struct connection *conn, struct buffered_data *in,
 	return 0;
 }
 
+/*
+ * The file descriptors watched by the main loop are registered only when
+ * they or the events of interest change, so the cost of waiting doesn't
+ * grow with the number of idle connections.  Linux uses epoll for this,
+ * other systems keep a persistent array for poll().
+ */
+#ifdef USE_EPOLL
+/* Maximum number of events returned by one epoll_wait() call. */
+#define POLL_MAX_EVENTS	64
+
+static int epoll_fd = -1;
+
+static void poll_init(void)
+{
+	BUILD_BUG_ON(EPOLLIN != POLLIN || EPOLLPRI != POLLPRI ||
+		     EPOLLOUT != POLLOUT || EPOLLERR != POLLERR ||
+		     EPOLLHUP != POLLHUP);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		barf_perror("Failed to create epoll instance");
+}
+
+static void poll_set(struct poll_entry *pe, int fd, short events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = pe };
+	int op;
+
+	if (pe->fd == fd && pe->events == events)
+		return;
+
+	if (pe->fd != -1 && pe->fd != fd) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pe->fd, NULL);
+		pe->fd = -1;
+	}
+
+	pe->revents = 0;
+	if (fd == -1)
+		return;
+
+	op = (pe->fd == -1) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(epoll_fd, op, fd, &ev)) {
+		syslog(LOG_ERR, "epoll_ctl failed, ignoring fd %d\n", fd);
+		return;
+	}
+
+	pe->fd = fd;
+	pe->events = events;
+}
+
+static int poll_wait(int timeout)
+{
+	struct epoll_event ev[POLL_MAX_EVENTS];
+	struct poll_entry *pe;
+	int i, n;
+
+	n = epoll_wait(epoll_fd, ev, ARRAY_SIZE(ev), timeout);
+	for (i = 0; i < n; i++) {
+		pe = ev[i].data.ptr;
+		pe->revents = ev[i].events;
+	}
+
+	return n;
+}
+#else
+static struct pollfd *fds;
+static struct poll_entry **fd_entries;
+static unsigned int current_array_size;
+static unsigned int nr_fds;
+
+static void poll_init(void)
+{
+}
+
+static void poll_del(struct poll_entry *pe)
+{
+	nr_fds--;
+	if (pe->idx != nr_fds) {
+		fds[pe->idx] = fds[nr_fds];
+		fd_entries[pe->idx] = fd_entries[nr_fds];
+		fd_entries[pe->idx]->idx = pe->idx;
+	}
+	pe->idx = -1;
+	pe->fd = -1;
+}
+
+static void poll_set(struct poll_entry *pe, int fd, short events)
+{
+	if (pe->fd == fd && pe->events == events)
+		return;
+
+	if (pe->idx != -1 && pe->fd != fd)
+		poll_del(pe);
+
+	pe->revents = 0;
+	if (fd == -1)
+		return;
+
+	if (pe->idx == -1) {
+		if (current_array_size < nr_fds + 1) {
+			struct pollfd *new_fds;
+			struct poll_entry **new_entries;
+			unsigned long newsize = ROUNDUP(nr_fds + 1, 8);
+
+			new_fds = realloc(fds, sizeof(*fds) * newsize);
+			if (new_fds)
+				fds = new_fds;
+			new_entries = realloc(fd_entries,
+					      sizeof(*fd_entries) * newsize);
+			if (new_entries)
+				fd_entries = new_entries;
+			if (!new_fds || !new_entries) {
+				syslog(LOG_ERR,
+				       "realloc failed, ignoring fd %d\n", fd);
+				return;
+			}
+			current_array_size = newsize;
+		}
+		pe->idx = nr_fds++;
+		fd_entries[pe->idx] = pe;
+	}
+
+	pe->fd = fd;
+	pe->events = events;
+	fds[pe->idx].fd = fd;
+	fds[pe->idx].events = events;
+	fds[pe->idx].revents = 0;
+}
+
+static int poll_wait(int timeout)
+{
+	unsigned int i;
+	int n;
+
+	n = poll(fds, nr_fds, timeout);
+	for (i = 0; n > 0 && i < nr_fds; i++)
+		fd_entries[i]->revents = fds[i].revents;
+
+	return n;
+}
+#endif
+
 static int destroy_conn(void *_conn)
 {
 	struct connection *conn = _conn;
@@ -445,6 +618,7 @@ static int destroy_conn(void *_conn)
 		       && poll(&pfd, 1, 0) == 1)
 			if (!write_messages(conn))
 				break;
+		poll_set(&conn->poll, -1, 0);
 		close(conn->fd);
 	}
 
@@ -483,62 +657,23 @@ static bool conn_can_write(struct connection *conn)
 	return !conn->is_ignored && conn->funcs->can_write(conn);
 }
 
-/* This function returns index inside the array if succeed, -1 if fail */
-static int set_fd(int fd, short events)
-{
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
-
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
-
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd ) * (newsize-current_array_size));
-		current_array_size = newsize;
-	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	syslog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
-}
-
-static void initialize_fds(int *p_sock_pollfd_idx, int *ptimeout)
+/*
+ * Update the registered file descriptors and calculate the timeout of the
+ * next wait.
+ */
+static void initialize_fds(int *ptimeout)
 {
 	struct connection *conn;
 	struct wrl_timestampt now;
 	uint64_t msecs;
 
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-	nr_fds = 0;
-
 	/* In case of delayed requests pause for max 1 second. */
 	*ptimeout = delayed_requests ? 1000 : -1;
 
-	if (sock != -1)
-		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
-	if (reopen_log_pipe[0] != -1)
-		reopen_log_pipe0_pollfd_idx =
-			set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
-
-	if (xce_handle != NULL)
-		xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
-					POLLIN|POLLPRI);
+	poll_set(&sock_pe, sock, POLLIN|POLLPRI);
+	poll_set(&reopen_log_pe, reopen_log_pipe[0], POLLIN|POLLPRI);
+	poll_set(&xce_pe, xce_handle ? xenevtchn_fd(xce_handle) : -1,
+		 POLLIN|POLLPRI);
 
 	wrl_gettime_now(&now);
 	wrl_log_periodic(now);
@@ -556,7 +691,7 @@ static void initialize_fds(int *p_sock_pollfd_idx, int *ptimeout)
 			short events = POLLIN|POLLPRI;
 			if (!list_empty(&conn->out_list))
 				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
+			poll_set(&conn->poll, conn->fd, events);
 			/*
 			 * For stalled connection, we want to process the
 			 * pending command as soon as live-update has aborted.
@@ -567,32 +702,74 @@ static void initialize_fds(int *p_sock_pollfd_idx, int *ptimeout)
 	}
 }
 
-void set_tdb_key(const char *name, TDB_DATA *key)
+/*
+ * The node data base is a hash table keyed by the data base name of a node,
+ * with a talloc-ed record (struct xs_tdb_record_hdr followed by permissions,
+ * data and children) as value.  Records are never modified once they have
+ * been stored: writing a node stores a new record, and readers take a talloc
+ * reference to the record instead of copying it.
+ */
+static struct hashtable *nodes;
+
+/* With "--internal-db off" all records are mirrored to a TDB file. */
+static TDB_CONTEXT *tdb_ctx;
+
+static void db_mirror(const char *db_name, const void *data, size_t size)
 {
-	/*
-	 * Dropping const is fine here, as the key will never be modified
-	 * by TDB.
-	 */
-	key->dptr = (char *)name;
-	key->dsize = strlen(name);
+	TDB_DATA key, val;
+	int ret;
+
+	if (!tdb_ctx)
+		return;
+
+	/* Dropping const is fine here, as TDB will never modify them. */
+	key.dptr = (char *)db_name;
+	key.dsize = strlen(db_name);
+	if (data) {
+		val.dptr = (char *)data;
+		val.dsize = size;
+		ret = tdb_store(tdb_ctx, key, val, TDB_REPLACE);
+	} else
+		ret = tdb_delete(tdb_ctx, key);
+
+	if (ret)
+		log("TDB error on mirroring %s: %s", db_name,
+		    tdb_errorstr(tdb_ctx));
 }
 
-static void get_acc_data(TDB_DATA *key, struct node_account_data *acc)
+/*
+ * Return the record of a node in the data base, or NULL with errno set to
+ * ENOENT.  The record must not be modified.
+ */
+const struct xs_tdb_record_hdr *db_fetch(const char *db_name, size_t *size)
 {
-	TDB_DATA old_data;
-	struct xs_tdb_record_hdr *hdr;
+	const struct xs_tdb_record_hdr *hdr;
+
+	hdr = hashtable_search(nodes, db_name);
+	if (!hdr) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	*size = talloc_get_size(hdr);
+
+	return hdr;
+}
+
+static void get_acc_data(const char *db_name, struct node_account_data *acc)
+{
+	const struct xs_tdb_record_hdr *hdr;
+	size_t size;
 
 	if (acc->memory < 0) {
-		old_data = tdb_fetch(tdb_ctx, *key);
+		hdr = db_fetch(db_name, &size);
 		/* No check for error, as the node might not exist. */
-		if (old_data.dptr == NULL) {
+		if (!hdr) {
 			acc->memory = 0;
 		} else {
-			hdr = (void *)old_data.dptr;
-			acc->memory = old_data.dsize;
+			acc->memory = size;
 			acc->domid = hdr->perms[0].id;
 		}
-		talloc_free(old_data.dptr);
 	}
 }
 
@@ -602,19 +779,28 @@ static void get_acc_data(TDB_DATA *key, struct node_account_data *acc)
  * count prepended (e.g. 123/local/domain/...). So testing for the node's
  * key not to start with "/" or "@" is sufficient.
  */
-static unsigned int get_acc_domid(struct connection *conn, TDB_DATA *key,
+static unsigned int get_acc_domid(struct connection *conn, const char *db_name,
 				  unsigned int domid)
 {
-	return (!conn || key->dptr[0] == '/' || key->dptr[0] == '@')
+	return (!conn || db_name[0] == '/' || db_name[0] == '@')
 	       ? domid : conn->id;
 }
 
-int do_tdb_write(struct connection *conn, TDB_DATA *key, TDB_DATA *data,
-		 struct node_account_data *acc, bool no_quota_check)
+/*
+ * Store a record in the data base.  data must be talloc-ed with a size of
+ * size bytes.  The data base takes a reference to it, so the caller must
+ * not modify it afterwards, and must drop its own reference by freeing the
+ * talloc parent of data, or via talloc_unlink().
+ */
+int db_write(struct connection *conn, const char *db_name, const void *data,
+	     size_t size, struct node_account_data *acc, bool no_quota_check)
 {
-	struct xs_tdb_record_hdr *hdr = (void *)data->dptr;
+	const struct xs_tdb_record_hdr *hdr = data;
 	struct node_account_data old_acc = {};
 	unsigned int old_domid, new_domid;
+	size_t name_len = strlen(db_name);
+	void *old;
+	char *name;
 	int ret;
 
 	if (!acc)
@@ -622,9 +808,9 @@ int do_tdb_write(struct connection *conn, TDB_DATA *key, TDB_DATA *data,
 	else
 		old_acc = *acc;
 
-	get_acc_data(key, &old_acc);
-	old_domid = get_acc_domid(conn, key, old_acc.domid);
-	new_domid = get_acc_domid(conn, key, hdr->perms[0].id);
+	get_acc_data(db_name, &old_acc);
+	old_domid = get_acc_domid(conn, db_name, old_acc.domid);
+	new_domid = get_acc_domid(conn, db_name, hdr->perms[0].id);
 
 	/*
 	 * Don't check for ENOENT, as we want to be able to switch orphaned
@@ -632,60 +818,82 @@ int do_tdb_write(struct connection *conn, TDB_DATA *key, TDB_DATA *data,
 	 */
 	if (old_acc.memory)
 		domain_memory_add_nochk(old_domid,
-					-old_acc.memory - key->dsize);
-	ret = domain_memory_add(new_domid, data->dsize + key->dsize,
-				no_quota_check);
+					-old_acc.memory - name_len);
+	ret = domain_memory_add(new_domid, size + name_len, no_quota_check);
 	if (ret) {
 		/* Error path, so no quota check. */
 		if (old_acc.memory)
 			domain_memory_add_nochk(old_domid,
-						old_acc.memory + key->dsize);
+						old_acc.memory + name_len);
 		return ret;
 	}
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_ctx, *key, *data, TDB_REPLACE) != 0) {
-		domain_memory_add_nochk(new_domid, -data->dsize - key->dsize);
-		/* Error path, so no quota check. */
-		if (old_acc.memory)
-			domain_memory_add_nochk(old_domid,
-						old_acc.memory + key->dsize);
-		errno = EIO;
-		return errno;
+	if (!talloc_reference(nodes, data))
+		goto nomem;
+
+	old = hashtable_search(nodes, db_name);
+	if (old) {
+		hashtable_replace(nodes, db_name, (void *)data);
+		talloc_unlink(nodes, old);
+	} else {
+		name = talloc_strdup(nodes, db_name);
+		if (!name || !hashtable_insert(nodes, name, (void *)data)) {
+			talloc_free(name);
+			talloc_unlink(nodes, (void *)data);
+			goto nomem;
+		}
 	}
 
+	db_mirror(db_name, data, size);
+
 	if (acc) {
 		/* Don't use new_domid, as it might be a transaction node. */
 		acc->domid = hdr->perms[0].id;
-		acc->memory = data->dsize;
+		acc->memory = size;
 	}
 
 	return 0;
+
+ nomem:
+	domain_memory_add_nochk(new_domid, -size - name_len);
+	/* Error path, so no quota check. */
+	if (old_acc.memory)
+		domain_memory_add_nochk(old_domid, old_acc.memory + name_len);
+	errno = ENOMEM;
+	return errno;
 }
 
-int do_tdb_delete(struct connection *conn, TDB_DATA *key,
-		  struct node_account_data *acc)
+int db_delete(struct connection *conn, const char *db_name,
+	      struct node_account_data *acc)
 {
 	struct node_account_data tmp_acc;
 	unsigned int domid;
+	void *data;
 
 	if (!acc) {
 		acc = &tmp_acc;
 		acc->memory = -1;
 	}
 
-	get_acc_data(key, acc);
-
-	if (tdb_delete(tdb_ctx, *key)) {
-		errno = EIO;
+	data = hashtable_search(nodes, db_name);
+	if (!data) {
+		errno = ENOENT;
 		return errno;
 	}
 
+	get_acc_data(db_name, acc);
+	db_mirror(db_name, NULL, 0);
+
 	if (acc->memory) {
-		domid = get_acc_domid(conn, key, acc->domid);
-		domain_memory_add_nochk(domid, -acc->memory - key->dsize);
+		domid = get_acc_domid(conn, db_name, acc->domid);
+		domain_memory_add_nochk(domid,
+					-acc->memory - strlen(db_name));
 	}
 
+	/* Might free db_name, if it is the key of the entry. */
+	hashtable_remove(nodes, db_name);
+	talloc_unlink(nodes, data);
+
 	return 0;
 }
 
@@ -696,9 +904,10 @@ int do_tdb_delete(struct connection *conn, TDB_DATA *key,
 struct node *read_node(struct connection *conn, const void *ctx,
 		       const char *name)
 {
-	TDB_DATA key, data;
-	struct xs_tdb_record_hdr *hdr;
+	const char *db_name;
+	const struct xs_tdb_record_hdr *hdr;
 	struct node *node;
+	size_t size;
 	int err;
 
 	node = talloc(ctx, struct node);
@@ -713,36 +922,38 @@ struct node *read_node(struct connection *conn, const void *ctx,
 		return NULL;
 	}
 
-	transaction_prepend(conn, name, &key);
-
-	data = tdb_fetch(tdb_ctx, key);
+	db_name = transaction_prepend(conn, name);
+	hdr = db_fetch(db_name, &size);
 
-	if (data.dptr == NULL) {
-		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
-			node->generation = NO_GENERATION;
-			err = access_node(conn, node, NODE_ACCESS_READ, NULL);
-			errno = err ? : ENOENT;
-		} else {
-			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
-			errno = EIO;
-		}
+	if (hdr == NULL) {
+		node->generation = NO_GENERATION;
+		err = access_node(conn, node, NODE_ACCESS_READ, NULL);
+		errno = err ? : ENOENT;
 		goto error;
 	}
 
 	node->parent = NULL;
-	talloc_steal(node, data.dptr);
+
+	/* Share data and children with the data base. */
+	if (!talloc_reference(node, hdr))
+		goto nomem;
 
 	/* Datalen, childlen, number of permissions */
-	hdr = (void *)data.dptr;
 	node->generation = hdr->generation;
 	node->perms.num = hdr->num_perms;
 	node->datalen = hdr->datalen;
 	node->childlen = hdr->childlen;
 
-	/* Permissions are struct xs_permissions. */
-	node->perms.p = hdr->perms;
+	/*
+	 * Permissions are struct xs_permissions.  They are copied, as they
+	 * are adjusted in place for domains having gone away.
+	 */
+	node->perms.p = talloc_memdup(node, hdr->perms,
+				      hdr->num_perms * sizeof(*hdr->perms));
+	if (!node->perms.p)
+		goto nomem;
 	node->acc.domid = get_node_owner(node);
-	node->acc.memory = data.dsize;
+	node->acc.memory = size;
 	if (domain_adjust_node_perms(node))
 		goto error;
 
@@ -751,7 +962,7 @@ struct node *read_node(struct connection *conn, const void *ctx,
 		node->acc.memory = 0;
 
 	/* Data is binary blob (usually ascii, no nul). */
-	node->data = node->perms.p + hdr->num_perms;
+	node->data = (void *)(hdr->perms + hdr->num_perms);
 	/* Children is strings, nul separated. */
 	node->children = node->data + node->datalen;
 
@@ -760,6 +971,8 @@ struct node *read_node(struct connection *conn, const void *ctx,
 
 	return node;
 
+ nomem:
+	errno = ENOMEM;
  error:
 	talloc_free(node);
 	return NULL;
@@ -777,33 +990,32 @@ static bool read_node_can_propagate_errno(void)
 	return errno == ENOMEM || errno == ENOSPC;
 }
 
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
-		   bool no_quota_check)
+int write_node_raw(struct connection *conn, const char *db_name,
+		   struct node *node, bool no_quota_check)
 {
-	TDB_DATA data;
+	size_t size;
 	void *p;
 	struct xs_tdb_record_hdr *hdr;
 
 	if (domain_adjust_node_perms(node))
 		return errno;
 
-	data.dsize = sizeof(*hdr)
+	size = sizeof(*hdr)
 		+ node->perms.num * sizeof(node->perms.p[0])
 		+ node->datalen + node->childlen;
 
 	if (!no_quota_check && domain_is_unprivileged(conn) &&
-	    data.dsize >= quota_max_entry_size) {
+	    size >= quota_max_entry_size) {
 		errno = ENOSPC;
 		return errno;
 	}
 
-	data.dptr = talloc_size(node, data.dsize);
-	if (!data.dptr) {
+	hdr = talloc_size(node, size);
+	if (!hdr) {
 		errno = ENOMEM;
 		return errno;
 	}
 
-	hdr = (void *)data.dptr;
 	hdr->generation = node->generation;
 	hdr->num_perms = node->perms.num;
 	hdr->datalen = node->datalen;
@@ -816,25 +1028,26 @@ int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	if (do_tdb_write(conn, key, &data, &node->acc, no_quota_check))
+	if (db_write(conn, db_name, hdr, size, &node->acc, no_quota_check))
 		return EIO;
 
 	return 0;
 }
 
 /*
- * Write the node. If the node is written, caller can find the key used in
- * node->key. This can later be used if the change needs to be reverted.
+ * Write the node. If the node is written, caller can find the data base name
+ * used in node->db_name. This can later be used if the change needs to be
+ * reverted.
  */
 static int write_node(struct connection *conn, struct node *node,
 		      bool no_quota_check)
 {
 	int ret;
 
-	if (access_node(conn, node, NODE_ACCESS_WRITE, &node->key))
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &node->db_name))
 		return errno;
 
-	ret = write_node_raw(conn, &node->key, node, no_quota_check);
+	ret = write_node_raw(conn, node->db_name, node, no_quota_check);
 	if (ret && conn && conn->transaction) {
 		/*
 		 * Reverting access_node() is hard, so just fail the
@@ -1027,6 +1240,33 @@ static void send_error(struct connection *conn, int error)
 			  strlen(xsd_errors[i].errstring) + 1);
 }
 
+/* Replies of the sub-requests of an XS_MULTI request. */
+struct multi_reply {
+	unsigned int used;
+	bool error;		/* Last sub-request failed. */
+	bool overflow;		/* Replies don't fit into one message. */
+	char buffer[XENSTORE_PAYLOAD_MAX];
+};
+
+static void multi_add_reply(struct multi_reply *multi,
+			    enum xsd_sockmsg_type type,
+			    const void *data, unsigned int len)
+{
+	struct xsd_sockmsg hdr = { .type = type, .len = len };
+
+	multi->error = (type == XS_ERROR);
+	if (multi->overflow ||
+	    len > sizeof(multi->buffer) - multi->used ||
+	    sizeof(hdr) > sizeof(multi->buffer) - multi->used - len) {
+		multi->overflow = true;
+		return;
+	}
+
+	memcpy(multi->buffer + multi->used, &hdr, sizeof(hdr));
+	memcpy(multi->buffer + multi->used + sizeof(hdr), data, len);
+	multi->used += sizeof(hdr) + len;
+}
+
 void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		const void *data, unsigned int len)
 {
@@ -1034,6 +1274,11 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	assert(type != XS_WATCH_EVENT);
 
+	if (conn->multi) {
+		multi_add_reply(conn->multi, type, data, len);
+		return;
+	}
+
 	if ( len > XENSTORE_PAYLOAD_MAX ) {
 		send_error(conn, E2BIG);
 		return;
@@ -1442,7 +1687,7 @@ static void destroy_node_rm(struct connection *conn, struct node *node)
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	do_tdb_delete(conn, &node->key, &node->acc);
+	db_delete(conn, node->db_name, &node->acc);
 }
 
 static int destroy_node(struct connection *conn, struct node *node)
@@ -1481,7 +1726,7 @@ static struct node *create_node(struct connection *conn, const void *ctx,
 	 * node will be already existing and won't have i->parent set.
 	 * New nodes are subject to quota handling.
 	 * Initially set a destructor for all new nodes removing them from
-	 * TDB again and undoing quota accounting for the case of an error
+	 * the data base again and undoing quota accounting for the case of an error
 	 * during the write loop.
 	 */
 	for (i = node; i; i = i->parent) {
@@ -1509,8 +1754,8 @@ static struct node *create_node(struct connection *conn, const void *ctx,
 
 err:
 	/*
-	 * We failed to update TDB for some of the nodes. Undo any work that
-	 * have already been done.
+	 * We failed to update the data base for some of the nodes. Undo any
+	 * work that have already been done.
 	 */
 	for (j = node; j != i; j = j->parent)
 		destroy_node(conn, j);
@@ -1592,19 +1837,23 @@ static int do_mkdir(const void *ctx, struct connection *conn,
 	return 0;
 }
 
-/* Delete memory using memmove. */
-static void memdel(void *mem, unsigned off, unsigned len, unsigned total)
-{
-	memmove(mem + off, mem + off + len, total - off - len);
-}
-
 static int remove_child_entry(struct connection *conn, struct node *node,
 			      size_t offset)
 {
-	size_t childlen = strlen(node->children + offset);
+	size_t childlen = strlen(node->children + offset) + 1;
+	char *children;
 
-	memdel(node->children, offset, childlen + 1, node->childlen);
-	node->childlen -= childlen + 1;
+	/* The children are shared with the data base, so don't modify them. */
+	children = talloc_size(node, node->childlen - childlen);
+	if (!children) {
+		errno = ENOMEM;
+		return errno;
+	}
+	memcpy(children, node->children, offset);
+	memcpy(children + offset, node->children + offset + childlen,
+	       node->childlen - offset - childlen);
+	node->children = children;
+	node->childlen -= childlen;
 
 	return write_node(conn, node, true);
 }
@@ -1632,15 +1881,15 @@ static int delnode_sub(const void *ctx, struct connection *conn,
 	const char *root = arg;
 	bool watch_exact;
 	int ret;
-	TDB_DATA key;
+	const char *db_name;
 
 	/* Any error here will probably be repeated for all following calls. */
-	ret = access_node(conn, node, NODE_ACCESS_DELETE, &key);
+	ret = access_node(conn, node, NODE_ACCESS_DELETE, &db_name);
 	if (ret > 0)
 		return WALK_TREE_SUCCESS_STOP;
 
 	/* In case of error stop the walk. */
-	if (!ret && do_tdb_delete(conn, &key, &node->acc))
+	if (!ret && db_delete(conn, db_name, &node->acc))
 		return WALK_TREE_SUCCESS_STOP;
 
 	/*
@@ -1950,6 +2199,9 @@ int walk_node_tree(const void *ctx, struct connection *conn, const char *root,
 	return ret < 0 ? ret : WALK_TREE_OK;
 }
 
+static int do_multi(const void *ctx, struct connection *conn,
+		    struct buffered_data *in);
+
 static struct {
 	const char *str;
 	int (*func)(const void *ctx, struct connection *conn,
@@ -1957,11 +2209,13 @@ static struct {
 	unsigned int flags;
 #define XS_FLAG_NOTID		(1U << 0)	/* Ignore transaction id. */
 #define XS_FLAG_PRIV		(1U << 1)	/* Privileged domain only. */
+#define XS_FLAG_MULTI		(1U << 2)	/* Allowed in XS_MULTI. */
 } const wire_funcs[XS_TYPE_COUNT] = {
 	[XS_CONTROL]           =
 	    { "CONTROL",       do_control,      XS_FLAG_PRIV },
 	[XS_DIRECTORY]         = { "DIRECTORY",         send_directory },
-	[XS_READ]              = { "READ",              do_read },
+	[XS_READ]              =
+	    { "READ",          do_read,         XS_FLAG_MULTI },
 	[XS_GET_PERMS]         = { "GET_PERMS",         do_get_perms },
 	[XS_WATCH]             =
 	    { "WATCH",         do_watch,        XS_FLAG_NOTID },
@@ -1974,10 +2228,14 @@ static struct {
 	[XS_RELEASE]           =
 	    { "RELEASE",       do_release,      XS_FLAG_PRIV },
 	[XS_GET_DOMAIN_PATH]   = { "GET_DOMAIN_PATH",   do_get_domain_path },
-	[XS_WRITE]             = { "WRITE",             do_write },
-	[XS_MKDIR]             = { "MKDIR",             do_mkdir },
-	[XS_RM]                = { "RM",                do_rm },
-	[XS_SET_PERMS]         = { "SET_PERMS",         do_set_perms },
+	[XS_WRITE]             =
+	    { "WRITE",         do_write,        XS_FLAG_MULTI },
+	[XS_MKDIR]             =
+	    { "MKDIR",         do_mkdir,        XS_FLAG_MULTI },
+	[XS_RM]                =
+	    { "RM",            do_rm,           XS_FLAG_MULTI },
+	[XS_SET_PERMS]         =
+	    { "SET_PERMS",     do_set_perms,    XS_FLAG_MULTI },
 	[XS_WATCH_EVENT]       = { "WATCH_EVENT",       NULL },
 	[XS_ERROR]             = { "ERROR",             NULL },
 	[XS_IS_DOMAIN_INTRODUCED] =
@@ -1988,6 +2246,7 @@ static struct {
 	    { "SET_TARGET",    do_set_target,   XS_FLAG_PRIV },
 	[XS_RESET_WATCHES]     = { "RESET_WATCHES",     do_reset_watches },
 	[XS_DIRECTORY_PART]    = { "DIRECTORY_PART",    send_directory_part },
+	[XS_MULTI]             = { "MULTI",             do_multi },
 };
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -1998,6 +2257,84 @@ static const char *sockmsg_string(enum xsd_sockmsg_type type)
 	return "**UNKNOWN**";
 }
 
+/*
+ * Execute the sub-requests of an XS_MULTI request in order, stopping at the
+ * first failing one.  Outside of a transaction the sub-requests are run in an
+ * implicit transaction, which is only committed if all of them succeeded.
+ */
+static int do_multi(const void *ctx, struct connection *conn,
+		    struct buffered_data *in)
+{
+	struct transaction *trans = NULL;
+	struct multi_reply *multi;
+	struct buffered_data sub;
+	struct xsd_sockmsg hdr;
+	unsigned int off;
+	bool failed = false;
+	void *subctx;
+	int ret;
+
+	/* Validate all sub-requests before executing any of them. */
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		if (in->used - off < sizeof(hdr))
+			return EINVAL;
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		if (hdr.len > in->used - off - sizeof(hdr) ||
+		    hdr.type >= XS_TYPE_COUNT ||
+		    !(wire_funcs[hdr.type].flags & XS_FLAG_MULTI))
+			return EINVAL;
+	}
+
+	multi = talloc_zero(ctx, struct multi_reply);
+	if (!multi)
+		return ENOMEM;
+
+	if (!conn->transaction) {
+		trans = transaction_start_implicit(ctx, conn);
+		if (!trans)
+			return ENOMEM;
+		conn->transaction = trans;
+	}
+
+	conn->multi = multi;
+	for (off = 0; off < in->used && !failed; off += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		memset(&sub, 0, sizeof(sub));
+		sub.hdr.msg = hdr;
+		sub.buffer = in->buffer + off + sizeof(hdr);
+		sub.used = hdr.len;
+
+		subctx = talloc_new(ctx);
+		if (!subctx)
+			ret = ENOMEM;
+		else
+			ret = wire_funcs[hdr.type].func(subctx, conn, &sub);
+		talloc_free(subctx);
+		if (ret)
+			send_error(conn, ret);
+
+		failed = multi->error || multi->overflow;
+	}
+	conn->multi = NULL;
+
+	if (trans) {
+		conn->transaction = NULL;
+		/* On failure the transaction is dropped together with ctx. */
+		if (!failed) {
+			ret = transaction_commit(conn, trans);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (multi->overflow)
+		return E2BIG;
+
+	send_reply(conn, XS_MULTI, multi->buffer, multi->used);
+
+	return 0;
+}
+
 /* Process "in" for conn: "in" will vanish after this conversation, so
  * we can talloc off it for temporary variables.  May free "conn".
  */
@@ -2189,7 +2526,8 @@ struct connection *new_connection(const struct interface_funcs *funcs)
 		return NULL;
 
 	new->fd = -1;
-	new->pollfd_idx = -1;
+	new->poll.fd = -1;
+	new->poll.idx = -1;
 	new->funcs = funcs;
 	new->is_ignored = false;
 	new->is_stalled = false;
@@ -2222,11 +2560,20 @@ static void accept_connection(int sock)
 {
 }
 #else
-static int writefd(struct connection *conn, const void *data, unsigned int len)
+/*
+ * Sockets are blocking, so don't let a client which isn't reading stall us
+ * when the queued output exceeds the free socket buffer space.
+ */
+static int writevfd(struct connection *conn, const struct iovec *iov,
+		    unsigned int iovcnt)
 {
+	struct msghdr msg = {
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+	};
 	int rc;
 
-	while ((rc = write(conn->fd, data, len)) < 0) {
+	while ((rc = sendmsg(conn->fd, &msg, MSG_DONTWAIT)) < 0) {
 		if (errno == EAGAIN) {
 			rc = 0;
 			break;
@@ -2262,15 +2609,12 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 
 static bool socket_can_process(struct connection *conn, int mask)
 {
-	if (conn->pollfd_idx == -1)
-		return false;
-
-	if (fds[conn->pollfd_idx].revents & ~(POLLIN | POLLOUT)) {
+	if (conn->poll.revents & ~(POLLIN | POLLOUT)) {
 		talloc_free(conn);
 		return false;
 	}
 
-	return (fds[conn->pollfd_idx].revents & mask);
+	return (conn->poll.revents & mask);
 }
 
 static bool socket_can_write(struct connection *conn)
@@ -2284,7 +2628,7 @@ static bool socket_can_read(struct connection *conn)
 }
 
 const struct interface_funcs socket_funcs = {
-	.write = writefd,
+	.writev = writevfd,
 	.read = readfd,
 	.can_write = socket_can_write,
 	.can_read = socket_can_read,
@@ -2308,7 +2652,7 @@ static void accept_connection(int sock)
 }
 #endif
 
-static int tdb_flags = TDB_INTERNAL | TDB_NOLOCK;
+static bool tdb_mirror;
 
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
@@ -2361,18 +2705,25 @@ void setup_structure(bool live_update)
 {
 	char *tdbname;
 
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-	if (!tdbname)
-		barf_perror("Could not create tdbname");
+	nodes = create_hashtable(NULL, 7919, hash_from_key_fn, keys_equal_fn,
+				 HASHTABLE_FREE_KEY);
+	if (!nodes)
+		barf_perror("Could not create node data base");
+
+	if (tdb_mirror) {
+		tdbname = talloc_strdup(talloc_autofree_context(),
+					xs_daemon_tdb());
+		if (!tdbname)
+			barf_perror("Could not create tdbname");
 
-	if (!(tdb_flags & TDB_INTERNAL))
 		unlink(tdbname);
 
-	tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags,
-			      O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
-			      0640, &tdb_logger, NULL);
-	if (!tdb_ctx)
-		barf_perror("Could not create tdb file %s", tdbname);
+		tdb_ctx = tdb_open_ex(tdbname, 7919, 0,
+				      O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+				      0640, &tdb_logger, NULL);
+		if (!tdb_ctx)
+			barf_perror("Could not create tdb file %s", tdbname);
+	}
 
 	if (live_update)
 		manual_node("/", NULL);
@@ -2386,7 +2737,7 @@ void setup_structure(bool live_update)
 	}
 }
 
-static unsigned int hash_from_key_fn(const void *k)
+unsigned int hash_from_key_fn(const void *k)
 {
 	const char *str = k;
 	unsigned int hash = 5381;
@@ -2399,7 +2750,7 @@ static unsigned int hash_from_key_fn(const void *k)
 }
 
 
-static int keys_equal_fn(const void *key1, const void *key2)
+int keys_equal_fn(const void *key1, const void *key2)
 {
 	return 0 == strcmp(key1, key2);
 }
@@ -2463,12 +2814,11 @@ static int check_store_enoent(const void *ctx, struct connection *conn,
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(const void *key, void *val, void *private)
 {
 	struct hashtable *reachable = private;
 	char *slash;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	char *name = talloc_strdup(NULL, key);
 
 	if (!name) {
 		log("clean_store: ENOMEM");
@@ -2483,7 +2833,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			do_tdb_delete(NULL, &key, NULL);
+			db_delete(NULL, key, NULL);
 		}
 	}
 
@@ -2499,7 +2849,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct check_store_data *data)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, data->reachable);
+	hashtable_iterate(nodes, clean_store_, data->reachable);
 	domain_check_acc(data->domains);
 }
 
@@ -2657,8 +3007,9 @@ static void usage(void)
 "                          watch-event: time a watch-event is kept pending\n"
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
-"  -I, --internal-db [on|off] store database in memory, not on disk, default is\n"
-"                          memory, with \"--internal-db off\" it is on disk\n"
+"  -I, --internal-db [on|off] store database in memory only, default is on,\n"
+"                          with \"--internal-db off\" it is also written to a\n"
+"                          TDB file on disk, e.g. for xs_tdb_dump (debug only)\n"
 "  -K, --keep-orphans      don't delete nodes owned by a domain when the\n"
 "                          domain is deleted (this is a security risk!)\n"
 "  -V, --verbose           to request verbose execution.\n");
@@ -2792,7 +3143,6 @@ int set_trace_switch(const char *arg)
 int main(int argc, char *argv[])
 {
 	int opt;
-	int sock_pollfd_idx = -1;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
@@ -2843,7 +3193,7 @@ int main(int argc, char *argv[])
 			break;
 		case 'I':
 			if (optarg && !strcmp(optarg, "off"))
-				tdb_flags = 0;
+				tdb_mirror = true;
 			break;
 		case 'K':
 			keep_orphans = true;
@@ -2953,7 +3303,8 @@ int main(int argc, char *argv[])
 	check_store();
 
 	/* Get ready to listen to the tools. */
-	initialize_fds(&sock_pollfd_idx, &timeout);
+	poll_init();
+	initialize_fds(&timeout);
 
 #if defined(XEN_SYSTEMD_ENABLED)
 	if (!live_update) {
@@ -2966,46 +3317,39 @@ int main(int argc, char *argv[])
 	for (;;) {
 		struct connection *conn, *next;
 
-		if (poll(fds, nr_fds, timeout) < 0) {
+		if (poll_wait(timeout) < 0) {
 			if (errno == EINTR)
 				continue;
 			barf_perror("Poll failed");
 		}
 
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
-				close(reopen_log_pipe[0]);
-				close(reopen_log_pipe[1]);
-				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
-				char c;
-				if (read(reopen_log_pipe[0], &c, 1) != 1)
-					barf_perror("read failed");
-				reopen_log();
-			}
-			reopen_log_pipe0_pollfd_idx = -1;
+		if (reopen_log_pe.revents & ~POLLIN) {
+			poll_set(&reopen_log_pe, -1, 0);
+			close(reopen_log_pipe[0]);
+			close(reopen_log_pipe[1]);
+			init_pipe(reopen_log_pipe);
+		} else if (reopen_log_pe.revents & POLLIN) {
+			char c;
+			if (read(reopen_log_pipe[0], &c, 1) != 1)
+				barf_perror("read failed");
+			reopen_log();
 		}
+		reopen_log_pe.revents = 0;
 
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("sock poll failed");
-				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(sock);
-				sock_pollfd_idx = -1;
-			}
+		if (sock_pe.revents & ~POLLIN) {
+			barf_perror("sock poll failed");
+			break;
+		} else if (sock_pe.revents & POLLIN) {
+			accept_connection(sock);
+			sock_pe.revents = 0;
 		}
 
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
-			}
+		if (xce_pe.revents & ~POLLIN) {
+			barf_perror("xce_handle poll failed");
+			break;
+		} else if (xce_pe.revents & POLLIN) {
+			handle_event();
+			xce_pe.revents = 0;
 		}
 
 		/*
@@ -3038,7 +3382,7 @@ int main(int argc, char *argv[])
 			if (talloc_free(conn) == 0)
 				continue;
 
-			conn->pollfd_idx = -1;
+			conn->poll.revents = 0;
 		}
 
 		if (delayed_requests) {
@@ -3051,7 +3395,7 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		initialize_fds(&sock_pollfd_idx, &timeout);
+		initialize_fds(&timeout);
 	}
 }
 
@@ -3418,7 +3762,6 @@ void read_state_node(const void *ctx, const void *state)
 {
 	const struct xs_state_node *sn = state;
 	struct node *node, *parent;
-	TDB_DATA key;
 	char *name, *parentname;
 	unsigned int i;
 	struct connection conn = { .id = priv_domid };
@@ -3471,13 +3814,11 @@ void read_state_node(const void *ctx, const void *state)
 		if (add_child(node, parent, name))
 			barf("allocation error restoring node");
 
-		set_tdb_key(parentname, &key);
-		if (write_node_raw(NULL, &key, parent, true))
+		if (write_node_raw(NULL, parentname, parent, true))
 			barf("write parent error restoring node");
 	}
 
-	set_tdb_key(name, &key);
-	if (write_node_raw(NULL, &key, node, true))
+	if (write_node_raw(NULL, name, node, true))
 		barf("write node error restoring node");
 
 	if (domain_nbentry_inc(&conn, get_node_owner(node)))
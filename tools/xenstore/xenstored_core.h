@@ -23,6 +23,7 @@
 #include <xengnttab.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -33,7 +34,6 @@
 #include "xenstore_lib.h"
 #include "xenstore_state.h"
 #include "list.h"
-#include "tdb.h"
 #include "hashtable.h"
 
 #ifndef O_CLOEXEC
@@ -108,20 +108,30 @@ struct delayed_request {
 struct connection;
 
 struct interface_funcs {
-	int (*write)(struct connection *, const void *, unsigned int);
+	int (*writev)(struct connection *, const struct iovec *, unsigned int);
 	int (*read)(struct connection *, void *, unsigned int);
 	bool (*can_write)(struct connection *);
 	bool (*can_read)(struct connection *);
 };
 
+struct multi_reply;
+
+/* A file descriptor watched by the main loop. */
+struct poll_entry {
+	int fd;			/* -1 if not registered. */
+	short events;		/* POLL* events asked for. */
+	short revents;		/* Events seen, cleared by the consumer. */
+	int idx;		/* Slot in the poll() array, if used. */
+};
+
 struct connection
 {
 	struct list_head list;
 
 	/* The file descriptor we came in on. */
 	int fd;
-	/* The index of pollfd in global pollfd array */
-	int pollfd_idx;
+	/* Registration of fd with the main loop. */
+	struct poll_entry poll;
 
 	/* Who am I? Domid of connection. */
 	unsigned int id;
@@ -145,6 +155,9 @@ struct connection
 	/* Transaction context for current request (NULL if none). */
 	struct transaction *transaction;
 
+	/* Replies collected for the current XS_MULTI request (NULL if none). */
+	struct multi_reply *multi;
+
 	/* List of in-progress transactions. */
 	struct list_head transaction_list;
 	uint32_t next_transaction_id;
@@ -183,8 +196,8 @@ struct node_account_data {
 
 struct node {
 	const char *name;
-	/* Key used to update TDB */
-	TDB_DATA key;
+	/* Data base name used to update the node */
+	const char *db_name;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -238,11 +251,11 @@ static inline unsigned int get_node_owner(const struct node *node)
 	return node->perms.p[0].id;
 }
 
-/* Write a node to the tdb data base. */
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
-		   bool no_quota_check);
+/* Write a node to the data base. */
+int write_node_raw(struct connection *conn, const char *db_name,
+		   struct node *node, bool no_quota_check);
 
-/* Get a node from the tdb data base. */
+/* Get a node from the data base. */
 struct node *read_node(struct connection *conn, const void *ctx,
 		       const char *name);
 
@@ -302,7 +315,6 @@ extern unsigned int trace_flags;
 extern const char *const trace_switches[];
 int set_trace_switch(const char *arg);
 
-extern TDB_CONTEXT *tdb_ctx;
 extern int dom0_domid;
 extern int dom0_event;
 extern int priv_domid;
@@ -355,13 +367,18 @@ extern const struct interface_funcs socket_funcs;
 #endif
 extern xengnttab_handle **xgt_handle;
 
+/* Hash table functions for string keys. */
+unsigned int hash_from_key_fn(const void *k);
+int keys_equal_fn(const void *key1, const void *key2);
+
 int remember_string(struct hashtable *hash, const char *str);
 
-void set_tdb_key(const char *name, TDB_DATA *key);
-int do_tdb_write(struct connection *conn, TDB_DATA *key, TDB_DATA *data,
-		 struct node_account_data *acc, bool no_quota_check);
-int do_tdb_delete(struct connection *conn, TDB_DATA *key,
-		  struct node_account_data *acc);
+/* Node data base access. */
+const struct xs_tdb_record_hdr *db_fetch(const char *db_name, size_t *size);
+int db_write(struct connection *conn, const char *db_name, const void *data,
+	     size_t size, struct node_account_data *acc, bool no_quota_check);
+int db_delete(struct connection *conn, const char *db_name,
+	      struct node_account_data *acc);
 
 void conn_free_buffered_data(struct connection *conn);
 
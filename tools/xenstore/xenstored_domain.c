@@ -130,11 +130,17 @@ static const void *get_input_chunk(XENSTORE_RING_IDX cons,
 	return buf + MASK_XENSTORE_IDX(cons);
 }
 
+/*
+ * Copy as much of the iovecs as fits into the ring, and notify the domain
+ * only once for all of it.
+ */
 static int writechn(struct connection *conn,
-		    const void *data, unsigned int len)
+		    const struct iovec *iov, unsigned int iovcnt)
 {
 	uint32_t avail;
 	void *dest;
+	const char *src;
+	unsigned int i, len, done = 0;
 	struct xenstore_domain_interface *intf = conn->domain->interface;
 	XENSTORE_RING_IDX cons, prod;
 
@@ -148,17 +154,33 @@ static int writechn(struct connection *conn,
 		return -1;
 	}
 
-	dest = get_output_chunk(cons, prod, intf->rsp, &avail);
-	if (avail < len)
-		len = avail;
+	for (i = 0; i < iovcnt; i++) {
+		src = iov[i].iov_base;
+		len = iov[i].iov_len;
+		while (len) {
+			dest = get_output_chunk(cons, prod, intf->rsp, &avail);
+			if (!avail)
+				goto out;
+			if (avail > len)
+				avail = len;
+
+			memcpy(dest, src, avail);
+			src += avail;
+			len -= avail;
+			prod += avail;
+			done += avail;
+		}
+	}
 
-	memcpy(dest, data, len);
-	xen_mb();
-	intf->rsp_prod += len;
+ out:
+	if (done) {
+		xen_mb();
+		intf->rsp_prod = prod;
 
-	xenevtchn_notify(xce_handle, conn->domain->port);
+		xenevtchn_notify(xce_handle, conn->domain->port);
+	}
 
-	return len;
+	return done;
 }
 
 static int readchn(struct connection *conn, void *data, unsigned int len)
@@ -216,7 +238,7 @@ static bool domain_can_read(struct connection *conn)
 }
 
 static const struct interface_funcs domain_funcs = {
-	.write = writechn,
+	.writev = writechn,
 	.read = readchn,
 	.can_write = domain_can_write,
 	.can_read = domain_can_read,
@@ -238,19 +260,17 @@ static int domain_tree_remove_sub(const void *ctx, struct connection *conn,
 				  struct node *node, void *arg)
 {
 	struct domain *domain = arg;
-	TDB_DATA key;
 	int ret = WALK_TREE_OK;
 
 	if (node->perms.p[0].id != domain->domid)
 		return WALK_TREE_OK;
 
 	if (keep_orphans) {
-		set_tdb_key(node->name, &key);
 		domain->nbentry--;
 		node->perms.p[0].id = priv_domid;
 		node->acc.memory = 0;
 		domain_nbentry_inc(NULL, priv_domid);
-		if (write_node_raw(NULL, &key, node, true)) {
+		if (write_node_raw(NULL, node->name, node, true)) {
 			/* That's unfortunate. We only can try to continue. */
 			syslog(LOG_ERR,
 			       "error when moving orphaned node %s to dom0\n",
@@ -40,7 +40,7 @@
  * Some notes regarding detection and handling of transaction conflicts:
  *
  * Basic source of reference is the 'generation' count. Each writing access
- * (either normal write or in a transaction) to the tdb data base will set
+ * (either normal write or in a transaction) to the data base will set
  * the node specific generation count to the global generation count.
  * For being able to identify a transaction the transaction specific generation
  * count is initialized with the global generation count when starting the
@@ -188,20 +188,17 @@ static char *transaction_get_node_name(void *ctx, struct transaction *trans,
  * Prepend the transaction to name if node has been modified in the current
  * transaction.
  */
-void transaction_prepend(struct connection *conn, const char *name,
-			 TDB_DATA *key)
+const char *transaction_prepend(struct connection *conn, const char *name)
 {
 	struct accessed_node *i;
 
 	if (conn && conn->transaction) {
 		i = find_accessed_node(conn->transaction, name);
-		if (i) {
-			set_tdb_key(i->trans_name, key);
-			return;
-		}
+		if (i)
+			return i->trans_name;
 	}
 
-	set_tdb_key(name, key);
+	return name;
 }
 
 /*
@@ -211,19 +208,20 @@ void transaction_prepend(struct connection *conn, const char *name,
  * node->generation).
  *
  * Accesses in a transaction will be added to the list of accessed nodes
- * if not already done. Read type accesses will copy the node to the
- * transaction specific data base part, write type accesses go there
- * anyway.
+ * if not already done. Read type accesses will add the node's record to the
+ * transaction specific data base part (sharing it with the global data base,
+ * not copying it), write type accesses go there anyway.
  *
- * If not NULL, key will be supplied with name and length of name of the node
- * to be accessed in the data base.
+ * If not NULL, db_name will be set to the name of the node to be accessed in
+ * the data base.
  */
 int access_node(struct connection *conn, struct node *node,
-		enum node_access_type type, TDB_DATA *key)
+		enum node_access_type type, const char **db_name)
 {
 	struct accessed_node *i = NULL;
 	struct transaction *trans;
-	TDB_DATA local_key;
+	const struct xs_tdb_record_hdr *hdr;
+	size_t size;
 	int ret;
 	bool introduce = false;
 
@@ -235,8 +233,8 @@ int access_node(struct connection *conn, struct node *node,
 
 	if (!conn || !conn->transaction) {
 		/* They're changing the global database. */
-		if (key)
-			set_tdb_key(node->name, key);
+		if (db_name)
+			*db_name = node->name;
 		return 0;
 	}
 
@@ -268,7 +266,7 @@ int access_node(struct connection *conn, struct node *node,
 
 		introduce = true;
 		i->ta_node = false;
-		/* acc.memory < 0 means "unknown, get size from TDB". */
+		/* acc.memory < 0 means "unknown, get size from data base". */
 		node->acc.memory = -1;
 
 		/*
@@ -282,8 +280,10 @@ int access_node(struct connection *conn, struct node *node,
 			i->generation = node->generation;
 			i->check_gen = true;
 			if (node->generation != NO_GENERATION) {
-				set_tdb_key(i->trans_name, &local_key);
-				ret = write_node_raw(conn, &local_key, node, true);
+				hdr = db_fetch(node->name, &size);
+				ret = hdr ? db_write(conn, i->trans_name, hdr,
+						     size, &node->acc, true)
+					  : errno;
 				if (ret)
 					goto err;
 				i->ta_node = true;
@@ -300,8 +300,8 @@ int access_node(struct connection *conn, struct node *node,
 		/* Nothing to delete. */
 		return -1;
 
-	if (key) {
-		set_tdb_key(i->trans_name, key);
+	if (db_name) {
+		*db_name = i->trans_name;
 		if (type == NODE_ACCESS_WRITE)
 			i->ta_node = true;
 		if (type == NODE_ACCESS_DELETE)
@@ -353,22 +353,15 @@ static int finalize_transaction(struct connection *conn,
 				struct transaction *trans, bool *is_corrupt)
 {
 	struct accessed_node *i, *n;
-	TDB_DATA key, ta_key, data;
-	struct xs_tdb_record_hdr *hdr;
+	const struct xs_tdb_record_hdr *hdr;
+	struct xs_tdb_record_hdr *data;
+	size_t size;
 	uint64_t gen;
 
 	list_for_each_entry_safe(i, n, &trans->accessed, list) {
 		if (i->check_gen) {
-			set_tdb_key(i->node, &key);
-			data = tdb_fetch(tdb_ctx, key);
-			hdr = (void *)data.dptr;
-			if (!data.dptr) {
-				if (tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)
-					return EIO;
-				gen = NO_GENERATION;
-			} else
-				gen = hdr->generation;
-			talloc_free(data.dptr);
+			hdr = db_fetch(i->node, &size);
+			gen = hdr ? hdr->generation : NO_GENERATION;
 			if (i->generation != gen)
 				return EAGAIN;
 		}
@@ -376,8 +369,7 @@ static int finalize_transaction(struct connection *conn,
 		/* Entries for unmodified nodes can be removed early. */
 		if (!i->modified) {
 			if (i->ta_node) {
-				set_tdb_key(i->trans_name, &ta_key);
-				if (do_tdb_delete(conn, &ta_key, NULL))
+				if (db_delete(conn, i->trans_name, NULL))
 					return EIO;
 			}
 			list_del(&i->list);
@@ -386,17 +378,15 @@ static int finalize_transaction(struct connection *conn,
 	}
 
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
-		set_tdb_key(i->node, &key);
 		if (i->ta_node) {
-			set_tdb_key(i->trans_name, &ta_key);
-			data = tdb_fetch(tdb_ctx, ta_key);
-			if (data.dptr) {
-				hdr = (void *)data.dptr;
-				hdr->generation = ++generation;
-				*is_corrupt |= do_tdb_write(conn, &key, &data,
-							    NULL, true);
-				talloc_free(data.dptr);
-				if (do_tdb_delete(conn, &ta_key, NULL))
+			hdr = db_fetch(i->trans_name, &size);
+			/* The record might be shared, so modify a copy. */
+			data = hdr ? talloc_memdup(i, hdr, size) : NULL;
+			if (data) {
+				data->generation = ++generation;
+				*is_corrupt |= db_write(conn, i->node, data,
+							size, NULL, true);
+				if (db_delete(conn, i->trans_name, NULL))
 					*is_corrupt = true;
 			} else {
 				*is_corrupt = true;
@@ -409,7 +399,7 @@ static int finalize_transaction(struct connection *conn,
 			 */
 			*is_corrupt |= (i->generation == NO_GENERATION)
 				       ? false
-				       : do_tdb_delete(conn, &key, NULL);
+				       : db_delete(conn, i->node, NULL);
 		}
 		if (i->fire_watch)
 			fire_watches(conn, trans, i->node, NULL, i->watch_exact,
@@ -426,15 +416,12 @@ static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
 	struct accessed_node *i;
-	TDB_DATA key;
 
 	wrl_ntransactions--;
 	trace_destroy(trans, "transaction");
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
-		if (i->ta_node) {
-			set_tdb_key(i->trans_name, &key);
-			do_tdb_delete(trans->conn, &key, NULL);
-		}
+		if (i->ta_node)
+			db_delete(trans->conn, i->trans_name, NULL);
 		list_del(&i->list);
 		talloc_free(i);
 	}
@@ -456,6 +443,58 @@ struct transaction *transaction_lookup(struct connection *conn, uint32_t id)
 	return ERR_PTR(-ENOENT);
 }
 
+static struct transaction *transaction_alloc(const void *ctx,
+					     struct connection *conn)
+{
+	struct transaction *trans;
+
+	trans = talloc_zero(ctx, struct transaction);
+	if (!trans)
+		return NULL;
+
+	trace_create(trans, "transaction");
+	INIT_LIST_HEAD(&trans->accessed);
+	INIT_LIST_HEAD(&trans->changed_domains);
+	trans->conn = conn;
+	trans->fail = false;
+	trans->generation = ++generation;
+	talloc_set_destructor(trans, destroy_transaction);
+	wrl_ntransactions++;
+
+	return trans;
+}
+
+struct transaction *transaction_start_implicit(const void *ctx,
+					       struct connection *conn)
+{
+	return transaction_alloc(ctx, conn);
+}
+
+int transaction_commit(struct connection *conn, struct transaction *trans)
+{
+	bool is_corrupt = false;
+	int ret;
+
+	if (trans->fail)
+		return ENOMEM;
+	ret = acc_fix_domains(&trans->changed_domains, false);
+	if (ret)
+		return ret;
+	ret = finalize_transaction(conn, trans, &is_corrupt);
+	if (ret)
+		return ret;
+
+	wrl_apply_debit_trans_commit(conn);
+
+	/* fix domain entry for each changed domain */
+	acc_fix_domains(&trans->changed_domains, true);
+
+	if (is_corrupt)
+		corrupt(conn, "transaction inconsistency");
+
+	return 0;
+}
+
 int do_transaction_start(const void *ctx, struct connection *conn,
 			 struct buffered_data *in)
 {
@@ -471,17 +510,10 @@ int do_transaction_start(const void *ctx, struct connection *conn,
 		return ENOSPC;
 
 	/* Attach transaction to ctx for autofree until it's complete */
-	trans = talloc_zero(ctx, struct transaction);
+	trans = transaction_alloc(ctx, conn);
 	if (!trans)
 		return ENOMEM;
 
-	trace_create(trans, "transaction");
-	INIT_LIST_HEAD(&trans->accessed);
-	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->conn = conn;
-	trans->fail = false;
-	trans->generation = ++generation;
-
 	/* Pick an unused transaction identifier. */
 	do {
 		trans->id = conn->next_transaction_id;
@@ -491,11 +523,9 @@ int do_transaction_start(const void *ctx, struct connection *conn,
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
-	talloc_set_destructor(trans, destroy_transaction);
 	if (!conn->transaction_started)
 		conn->ta_start_time = time(NULL);
 	conn->transaction_started++;
-	wrl_ntransactions++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
 	send_reply(conn, XS_TRANSACTION_START, id_str, strlen(id_str)+1);
@@ -508,7 +538,6 @@ int do_transaction_end(const void *ctx, struct connection *conn,
 {
 	const char *arg = onearg(in);
 	struct transaction *trans;
-	bool is_corrupt = false;
 	int ret;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F")))
@@ -527,22 +556,9 @@ int do_transaction_end(const void *ctx, struct connection *conn,
 	talloc_steal(ctx, trans);
 
 	if (streq(arg, "T")) {
-		if (trans->fail)
-			return ENOMEM;
-		ret = acc_fix_domains(&trans->changed_domains, false);
-		if (ret)
-			return ret;
-		ret = finalize_transaction(conn, trans, &is_corrupt);
+		ret = transaction_commit(conn, trans);
 		if (ret)
 			return ret;
-
-		wrl_apply_debit_trans_commit(conn);
-
-		/* fix domain entry for each changed domain */
-		acc_fix_domains(&trans->changed_domains, true);
-
-		if (is_corrupt)
-			corrupt(conn, "transaction inconsistency");
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 
@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <syslog.h>
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
@@ -30,15 +31,24 @@
 #include "utils.h"
 #include "xenstored_domain.h"
 #include "xenstored_transaction.h"
+#include "hashtable.h"
 
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches of all connections on the same node. */
+	struct list_head node_list;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
+	struct connection *conn;
+
+	/* Creation order, for firing a connection's watches in order. */
+	uint64_t seq;
+
 	/* Offset into path for skipping prefix (used for relative paths). */
 	unsigned int prefix_len;
 
@@ -46,22 +56,103 @@ struct watch
 	char *node;
 };
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+/* All watches on a node, indexed by the node's path in watch_index. */
+struct watch_node
 {
-	unsigned int len = strlen(parent);
+	char *path;
+	struct list_head watches;
+};
 
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
+static struct hashtable *watch_index;
+static uint64_t watch_seq;
+
+static int watch_index_add(struct watch *watch)
+{
+	struct watch_node *wn;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(NULL, 64, hash_from_key_fn,
+					       keys_equal_fn, 0);
+		if (!watch_index)
+			return ENOMEM;
+	}
+
+	wn = hashtable_search(watch_index, watch->node);
+	if (!wn) {
+		wn = talloc(watch_index, struct watch_node);
+		if (!wn)
+			return ENOMEM;
+		wn->path = talloc_strdup(wn, watch->node);
+		INIT_LIST_HEAD(&wn->watches);
+		if (!wn->path || !hashtable_insert(watch_index, wn->path, wn)) {
+			talloc_free(wn);
+			return ENOMEM;
+		}
+	}
+
+	list_add_tail(&watch->node_list, &wn->watches);
+
+	return 0;
+}
+
+static void watch_index_del(struct watch *watch)
+{
+	struct watch_node *wn;
+
+	if (list_empty(&watch->node_list))
+		return;
+
+	list_del(&watch->node_list);
+
+	wn = hashtable_search(watch_index, watch->node);
+	if (wn && list_empty(&wn->watches)) {
+		hashtable_remove(watch_index, wn->path);
+		talloc_free(wn);
+	}
+}
+
+struct watch_matches
+{
+	struct watch **watches;
+	unsigned int nr, max;
+};
+
+/* Add all watches on a node to the set of watches to fire. */
+static bool add_watch_matches(const void *ctx, struct watch_matches *m,
+			      const char *path)
+{
+	struct watch_node *wn = hashtable_search(watch_index, path);
+	struct watch *watch;
+	struct watch **new;
+
+	if (!wn)
 		return true;
 
-	if (strncmp(child, parent, len) != 0)
-		return false;
+	list_for_each_entry(watch, &wn->watches, node_list) {
+		if (m->nr == m->max) {
+			m->max = m->max ? m->max * 2 : 16;
+			new = talloc_realloc(ctx, m->watches, struct watch *,
+					     m->max);
+			if (!new)
+				return false;
+			m->watches = new;
+		}
+		m->watches[m->nr++] = watch;
+	}
+
+	return true;
+}
+
+/* Group watches by connection, each connection's in creation order. */
+static int cmp_watch_matches(const void *a, const void *b)
+{
+	const struct watch *wa = *(struct watch * const *)a;
+	const struct watch *wb = *(struct watch * const *)b;
+
+	if (wa->conn != wb->conn)
+		return (uintptr_t)wa->conn < (uintptr_t)wb->conn ? -1 : 1;
 
-	return child[len] == '/' || child[len] == '\0';
+	return wa->seq < wb->seq ? -1 : wa->seq > wb->seq;
 }
 
 static const char *get_watch_path(const struct watch *watch, const char *name)
@@ -124,9 +215,13 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
 void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		  struct node *node, bool exact, struct node_perms *perms)
 {
-	struct connection *i;
+	struct connection *i = NULL;
 	struct buffered_data *req;
+	struct watch_matches m = { };
 	struct watch *watch;
+	char *path, *slash;
+	bool permitted = false;
+	unsigned int w;
 
 	/* During transactions, don't fire watches, but queue them. */
 	if (conn && conn->transaction) {
@@ -134,31 +229,60 @@ void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		return;
 	}
 
+	if (!watch_index)
+		return;
+
 	req = domain_is_unprivileged(conn) ? conn->in : NULL;
 
+	/*
+	 * Look up the watches on the node itself, and unless exact, those on
+	 * each of its parents up to the root.
+	 */
+	if (!add_watch_matches(ctx, &m, name))
+		goto nomem;
+
+	if (!exact) {
+		path = talloc_strdup(ctx, name);
+		if (!path)
+			goto nomem;
+
+		while ((slash = strrchr(path, '/')) && slash != path) {
+			*slash = '\0';
+			if (!add_watch_matches(ctx, &m, path))
+				goto nomem;
+		}
+
+		if (!streq(name, "/") && !add_watch_matches(ctx, &m, "/"))
+			goto nomem;
+	}
+
+	qsort(m.watches, m.nr, sizeof(*m.watches), cmp_watch_matches);
+
 	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		if (!watch_permitted(i, ctx, name, node, perms))
-			continue;
-
-		list_for_each_entry(watch, &i->watches, list) {
-			if (exact) {
-				if (streq(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			} else {
-				if (is_child(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			}
+	for (w = 0; w < m.nr; w++) {
+		watch = m.watches[w];
+
+		if (watch->conn != i) {
+			i = watch->conn;
+			permitted = watch_permitted(i, ctx, name, node, perms);
 		}
+
+		if (permitted)
+			send_event(req, i, get_watch_path(watch, name),
+				   watch->token);
 	}
+
+	talloc_free(m.watches);
+	return;
+
+ nomem:
+	log("fire_watches: ENOMEM firing watches for %s", name);
+	talloc_free(m.watches);
 }
 
 static int destroy_watch(void *_watch)
 {
+	watch_index_del(_watch);
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -195,6 +319,7 @@ static struct watch *add_watch(struct connection *conn, char *path, char *token,
 	watch = talloc(conn, struct watch);
 	if (!watch)
 		goto nomem;
+	INIT_LIST_HEAD(&watch->node_list);
 	watch->node = talloc_strdup(watch, path);
 	watch->token = talloc_strdup(watch, token);
 	if (!watch->node || !watch->token)
@@ -204,12 +329,19 @@ static struct watch *add_watch(struct connection *conn, char *path, char *token,
 		goto nomem;
 
 	watch->prefix_len = relative ? strlen(get_implicit_path(conn)) + 1 : 0;
+	watch->conn = conn;
+	watch->seq = watch_seq++;
 
 	INIT_LIST_HEAD(&watch->events);
 
+	if (watch_index_add(watch)) {
+		domain_memory_add_nochk(conn->id, -strlen(path) - strlen(token));
+		goto nomem;
+	}
+
+	talloc_set_destructor(watch, destroy_watch);
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
-	talloc_set_destructor(watch, destroy_watch);
 
 	return watch;
 
@@ -26,6 +26,7 @@
 #include <ctype.h>
 #include <poll.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -48,6 +49,9 @@ do {                                                            \
 /* sleep for this long (milliseconds) between checking the trace buffers */
 #define POLL_SLEEP_MILLIS 100
 
+/* Number of iovecs gathered before writing them out (IOV_MAX on Linux/BSD) */
+#define WRITE_BATCH_IOVS 1024
+
 #define DEFAULT_TBUF_SIZE 32
 /***** The code **************************************************************/
 
@@ -62,7 +66,8 @@ typedef struct settings_st {
     unsigned long memory_buffer;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        merge:1;
 } settings_t;
 
 struct t_struct {
@@ -332,97 +337,385 @@ fail:
     return;
 }
 
+/*
+ * Output to file is gathered into a batch of iovecs pointing straight at the
+ * mapped trace buffers, and written out with writev() once per pass over the
+ * buffers, or when the batch fills up.  A buffer window must not be released
+ * to Xen until batch_flush() has written it out: batch_release() queues the
+ * release, which happens as soon as the window's last iovec is written.
+ */
+static struct {
+    struct iovec iov[WRITE_BATCH_IOVS];
+    /* cpu_change records, indexed by the iovec slot pointing at them */
+    struct cpu_change_record rec[WRITE_BATCH_IOVS];
+    unsigned int nr;
+    unsigned long size;
+    /*
+     * Windows to release, in iovec order.  Each ends with at least one
+     * iovec of the batch, so there are never more than iovecs.
+     */
+    struct {
+        struct t_buf *meta;
+        unsigned long cons;
+        unsigned int end;   /* Number of iovecs to write before release. */
+    } rel[WRITE_BATCH_IOVS];
+    unsigned int nr_rel;
+} wbatch;
+
+static void check_disk_space(unsigned long size)
+{
+    struct statvfs stat;
+    unsigned long long freespace;
+
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs (outfd, &stat) )
+    {
+        fprintf(stderr, "Statfs failed!\n");
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
+
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
+    freespace >>= 20; /* Convert to MB */
+
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
+    }
+}
+
+/* Release the windows whose iovecs are among the first @done written. */
+static void batch_release_written(unsigned int done, unsigned int *released)
+{
+    if ( *released == wbatch.nr_rel || wbatch.rel[*released].end > done )
+        return;
+
+    xen_mb(); /* read buffer, then update cons. */
+    for ( ; *released < wbatch.nr_rel && wbatch.rel[*released].end <= done;
+          ++*released )
+        wbatch.rel[*released].meta->cons = wbatch.rel[*released].cons;
+}
+
+static void batch_flush(void)
+{
+    struct iovec *iov = wbatch.iov;
+    unsigned int nr = wbatch.nr, released = 0;
+    ssize_t written;
+
+    if ( nr == 0 )
+        return;
+
+    if ( opts.disk_rsvd != 0 )
+        check_disk_space(wbatch.size);
+
+    while ( nr )
+    {
+        written = writev(outfd, iov, nr);
+        if ( written < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            fprintf(stderr, "Write failed! (size %lu)\n", wbatch.size);
+            PERROR("Failed to write trace data");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Skip over what was written, and retry the remainder. */
+        while ( nr && written >= iov->iov_len )
+        {
+            written -= iov->iov_len;
+            iov++;
+            nr--;
+        }
+        if ( nr )
+        {
+            iov->iov_base += written;
+            iov->iov_len -= written;
+        }
+
+        batch_release_written(wbatch.nr - nr, &released);
+    }
+
+    wbatch.nr = 0;
+    wbatch.size = 0;
+    wbatch.nr_rel = 0;
+}
+
+static void batch_add(void *start, unsigned long size)
+{
+    if ( wbatch.nr == WRITE_BATCH_IOVS )
+        batch_flush();
+
+    wbatch.iov[wbatch.nr].iov_base = start;
+    wbatch.iov[wbatch.nr].iov_len = size;
+    wbatch.nr++;
+    wbatch.size += size;
+}
+
+static void batch_add_cpu_change(unsigned int cpu, unsigned long window_size)
+{
+    struct cpu_change_record *rec;
+
+    if ( wbatch.nr == WRITE_BATCH_IOVS )
+        batch_flush();
+
+    rec = &wbatch.rec[wbatch.nr];
+    rec->header = CPU_CHANGE_HEADER;
+    rec->data.cpu = cpu;
+    rec->data.window_size = window_size;
+
+    batch_add(rec, sizeof(*rec));
+}
+
+/* Release a window to Xen once all of it has been written. */
+static void batch_release(struct t_buf *meta, unsigned long cons)
+{
+    /* Copied out to the memory buffer already. */
+    if ( opts.memory_buffer )
+    {
+        xen_mb(); /* read buffer, then update cons. */
+        meta->cons = cons;
+        return;
+    }
+
+    wbatch.rel[wbatch.nr_rel].meta = meta;
+    wbatch.rel[wbatch.nr_rel].cons = cons;
+    wbatch.rel[wbatch.nr_rel].end = wbatch.nr;
+    wbatch.nr_rel++;
+}
+
 /**
  * write_buffer - write a section of the trace buffer
  * @cpu      - source buffer CPU ID
  * @start
  * @size     - size of write (may be less than total window size)
  * @total_size - total size of the window (0 on 2nd write of wrapped windows)
- * @out      - output stream
  *
- * Outputs the trace buffer to a filestream, prepending the CPU and size
- * of the buffer write.
+ * Outputs the trace buffer to the memory buffer, or adds it to the write
+ * batch, prepending the CPU and size of the buffer write.
  */
 static void write_buffer(unsigned int cpu, unsigned char *start, int size,
                          int total_size)
 {
-    struct statvfs stat;
-    size_t written = 0;
-    
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
+    /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
+     * windows may involve two writes, so only write the record on the
+     * first write. */
+    if ( total_size != 0 )
     {
-        unsigned long long freespace;
+        if ( opts.memory_buffer )
+            membuf_reserve_window(cpu, total_size);
+        else
+            batch_add_cpu_change(cpu, total_size);
+    }
 
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
+    if ( opts.memory_buffer )
+        membuf_write(start, size);
+    else
+        batch_add(start, size);
+}
 
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+/*
+ * Merging of the records of all CPUs into a single stream, in TSC order.
+ *
+ * Windows are copied out of the trace buffers as soon as they are read,
+ * so that the buffers are released to Xen without waiting for the merge.
+ * Records produced after a pass over the buffers carry TSCs later than the
+ * start of that pass, hence later than anything read in the pass before.
+ * Each pass therefore emits the records up to the highest TSC seen before
+ * it started, and holds the others back for the next pass.  Records
+ * without a TSC take the one of the record before them on the same CPU.
+ */
+struct merge_cpu {
+    unsigned char *buf;     /* records copied out of the trace buffer */
+    unsigned long head;     /* offset of the next record to emit */
+    unsigned long tail;     /* offset past the last record */
+    unsigned long size;
+    uint64_t head_tsc;      /* TSC of the record at head */
+    uint64_t last_tsc;      /* TSC of the record before head */
+    uint64_t tail_tsc;      /* TSC of the record before tail */
+};
 
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+static struct {
+    struct merge_cpu *cpu;
+    unsigned int num;
+    unsigned int *heap;     /* CPUs with records to emit, by head_tsc */
+    unsigned int nr_heap;
+    uint64_t seen_tsc;      /* highest TSC read in previous passes */
+} merge;
+
+static unsigned int rec_size(const struct t_rec *rec)
+{
+    return sizeof(uint32_t) *
+           (1 + rec->extra_u32 + (rec->cycles_included ? 2 : 0));
+}
+
+static uint64_t rec_tsc(const struct t_rec *rec, uint64_t prev_tsc)
+{
+    if ( !rec->cycles_included )
+        return prev_tsc;
 
-        freespace >>= 20; /* Convert to MB */
+    return ((uint64_t)rec->u.cycles.cycles_hi << 32) |
+           rec->u.cycles.cycles_lo;
+}
+
+static void merge_init(unsigned int num)
+{
+    merge.cpu = calloc(num, sizeof(*merge.cpu));
+    merge.heap = calloc(num, sizeof(*merge.heap));
+    if ( merge.cpu == NULL || merge.heap == NULL )
+    {
+        PERROR("Failed to allocate memory for merging");
+        exit(EXIT_FAILURE);
+    }
+    merge.num = num;
+}
 
-        if ( freespace <= opts.disk_rsvd )
+/*
+ * Copy a chunk of a CPU's window, dropping the padding records Xen inserts
+ * at the end of the buffer.
+ */
+static void merge_append(unsigned int cpu, const unsigned char *start,
+                         unsigned long size)
+{
+    struct merge_cpu *mc = &merge.cpu[cpu];
+    unsigned long offset = 0;
+
+    /* Move what is left from the previous pass to the front. */
+    if ( mc->head )
+    {
+        memmove(mc->buf, mc->buf + mc->head, mc->tail - mc->head);
+        mc->tail -= mc->head;
+        mc->head = 0;
+    }
+
+    if ( mc->size - mc->tail < size )
+    {
+        unsigned char *buf = realloc(mc->buf, mc->tail + size);
+
+        if ( buf == NULL )
         {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
+            PERROR("Failed to allocate memory for merging");
+            exit(EXIT_FAILURE);
         }
+        mc->buf = buf;
+        mc->size = mc->tail + size;
     }
 
-    /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
-     * windows may involve two writes, so only write the record on the
-     * first write. */
-    if ( total_size != 0 )
+    while ( offset < size )
     {
-        if ( opts.memory_buffer )
+        const struct t_rec *rec = (const struct t_rec *)(start + offset);
+        unsigned int len = rec_size(rec);
+
+        if ( len > size - offset )
         {
-            membuf_reserve_window(cpu, total_size);
+            fprintf(stderr, "%s: record overruns the window on cpu %u!\n",
+                    __func__, cpu);
+            exit(EXIT_FAILURE);
         }
-        else
-        {
-            struct cpu_change_record rec;
-
-            rec.header = CPU_CHANGE_HEADER;
-            rec.data.cpu = cpu;
-            rec.data.window_size = total_size;
 
-            written = write(outfd, &rec, sizeof(rec));
-            if ( written != sizeof(rec) )
-            {
-                fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
-                        written);
-                goto fail;
-            }
+        if ( rec->event != TRC_TRACE_WRAP_BUFFER )
+        {
+            memcpy(mc->buf + mc->tail, rec, len);
+            mc->tail += len;
+            mc->tail_tsc = rec_tsc(rec, mc->tail_tsc);
         }
+
+        offset += len;
     }
+}
 
-    if ( opts.memory_buffer )
+static void merge_peek(struct merge_cpu *mc)
+{
+    mc->head_tsc = rec_tsc((const struct t_rec *)(mc->buf + mc->head),
+                           mc->last_tsc);
+}
+
+static int merge_before(unsigned int a, unsigned int b)
+{
+    return merge.cpu[a].head_tsc < merge.cpu[b].head_tsc ||
+           (merge.cpu[a].head_tsc == merge.cpu[b].head_tsc && a < b);
+}
+
+static void merge_sift_down(unsigned int i)
+{
+    unsigned int *heap = merge.heap;
+
+    for ( ; ; )
     {
-        membuf_write(start, size);
+        unsigned int min = i, l = 2 * i + 1, r = l + 1, tmp;
+
+        if ( l < merge.nr_heap && merge_before(heap[l], heap[min]) )
+            min = l;
+        if ( r < merge.nr_heap && merge_before(heap[r], heap[min]) )
+            min = r;
+        if ( min == i )
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
     }
-    else
+}
+
+/**
+ * merge_emit - write out merged records
+ * @limit: highest TSC which may be written out
+ *
+ * Writes out runs of records from the CPU with the oldest record, as long
+ * as they are older than the oldest record of any other CPU.
+ */
+static void merge_emit(uint64_t limit)
+{
+    unsigned int i;
+
+    merge.nr_heap = 0;
+    for ( i = 0; i < merge.num; i++ )
     {
-        written = write(outfd, start, size);
-        if ( written != size )
-        {
-            fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
-                    size, written);
-            goto fail;
-        }
+        struct merge_cpu *mc = &merge.cpu[i];
+
+        if ( mc->head == mc->tail )
+            continue;
+
+        merge_peek(mc);
+        merge.heap[merge.nr_heap++] = i;
     }
 
-    return;
+    for ( i = merge.nr_heap / 2; i-- > 0; )
+        merge_sift_down(i);
 
-fail:
-    PERROR("Failed to write trace data");
-    exit(EXIT_FAILURE);
+    while ( merge.nr_heap )
+    {
+        unsigned int cpu = merge.heap[0];
+        struct merge_cpu *mc = &merge.cpu[cpu];
+        unsigned long start = mc->head;
+        uint64_t bound = limit;
+
+        if ( mc->head_tsc > limit )
+            break;
+
+        /* The next oldest CPU is one of the root's children. */
+        for ( i = 1; i <= 2 && i < merge.nr_heap; i++ )
+            if ( merge.cpu[merge.heap[i]].head_tsc < bound )
+                bound = merge.cpu[merge.heap[i]].head_tsc;
+
+        do {
+            mc->head += rec_size((const struct t_rec *)(mc->buf + mc->head));
+            mc->last_tsc = mc->head_tsc;
+            if ( mc->head == mc->tail )
+                break;
+            merge_peek(mc);
+        } while ( mc->head_tsc <= bound );
+
+        write_buffer(cpu, mc->buf + start, mc->head - start,
+                     mc->head - start);
+
+        if ( mc->head == mc->tail )
+            merge.heap[0] = merge.heap[--merge.nr_heap];
+        merge_sift_down(0);
+    }
 }
 
 static void disable_tbufs(void)
@@ -626,7 +919,8 @@ static void event_init(void)
 
 /**
  * wait_for_event_or_timeout - sleep for the specified number of milliseconds,
- *                             or until an VIRQ_TBUF event occurs
+ *                             or until an VIRQ_TBUF event occurs.  With 0
+ *                             milliseconds, only wait for the event.
  */
 static void wait_for_event_or_timeout(unsigned long milliseconds)
 {
@@ -635,7 +929,7 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
                          .events = POLLIN | POLLERR };
     int port;
 
-    rc = poll(&fd, 1, milliseconds);
+    rc = poll(&fd, 1, milliseconds ? milliseconds : -1);
     if (rc == -1) {
         if (errno == EINTR)
             return;
@@ -706,6 +1000,9 @@ static int monitor_tbufs(void)
     meta = tbufs->meta;
     data = tbufs->data;
 
+    if ( opts.merge )
+        merge_init(num);
+
     if ( opts.discard )
         for ( i = 0; i < num; i++ )
             if ( meta[i] )
@@ -714,6 +1011,14 @@ static int monitor_tbufs(void)
     /* now, scan buffers for events */
     while ( 1 )
     {
+        /*
+         * Xen only signals VIRQ_TBUF when a buffer goes past its high water
+         * mark (half full), which it can't while it holds more than that.
+         * Scan again straight away in that case.
+         */
+        int busy = 0;
+        uint64_t limit = merge.seen_tsc;
+
         for ( i = 0; i < num; i++ )
         {
             unsigned long start_offset, end_offset, window_size, cons, prod;
@@ -741,9 +1046,32 @@ static int monitor_tbufs(void)
             assert(window_size > 0);
             assert(window_size <= data_size);
 
+            if ( window_size >= data_size / 2 )
+                busy = 1;
+
             start_offset = cons % data_size;
             end_offset = prod % data_size;
 
+            if ( opts.merge )
+            {
+                /* Copy the window out, and release it straight away. */
+                if ( end_offset > start_offset )
+                    merge_append(i, data[i] + start_offset, window_size);
+                else
+                {
+                    merge_append(i, data[i] + start_offset,
+                                 data_size - start_offset);
+                    merge_append(i, data[i], end_offset);
+                }
+
+                if ( merge.cpu[i].tail_tsc > merge.seen_tsc )
+                    merge.seen_tsc = merge.cpu[i].tail_tsc;
+
+                xen_mb(); /* read buffer, then update cons. */
+                meta[i]->cons = prod;
+                continue;
+            }
+
             if ( end_offset > start_offset )
             {
                 /* If window does not wrap, write in one big chunk */
@@ -765,11 +1093,15 @@ static int monitor_tbufs(void)
                              0);
             }
 
-            xen_mb(); /* read buffer, then update cons. */
-            meta[i]->cons = prod;
-
+            batch_release(meta[i], prod);
         }
 
+        /* On the last pass, write out everything that is left. */
+        if ( opts.merge )
+            merge_emit(last_read ? limit : UINT64_MAX);
+
+        batch_flush();
+
         if ( interrupted )
         {
             if ( last_read )
@@ -784,7 +1116,8 @@ static int monitor_tbufs(void)
                 break;
         }
 
-        wait_for_event_or_timeout(opts.poll_sleep);
+        if ( !busy )
+            wait_for_event_or_timeout(opts.poll_sleep);
     }
 
     if ( opts.memory_buffer )
@@ -821,7 +1154,9 @@ static void usage(void)
 "  -e, --evt-mask=e        Set evt-mask\n" \
 "  -s, --poll-sleep=p      Set sleep time, p, in milliseconds between\n" \
 "                          polling the trace buffer for new data\n" \
-"                          (default " xstr(POLL_SLEEP_MILLIS) ").\n" \
+"                          (default " xstr(POLL_SLEEP_MILLIS) ").  With 0,\n" \
+"                          only wait for Xen to signal a buffer getting\n" \
+"                          half full.\n" \
 "  -S, --trace-buf-size=N  Set trace buffer size in pages (default " \
                            xstr(DEFAULT_TBUF_SIZE) ").\n" \
 "                          N.B. that the trace buffer cannot be resized.\n" \
@@ -845,6 +1180,10 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -m  --merge             Merge the records of all CPUs into a single stream\n" \
+"                          ordered by TSC, which must be synchronised across\n" \
+"                          CPUs.  Records are held back until the following\n" \
+"                          poll of the trace buffers.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -1093,12 +1432,13 @@ static void parse_args(int argc, char **argv)
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
+        { "merge",          no_argument,       0, 'm' },
         { "help",           no_argument,       0, '?' },
         { "version",        no_argument,       0, 'V' },
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxXm?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1139,6 +1479,10 @@ static void parse_args(int argc, char **argv)
             opts.start_disabled = 1;
             break;
 
+        case 'm': /* Merge CPUs in TSC order */
+            opts.merge = 1;
+            break;
+
         case 'T':
             opts.timeout = argtol(optarg, 0);
             break;
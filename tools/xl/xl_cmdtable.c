@@ -174,7 +174,10 @@ const struct cmd_spec cmd_table[] = {
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
       "-p              Do not unpause domain after migrating it.\n"
-      "-D              Preserve the domain id"
+      "-D              Preserve the domain id\n"
+      "--workers=N     Prepare page data with N threads.\n"
+      "--encode=<list> Encode page data: zero, delta and/or compress.\n"
+      "--adaptive      Finish precopy based on the expected downtime."
     },
     { "restore",
       &main_restore, 0, 1,
@@ -178,7 +178,8 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 
 static void migrate_domain(uint32_t domid, int preserve_domid,
                            const char *rune, int debug,
-                           const char *override_config_file)
+                           const char *override_config_file,
+                           int suspend_flags)
 {
     pid_t child = -1;
     int rc;
@@ -186,7 +187,7 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
     char *away_domname;
     char rc_buf;
     uint8_t *config_data;
-    int config_len, flags = LIBXL_SUSPEND_LIVE;
+    int config_len, flags = LIBXL_SUSPEND_LIVE | suspend_flags;
 
     save_domain_core_begin(domid, preserve_domid, override_config_file,
                            &config_data, &config_len);
@@ -538,10 +539,15 @@ int main_migrate(int argc, char **argv)
     char *rune = NULL;
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
-    int preserve_domid = 0;
+    int preserve_domid = 0, suspend_flags = 0;
+    char *endptr, *tok, *saveptr;
+    unsigned long workers;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"workers", 1, 0, 0x300},
+        {"encode", 1, 0, 0x400},
+        {"adaptive", 0, 0, 0x500},
         COMMON_LONG_OPTS
     };
 
@@ -571,6 +577,32 @@ int main_migrate(int argc, char **argv)
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --workers */
+        workers = strtoul(optarg, &endptr, 10);
+        if (*endptr || workers > 255) {
+            fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+            return EXIT_FAILURE;
+        }
+        suspend_flags |= LIBXL_SUSPEND_WORKERS(workers);
+        break;
+    case 0x400: /* --encode */
+        for (tok = strtok_r(optarg, ",", &saveptr); tok;
+             tok = strtok_r(NULL, ",", &saveptr)) {
+            if (!strcmp(tok, "zero"))
+                suspend_flags |= LIBXL_SUSPEND_ENCODE_ZERO;
+            else if (!strcmp(tok, "delta"))
+                suspend_flags |= LIBXL_SUSPEND_ENCODE_DELTA;
+            else if (!strcmp(tok, "compress"))
+                suspend_flags |= LIBXL_SUSPEND_ENCODE_COMPRESS;
+            else {
+                fprintf(stderr, "Invalid encoding: %s\n", tok);
+                return EXIT_FAILURE;
+            }
+        }
+        break;
+    case 0x500: /* --adaptive */
+        suspend_flags |= LIBXL_SUSPEND_ADAPTIVE_PRECOPY;
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -602,7 +634,8 @@ int main_migrate(int argc, char **argv)
                   pause_after_migration ? " -p" : "");
     }
 
-    migrate_domain(domid, preserve_domid, rune, debug, config_filename);
+    migrate_domain(domid, preserve_domid, rune, debug, config_filename,
+                   suspend_flags);
     return EXIT_SUCCESS;
 }
 
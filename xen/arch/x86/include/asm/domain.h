@@ -186,6 +186,9 @@ struct log_dirty_domain {
     unsigned long  fault_count;
     unsigned long  dirty_count;
 
+    /* entries per vCPU dirty ring, 0 when the rings are disabled */
+    unsigned int   ring_entries;
+
     /* functions which are paging mode specific */
     const struct log_dirty_ops {
         int        (*enable  )(struct domain *d, bool log_global);
@@ -225,6 +228,10 @@ struct paging_domain {
                 unsigned long done:PADDR_BITS - PAGE_SHIFT;
                 unsigned long i4:PAGETABLE_ORDER;
                 unsigned long i3:PAGETABLE_ORDER;
+                /* Returning a pfn list rather than a bitmap. */
+                unsigned long pfn_list:1;
+                /* Number of pfns written to the list so far. */
+                unsigned long nr_pfns:PADDR_BITS - PAGE_SHIFT;
             } log_dirty;
         };
     } preempt;
@@ -252,6 +259,18 @@ struct paging_vcpu {
     unsigned int last_write_was_pt:1;
     /* HVM guest: last write emulation succeeds */
     unsigned int last_write_emul_ok:1;
+
+    /* HVM guest: ring of pages dirtied by this vCPU */
+    struct paging_dirty_ring {
+        struct xen_dirty_ring *ring;
+        struct page_info    **pg;
+        /* Private copy of the producer index. */
+        unsigned int          prod;
+        /* Entries before this one have been reset, and may be reused. */
+        unsigned int          reset;
+        /* Paused until the consumer makes room in the ring. */
+        bool                  stalled;
+    } dirty_ring;
 #endif
     /* Translated guest: virtual TLB */
     struct shadow_vtlb *vtlb;
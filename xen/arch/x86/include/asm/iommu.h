@@ -49,6 +49,7 @@ struct arch_iommu
     struct {
         struct page_list_head list;
         spinlock_t lock;
+        unsigned int nr; /* pages on the list */
     } pgtables;
 
     struct list_head identity_maps;
@@ -161,6 +161,8 @@ void paging_log_dirty_init(struct domain *d, const struct log_dirty_ops *ops);
 void paging_mark_dirty(struct domain *d, mfn_t gmfn);
 /* mark a page as dirty with taking guest pfn as parameter */
 void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn);
+/* likewise, for a page dirtied by @v while it wasn't necessarily current */
+void paging_mark_pfn_dirty_vcpu(struct vcpu *v, pfn_t pfn);
 
 /* is this guest page dirty? 
  * This is called from inside paging code, with the paging lock held. */
@@ -170,7 +172,8 @@ bool paging_mfn_is_dirty(const struct domain *d, mfn_t gmfn);
  * Log-dirty radix tree indexing:
  *   All tree nodes are PAGE_SIZE bytes, mapped on-demand.
  *   Leaf nodes are simple bitmaps; 1 bit per guest pfn.
- *   Interior nodes are arrays of LOGDIRTY_NODE_ENTRIES mfns.
+ *   Interior nodes are arrays of LOGDIRTY_NODE_ENTRIES mfns, each with a
+ *   summary bit telling whether the subtree may hold dirty bits.
  * TODO: Dynamic radix tree height. Most guests will only need 2 levels.
  *       The fourth level is basically unusable on 32-bit Xen.
  * TODO2: Abstract out the radix-tree mechanics?
@@ -197,12 +200,31 @@ struct sh_dirty_vram {
 };
 #endif
 
+#ifdef CONFIG_HVM
+/* dirty ring resource, see XENMEM_resource_dirty_ring */
+unsigned int paging_dirty_ring_max_frames(const struct domain *d);
+int paging_dirty_ring_get_frame(struct domain *d, unsigned int id,
+                                unsigned int frame, mfn_t *mfn);
+#else
+static inline unsigned int paging_dirty_ring_max_frames(const struct domain *d)
+{
+    return 0;
+}
+static inline int paging_dirty_ring_get_frame(struct domain *d,
+                                              unsigned int id,
+                                              unsigned int frame, mfn_t *mfn)
+{
+    return -EOPNOTSUPP;
+}
+#endif
+
 #else /* !PG_log_dirty */
 
 static inline void paging_log_dirty_init(struct domain *d,
                                          const struct log_dirty_ops *ops) {}
 static inline void paging_mark_dirty(struct domain *d, mfn_t gmfn) {}
 static inline void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn) {}
+static inline void paging_mark_pfn_dirty_vcpu(struct vcpu *v, pfn_t pfn) {}
 static inline bool paging_mfn_is_dirty(struct domain *d, mfn_t gmfn) { return false; }
 
 #endif /* PG_log_dirty */
@@ -127,6 +127,11 @@ PERFCOUNTER(pauseloop_exits, "vmexits from Pause-Loop Detection")
 
 PERFCOUNTER(iommu_pt_shatters,    "IOMMU page table shatters")
 PERFCOUNTER(iommu_pt_coalesces,   "IOMMU page table coalesces")
+PERFCOUNTER(iommu_pt_allocs,      "IOMMU page table allocations")
+PERFCOUNTER(iommu_pt_frees,       "IOMMU page table frees")
+
+PERFCOUNTER(dirty_ring_overflow,  "dirty ring overflows")
+PERFCOUNTER(dirty_ring_stall,     "dirty ring vCPU stalls")
 
 PERFCOUNTER(buslock, "Bus Locks Detected")
 PERFCOUNTER(vmnotify_crash, "domain crashes by Notify VM Exit")
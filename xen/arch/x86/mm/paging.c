@@ -97,6 +97,69 @@ static mfn_t paging_new_log_dirty_node(struct domain *d)
     return mfn;
 }
 
+/*
+ * Valid entries of interior nodes have LOGDIRTY_SUMMARY set while the subtree
+ * below them may hold dirty bits, allowing log-dirty operations to skip clean
+ * subtrees.  The bit is clear in any valid MFN.
+ */
+#define LOGDIRTY_SUMMARY (1UL << (PADDR_BITS - PAGE_SHIFT))
+
+static mfn_t log_dirty_entry_mfn(mfn_t e)
+{
+    return _mfn(mfn_x(e) & ~LOGDIRTY_SUMMARY);
+}
+
+static bool log_dirty_entry_summary(mfn_t e)
+{
+    return !mfn_eq(e, INVALID_MFN) && (mfn_x(e) & LOGDIRTY_SUMMARY);
+}
+
+static void log_dirty_entry_set_summary(mfn_t *e)
+{
+    if ( !mfn_eq(*e, INVALID_MFN) && !(mfn_x(*e) & LOGDIRTY_SUMMARY) )
+        *e = _mfn(mfn_x(*e) | LOGDIRTY_SUMMARY);
+}
+
+/*
+ * Get the node below an entry of an interior node, allocating it if needed,
+ * and flag the subtree as possibly holding dirty bits.
+ */
+static mfn_t log_dirty_walk_entry(struct domain *d, mfn_t *e, bool leaf)
+{
+    if ( mfn_eq(*e, INVALID_MFN) )
+    {
+        mfn_t mfn = leaf ? paging_new_log_dirty_leaf(d)
+                         : paging_new_log_dirty_node(d);
+
+        if ( mfn_eq(mfn, INVALID_MFN) )
+            return mfn;
+        *e = mfn;
+    }
+
+    log_dirty_entry_set_summary(e);
+
+    return log_dirty_entry_mfn(*e);
+}
+
+/*
+ * Whether a log-dirty operation has to visit the subtree below an entry.
+ * Cleaning operations clear the summary before visiting the subtree, so
+ * pages marked dirty while the operation is preempted set it again.  The
+ * remainder of a subtree the operation was preempted in needs visiting
+ * regardless.
+ */
+static bool log_dirty_visit_entry(mfn_t *e, bool clean, bool resumed)
+{
+    if ( mfn_eq(*e, INVALID_MFN) ||
+         (!(mfn_x(*e) & LOGDIRTY_SUMMARY) && !resumed) )
+        return false;
+
+    if ( clean )
+        *e = log_dirty_entry_mfn(*e);
+
+    return true;
+}
+
 /* get the top of the log-dirty bitmap trie */
 static mfn_t *paging_map_log_dirty_bitmap(struct domain *d)
 {
@@ -148,21 +211,22 @@ static int paging_free_log_dirty_bitmap(struct domain *d, int rc)
         if ( mfn_eq(l4[i4], INVALID_MFN) )
             continue;
 
-        l3 = map_domain_page(l4[i4]);
+        l3 = map_domain_page(log_dirty_entry_mfn(l4[i4]));
 
         for ( ; i3 < LOGDIRTY_NODE_ENTRIES; i3++ )
         {
             if ( mfn_eq(l3[i3], INVALID_MFN) )
                 continue;
 
-            l2 = map_domain_page(l3[i3]);
+            l2 = map_domain_page(log_dirty_entry_mfn(l3[i3]));
 
             for ( i2 = 0; i2 < LOGDIRTY_NODE_ENTRIES; i2++ )
                 if ( !mfn_eq(l2[i2], INVALID_MFN) )
-                    paging_free_log_dirty_page(d, l2[i2]);
+                    paging_free_log_dirty_page(d,
+                                               log_dirty_entry_mfn(l2[i2]));
 
             unmap_domain_page(l2);
-            paging_free_log_dirty_page(d, l3[i3]);
+            paging_free_log_dirty_page(d, log_dirty_entry_mfn(l3[i3]));
             l3[i3] = INVALID_MFN;
 
             if ( i3 < LOGDIRTY_NODE_ENTRIES - 1 && hypercall_preempt_check() )
@@ -177,7 +241,7 @@ static int paging_free_log_dirty_bitmap(struct domain *d, int rc)
         unmap_domain_page(l3);
         if ( rc )
             break;
-        paging_free_log_dirty_page(d, l4[i4]);
+        paging_free_log_dirty_page(d, log_dirty_entry_mfn(l4[i4]));
         l4[i4] = INVALID_MFN;
 
         if ( i4 < LOGDIRTY_NODE_ENTRIES - 1 && hypercall_preempt_check() )
@@ -213,6 +277,395 @@ static int paging_free_log_dirty_bitmap(struct domain *d, int rc)
     return rc;
 }
 
+#ifdef CONFIG_HVM
+/*
+ * Per-vCPU dirty rings, see XEN_DOMCTL_SHADOW_OP_DIRTY_RING_ENABLE.
+ *
+ * Entries are appended with the paging lock held.  Xen only trusts its own
+ * copies of the indexes: slots become reusable once a RESET has moved the
+ * reset index past them, and the consumer's index is only read by RESET.
+ */
+
+/* Free slots below which a vCPU is stalled: room for a full PML buffer. */
+#define DIRTY_RING_SLACK 512
+
+static unsigned int dirty_ring_frames(unsigned int entries)
+{
+    return 1 + entries / (PAGE_SIZE / sizeof(uint64_t));
+}
+
+static void dirty_ring_free(struct vcpu *v, unsigned int entries)
+{
+    struct paging_dirty_ring *dr = &v->arch.paging.dirty_ring;
+    unsigned int i;
+
+    if ( dr->ring )
+    {
+        vunmap(dr->ring);
+        dr->ring = NULL;
+    }
+
+    if ( dr->pg )
+    {
+        for ( i = 0; i < dirty_ring_frames(entries); i++ )
+        {
+            struct page_info *page = dr->pg[i];
+
+            if ( !page )
+                continue;
+
+            put_page_alloc_ref(page);
+            put_page_and_type(page);
+        }
+
+        XFREE(dr->pg);
+    }
+}
+
+/*
+ * The ring is made of individual pages, mapped contiguously, so that the
+ * consumer can map it likewise through XENMEM_acquire_resource.
+ */
+static int dirty_ring_alloc(struct vcpu *v, unsigned int entries)
+{
+    struct domain *d = v->domain;
+    struct paging_dirty_ring *dr = &v->arch.paging.dirty_ring;
+    unsigned int i, nr = dirty_ring_frames(entries);
+    struct xen_dirty_ring *ring;
+    mfn_t *mfn;
+    int rc = -ENOMEM;
+
+    BUILD_BUG_ON(sizeof(*ring) != PAGE_SIZE);
+
+    dr->pg = xzalloc_array(struct page_info *, nr);
+    mfn = xmalloc_array(mfn_t, nr);
+    if ( !dr->pg || !mfn )
+        goto fail;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct page_info *page = alloc_domheap_page(d, MEMF_no_refcount);
+
+        if ( !page )
+            goto fail;
+
+        if ( !get_page_and_type(page, d, PGT_writable_page) )
+        {
+            /* See vmtrace_alloc_buffer(): leak the page. */
+            rc = -ENODATA;
+            goto fail;
+        }
+
+        dr->pg[i] = page;
+        mfn[i] = page_to_mfn(page);
+    }
+
+    ring = vmap(mfn, nr);
+    if ( !ring )
+        goto fail;
+
+    for ( i = 0; i < nr; i++ )
+        clear_page((void *)ring + i * PAGE_SIZE);
+
+    ring->nr_entries = entries;
+
+    dr->ring = ring;
+    dr->prod = 0;
+    dr->reset = 0;
+    xfree(mfn);
+
+    return 0;
+
+ fail:
+    xfree(mfn);
+    dirty_ring_free(v, entries);
+
+    return rc;
+}
+
+static int paging_dirty_ring_enable(struct domain *d, unsigned long entries)
+{
+    struct vcpu *v;
+    int rc = 0;
+
+    if ( !hap_enabled(d) )
+        return -EOPNOTSUPP;
+
+    if ( entries < XEN_DIRTY_RING_MIN_ENTRIES ||
+         entries > XEN_DIRTY_RING_MAX_ENTRIES ||
+         (entries & (entries - 1)) )
+        return -EINVAL;
+
+    /* Serialised against paging_dirty_ring_disable() by the domctl lock. */
+    if ( !paging_mode_log_dirty(d) )
+        return -EINVAL;
+    if ( d->arch.paging.log_dirty.ring_entries )
+        return -EEXIST;
+
+    for_each_vcpu ( d, v )
+    {
+        rc = dirty_ring_alloc(v, entries);
+        if ( rc )
+            break;
+    }
+
+    if ( rc )
+    {
+        for_each_vcpu ( d, v )
+            dirty_ring_free(v, entries);
+        return rc;
+    }
+
+    paging_lock(d);
+    d->arch.paging.log_dirty.ring_entries = entries;
+    paging_unlock(d);
+
+    return 0;
+}
+
+static void paging_dirty_ring_disable(struct domain *d)
+{
+    unsigned int entries = d->arch.paging.log_dirty.ring_entries;
+    struct vcpu *v;
+
+    if ( !entries )
+        return;
+
+    paging_lock(d);
+
+    d->arch.paging.log_dirty.ring_entries = 0;
+
+    for_each_vcpu ( d, v )
+        if ( v->arch.paging.dirty_ring.stalled )
+        {
+            v->arch.paging.dirty_ring.stalled = false;
+            vcpu_unpause(v);
+        }
+
+    paging_unlock(d);
+
+    for_each_vcpu ( d, v )
+        dirty_ring_free(v, entries);
+}
+
+/*
+ * Append a newly dirtied page to the ring of the vCPU which dirtied it, and
+ * stall that vCPU if its ring is getting full.  Pages dirtied on behalf of
+ * the domain are left to CLEAN, by flagging vCPU0's ring as overflowed:
+ * charging them to a vCPU would stall it for work it didn't do.
+ */
+static void dirty_ring_push(struct domain *d, struct vcpu *v, pfn_t pfn)
+{
+    unsigned int nr = d->arch.paging.log_dirty.ring_entries;
+    struct paging_dirty_ring *dr;
+    unsigned int used;
+
+    ASSERT(paging_locked_by_me(d));
+
+    if ( !nr )
+        return;
+
+    dr = &(v ?: d->vcpu[0])->arch.paging.dirty_ring;
+    ASSERT(!v || v->domain == d);
+
+    used = dr->prod - dr->reset;
+    if ( !v || used >= nr )
+    {
+        perfc_incr(dirty_ring_overflow);
+        set_bit(_XEN_DIRTY_RING_OVERFLOW, &dr->ring->flags);
+        return;
+    }
+
+    XEN_DIRTY_RING_ENTRIES(dr->ring)[dr->prod & (nr - 1)] = pfn_x(pfn);
+    smp_wmb();
+    write_atomic(&dr->ring->prod, ++dr->prod);
+
+    if ( !dr->stalled && nr - used - 1 < DIRTY_RING_SLACK )
+    {
+        perfc_incr(dirty_ring_stall);
+        dr->stalled = true;
+        vcpu_pause_nosync(v);
+    }
+}
+
+/* Pages dropped from the rings are about to be collected by a CLEAN. */
+static void dirty_ring_clear_overflow(struct domain *d)
+{
+    struct vcpu *v;
+
+    ASSERT(paging_locked_by_me(d));
+
+    if ( !d->arch.paging.log_dirty.ring_entries )
+        return;
+
+    for_each_vcpu ( d, v )
+        clear_bit(_XEN_DIRTY_RING_OVERFLOW,
+                  &v->arch.paging.dirty_ring.ring->flags);
+}
+
+/* Clear the bit of a page in the log-dirty bitmap, if it is set. */
+static void paging_clear_pfn_dirty(struct domain *d, pfn_t pfn)
+{
+    mfn_t mfn, *l4, *l3, *l2;
+    unsigned long *l1;
+
+    ASSERT(paging_locked_by_me(d));
+
+    if ( unlikely(!VALID_M2P(pfn_x(pfn))) )
+        return;
+
+    mfn = d->arch.paging.log_dirty.top;
+    if ( mfn_eq(mfn, INVALID_MFN) )
+        return;
+
+    l4 = map_domain_page(mfn);
+    mfn = l4[L4_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l4);
+    if ( !log_dirty_entry_summary(mfn) )
+        return;
+
+    l3 = map_domain_page(log_dirty_entry_mfn(mfn));
+    mfn = l3[L3_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l3);
+    if ( !log_dirty_entry_summary(mfn) )
+        return;
+
+    l2 = map_domain_page(log_dirty_entry_mfn(mfn));
+    mfn = l2[L2_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l2);
+    if ( !log_dirty_entry_summary(mfn) )
+        return;
+
+    l1 = map_domain_page(log_dirty_entry_mfn(mfn));
+    __clear_bit(L1_LOGDIRTY_IDX(pfn), l1);
+    unmap_domain_page(l1);
+}
+
+/*
+ * Re-arm dirty logging for the entries each consumer has moved past.  The
+ * bitmap bits are cleared before the pages get write protected again, so
+ * that a write in between is seen by the consumer reading the page after
+ * RESET, while later writes are reported anew.  Slots are only released
+ * once their pages have been re-armed.
+ */
+static int paging_dirty_ring_reset(struct domain *d, bool resuming)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned int nr = d->arch.paging.log_dirty.ring_entries;
+    struct vcpu *v;
+    int rc = 0;
+
+    if ( !nr )
+        return -EINVAL;
+
+    /*
+     * Have dirty GFNs cached by hardware reach the rings first, so that
+     * their pages aren't re-armed underneath entries not reported yet.
+     */
+    if ( !resuming )
+    {
+        domain_pause(d);
+        p2m_flush_hardware_cached_dirty(d);
+        domain_unpause(d);
+    }
+
+    for_each_vcpu ( d, v )
+    {
+        struct paging_dirty_ring *dr = &v->arch.paging.dirty_ring;
+        const uint64_t *entries = XEN_DIRTY_RING_ENTRIES(dr->ring);
+        unsigned int i, cons, end;
+
+        /* Entries are stable until dr->reset moves. */
+        cons = ACCESS_ONCE(dr->ring->cons);
+        if ( cons - dr->reset > dr->prod - dr->reset )
+        {
+            rc = -EINVAL;
+            break;
+        }
+
+        while ( dr->reset != cons )
+        {
+            end = cons - dr->reset > DIRTY_RING_SLACK
+                  ? dr->reset + DIRTY_RING_SLACK : cons;
+
+            p2m_lock(p2m);
+
+            paging_lock(d);
+            for ( i = dr->reset; i != end; i++ )
+                paging_clear_pfn_dirty(d, _pfn(entries[i & (nr - 1)]));
+            paging_unlock(d);
+
+            for ( i = dr->reset; i != end; i++ )
+                p2m_change_type_one(d, entries[i & (nr - 1)],
+                                    p2m_ram_rw, p2m_ram_logdirty);
+
+            paging_lock(d);
+            dr->reset = end;
+            if ( dr->stalled &&
+                 nr - (dr->prod - dr->reset) >= DIRTY_RING_SLACK )
+            {
+                dr->stalled = false;
+                vcpu_unpause(v);
+            }
+            paging_unlock(d);
+
+            p2m_unlock(p2m);
+
+            if ( dr->reset != cons && hypercall_preempt_check() )
+            {
+                rc = -ERESTART;
+                break;
+            }
+        }
+
+        if ( rc )
+            break;
+    }
+
+    if ( rc == -ERESTART )
+    {
+        d->arch.paging.preempt.dom = current->domain;
+        d->arch.paging.preempt.op = XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET;
+    }
+    else if ( resuming )
+        d->arch.paging.preempt.dom = NULL;
+
+    return rc;
+}
+
+unsigned int paging_dirty_ring_max_frames(const struct domain *d)
+{
+    return hap_enabled(d) ? dirty_ring_frames(XEN_DIRTY_RING_MAX_ENTRIES) : 0;
+}
+
+int paging_dirty_ring_get_frame(struct domain *d, unsigned int id,
+                                unsigned int frame, mfn_t *mfn)
+{
+    struct vcpu *v = domain_vcpu(d, id);
+    int rc = -EINVAL;
+
+    if ( !v )
+        return -ENOENT;
+
+    paging_lock(d);
+
+    if ( d->arch.paging.log_dirty.ring_entries &&
+         frame < dirty_ring_frames(d->arch.paging.log_dirty.ring_entries) )
+    {
+        *mfn = page_to_mfn(v->arch.paging.dirty_ring.pg[frame]);
+        rc = 0;
+    }
+
+    paging_unlock(d);
+
+    return rc;
+}
+#else /* !CONFIG_HVM */
+static void paging_dirty_ring_disable(struct domain *d) {}
+static void dirty_ring_push(struct domain *d, struct vcpu *v, pfn_t pfn) {}
+static void dirty_ring_clear_overflow(struct domain *d) {}
+#endif /* CONFIG_HVM */
+
 static int paging_log_dirty_enable(struct domain *d, bool log_global)
 {
     int ret;
@@ -243,6 +696,7 @@ static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
     if ( !resuming )
     {
         domain_pause(d);
+        paging_dirty_ring_disable(d);
         /* Safe because the domain is paused. */
         if ( paging_mode_log_dirty(d) )
         {
@@ -260,8 +714,11 @@ static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
     return ret;
 }
 
-/* Mark a page as dirty, with taking guest pfn as parameter */
-void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
+/*
+ * Mark a page as dirty, with taking guest pfn as parameter.  @v is the vCPU
+ * which dirtied the page, if any.
+ */
+static void mark_pfn_dirty(struct domain *d, struct vcpu *v, pfn_t pfn)
 {
     bool changed;
     mfn_t mfn, *l4, *l3, *l2;
@@ -299,25 +756,19 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
     }
 
     l4 = paging_map_log_dirty_bitmap(d);
-    mfn = l4[i4];
-    if ( mfn_eq(mfn, INVALID_MFN) )
-        l4[i4] = mfn = paging_new_log_dirty_node(d);
+    mfn = log_dirty_walk_entry(d, &l4[i4], false);
     unmap_domain_page(l4);
     if ( mfn_eq(mfn, INVALID_MFN) )
         goto out;
 
     l3 = map_domain_page(mfn);
-    mfn = l3[i3];
-    if ( mfn_eq(mfn, INVALID_MFN) )
-        l3[i3] = mfn = paging_new_log_dirty_node(d);
+    mfn = log_dirty_walk_entry(d, &l3[i3], false);
     unmap_domain_page(l3);
     if ( mfn_eq(mfn, INVALID_MFN) )
         goto out;
 
     l2 = map_domain_page(mfn);
-    mfn = l2[i2];
-    if ( mfn_eq(mfn, INVALID_MFN) )
-        l2[i2] = mfn = paging_new_log_dirty_leaf(d);
+    mfn = log_dirty_walk_entry(d, &l2[i2], true);
     unmap_domain_page(l2);
     if ( mfn_eq(mfn, INVALID_MFN) )
         goto out;
@@ -331,6 +782,7 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
                      "d%d: marked mfn %" PRI_mfn " (pfn %" PRI_pfn ")\n",
                      d->domain_id, mfn_x(mfn), pfn_x(pfn));
         d->arch.paging.log_dirty.dirty_count++;
+        dirty_ring_push(d, v, pfn);
     }
 
 out:
@@ -339,6 +791,18 @@ out:
     return;
 }
 
+void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
+{
+    struct vcpu *curr = current;
+
+    mark_pfn_dirty(d, curr->domain == d ? curr : NULL, pfn);
+}
+
+void paging_mark_pfn_dirty_vcpu(struct vcpu *v, pfn_t pfn)
+{
+    mark_pfn_dirty(v->domain, v, pfn);
+}
+
 /* Mark a page as dirty */
 void paging_mark_dirty(struct domain *d, mfn_t gmfn)
 {
@@ -379,22 +843,22 @@ bool paging_mfn_is_dirty(const struct domain *d, mfn_t gmfn)
     l4 = map_domain_page(mfn);
     mfn = l4[L4_LOGDIRTY_IDX(pfn)];
     unmap_domain_page(l4);
-    if ( mfn_eq(mfn, INVALID_MFN) )
+    if ( !log_dirty_entry_summary(mfn) )
         return false;
 
-    l3 = map_domain_page(mfn);
+    l3 = map_domain_page(log_dirty_entry_mfn(mfn));
     mfn = l3[L3_LOGDIRTY_IDX(pfn)];
     unmap_domain_page(l3);
-    if ( mfn_eq(mfn, INVALID_MFN) )
+    if ( !log_dirty_entry_summary(mfn) )
         return false;
 
-    l2 = map_domain_page(mfn);
+    l2 = map_domain_page(log_dirty_entry_mfn(mfn));
     mfn = l2[L2_LOGDIRTY_IDX(pfn)];
     unmap_domain_page(l2);
-    if ( mfn_eq(mfn, INVALID_MFN) )
+    if ( !log_dirty_entry_summary(mfn) )
         return false;
 
-    l1 = map_domain_page(mfn);
+    l1 = map_domain_page(log_dirty_entry_mfn(mfn));
     dirty = test_bit(L1_LOGDIRTY_IDX(pfn), l1);
     unmap_domain_page(l1);
 
@@ -402,6 +866,109 @@ bool paging_mfn_is_dirty(const struct domain *d, mfn_t gmfn)
 }
 #endif
 
+/*
+ * Append the pfns of the bits set in a log-dirty leaf, whose first bit
+ * represents pfn @base, to the caller's pfn list.  Nothing is appended if
+ * they don't all fit.
+ */
+static int copy_dirty_pfns(struct xen_domctl_shadow_op *sc,
+                           const unsigned long *l1, unsigned long base,
+                           unsigned long *nr_pfns)
+{
+    uint64_t buf[32];
+    unsigned int i, nr = 0;
+    unsigned int bits = min_t(unsigned long, PAGE_SIZE * 8, sc->pages - base);
+
+    if ( *nr_pfns + bitmap_weight(l1, bits) > sc->nr_dirty_pfns )
+        return -ENOBUFS;
+
+    for ( i = find_first_bit(l1, bits); ; i = find_next_bit(l1, bits, i + 1) )
+    {
+        if ( i < bits )
+            buf[nr++] = base + i;
+
+        if ( nr && (i >= bits || nr == ARRAY_SIZE(buf)) )
+        {
+            if ( copy_to_guest_offset(sc->dirty_pfns, *nr_pfns, buf, nr) )
+                return -EFAULT;
+            *nr_pfns += nr;
+            nr = 0;
+        }
+
+        if ( i >= bits )
+            return 0;
+    }
+}
+
+/*
+ * The pfn list overflowed: turn the first @nr_pfns pfns listed, which cover
+ * the pfns below @pages, into the caller's bitmap, so that the operation can
+ * carry on filling the bitmap without losing any of them.  The list is in
+ * ascending order, so the bitmap can be built a page at a time, and copied
+ * out in one go like the log-dirty leaves are.
+ */
+static int dirty_pfns_to_bitmap(struct xen_domctl_shadow_op *sc,
+                                unsigned long pages, unsigned long nr_pfns)
+{
+    uint64_t buf[32];
+    unsigned long *bitmap = alloc_xenheap_page();
+    unsigned long base, end, i = 0;
+    unsigned int j = 0, nr = 0;
+    int rc = 0;
+
+    if ( !bitmap )
+        return -ENOMEM;
+
+    for ( base = 0; base < pages; base = end )
+    {
+        end = min(base + PAGE_SIZE * 8, pages);
+        clear_page(bitmap);
+
+        for ( ; ; j++ )
+        {
+            if ( j == nr )
+            {
+                if ( i == nr_pfns )
+                    break;
+                nr = min_t(unsigned long, nr_pfns - i, ARRAY_SIZE(buf));
+                if ( copy_from_guest_offset(buf, sc->dirty_pfns, i, nr) )
+                {
+                    rc = -EFAULT;
+                    goto out;
+                }
+                i += nr;
+                j = 0;
+            }
+
+            if ( buf[j] >= end )
+                break;
+            /* The list was tampered with. */
+            if ( buf[j] < base )
+            {
+                rc = -EINVAL;
+                goto out;
+            }
+            __set_bit(buf[j] - base, bitmap);
+        }
+
+        if ( copy_to_guest_offset(sc->dirty_bitmap, base >> 3,
+                                  (uint8_t *)bitmap, (end - base + 7) >> 3) )
+        {
+            rc = -EFAULT;
+            goto out;
+        }
+    }
+
+    /* Listed pfns beyond @pages. */
+    if ( j < nr )
+        rc = -EINVAL;
+
+ out:
+    free_xenheap_page(bitmap);
+
+    return rc;
+}
+
 /* Read a domain's log-dirty bitmap and stats.  If the operation is a CLEAN,
  * clear the bitmap and stats as well. */
 static int paging_log_dirty_op(struct domain *d,
@@ -409,7 +976,8 @@ static int paging_log_dirty_op(struct domain *d,
                                bool_t resuming)
 {
     int rv = 0, clean = 0, peek = 1;
-    unsigned long pages = 0;
+    bool pfn_list;
+    unsigned long pages = 0, nr_pfns;
     mfn_t *l4 = NULL, *l3 = NULL, *l2 = NULL;
     unsigned long *l1 = NULL;
     int i4, i3, i2;
@@ -437,8 +1005,26 @@ static int paging_log_dirty_op(struct domain *d,
     paging_lock(d);
 
     if ( !d->arch.paging.preempt.dom )
+    {
         memset(&d->arch.paging.preempt.log_dirty, 0,
                sizeof(d->arch.paging.preempt.log_dirty));
+
+        /*
+         * dirty_count is only a hint: pages may still be marked dirty by
+         * backends while the operation is preempted, and a CLEAN resets it
+         * with such pages pending.  Should the list overflow, the operation
+         * falls back to the bitmap, and the choice is kept across
+         * continuations.
+         */
+        d->arch.paging.preempt.log_dirty.pfn_list =
+            (sc->mode & XEN_DOMCTL_SHADOW_LOGDIRTY_PFN_LIST) &&
+            !guest_handle_is_null(sc->dirty_pfns) &&
+            !guest_handle_is_null(sc->dirty_bitmap) &&
+            d->arch.paging.log_dirty.dirty_count <= sc->nr_dirty_pfns;
+
+        if ( sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN )
+            dirty_ring_clear_overflow(d);
+    }
     else if ( d->arch.paging.preempt.dom != current->domain ||
               d->arch.paging.preempt.op != sc->op )
     {
@@ -449,6 +1035,7 @@ static int paging_log_dirty_op(struct domain *d,
     }
 
     clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN);
+    pfn_list = d->arch.paging.preempt.log_dirty.pfn_list;
 
     PAGING_DEBUG(LOGDIRTY, "log-dirty %s: dom %u faults=%lu dirty=%lu\n",
                  (clean) ? "clean" : "peek",
@@ -461,7 +1048,7 @@ static int paging_log_dirty_op(struct domain *d,
     sc->stats.dirty_count = min(d->arch.paging.log_dirty.dirty_count,
                                 UINT32_MAX + 0UL);
 
-    if ( guest_handle_is_null(sc->dirty_bitmap) )
+    if ( !pfn_list && guest_handle_is_null(sc->dirty_bitmap) )
         /* caller may have wanted just to clean the state or access stats. */
         peek = 0;
 
@@ -477,25 +1064,41 @@ static int paging_log_dirty_op(struct domain *d,
     i4 = d->arch.paging.preempt.log_dirty.i4;
     i3 = d->arch.paging.preempt.log_dirty.i3;
     pages = d->arch.paging.preempt.log_dirty.done;
+    nr_pfns = d->arch.paging.preempt.log_dirty.nr_pfns;
 
+    /*
+     * Subtrees without dirty bits are neither mapped nor scanned, and there
+     * is nothing to clean in them.
+     */
     for ( ; (pages < sc->pages) && (i4 < LOGDIRTY_NODE_ENTRIES); i4++, i3 = 0 )
     {
-        l3 = ((l4 && !mfn_eq(l4[i4], INVALID_MFN)) ?
-              map_domain_page(l4[i4]) : NULL);
+        l3 = ((l4 && log_dirty_visit_entry(&l4[i4], clean, i3)) ?
+              map_domain_page(log_dirty_entry_mfn(l4[i4])) : NULL);
         for ( ; (pages < sc->pages) && (i3 < LOGDIRTY_NODE_ENTRIES); i3++ )
         {
-            l2 = ((l3 && !mfn_eq(l3[i3], INVALID_MFN)) ?
-                  map_domain_page(l3[i3]) : NULL);
+            l2 = ((l3 && log_dirty_visit_entry(&l3[i3], clean, false)) ?
+                  map_domain_page(log_dirty_entry_mfn(l3[i3])) : NULL);
             for ( i2 = 0;
                   (pages < sc->pages) && (i2 < LOGDIRTY_NODE_ENTRIES);
                   i2++ )
             {
                 unsigned int bytes = PAGE_SIZE;
-                l1 = ((l2 && !mfn_eq(l2[i2], INVALID_MFN)) ?
-                      map_domain_page(l2[i2]) : NULL);
+                l1 = ((l2 && log_dirty_visit_entry(&l2[i2], clean, false)) ?
+                      map_domain_page(log_dirty_entry_mfn(l2[i2])) : NULL);
                 if ( unlikely(((sc->pages - pages + 7) >> 3) < bytes) )
                     bytes = (unsigned int)((sc->pages - pages + 7) >> 3);
-                if ( likely(peek) )
+                /* Absent leaves have no dirty pfns to report. */
+                if ( likely(peek) && pfn_list && l1 &&
+                     (rv = copy_dirty_pfns(sc, l1, pages, &nr_pfns)) != 0 )
+                {
+                    /* Nothing was cleared yet, switch to the bitmap. */
+                    if ( rv != -ENOBUFS ||
+                         (rv = dirty_pfns_to_bitmap(sc, pages, nr_pfns)) != 0 )
+                        goto out;
+                    pfn_list = false;
+                    d->arch.paging.preempt.log_dirty.pfn_list = false;
+                }
+                if ( likely(peek) && !pfn_list )
                 {
                     if ( (l1 ? copy_to_guest_offset(sc->dirty_bitmap,
                                                     pages >> 3, (uint8_t *)l1,
@@ -556,6 +1159,7 @@ static int paging_log_dirty_op(struct domain *d,
         d->arch.paging.preempt.dom = current->domain;
         d->arch.paging.preempt.op = sc->op;
         d->arch.paging.preempt.log_dirty.done = pages;
+        d->arch.paging.preempt.log_dirty.nr_pfns = nr_pfns;
     }
 
     paging_unlock(d);
@@ -569,6 +1173,10 @@ static int paging_log_dirty_op(struct domain *d,
 
     if ( pages < sc->pages )
         sc->pages = pages;
+    if ( pfn_list )
+        sc->nr_dirty_pfns = nr_pfns;
+    else
+        sc->mode &= ~XEN_DOMCTL_SHADOW_LOGDIRTY_PFN_LIST;
     if ( clean )
     {
         /* We need to further call clean_dirty_bitmap() functions of specific
@@ -579,6 +1187,17 @@ static int paging_log_dirty_op(struct domain *d,
     return rv;
 
  out:
+    if ( clean )
+    {
+        /* The subtrees being visited haven't been cleaned after all. */
+        if ( l2 )
+            log_dirty_entry_set_summary(&l2[i2]);
+        if ( l3 )
+            log_dirty_entry_set_summary(&l3[i3]);
+        if ( l4 )
+            log_dirty_entry_set_summary(&l4[i4]);
+    }
+
     d->arch.paging.preempt.dom = NULL;
     paging_unlock(d);
     domain_unpause(d);
@@ -749,9 +1368,18 @@ int paging_domctl(struct domain *d, struct xen_domctl_shadow_op *sc,
 
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
-        if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
+        if ( sc->mode & ~(XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL |
+                          XEN_DOMCTL_SHADOW_LOGDIRTY_PFN_LIST) )
             return -EINVAL;
         return paging_log_dirty_op(d, sc, resuming);
+
+#ifdef CONFIG_HVM
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_ENABLE:
+        return paging_dirty_ring_enable(d, sc->pages);
+
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET:
+        return paging_dirty_ring_reset(d, resuming);
+#endif
     }
 
     /* Here, dispatch domctl to the appropriate paging code */
@@ -828,6 +1456,7 @@ int paging_teardown(struct domain *d)
 
 #if PG_log_dirty
     /* clean up log dirty resources. */
+    paging_dirty_ring_disable(d);
     rc = paging_free_log_dirty_bitmap(d, 0);
     if ( rc == -ERESTART )
         return rc;
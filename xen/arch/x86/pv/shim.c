@@ -412,6 +412,92 @@ int pv_shim_shutdown(uint8_t reason)
     return 0;
 }
 
+/* Number of ports forwarded per EVTCHNOP_send_batch to the parent. */
+#define SHIM_SEND_BATCH 64
+
+/*
+ * Forward EVTCHNOP_send_batch in chunks, handling the console port locally
+ * as EVTCHNOP_send does.  Fall back to single sends if the parent doesn't
+ * know the batched operation.
+ */
+static long pv_shim_send_batch(XEN_GUEST_HANDLE_PARAM(evtchn_send_batch_t) arg)
+{
+    struct evtchn_send_batch batch;
+    XEN_GUEST_HANDLE(evtchn_port_t) ports_hnd;
+    union {
+        struct evtchn_send_batch batch;
+        uint8_t raw[sizeof(struct evtchn_send_batch) +
+                    SHIM_SEND_BATCH * sizeof(evtchn_port_t)];
+    } fwd;
+    unsigned int i, nr;
+    long rc = 0;
+
+    if ( copy_from_guest(&batch, arg, 1) )
+        return -EFAULT;
+
+    if ( batch.done > batch.nr_ports )
+        return -EINVAL;
+
+    ports_hnd = guest_handle_for_field(arg, evtchn_port_t, ports[0]);
+
+    while ( batch.done < batch.nr_ports )
+    {
+        nr = min_t(unsigned int, batch.nr_ports - batch.done,
+                   SHIM_SEND_BATCH);
+
+        if ( copy_from_guest_offset(fwd.batch.ports, ports_hnd, batch.done,
+                                    nr) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        for ( i = 0; i < nr; i++ )
+            if ( pv_console && fwd.batch.ports[i] == pv_console_evtchn() )
+                break;
+
+        if ( !i )
+        {
+            consoled_guest_rx();
+            batch.done++;
+        }
+        else
+        {
+            fwd.batch.nr_ports = i;
+            fwd.batch.done = 0;
+            rc = xen_hypercall_event_channel_op(EVTCHNOP_send_batch,
+                                                &fwd.batch);
+            if ( rc == -ENOSYS )
+            {
+                struct evtchn_send send;
+
+                for ( rc = 0; !rc && fwd.batch.done < i; )
+                {
+                    send.port = fwd.batch.ports[fwd.batch.done];
+                    rc = xen_hypercall_event_channel_op(EVTCHNOP_send, &send);
+                    if ( !rc )
+                        fwd.batch.done++;
+                }
+            }
+
+            batch.done += fwd.batch.done;
+            if ( rc )
+                break;
+        }
+
+        if ( batch.done < batch.nr_ports && hypercall_preempt_check() )
+        {
+            rc = -ERESTART;
+            break;
+        }
+    }
+
+    if ( __copy_field_to_guest(arg, &batch, done) )
+        rc = -EFAULT;
+
+    return rc;
+}
+
 long pv_shim_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     struct domain *d = current->domain;
@@ -618,6 +704,13 @@ long pv_shim_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_send_batch:
+        rc = pv_shim_send_batch(guest_handle_cast(arg, evtchn_send_batch_t));
+        if ( rc == -ERESTART )
+            rc = hypercall_create_continuation(__HYPERVISOR_event_channel_op,
+                                               "ih", EVTCHNOP_send_batch, arg);
+        break;
+
     case EVTCHNOP_reset: {
         struct evtchn_reset reset;
 
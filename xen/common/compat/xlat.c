@@ -66,6 +66,10 @@ CHECK_evtchn_init_control;
 CHECK_evtchn_reset;
 #undef xen_evtchn_reset
 
+#define xen_evtchn_send_batch evtchn_send_batch
+CHECK_evtchn_send_batch;
+#undef xen_evtchn_send_batch
+
 #define xen_evtchn_set_priority evtchn_set_priority
 CHECK_evtchn_set_priority;
 #undef xen_evtchn_set_priority
@@ -193,6 +193,54 @@ static struct evtchn *alloc_evtchn_bucket(struct domain *d, unsigned int port)
     return NULL;
 }
 
+/* Number of ports tracked in the d->evtchn_used bitmap. */
+static unsigned int evtchn_used_bits(const struct domain *d)
+{
+    return min_t(unsigned int, d->max_evtchn_port + 1, MAX_NR_EVTCHNS);
+}
+
+static void evtchn_mark_used(struct domain *d, evtchn_port_t port)
+{
+    unsigned int word = port / BITS_PER_LONG;
+
+    __set_bit(port, d->evtchn_used);
+    if ( d->evtchn_used[word] == ~0UL )
+        __set_bit(word, d->evtchn_used_full);
+}
+
+static void evtchn_mark_free(struct domain *d, evtchn_port_t port)
+{
+    __clear_bit(port, d->evtchn_used);
+    __clear_bit(port / BITS_PER_LONG, d->evtchn_used_full);
+}
+
+/*
+ * Find the lowest port not in use at or above start.  Returns
+ * evtchn_used_bits(d) if there is none.
+ */
+static unsigned int evtchn_find_unused(const struct domain *d,
+                                       unsigned int start)
+{
+    unsigned int nr = evtchn_used_bits(d);
+    unsigned int nr_words = BITS_TO_LONGS(nr);
+    unsigned int word, port;
+
+    for ( word = find_next_zero_bit(d->evtchn_used_full, nr_words,
+                                    start / BITS_PER_LONG);
+          word < nr_words;
+          word = find_next_zero_bit(d->evtchn_used_full, nr_words, word + 1) )
+    {
+        unsigned int end = min(nr, (word + 1) * BITS_PER_LONG);
+
+        port = find_next_zero_bit(d->evtchn_used, end,
+                                  max(start, word * BITS_PER_LONG));
+        if ( port < end )
+            return port;
+    }
+
+    return nr;
+}
+
 /*
  * Allocate a given port and ensure all the buckets up to that ports
  * have been allocated.
@@ -249,6 +297,7 @@ int evtchn_allocate_port(struct domain *d, evtchn_port_t port)
     }
 
     write_atomic(&d->active_evtchns, d->active_evtchns + 1);
+    evtchn_mark_used(d, port);
 
     return 0;
 }
@@ -260,7 +309,13 @@ static int get_free_port(struct domain *d)
     if ( d->is_dying )
         return -EINVAL;
 
-    for ( port = 0; port <= d->max_evtchn_port; port++ )
+    /*
+     * Ports which aren't in use may still be busy (e.g. linked on a FIFO
+     * queue), in which case evtchn_allocate_port() fails with -EBUSY and the
+     * next unused one is tried.
+     */
+    for ( port = evtchn_find_unused(d, 0); port <= d->max_evtchn_port;
+          port = evtchn_find_unused(d, port + 1) )
     {
         int rc = evtchn_allocate_port(d, port);
 
@@ -281,7 +336,10 @@ static void check_free_port(struct domain *d, evtchn_port_t port)
 {
     if ( port_is_valid(d, port) &&
          evtchn_from_port(d, port)->state == ECS_FREE )
+    {
         write_atomic(&d->active_evtchns, d->active_evtchns - 1);
+        evtchn_mark_free(d, port);
+    }
 }
 
 void evtchn_free(struct domain *d, struct evtchn *chn)
@@ -296,6 +354,7 @@ void evtchn_free(struct domain *d, struct evtchn *chn)
         smp_wmb();
     }
     write_atomic(&d->active_evtchns, d->active_evtchns - 1);
+    evtchn_mark_free(d, chn->port);
 
     /* Reset binding to vcpu0 when the channel is freed. */
     chn->state          = ECS_FREE;
@@ -773,27 +832,34 @@ int evtchn_close(struct domain *d1, int port1, bool guest)
     return rc;
 }
 
-int evtchn_send(struct domain *ld, unsigned int lport)
+struct xen_notification {
+    xen_event_channel_notification_t fn;
+    struct vcpu *v;
+    evtchn_port_t port;
+};
+
+/*
+ * Send via @lchn, which the caller keeps from changing state, either by
+ * holding its lock or by holding its domain's event_lock.  Notifications
+ * for Xen-attached remote ends are only looked up, in @xn, for the caller
+ * to deliver once it dropped its lock.
+ */
+static int evtchn_send_one(struct domain *ld, struct evtchn *lchn,
+                           struct xen_notification *xn)
 {
-    struct evtchn *lchn = _evtchn_from_port(ld, lport), *rchn;
+    struct evtchn *rchn;
     struct domain *rd;
-    int            rport, ret = 0;
+    int            rport, ret;
 
-    if ( !lchn )
-        return -EINVAL;
-
-    evtchn_read_lock(lchn);
+    xn->fn = NULL;
 
     /* Guest cannot send via a Xen-attached event channel. */
     if ( unlikely(consumer_is_xen(lchn)) )
-    {
-        ret = -EINVAL;
-        goto out;
-    }
+        return -EINVAL;
 
     ret = xsm_evtchn_send(XSM_HOOK, ld, lchn);
     if ( ret )
-        goto out;
+        return ret;
 
     switch ( lchn->state )
     {
@@ -803,15 +869,11 @@ int evtchn_send(struct domain *ld, unsigned int lport)
         rchn  = evtchn_from_port(rd, rport);
         if ( consumer_is_xen(rchn) )
         {
-            /* Don't keep holding the lock for the call below. */
-            xen_event_channel_notification_t fn = xen_notification_fn(rchn);
-            struct vcpu *rv = rd->vcpu[rchn->notify_vcpu_id];
-
+            xn->fn = xen_notification_fn(rchn);
+            xn->v = rd->vcpu[rchn->notify_vcpu_id];
+            xn->port = rport;
             rcu_lock_domain(rd);
-            evtchn_read_unlock(lchn);
-            fn(rv, rport);
-            rcu_unlock_domain(rd);
-            return 0;
+            break;
         }
         evtchn_port_set_pending(rd, rchn->notify_vcpu_id, rchn);
         break;
@@ -825,12 +887,109 @@ int evtchn_send(struct domain *ld, unsigned int lport)
         ret = -EINVAL;
     }
 
-out:
+    return ret;
+}
+
+/* Deliver a notification looked up by evtchn_send_one(), without locks. */
+static void xen_notify(const struct xen_notification *xn)
+{
+    xn->fn(xn->v, xn->port);
+    rcu_unlock_domain(xn->v->domain);
+}
+
+int evtchn_send(struct domain *ld, unsigned int lport)
+{
+    struct evtchn *lchn = _evtchn_from_port(ld, lport);
+    struct xen_notification xn;
+    int ret;
+
+    if ( !lchn )
+        return -EINVAL;
+
+    evtchn_read_lock(lchn);
+    ret = evtchn_send_one(ld, lchn, &xn);
     evtchn_read_unlock(lchn);
 
+    if ( xn.fn )
+        xen_notify(&xn);
+
     return ret;
 }
 
+/* Number of ports EVTCHNOP_send_batch processes between preemption checks. */
+#define SEND_BATCH_CHUNK 64
+
+static int evtchn_send_batch(
+    XEN_GUEST_HANDLE_PARAM(evtchn_send_batch_t) arg)
+{
+    struct domain *d = current->domain;
+    struct evtchn_send_batch batch;
+    XEN_GUEST_HANDLE(evtchn_port_t) ports_hnd;
+    evtchn_port_t ports[SEND_BATCH_CHUNK];
+    struct xen_notification xn;
+    unsigned int i, nr;
+    int rc = 0;
+
+    if ( copy_from_guest(&batch, arg, 1) )
+        return -EFAULT;
+
+    if ( batch.done > batch.nr_ports )
+        return -EINVAL;
+
+    ports_hnd = guest_handle_for_field(arg, evtchn_port_t, ports[0]);
+
+    while ( batch.done < batch.nr_ports )
+    {
+        nr = min_t(unsigned int, batch.nr_ports - batch.done,
+                   ARRAY_SIZE(ports));
+
+        if ( copy_from_guest_offset(ports, ports_hnd, batch.done, nr) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        /*
+         * Rather than the lock of each channel, hold the domain's event_lock
+         * across the chunk: channels only change state with it write-locked.
+         */
+        read_lock(&d->event_lock);
+
+        for ( i = 0; i < nr; i++ )
+        {
+            struct evtchn *lchn = _evtchn_from_port(d, ports[i]);
+
+            rc = lchn ? evtchn_send_one(d, lchn, &xn) : -EINVAL;
+            if ( rc )
+                break;
+
+            if ( xn.fn )
+            {
+                read_unlock(&d->event_lock);
+                xen_notify(&xn);
+                read_lock(&d->event_lock);
+            }
+        }
+
+        read_unlock(&d->event_lock);
+
+        batch.done += i;
+        if ( rc )
+            break;
+
+        if ( batch.done < batch.nr_ports && hypercall_preempt_check() )
+        {
+            rc = -ERESTART;
+            break;
+        }
+    }
+
+    if ( __copy_field_to_guest(arg, &batch, done) )
+        rc = -EFAULT;
+
+    return rc;
+}
+
 bool evtchn_virq_enabled(const struct vcpu *v, unsigned int virq)
 {
     if ( !v )
@@ -1299,6 +1458,13 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_send_batch:
+        rc = evtchn_send_batch(guest_handle_cast(arg, evtchn_send_batch_t));
+        if ( rc == -ERESTART )
+            rc = hypercall_create_continuation(__HYPERVISOR_event_channel_op,
+                                               "ih", EVTCHNOP_send_batch, arg);
+        break;
+
     case EVTCHNOP_status: {
         struct evtchn_status status;
         if ( copy_from_guest(&status, arg, 1) != 0 )
@@ -1500,9 +1666,17 @@ int evtchn_init(struct domain *d, unsigned int max_port)
     evtchn_2l_init(d);
     d->max_evtchn_port = min_t(unsigned int, max_port, INT_MAX);
 
+    d->evtchn_used = xzalloc_array(unsigned long,
+                                   BITS_TO_LONGS(evtchn_used_bits(d)));
+    d->evtchn_used_full =
+        xzalloc_array(unsigned long,
+                      BITS_TO_LONGS(BITS_TO_LONGS(evtchn_used_bits(d))));
+    if ( !d->evtchn_used || !d->evtchn_used_full )
+        goto nomem;
+
     d->evtchn = alloc_evtchn_bucket(d, 0);
     if ( !d->evtchn )
-        return -ENOMEM;
+        goto nomem;
     d->valid_evtchns = EVTCHNS_PER_BUCKET;
 
     rwlock_init(&d->event_lock);
@@ -1510,6 +1684,9 @@ int evtchn_init(struct domain *d, unsigned int max_port)
     if ( get_free_port(d) != 0 )
     {
         free_evtchn_bucket(d, d->evtchn);
+        d->evtchn = NULL;
+        XFREE(d->evtchn_used);
+        XFREE(d->evtchn_used_full);
         return -EINVAL;
     }
     evtchn_from_port(d, 0)->state = ECS_RESERVED;
@@ -1518,13 +1695,17 @@ int evtchn_init(struct domain *d, unsigned int max_port)
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     d->poll_mask = xzalloc_array(unsigned long, BITS_TO_LONGS(d->max_vcpus));
     if ( !d->poll_mask )
-    {
-        free_evtchn_bucket(d, d->evtchn);
-        return -ENOMEM;
-    }
+        goto nomem;
 #endif
 
     return 0;
+
+ nomem:
+    free_evtchn_bucket(d, d->evtchn);
+    d->evtchn = NULL;
+    XFREE(d->evtchn_used);
+    XFREE(d->evtchn_used_full);
+    return -ENOMEM;
 }
 
 int evtchn_destroy(struct domain *d)
@@ -1578,6 +1759,9 @@ void evtchn_destroy_final(struct domain *d)
     }
     free_evtchn_bucket(d, d->evtchn);
 
+    XFREE(d->evtchn_used);
+    XFREE(d->evtchn_used_full);
+
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     xfree(d->poll_mask);
     d->poll_mask = NULL;
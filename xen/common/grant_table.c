@@ -41,6 +41,7 @@
 #include <xen/radix-tree.h>
 #include <xen/vmap.h>
 #include <xen/nospec.h>
+#include <xen/perfc.h>
 #include <xsm/xsm.h>
 #include <asm/flushtlb.h>
 #include <asm/guest_atomics.h>
@@ -56,7 +57,7 @@ struct grant_table {
      * entry list, etc.)
      */
     percpu_rwlock_t       lock;
-    /* Lock protecting the maptrack limit */
+    /* Lock protecting the maptrack limit and depot */
     spinlock_t            maptrack_lock;
     unsigned int          max_version;
     /*
@@ -79,6 +80,12 @@ struct grant_table {
      * progress.
      */
     unsigned int          maptrack_limit;
+    /*
+     * Depot of free maptrack entries, chained through their ref fields, from
+     * which the per-vCPU magazines get refilled in bulk.
+     */
+    unsigned int          maptrack_depot;
+    unsigned int          maptrack_depot_nr;
     /* Shared grant table (see include/public/grant_table.h). */
     union {
         void **shared_raw;
@@ -285,8 +292,7 @@ struct grant_mapping {
     grant_ref_t ref;        /* grant ref */
     uint16_t flags;         /* 0-4: GNTMAP_* ; 5-15: unused */
     domid_t  domid;         /* granting domain */
-    uint32_t vcpu;          /* vcpu which created the grant mapping */
-    uint32_t pad;           /* round size to a power of 2 */
+    uint32_t pad[2];        /* round size to a power of 2 */
 };
 
 /* Number of grant table frames. Caller must hold d's grant table lock. */
@@ -537,48 +543,193 @@ static int get_paged_frame(unsigned long gfn, mfn_t *mfn,
 
 #define INVALID_MAPTRACK_HANDLE UINT_MAX
 
-static inline grant_handle_t
-_get_maptrack_handle(struct grant_table *t, struct vcpu *v)
+/*
+ * Free maptrack entries are kept in per-vCPU magazines, backed by a depot
+ * shared by all vCPUs of the domain.
+ *
+ * A vCPU's magazine is a list of entries chained through their ref fields.
+ * Only the vCPU itself (which is current whenever handles get allocated or
+ * freed) pushes entries onto or pops entries off its magazine, so no lock is
+ * needed.  Other vCPUs may only steal a magazine as a whole, by exchanging its
+ * head with MAPTRACK_TAIL, so cmpxchg() suffices for the owner to notice.
+ *
+ * Magazines are refilled from and drained to the depot (protected by
+ * @maptrack_lock) in batches.  The batch size of a vCPU adapts to its usage
+ * pattern: it grows with each refill and shrinks with each drain.
+ */
+#define MAPTRACK_BATCH_MIN 8
+#define MAPTRACK_BATCH_MAX 128
+
+/*
+ * Find the end of a list of entries, not going further than *nr entries.
+ * The number of entries up to and including the returned one is put in *nr.
+ */
+static unsigned int maptrack_list_end(struct grant_table *t,
+                                      unsigned int first, unsigned int *nr)
 {
-    unsigned int head, next;
+    unsigned int i, last = first;
 
-    spin_lock(&v->maptrack_freelist_lock);
+    for ( i = 1; i < *nr; i++ )
+    {
+        unsigned int next = maptrack_entry(t, last).ref;
 
-    /* No maptrack pages allocated for this VCPU yet? */
-    head = v->maptrack_head;
-    if ( unlikely(head == MAPTRACK_TAIL) )
+        if ( next == MAPTRACK_TAIL )
+            break;
+        last = next;
+    }
+    *nr = i;
+
+    return last;
+}
+
+static void maptrack_push(struct grant_table *t, struct vcpu *v,
+                          unsigned int first, unsigned int last,
+                          unsigned int nr)
+{
+    unsigned int head = read_atomic(&v->maptrack_head), prev;
+
+    for ( ; ; )
     {
-        spin_unlock(&v->maptrack_freelist_lock);
-        return INVALID_MAPTRACK_HANDLE;
+        maptrack_entry(t, last).ref = head;
+        prev = cmpxchg(&v->maptrack_head, head, first);
+        if ( prev == head )
+            break;
+        head = prev;
     }
 
-    /*
-     * Always keep one entry in the free list to make it easier to
-     * add free entries to the tail.
-     */
-    next = maptrack_entry(t, head).ref;
-    if ( unlikely(next == MAPTRACK_TAIL) )
-        head = INVALID_MAPTRACK_HANDLE;
-    else
-        v->maptrack_head = next;
+    v->maptrack_nr += nr;
+}
+
+static grant_handle_t maptrack_pop(struct grant_table *t, struct vcpu *v)
+{
+    unsigned int head = read_atomic(&v->maptrack_head), prev;
+
+    while ( head != MAPTRACK_TAIL )
+    {
+        prev = cmpxchg(&v->maptrack_head, head, maptrack_entry(t, head).ref);
+        if ( prev == head )
+        {
+            if ( v->maptrack_nr )
+                v->maptrack_nr--;
+            return head;
+        }
+        /* The magazine was stolen. */
+        head = prev;
+    }
 
-    spin_unlock(&v->maptrack_freelist_lock);
+    v->maptrack_nr = 0;
 
-    return head;
+    return INVALID_MAPTRACK_HANDLE;
+}
+
+/* Add a new maptrack frame to the depot.  Caller must hold maptrack_lock. */
+static void maptrack_grow(struct grant_table *t)
+{
+    struct grant_mapping *new_mt = alloc_xenheap_page();
+    unsigned int i, handle = t->maptrack_limit;
+
+    if ( !new_mt )
+        return;
+
+    clear_page(new_mt);
+
+    for ( i = 0; i < MAPTRACK_PER_PAGE - 1; i++ )
+    {
+        BUILD_BUG_ON(sizeof(new_mt->ref) < sizeof(handle));
+        new_mt[i].ref = handle + i + 1;
+    }
+    new_mt[i].ref = t->maptrack_depot;
+
+    t->maptrack[nr_maptrack_frames(t)] = new_mt;
+    smp_wmb();
+    t->maptrack_limit += MAPTRACK_PER_PAGE;
+
+    t->maptrack_depot = handle;
+    t->maptrack_depot_nr += MAPTRACK_PER_PAGE;
+
+    perfc_incr(maptrack_grow);
 }
 
 /*
- * Try to "steal" a free maptrack entry from another VCPU.
+ * Move a batch of entries from the depot to the (empty) magazine of v.
+ * New maptrack frames are allocated ahead of the depot running dry, as long
+ * as there is headroom.
+ */
+static bool maptrack_refill(struct grant_table *t, struct vcpu *v)
+{
+    unsigned int first, last, nr = v->maptrack_batch;
+
+    spin_lock(&t->maptrack_lock);
+
+    if ( t->maptrack_depot_nr < 2 * MAPTRACK_BATCH_MAX &&
+         nr_maptrack_frames(t) < t->max_maptrack_frames )
+        maptrack_grow(t);
+
+    first = t->maptrack_depot;
+    if ( first == MAPTRACK_TAIL )
+    {
+        spin_unlock(&t->maptrack_lock);
+        return false;
+    }
+
+    last = maptrack_list_end(t, first, &nr);
+    t->maptrack_depot = maptrack_entry(t, last).ref;
+    t->maptrack_depot_nr -= nr;
+
+    spin_unlock(&t->maptrack_lock);
+
+    maptrack_push(t, v, first, last, nr);
+    v->maptrack_batch = min_t(unsigned int, v->maptrack_batch * 2,
+                              MAPTRACK_BATCH_MAX);
+    perfc_incr(maptrack_refill);
+
+    return true;
+}
+
+/* Keep a batch of entries in the magazine of v, and return the rest. */
+static void maptrack_drain(struct grant_table *t, struct vcpu *v)
+{
+    unsigned int first = xchg(&v->maptrack_head, MAPTRACK_TAIL);
+    unsigned int last, rest, nr = v->maptrack_batch;
+
+    v->maptrack_nr = 0;
+    if ( first == MAPTRACK_TAIL )
+        return;
+
+    last = maptrack_list_end(t, first, &nr);
+    rest = maptrack_entry(t, last).ref;
+    maptrack_push(t, v, first, last, nr);
+
+    if ( rest != MAPTRACK_TAIL )
+    {
+        nr = UINT_MAX;
+        last = maptrack_list_end(t, rest, &nr);
+
+        spin_lock(&t->maptrack_lock);
+        maptrack_entry(t, last).ref = t->maptrack_depot;
+        t->maptrack_depot = rest;
+        t->maptrack_depot_nr += nr;
+        spin_unlock(&t->maptrack_lock);
+
+        perfc_incr(maptrack_drain);
+    }
+
+    v->maptrack_batch = max_t(unsigned int, v->maptrack_batch / 2,
+                              MAPTRACK_BATCH_MIN);
+}
+
+/*
+ * Try to "steal" the free maptrack entries of another VCPU, when the depot
+ * can't supply any.
  *
- * A stolen entry is transferred to the thief, so the number of
- * entries for each VCPU should tend to the usage pattern.
+ * All entries of the victim's magazine are transferred to the thief, so the
+ * number of entries for each VCPU should tend to the usage pattern.
  *
- * To avoid having to atomically count the number of free entries on
- * each VCPU and to avoid two VCPU repeatedly stealing entries from
- * each other, the initial victim VCPU is selected randomly.
+ * To avoid two VCPU repeatedly stealing entries from each other, the initial
+ * victim VCPU is selected randomly.
  */
 static grant_handle_t steal_maptrack_handle(struct grant_table *t,
-                                            const struct vcpu *curr)
+                                            struct vcpu *curr)
 {
     const struct domain *currd = curr->domain;
     unsigned int first, i;
@@ -587,14 +738,22 @@ static grant_handle_t steal_maptrack_handle(struct grant_table *t,
     first = i = get_random() % currd->max_vcpus;
 
     do {
-        if ( currd->vcpu[i] )
+        struct vcpu *v = currd->vcpu[i];
+
+        if ( v && v != curr )
         {
-            grant_handle_t handle;
+            unsigned int handle = xchg(&v->maptrack_head, MAPTRACK_TAIL);
 
-            handle = _get_maptrack_handle(t, currd->vcpu[i]);
-            if ( handle != INVALID_MAPTRACK_HANDLE )
+            if ( handle != MAPTRACK_TAIL )
             {
-                maptrack_entry(t, handle).vcpu = curr->vcpu_id;
+                unsigned int next = maptrack_entry(t, handle).ref;
+                unsigned int nr = UINT_MAX;
+
+                if ( next != MAPTRACK_TAIL )
+                    maptrack_push(t, curr, next,
+                                  maptrack_list_end(t, next, &nr), nr);
+
+                perfc_incr(maptrack_steal);
                 return handle;
             }
         }
@@ -605,6 +764,7 @@ static grant_handle_t steal_maptrack_handle(struct grant_table *t,
     } while ( i != first );
 
     /* No free handles on any VCPU. */
+    perfc_incr(maptrack_steal_failed);
     return INVALID_MAPTRACK_HANDLE;
 }
 
@@ -612,103 +772,29 @@ static inline void
 put_maptrack_handle(
     struct grant_table *t, grant_handle_t handle)
 {
-    struct domain *currd = current->domain;
-    struct vcpu *v;
-    unsigned int tail;
-
-    /* 1. Set entry to be a tail. */
-    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
-
-    /* 2. Add entry to the tail of the list on the original VCPU. */
-    v = currd->vcpu[maptrack_entry(t, handle).vcpu];
-
-    spin_lock(&v->maptrack_freelist_lock);
-
-    tail = v->maptrack_tail;
-    v->maptrack_tail = handle;
+    struct vcpu *curr = current;
 
-    /* 3. Update the old tail entry to point to the new entry. */
-    maptrack_entry(t, tail).ref = handle;
+    maptrack_push(t, curr, handle, handle, 1);
 
-    spin_unlock(&v->maptrack_freelist_lock);
+    if ( unlikely(curr->maptrack_nr > 2 * curr->maptrack_batch) )
+        maptrack_drain(t, curr);
 }
 
 static inline grant_handle_t
 get_maptrack_handle(
     struct grant_table *lgt)
 {
-    struct vcpu          *curr = current;
-    unsigned int          i;
-    grant_handle_t        handle;
-    struct grant_mapping *new_mt = NULL;
+    struct vcpu *curr = current;
+    grant_handle_t handle = maptrack_pop(lgt, curr);
 
-    handle = _get_maptrack_handle(lgt, curr);
     if ( likely(handle != INVALID_MAPTRACK_HANDLE) )
         return handle;
 
-    spin_lock(&lgt->maptrack_lock);
+    if ( maptrack_refill(lgt, curr) )
+        handle = maptrack_pop(lgt, curr);
 
-    /*
-     * If we've run out of handles and still have frame headroom, try
-     * allocating a new maptrack frame.  If there is no headroom, or we're
-     * out of memory, try stealing an entry from another VCPU (in case the
-     * guest isn't mapping across its VCPUs evenly).
-     */
-    if ( nr_maptrack_frames(lgt) < lgt->max_maptrack_frames )
-        new_mt = alloc_xenheap_page();
-
-    if ( !new_mt )
-    {
-        spin_unlock(&lgt->maptrack_lock);
-
-        /*
-         * Uninitialized free list? Steal an extra entry for the tail
-         * sentinel.
-         */
-        if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        {
-            handle = steal_maptrack_handle(lgt, curr);
-            if ( handle == INVALID_MAPTRACK_HANDLE )
-                return handle;
-            spin_lock(&curr->maptrack_freelist_lock);
-            maptrack_entry(lgt, handle).ref = MAPTRACK_TAIL;
-            curr->maptrack_tail = handle;
-            if ( curr->maptrack_head == MAPTRACK_TAIL )
-                curr->maptrack_head = handle;
-            spin_unlock(&curr->maptrack_freelist_lock);
-        }
-        return steal_maptrack_handle(lgt, curr);
-    }
-
-    clear_page(new_mt);
-
-    /*
-     * Use the first new entry and add the remaining entries to the
-     * head of the free list.
-     */
-    handle = lgt->maptrack_limit;
-
-    for ( i = 0; i < MAPTRACK_PER_PAGE; i++ )
-    {
-        BUILD_BUG_ON(sizeof(new_mt->ref) < sizeof(handle));
-        new_mt[i].ref = handle + i + 1;
-        new_mt[i].vcpu = curr->vcpu_id;
-    }
-
-    /* Set tail directly if this is the first page for the local vCPU. */
-    if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
-
-    lgt->maptrack[nr_maptrack_frames(lgt)] = new_mt;
-    smp_wmb();
-    lgt->maptrack_limit += MAPTRACK_PER_PAGE;
-
-    spin_unlock(&lgt->maptrack_lock);
-
-    spin_lock(&curr->maptrack_freelist_lock);
-    new_mt[i - 1].ref = curr->maptrack_head;
-    curr->maptrack_head = handle + 1;
-    spin_unlock(&curr->maptrack_freelist_lock);
+    if ( handle == INVALID_MAPTRACK_HANDLE )
+        handle = steal_maptrack_handle(lgt, curr);
 
     return handle;
 }
@@ -1974,6 +2060,7 @@ int grant_table_init(struct domain *d, int max_grant_frames,
     /* Simple stuff. */
     percpu_rwlock_resource_init(&gt->lock, grant_rwlock);
     spin_lock_init(&gt->maptrack_lock);
+    gt->maptrack_depot = MAPTRACK_TAIL;
 
     gt->gt_version = 1;
     gt->max_grant_frames = max_grant_frames;
@@ -2995,19 +3082,26 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
     /* Make sure the above checks are not bypassed speculatively */
     block_speculation();
 
-    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
-           op->len);
+    if ( op->len == PAGE_SIZE )
+    {
+        /* Whole frame: use the (non-temporal, where available) page copy. */
+        perfc_incr(gnttab_copy_full_page);
+        copy_page(dest->virt, src->virt);
+    }
+    else
+        memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+               op->len);
     gnttab_mark_dirty(dest->domain, dest->mfn);
     rc = GNTST_okay;
  out:
     return rc;
 }
 
-static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+static int gnttab_copy_claim_bufs(const struct gnttab_copy *op,
+                                  struct gnttab_copy_buf *dest,
+                                  struct gnttab_copy_buf *src)
 {
-    int rc;
+    int rc = GNTST_okay;
 
     if ( !src->domain || op->source.domid != src->ptr.domid ||
          !dest->domain || op->dest.domid != dest->ptr.domid )
@@ -3030,6 +3124,8 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
         if ( rc )
             goto out;
     }
+    else
+        perfc_incr(gnttab_copy_src_hit);
 
     /* Different dest? */
     if ( !gnttab_copy_buf_valid(&op->dest, dest,
@@ -3040,12 +3136,94 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
         if ( rc )
             goto out;
     }
+    else
+        perfc_incr(gnttab_copy_dest_hit);
 
-    rc = gnttab_copy_buf(op, dest, src);
  out:
     return rc;
 }
 
+static int gnttab_copy_one(const struct gnttab_copy *op,
+                           struct gnttab_copy_buf *dest,
+                           struct gnttab_copy_buf *src)
+{
+    int rc = gnttab_copy_claim_bufs(op, dest, src);
+
+    if ( rc == GNTST_okay )
+        rc = gnttab_copy_buf(op, dest, src);
+
+    return rc;
+}
+
+/*
+ * Network backends commonly split a packet into several copy ops which hit
+ * the same source and destination frames back to back, at consecutive
+ * offsets.  Return how many of the (at most nr) ops starting at op form such
+ * a run, and hence can be carried out as a single copy.
+ */
+static unsigned int gnttab_copy_run(const struct gnttab_copy *op,
+                                    unsigned int nr, unsigned int *len)
+{
+    unsigned int i;
+
+    *len = op->len;
+
+    for ( i = 1; i < nr; i++ )
+    {
+        const struct gnttab_copy *next = &op[i];
+
+        if ( next->flags != op->flags ||
+             next->source.domid != op->source.domid ||
+             next->dest.domid != op->dest.domid ||
+             next->source.u.gmfn != op->source.u.gmfn ||
+             next->dest.u.gmfn != op->dest.u.gmfn ||
+             next->source.offset != op->source.offset + *len ||
+             next->dest.offset != op->dest.offset + *len ||
+             op->source.offset + *len + next->len > PAGE_SIZE ||
+             op->dest.offset + *len + next->len > PAGE_SIZE )
+            break;
+
+        *len += next->len;
+    }
+
+    return i;
+}
+
+/*
+ * Carry out a run of ops found by gnttab_copy_run() as a single copy.
+ * Returns GNTST_okay if the whole run was copied, in which case each op
+ * succeeded.  Otherwise nothing was copied, and the ops need to be processed
+ * one by one to determine their individual status.
+ */
+static int gnttab_copy_coalesced(const struct gnttab_copy *op,
+                                 unsigned int len,
+                                 struct gnttab_copy_buf *dest,
+                                 struct gnttab_copy_buf *src)
+{
+    struct gnttab_copy run = *op;
+    int rc;
+
+    run.len = len;
+
+    rc = gnttab_copy_claim_bufs(&run, dest, src);
+    if ( rc != GNTST_okay )
+        return rc;
+
+    /*
+     * Copying within a single frame could make one op of the run read what
+     * an earlier one wrote.  Leave this to the one-by-one path, as well as
+     * runs not fitting the claimed (possibly sub-page) grants.
+     */
+    if ( mfn_eq(src->mfn, dest->mfn) ||
+         run.source.offset < src->ptr.offset ||
+         run.source.offset + len > src->ptr.offset + src->len ||
+         run.dest.offset < dest->ptr.offset ||
+         run.dest.offset + len > dest->ptr.offset + dest->len )
+        return GNTST_general_error;
+
+    return gnttab_copy_buf(&run, dest, src);
+}
+
 /*
  * gnttab_copy(), other than the various other helpers of
  * do_grant_table_op(), returns (besides possible error indicators)
@@ -3054,30 +3232,57 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
  * positive value) a non-zero value is being handed back (zero needs
  * to be avoided, as that means "success, all done").
  */
+#define GNTTAB_COPY_BATCH 16
+
 static long gnttab_copy(
     XEN_GUEST_HANDLE_PARAM(gnttab_copy_t) uop, unsigned int count)
 {
-    unsigned int i;
-    struct gnttab_copy op;
+    unsigned int i = 0, nr = 0, run = 0, len;
+    struct gnttab_copy ops[GNTTAB_COPY_BATCH], *op = ops;
     struct gnttab_copy_buf src = {};
     struct gnttab_copy_buf dest = {};
     long rc = 0;
 
-    for ( i = 0; i < count; i++ )
+    for ( ; i < count; i++, op++ )
     {
-        if ( i && hypercall_preempt_check() )
+        if ( op == ops + nr )
         {
-            rc = count - i;
-            break;
+            if ( i && hypercall_preempt_check() )
+            {
+                rc = count - i;
+                break;
+            }
+
+            nr = min_t(unsigned int, count - i, GNTTAB_COPY_BATCH);
+            op = ops;
+            if ( unlikely(__copy_from_guest(ops, uop, nr)) )
+            {
+                rc = -EFAULT;
+                break;
+            }
         }
 
-        if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+        perfc_incr(gnttab_copy_ops);
+
+        if ( run )
         {
-            rc = -EFAULT;
-            break;
+            /* Part of a run which was already copied as a whole. */
+            --run;
+            rc = GNTST_okay;
+        }
+        else if ( (run = gnttab_copy_run(op, ops + nr - op, &len)) > 1 &&
+                  (rc = gnttab_copy_coalesced(op, len, &dest, &src)) ==
+                  GNTST_okay )
+        {
+            perfc_add(gnttab_copy_merged, run - 1);
+            --run;
+        }
+        else
+        {
+            run = 0;
+            rc = gnttab_copy_one(op, &dest, &src);
         }
 
-        rc = gnttab_copy_one(&op, &dest, &src);
         if ( rc > 0 )
         {
             rc = count - i;
@@ -3089,9 +3294,9 @@ static long gnttab_copy(
             gnttab_copy_release_buf(&dest);
         }
 
-        op.status = rc;
+        op->status = rc;
         rc = 0;
-        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+        if ( unlikely(__copy_field_to_guest(uop, op, status)) )
         {
             rc = -EFAULT;
             break;
@@ -3960,9 +4165,9 @@ grant_table_destroy(
 
 void grant_table_init_vcpu(struct vcpu *v)
 {
-    spin_lock_init(&v->maptrack_freelist_lock);
     v->maptrack_head = MAPTRACK_TAIL;
-    v->maptrack_tail = MAPTRACK_TAIL;
+    v->maptrack_nr = 0;
+    v->maptrack_batch = MAPTRACK_BATCH_MIN;
 }
 
 #ifdef CONFIG_MEM_SHARING
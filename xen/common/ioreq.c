@@ -24,8 +24,10 @@
 #include <xen/irq.h>
 #include <xen/lib.h>
 #include <xen/paging.h>
+#include <xen/perfc.h>
 #include <xen/sched.h>
 #include <xen/trace.h>
+#include <xen/vmap.h>
 
 #include <asm/guest_atomics.h>
 #include <asm/ioreq.h>
@@ -79,6 +81,17 @@ static struct ioreq_server *get_ioreq_server(const struct domain *d,
     return GET_IOREQ_SERVER(d, id);
 }
 
+/*
+ * Invalidate the lookaside caches of ioreq_server_select(), after a change
+ * to the state or the ranges of a server.  Lookups racing with the change
+ * may still see the old state, as they always could.
+ */
+static void ioreq_select_invalidate(struct domain *d)
+{
+    smp_wmb();
+    write_atomic(&d->ioreq_server.select_gen, d->ioreq_server.select_gen + 1);
+}
+
 /*
  * Iterate over all possible ioreq servers.
  *
@@ -323,6 +336,87 @@ static void ioreq_server_free_mfn(struct ioreq_server *s, bool buf)
     put_page_and_type(page);
 }
 
+static void ioreq_server_free_ring(struct ioreq_server *s)
+{
+    unsigned int i;
+
+    if ( s->bufring )
+    {
+        vunmap(s->bufring);
+        s->bufring = NULL;
+    }
+
+    for ( i = 0; i < ARRAY_SIZE(s->bufring_page); i++ )
+    {
+        struct page_info *page = s->bufring_page[i];
+
+        if ( !page )
+            continue;
+
+        s->bufring_page[i] = NULL;
+
+        put_page_alloc_ref(page);
+        put_page_and_type(page);
+    }
+}
+
+/*
+ * The ring is made of individual pages, mapped contiguously, so that the
+ * emulator can map it likewise through XENMEM_acquire_resource.
+ */
+static int ioreq_server_alloc_ring(struct ioreq_server *s)
+{
+    unsigned int i, nr = 1 + (1u << s->bufring_order);
+    mfn_t mfn[MAX_NR_BUFRING_FRAMES];
+    buffered_ioreq_ring_t *ring;
+
+    BUILD_BUG_ON(sizeof(buffered_ioreq_ring_t) != PAGE_SIZE);
+    BUILD_BUG_ON(PAGE_SIZE % sizeof(buf_ioreq_t));
+
+    if ( s->bufring )
+        return 0;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct page_info *page = alloc_domheap_page(s->target,
+                                                    MEMF_no_refcount);
+
+        if ( !page )
+            goto fail;
+
+        if ( !get_page_and_type(page, s->target, PGT_writable_page) )
+        {
+            /* See ioreq_server_alloc_mfn(). */
+            domain_crash(s->emulator);
+            ioreq_server_free_ring(s);
+            return -ENODATA;
+        }
+
+        s->bufring_page[i] = page;
+        mfn[i] = page_to_mfn(page);
+    }
+
+    ring = vmap(mfn, nr);
+    if ( !ring )
+        goto fail;
+
+    for ( i = 0; i < nr; i++ )
+        clear_page((void *)ring + i * PAGE_SIZE);
+
+    ring->nr_slots = (nr - 1) * (PAGE_SIZE / sizeof(buf_ioreq_t));
+    /* Signal the first request. */
+    ring->event_pointer = 1;
+
+    s->bufring = ring;
+
+    return 0;
+
+ fail:
+    ioreq_server_free_ring(s);
+
+    return -ENOMEM;
+}
+
 bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
 {
     const struct ioreq_server *s;
@@ -333,11 +427,20 @@ bool is_ioreq_server_page(struct domain *d, const struct page_info *page)
 
     FOR_EACH_IOREQ_SERVER(d, id, s)
     {
+        unsigned int i;
+
         if ( (s->ioreq.page == page) || (s->bufioreq.page == page) )
         {
             found = true;
             break;
         }
+
+        for ( i = 0; i < ARRAY_SIZE(s->bufring_page); i++ )
+            if ( s->bufring_page[i] == page )
+                found = true;
+
+        if ( found )
+            break;
     }
 
     spin_unlock_recursive(&d->ioreq_server.lock);
@@ -470,7 +573,9 @@ static int ioreq_server_alloc_pages(struct ioreq_server *s)
 
     rc = ioreq_server_alloc_mfn(s, false);
 
-    if ( !rc && (s->bufioreq_handling != HVM_IOREQSRV_BUFIOREQ_OFF) )
+    if ( !rc && HANDLE_BUFRING(s) )
+        rc = ioreq_server_alloc_ring(s);
+    else if ( !rc && HANDLE_BUFIOREQ(s) )
         rc = ioreq_server_alloc_mfn(s, true);
 
     if ( rc )
@@ -481,6 +586,7 @@ static int ioreq_server_alloc_pages(struct ioreq_server *s)
 
 static void ioreq_server_free_pages(struct ioreq_server *s)
 {
+    ioreq_server_free_ring(s);
     ioreq_server_free_mfn(s, true);
     ioreq_server_free_mfn(s, false);
 }
@@ -547,6 +653,7 @@ static void ioreq_server_enable(struct ioreq_server *s)
     arch_ioreq_server_enable(s);
 
     s->enabled = true;
+    ioreq_select_invalidate(s->target);
 
     list_for_each_entry ( sv,
                           &s->ioreq_vcpu_list,
@@ -567,6 +674,7 @@ static void ioreq_server_disable(struct ioreq_server *s)
     arch_ioreq_server_disable(s);
 
     s->enabled = false;
+    ioreq_select_invalidate(s->target);
 
  done:
     spin_unlock(&s->lock);
@@ -574,7 +682,7 @@ static void ioreq_server_disable(struct ioreq_server *s)
 
 static int ioreq_server_init(struct ioreq_server *s,
                              struct domain *d, int bufioreq_handling,
-                             ioservid_t id)
+                             unsigned int bufring_order, ioservid_t id)
 {
     struct domain *currd = current->domain;
     struct vcpu *v;
@@ -597,6 +705,7 @@ static int ioreq_server_init(struct ioreq_server *s,
         return rc;
 
     s->bufioreq_handling = bufioreq_handling;
+    s->bufring_order = bufring_order;
 
     for_each_vcpu ( d, v )
     {
@@ -640,7 +749,7 @@ static void ioreq_server_deinit(struct ioreq_server *s)
 }
 
 static int ioreq_server_create(struct domain *d, int bufioreq_handling,
-                               ioservid_t *id)
+                               unsigned int bufring_order, ioservid_t *id)
 {
     struct ioreq_server *s;
     unsigned int i;
@@ -649,7 +758,12 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
     if ( !IS_ENABLED(CONFIG_X86) && bufioreq_handling )
         return -EINVAL;
 
-    if ( bufioreq_handling > HVM_IOREQSRV_BUFIOREQ_ATOMIC )
+    if ( bufioreq_handling > HVM_IOREQSRV_BUFIOREQ_RING )
+        return -EINVAL;
+
+    if ( bufioreq_handling == HVM_IOREQSRV_BUFIOREQ_RING
+         ? bufring_order > IOREQ_BUFFER_RING_MAX_ORDER
+         : bufring_order )
         return -EINVAL;
 
     s = xzalloc(struct ioreq_server);
@@ -675,7 +789,7 @@ static int ioreq_server_create(struct domain *d, int bufioreq_handling,
      */
     set_ioreq_server(d, i, s);
 
-    rc = ioreq_server_init(s, d, bufioreq_handling, i);
+    rc = ioreq_server_init(s, d, bufioreq_handling, bufring_order, i);
     if ( rc )
     {
         set_ioreq_server(d, i, NULL);
@@ -762,6 +876,11 @@ static int ioreq_server_get_info(struct domain *d, ioservid_t id,
 
     if ( ioreq_gfn || bufioreq_gfn )
     {
+        /* The ring can only be mapped as a resource. */
+        rc = -EOPNOTSUPP;
+        if ( HANDLE_BUFRING(s) )
+            goto out;
+
         rc = arch_ioreq_server_map_pages(s);
         if ( rc )
             goto out;
@@ -811,11 +930,28 @@ int ioreq_server_get_frame(struct domain *d, ioservid_t id,
     if ( rc )
         goto out;
 
+    if ( idx >= XENMEM_resource_ioreq_server_frame_bufring(0) )
+    {
+        idx -= XENMEM_resource_ioreq_server_frame_bufring(0);
+
+        rc = -ENOENT;
+        if ( !HANDLE_BUFRING(s) )
+            goto out;
+
+        rc = -EINVAL;
+        if ( idx > (1u << s->bufring_order) )
+            goto out;
+
+        *mfn = page_to_mfn(s->bufring_page[idx]);
+        rc = 0;
+        goto out;
+    }
+
     switch ( idx )
     {
     case XENMEM_resource_ioreq_server_frame_bufioreq:
         rc = -ENOENT;
-        if ( !HANDLE_BUFIOREQ(s) )
+        if ( !HANDLE_BUFIOREQ(s) || HANDLE_BUFRING(s) )
             goto out;
 
         *mfn = page_to_mfn(s->bufioreq.page);
@@ -883,6 +1019,8 @@ static int ioreq_server_map_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_add_range(r, start, end);
+    if ( !rc )
+        ioreq_select_invalidate(d);
 
  out:
     spin_unlock_recursive(&d->ioreq_server.lock);
@@ -935,6 +1073,8 @@ static int ioreq_server_unmap_io_range(struct domain *d, ioservid_t id,
         goto out;
 
     rc = rangeset_remove_range(r, start, end);
+    if ( !rc )
+        ioreq_select_invalidate(d);
 
  out:
     spin_unlock_recursive(&d->ioreq_server.lock);
@@ -1096,60 +1236,160 @@ void ioreq_server_destroy_all(struct domain *d)
     spin_unlock_recursive(&d->ioreq_server.lock);
 }
 
+/* Returns MAX_NR_IOREQ_SERVERS if no server claims the range. */
+static unsigned int ioreq_server_lookup(const struct domain *d, uint8_t type,
+                                        unsigned long start, unsigned long end)
+{
+    struct ioreq_server *s;
+    unsigned int id;
+
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+    {
+        if ( s->enabled &&
+             rangeset_contains_range(s->range[type], start, end) )
+            return id;
+    }
+
+    return MAX_NR_IOREQ_SERVERS;
+}
+
 struct ioreq_server *ioreq_server_select(struct domain *d,
                                          ioreq_t *p)
 {
+    struct vcpu_io *vio = &current->io;
+    struct ioreq_select_entry *e;
     struct ioreq_server *s;
     uint8_t type;
     uint64_t addr;
-    unsigned int id;
+    unsigned long start, end, gen;
+    unsigned int i, id;
 
     if ( !arch_ioreq_server_get_type_addr(d, p, &type, &addr) )
         return NULL;
 
-    FOR_EACH_IOREQ_SERVER(d, id, s)
+    switch ( type )
     {
-        struct rangeset *r;
+    case XEN_DMOP_IO_RANGE_PORT:
+        start = addr;
+        end = start + p->size - 1;
+        break;
 
-        if ( !s->enabled )
-            continue;
+    case XEN_DMOP_IO_RANGE_MEMORY:
+        start = ioreq_mmio_first_byte(p);
+        end = ioreq_mmio_last_byte(p);
+        break;
 
-        r = s->range[type];
+    case XEN_DMOP_IO_RANGE_PCI:
+        start = end = addr >> 32;
+        break;
+
+    default:
+        ASSERT_UNREACHABLE();
+        return NULL;
+    }
+
+    /* Only the current vCPU's cache can be used without locking. */
+    if ( d != current->domain )
+    {
+        id = ioreq_server_lookup(d, type, start, end);
+        goto found;
+    }
+
+    gen = read_atomic(&d->ioreq_server.select_gen);
+    smp_rmb();
+
+    for ( i = 0; i < ARRAY_SIZE(vio->select); i++ )
+    {
+        e = &vio->select[i];
 
-        switch ( type )
+        if ( e->gen == gen && e->type == type &&
+             e->start == start && e->end == end )
         {
-            unsigned long start, end;
+            perfc_incr(ioreq_select_hit);
+            id = e->id;
+            goto found;
+        }
+    }
 
-        case XEN_DMOP_IO_RANGE_PORT:
-            start = addr;
-            end = start + p->size - 1;
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    perfc_incr(ioreq_select_miss);
 
-            break;
+    id = ioreq_server_lookup(d, type, start, end);
 
-        case XEN_DMOP_IO_RANGE_MEMORY:
-            start = ioreq_mmio_first_byte(p);
-            end = ioreq_mmio_last_byte(p);
+    e = &vio->select[vio->select_next++ % ARRAY_SIZE(vio->select)];
+    e->gen = gen;
+    e->type = type;
+    e->start = start;
+    e->end = end;
+    e->id = id;
 
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+ found:
+    s = get_ioreq_server(d, id);
+    if ( s && type == XEN_DMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
+    }
 
-            break;
+    return s;
+}
 
-        case XEN_DMOP_IO_RANGE_PCI:
-            if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
-            }
+static int ioreq_send_bufring(struct ioreq_server *s, buf_ioreq_t bp,
+                              bool qw, uint32_t data_hi)
+{
+    struct domain *d = current->domain;
+    buffered_ioreq_ring_t *ring = s->bufring;
+    buf_ioreq_t *slot;
+    uint32_t nr = 1u << (s->bufring_order + PAGE_SHIFT - 3);
+    uint32_t wp, n = qw ? 2 : 1;
 
-            break;
-        }
+    if ( !ring )
+        return IOREQ_STATUS_UNHANDLED;
+
+    slot = IOREQ_BUFFER_RING_SLOTS(ring);
+
+    spin_lock(&s->bufioreq_lock);
+
+    /*
+     * The pointers are shared with the emulator.  Bogus values can only
+     * cause requests to be lost or to take the synchronous path.
+     */
+    wp = ring->write_pointer;
+    if ( wp - ACCESS_ONCE(ring->read_pointer) > nr - n )
+    {
+        /* The queue is full: send the iopacket through the normal path. */
+        spin_unlock(&s->bufioreq_lock);
+        return IOREQ_STATUS_UNHANDLED;
     }
 
-    return NULL;
+    slot[wp & (nr - 1)] = bp;
+
+    if ( qw )
+    {
+        bp.data = data_hi;
+        slot[(wp + 1) & (nr - 1)] = bp;
+    }
+
+    /* Make the ioreq_t visible /before/ write_pointer. */
+    smp_wmb();
+    ring->write_pointer = wp + n;
+
+    perfc_incr(ioreq_bufring_sent);
+
+    /*
+     * Only notify if the consumer asked to be, i.e. it is about to wait or
+     * already waiting.  Order the write_pointer update against reading
+     * event_pointer, pairing with the consumer's final check.
+     */
+    smp_mb();
+    if ( wp + n - ACCESS_ONCE(ring->event_pointer) < n )
+    {
+        perfc_incr(ioreq_bufring_notify);
+        notify_via_xen_event_channel(d, s->bufioreq_evtchn);
+    }
+
+    spin_unlock(&s->bufioreq_lock);
+
+    return IOREQ_STATUS_HANDLED;
 }
 
 static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
@@ -1170,7 +1410,7 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
     iorp = &s->bufioreq;
     pg = iorp->va;
 
-    if ( !pg )
+    if ( !pg && !HANDLE_BUFRING(s) )
         return IOREQ_STATUS_UNHANDLED;
 
     /*
@@ -1204,6 +1444,9 @@ static int ioreq_send_buffered(struct ioreq_server *s, ioreq_t *p)
         return IOREQ_STATUS_UNHANDLED;
     }
 
+    if ( HANDLE_BUFRING(s) )
+        return ioreq_send_bufring(s, bp, qw, p->data >> 32);
+
     spin_lock(&s->bufioreq_lock);
 
     if ( (pg->ptrs.write_pointer - pg->ptrs.read_pointer) >=
@@ -1331,6 +1574,8 @@ unsigned int ioreq_broadcast(ioreq_t *p, bool buffered)
 void ioreq_domain_init(struct domain *d)
 {
     spin_lock_init(&d->ioreq_server.lock);
+    /* Generation 0 marks unused cache entries. */
+    d->ioreq_server.select_gen = 1;
 
     arch_ioreq_domain_init(d);
 }
@@ -1349,11 +1594,11 @@ int ioreq_server_dm_op(struct xen_dm_op *op, struct domain *d, bool *const_op)
         *const_op = false;
 
         rc = -EINVAL;
-        if ( data->pad[0] || data->pad[1] || data->pad[2] )
+        if ( data->pad[0] || data->pad[1] )
             break;
 
         rc = ioreq_server_create(d, data->handle_bufioreq,
-                                 &data->id);
+                                 data->bufioreq_order, &data->id);
         break;
     }
 
@@ -1126,8 +1126,18 @@ unsigned int ioreq_server_max_frames(const struct domain *d)
 
 #ifdef CONFIG_IOREQ_SERVER
     if ( is_hvm_domain(d) )
+    {
         /* One frame for the buf-ioreq ring, and one frame per 128 vcpus. */
         nr = 1 + DIV_ROUND_UP(d->max_vcpus * sizeof(struct ioreq), PAGE_SIZE);
+
+        /* Followed, at a fixed offset, by the multi-frame buffered ring. */
+        if ( IS_ENABLED(CONFIG_X86) )
+        {
+            ASSERT(nr <= XENMEM_resource_ioreq_server_frame_bufring(0));
+            nr = XENMEM_resource_ioreq_server_frame_bufring(
+                     MAX_NR_BUFRING_FRAMES);
+        }
+    }
 #endif
 
     return nr;
@@ -1154,6 +1164,11 @@ static unsigned int resource_max_frames(const struct domain *d,
     case XENMEM_resource_vmtrace_buf:
         return d->vmtrace_size >> PAGE_SHIFT;
 
+#ifdef CONFIG_X86
+    case XENMEM_resource_dirty_ring:
+        return paging_dirty_ring_max_frames(d);
+#endif
+
     default:
         return -EOPNOTSUPP;
     }
@@ -1217,6 +1232,31 @@ static int acquire_vmtrace_buf(
     return nr_frames;
 }
 
+static int acquire_dirty_ring(
+    struct domain *d, unsigned int id, unsigned int frame,
+    unsigned int nr_frames, xen_pfn_t mfn_list[])
+{
+#ifdef CONFIG_X86
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < nr_frames; i++ )
+    {
+        mfn_t mfn;
+
+        rc = paging_dirty_ring_get_frame(d, id, frame + i, &mfn);
+        if ( rc )
+            return rc;
+
+        mfn_list[i] = mfn_x(mfn);
+    }
+
+    return nr_frames;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
 /*
  * Returns -errno on error, or positive in the range [1, nr_frames] on
  * success.  Returning less than nr_frames contitutes a request for a
@@ -1237,6 +1277,9 @@ static int _acquire_resource(
     case XENMEM_resource_vmtrace_buf:
         return acquire_vmtrace_buf(d, id, frame, nr_frames, mfn_list);
 
+    case XENMEM_resource_dirty_ring:
+        return acquire_dirty_ring(d, id, frame, nr_frames, mfn_list);
+
     default:
         return -EOPNOTSUPP;
     }
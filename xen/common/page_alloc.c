@@ -120,6 +120,7 @@
  *   regions within it.
  */
 
+#include <xen/cpu.h>
 #include <xen/domain_page.h>
 #include <xen/event.h>
 #include <xen/init.h>
@@ -136,6 +137,8 @@
 #include <xen/sched.h>
 #include <xen/softirq.h>
 #include <xen/spinlock.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
 
 #include <asm/flushtlb.h>
 #include <asm/numa.h>
@@ -230,6 +233,13 @@ size_param("bootscrub_chunk", opt_bootscrub_chunk);
 static bool __read_mostly opt_scrub_domheap;
 boolean_param("scrub-domheap", opt_scrub_domheap);
 
+/*
+ * scrub-budget -> Percentage of a CPU each node's scrub worker may use for
+ * scrubbing free pages in the background, even if the node's CPUs are busy.
+ */
+static unsigned int __read_mostly opt_scrub_budget = 10;
+integer_param("scrub-budget", opt_scrub_budget);
+
 #ifdef CONFIG_SCRUB_DEBUG
 static bool __read_mostly scrub_debug;
 #else
@@ -503,11 +513,20 @@ out:
     return d->tot_pages;
 }
 
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags,
+    struct domain *d);
+static bool page_cache_drain_all(void);
+
 int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
 {
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
 
+    /* Cached pages count as allocated: give them back for the claim. */
+    if ( pages )
+        page_cache_drain_all();
+
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
@@ -934,7 +953,7 @@ static struct page_info *alloc_heap_pages(
     unsigned int i, buddy_order, zone, first_dirty;
     unsigned long request = 1UL << order;
     struct page_info *pg;
-    bool need_tlbflush = false;
+    bool need_tlbflush = false, drained = false;
     uint32_t tlbflush_timestamp = 0;
     unsigned int dirty_cnt = 0;
     mfn_t mfn;
@@ -948,6 +967,11 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    if ( order == 0 && (pg = page_cache_alloc(zone_lo, zone_hi,
+                                              memflags, d)) != NULL )
+        return pg;
+
+ retry:
     spin_lock(&heap_lock);
 
     /*
@@ -957,20 +981,28 @@ static struct page_info *alloc_heap_pages(
     if ( (outstanding_claims + request > total_avail_pages) &&
           ((memflags & MEMF_no_refcount) ||
            !d || d->outstanding_pages < request) )
+        pg = NULL;
+    else
     {
-        spin_unlock(&heap_lock);
-        return NULL;
+        pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
+        /* Try getting a dirty buddy if we couldn't get a clean one. */
+        if ( !pg && !(memflags & MEMF_no_scrub) )
+            pg = get_free_buddy(zone_lo, zone_hi, order,
+                                memflags | MEMF_no_scrub, d);
     }
 
-    pg = get_free_buddy(zone_lo, zone_hi, order, memflags, d);
-    /* Try getting a dirty buddy if we couldn't get a clean one. */
-    if ( !pg && !(memflags & MEMF_no_scrub) )
-        pg = get_free_buddy(zone_lo, zone_hi, order,
-                            memflags | MEMF_no_scrub, d);
     if ( !pg )
     {
-        /* No suitable memory blocks. Fail the request. */
         spin_unlock(&heap_lock);
+
+        /* Return cached pages to the heap before giving up. */
+        if ( !drained && page_cache_drain_all() )
+        {
+            drained = true;
+            goto retry;
+        }
+
+        /* No suitable memory blocks. Fail the request. */
         return NULL;
     }
 
@@ -1264,19 +1296,19 @@ static void cf_check scrub_continue(void *data)
     }
 }
 
-bool scrub_free_pages(void)
+/*
+ * Scrub free pages of @node, whose bit in node_scrubbing the caller must have
+ * set, until done or asked to preempt.  A non-zero @deadline limits the time
+ * spent scrubbing.
+ */
+static void scrub_node(nodeid_t node, s_time_t deadline)
 {
     struct page_info *pg;
     unsigned int zone;
     unsigned int cpu = smp_processor_id();
     bool preempt = false;
-    nodeid_t node;
     unsigned int cnt = 0;
 
-    node = node_to_scrub(true);
-    if ( node == NUMA_NO_NODE )
-        return false;
-
     spin_lock(&heap_lock);
 
     for ( zone = 0; zone < NR_ZONES; zone++ )
@@ -1330,7 +1362,7 @@ bool scrub_free_pages(void)
                         spin_lock(&heap_lock);
                         node_need_scrub[node] -= dirty_cnt;
                         spin_unlock(&heap_lock);
-                        goto out_nolock;
+                        return;
                     }
 
                     /*
@@ -1341,7 +1373,9 @@ bool scrub_free_pages(void)
                      * a request to preempt immediately, to not unduly delay
                      * its offlining.
                      */
-                    if ( !cpu_online(cpu) || (cnt > 800 && softirq_pending(cpu)) )
+                    if ( !cpu_online(cpu) ||
+                         (cnt > 800 && (softirq_pending(cpu) ||
+                                        (deadline && NOW() >= deadline))) )
                     {
                         preempt = true;
                         break;
@@ -1383,13 +1417,232 @@ bool scrub_free_pages(void)
 
  out:
     spin_unlock(&heap_lock);
+}
+
+bool scrub_free_pages(void)
+{
+    nodeid_t node = node_to_scrub(true);
+
+    if ( node == NUMA_NO_NODE )
+        return false;
+
+    scrub_node(node, 0);
 
- out_nolock:
     node_clear(node, node_scrubbing);
     return node_to_scrub(false) != NUMA_NO_NODE;
 }
 
-static bool mark_page_free(struct page_info *pg, mfn_t mfn)
+/*
+ * Idle CPUs only scrub when there's nothing else to do, which may leave a
+ * large backlog (e.g. after destroying a big domain) on busy nodes.  Hence
+ * each node also has a scrub worker: a softirq tasklet on one of the node's
+ * online CPUs (or, for memory-only nodes, any online CPU), which gets to
+ * scrub for opt_scrub_budget percent of every SCRUB_PERIOD.  Workers move
+ * away from CPUs going offline.
+ */
+#define SCRUB_PERIOD       MILLISECS(10)
+#define SCRUB_RETRY        MICROSECS(100)
+
+struct scrub_worker {
+    struct tasklet tasklet;
+    struct timer timer;
+    nodeid_t node;
+    unsigned int cpu;
+    bool active;        /* Tasklet or timer pending. */
+    s_time_t period_end;
+    s_time_t budget;    /* Left in the current period. */
+};
+
+static struct scrub_worker *__read_mostly scrub_workers[MAX_NUMNODES];
+
+static void scrub_worker_kick(nodeid_t node)
+{
+    struct scrub_worker *w = scrub_workers[node];
+
+    if ( w && !test_and_set_bool(w->active) )
+        tasklet_schedule_on_cpu(&w->tasklet, w->cpu);
+}
+
+static void cf_check scrub_worker_timer(void *data)
+{
+    struct scrub_worker *w = data;
+
+    tasklet_schedule_on_cpu(&w->tasklet, w->cpu);
+}
+
+static void cf_check scrub_worker_fn(void *data)
+{
+    struct scrub_worker *w = data;
+    s_time_t now = NOW();
+
+    if ( now >= w->period_end )
+    {
+        w->period_end = now + SCRUB_PERIOD;
+        w->budget = SCRUB_PERIOD / 100 * opt_scrub_budget;
+    }
+
+    /* Leave the node alone if an idle CPU is scrubbing it already. */
+    if ( w->budget > 0 && !node_test_and_set(w->node, node_scrubbing) )
+    {
+        scrub_node(w->node, now + w->budget);
+        node_clear(w->node, node_scrubbing);
+        w->budget -= NOW() - now;
+    }
+
+    if ( !node_need_scrub[w->node] )
+    {
+        w->active = false;
+        smp_mb();
+        /* Re-check, to not miss a kick racing with the above. */
+        if ( !node_need_scrub[w->node] || test_and_set_bool(w->active) )
+            return;
+    }
+
+    set_timer(&w->timer, w->budget > 0 ? NOW() + SCRUB_RETRY : w->period_end);
+}
+
+/* Pick an online CPU other than @exclude, preferably one of @node's. */
+static unsigned int scrub_worker_cpu(nodeid_t node, unsigned int exclude)
+{
+    unsigned int cpu;
+
+    for_each_cpu ( cpu, &node_to_cpumask(node) )
+        if ( cpu != exclude && cpu_online(cpu) )
+            return cpu;
+
+    for_each_online_cpu ( cpu )
+        if ( cpu != exclude )
+            return cpu;
+
+    return exclude;
+}
+
+static void scrub_worker_move(struct scrub_worker *w, unsigned int cpu)
+{
+    /* A tasklet already queued on the old CPU gets migrated when it dies. */
+    w->cpu = cpu;
+    migrate_timer(&w->timer, cpu);
+}
+
+static int cf_check scrub_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    nodeid_t node;
+
+    for_each_online_node ( node )
+    {
+        struct scrub_worker *w = scrub_workers[node];
+
+        if ( !w )
+            continue;
+
+        switch ( action )
+        {
+        case CPU_DOWN_PREPARE:
+            if ( w->cpu == cpu )
+                scrub_worker_move(w, scrub_worker_cpu(node, cpu));
+            break;
+
+        case CPU_ONLINE:
+            /* Move back home once one of the node's CPUs is available. */
+            if ( cpu_to_node(cpu) == node &&
+                 cpu_to_node(w->cpu) != node )
+                scrub_worker_move(w, cpu);
+            break;
+        }
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block scrub_cpu_nfb = {
+    .notifier_call = scrub_cpu_callback,
+};
+
+static int __init cf_check scrub_workers_init(void)
+{
+    nodeid_t node;
+
+    if ( !opt_scrub_budget )
+        return 0;
+
+    if ( opt_scrub_budget > 100 )
+        opt_scrub_budget = 100;
+
+    for_each_online_node ( node )
+    {
+        struct scrub_worker *w = xzalloc(struct scrub_worker);
+
+        if ( !w )
+            return -ENOMEM;
+
+        w->node = node;
+        w->cpu = scrub_worker_cpu(node, nr_cpu_ids);
+        softirq_tasklet_init(&w->tasklet, scrub_worker_fn, w);
+        init_timer(&w->timer, scrub_worker_timer, w, w->cpu);
+
+        scrub_workers[node] = w;
+        if ( node_need_scrub[node] )
+            scrub_worker_kick(node);
+    }
+
+    register_cpu_notifier(&scrub_cpu_nfb);
+
+    return 0;
+}
+__initcall(scrub_workers_init);
+
+unsigned long scrub_pending_pages(unsigned int node)
+{
+    unsigned long pages = 0;
+
+    if ( node != NUMA_NO_NODE )
+        return node_need_scrub[node];
+
+    for_each_online_node ( node )
+        pages += node_need_scrub[node];
+
+    return pages;
+}
+
+/*
+ * Scrub all free pages of @node (or of all nodes, for NUMA_NO_NODE), helping
+ * the workers and idle CPUs.  Returns -ERESTART if preemption is needed.
+ */
+int scrub_wait(unsigned int node)
+{
+    unsigned int n = node == NUMA_NO_NODE ? first_node(node_online_map) : node;
+
+    for ( ; ; )
+    {
+        while ( node_need_scrub[n] )
+        {
+            if ( hypercall_preempt_check() )
+                return -ERESTART;
+
+            /* Wait for whoever is scrubbing the node at the moment. */
+            if ( node_test_and_set(n, node_scrubbing) )
+            {
+                cpu_relax();
+                continue;
+            }
+
+            scrub_node(n, NOW() + SCRUB_PERIOD);
+            node_clear(n, node_scrubbing);
+        }
+
+        if ( node != NUMA_NO_NODE )
+            break;
+        n = next_node(n, node_online_map);
+        if ( n >= MAX_NUMNODES )
+            break;
+    }
+
+    return 0;
+}
+
+static bool mark_page_free(struct page_info *pg, mfn_t mfn, bool cached)
 {
     bool pg_offlined = false;
 
@@ -1428,10 +1681,19 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
         BUG();
     }
 
-    /* If a page has no owner it will need no safety TLB flush. */
-    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
-    if ( pg->u.free.need_tlbflush )
-        page_set_tlbflush_timestamp(pg);
+    /*
+     * If a page has no owner it will need no safety TLB flush.  Pages coming
+     * from a per-CPU cache lost their owner already, but page_cache_free()
+     * recorded whether a flush is still pending.
+     */
+    if ( cached )
+        ASSERT(!page_get_owner(pg));
+    else
+    {
+        pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+        if ( pg->u.free.need_tlbflush )
+            page_set_tlbflush_timestamp(pg);
+    }
 
     /* This page is not a guest frame any more. */
     page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
@@ -1440,9 +1702,12 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
     return pg_offlined;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order, bool need_scrub)
+/*
+ * Free 2^@order set of pages.  Caller must hold heap_lock.  @cached pages
+ * come from a per-CPU cache, and keep their TLB flush state.
+ */
+static void free_heap_pages_locked(
+    struct page_info *pg, unsigned int order, bool need_scrub, bool cached)
 {
     unsigned long mask;
     mfn_t mfn = page_to_mfn(pg);
@@ -1451,12 +1716,11 @@ static void free_heap_pages(
     bool pg_offlined = false;
 
     ASSERT(order <= MAX_ORDER);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
-        if ( mark_page_free(&pg[i], mfn_add(mfn, i)) )
+        if ( mark_page_free(&pg[i], mfn_add(mfn, i), cached) )
             pg_offlined = true;
 
         if ( need_scrub )
@@ -1535,10 +1799,288 @@ static void free_heap_pages(
 
     if ( pg_offlined )
         reserve_offlined_page(pg);
+}
+
+static bool page_cache_free(struct page_info *pg);
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    if ( order == 0 && !need_scrub && page_cache_free(pg) )
+        return;
+
+    spin_lock(&heap_lock);
+    free_heap_pages_locked(pg, order, need_scrub, false);
+    spin_unlock(&heap_lock);
+
+    if ( need_scrub )
+        scrub_worker_kick(page_to_nid(pg));
+}
+
+/*
+ * Per-CPU caches of single pages, keeping the bulk of order-0 allocations
+ * and frees (ballooning, PoD, p2m page tables, ...) off heap_lock.  Pages
+ * move between a cache and the heap in batches.  Cached pages are clean, and
+ * are accounted as allocated; all caches get drained before an allocation is
+ * failed, or a claim is staked.
+ */
+#define PAGE_CACHE_BATCH_ORDER 4
+#define PAGE_CACHE_BATCH       (1U << PAGE_CACHE_BATCH_ORDER)
+#define PAGE_CACHE_HIGH        (4 * PAGE_CACHE_BATCH)
+
+struct page_cache {
+    spinlock_t lock;
+    struct page_list_head pages;
+    unsigned int count;
+};
 
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+static bool __read_mostly page_cache_enabled;
+
+static void page_cache_release(struct page_list_head *list)
+{
+    struct page_info *pg;
+
+    spin_lock(&heap_lock);
+    while ( (pg = page_list_remove_head(list)) != NULL )
+        free_heap_pages_locked(pg, 0, false, true);
     spin_unlock(&heap_lock);
 }
 
+/* Move a batch of pages from the heap to the local cache. */
+static bool page_cache_refill(unsigned int zone_lo, unsigned int zone_hi,
+                              unsigned int memflags)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    struct page_info *pg;
+    unsigned int i;
+
+    pg = alloc_heap_pages(zone_lo, zone_hi, PAGE_CACHE_BATCH_ORDER,
+                          memflags & (MEMF_node_mask << _MEMF_node), NULL);
+    if ( !pg )
+        return false;
+
+    spin_lock(&pc->lock);
+    for ( i = 0; i < PAGE_CACHE_BATCH; i++ )
+    {
+        /* Nothing to flush: alloc_heap_pages() took care of that. */
+        pg[i].u.free.need_tlbflush = false;
+        page_list_add_tail(&pg[i], &pc->pages);
+    }
+    pc->count += PAGE_CACHE_BATCH;
+    spin_unlock(&pc->lock);
+
+    perfc_incr(page_cache_refill);
+
+    return true;
+}
+
+static struct page_info *page_cache_get(unsigned int zone_lo,
+                                        unsigned int zone_hi,
+                                        unsigned int memflags,
+                                        const struct domain *d)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    nodeid_t node = MEMF_get_node(memflags);
+    struct page_info *pg;
+
+    spin_lock(&pc->lock);
+
+    pg = page_list_first(&pc->pages);
+    if ( pg &&
+         page_to_zone(pg) >= zone_lo && page_to_zone(pg) <= zone_hi &&
+         (node == NUMA_NO_NODE || node == page_to_nid(pg)) &&
+         (!d || nodemask_test(page_to_nid(pg), &d->node_affinity)) )
+    {
+        page_list_del(pg, &pc->pages);
+        pc->count--;
+    }
+    else
+        pg = NULL;
+
+    spin_unlock(&pc->lock);
+
+    return pg;
+}
+
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags,
+    struct domain *d)
+{
+    struct page_info *pg;
+    uint32_t tlbflush_timestamp = 0;
+    bool need_tlbflush = false;
+
+    if ( !page_cache_enabled || scrub_debug )
+        return NULL;
+
+    pg = page_cache_get(zone_lo, zone_hi, memflags, d);
+    if ( !pg && !this_cpu(page_cache).count &&
+         page_cache_refill(zone_lo, zone_hi, memflags) )
+        pg = page_cache_get(zone_lo, zone_hi, memflags, d);
+    if ( !pg )
+    {
+        perfc_incr(page_cache_miss);
+        return NULL;
+    }
+
+    /* Pages to be offlined can only leave the cache towards the heap. */
+    if ( unlikely(!page_state_is(pg, inuse)) )
+    {
+        spin_lock(&heap_lock);
+        free_heap_pages_locked(pg, 0, false, true);
+        spin_unlock(&heap_lock);
+        return NULL;
+    }
+
+    perfc_incr(page_cache_hit);
+
+    if ( d != NULL )
+        d->last_alloc_node = page_to_nid(pg);
+
+    if ( !(memflags & MEMF_no_tlbflush) )
+    {
+        accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+        if ( need_tlbflush )
+            filtered_flush_tlb_mask(tlbflush_timestamp);
+    }
+
+    /* Initialise fields which have other uses for cached pages. */
+    pg->u.inuse.type_info = PGT_TYPE_INFO_INITIALIZER;
+
+    flush_page_to_ram(mfn_x(page_to_mfn(pg)),
+                      !(memflags & MEMF_no_icache_flush));
+
+    return pg;
+}
+
+static bool page_cache_free(struct page_info *pg)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    PAGE_LIST_HEAD(excess);
+    unsigned int i;
+
+    /* Keep the caches node local. */
+    if ( !page_cache_enabled || scrub_debug ||
+         !page_state_is(pg, inuse) || (pg->count_info & PGC_broken) ||
+         page_to_nid(pg) != cpu_to_node(smp_processor_id()) )
+        return false;
+
+    /* As mark_page_free() does for pages going back to the heap. */
+    pg->count_info = PGC_state_inuse;
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        page_set_tlbflush_timestamp(pg);
+    page_set_owner(pg, NULL);
+    set_gpfn_from_mfn(mfn_x(page_to_mfn(pg)), INVALID_M2P_ENTRY);
+
+    spin_lock(&pc->lock);
+
+    /* Most recently freed pages are the most likely to be cache hot. */
+    page_list_add(pg, &pc->pages);
+    if ( ++pc->count > PAGE_CACHE_HIGH )
+    {
+        for ( i = 0; i < 2 * PAGE_CACHE_BATCH; i++ )
+        {
+            struct page_info *tail = page_list_last(&pc->pages);
+
+            page_list_del(tail, &pc->pages);
+            page_list_add(tail, &excess);
+        }
+        pc->count -= i;
+    }
+
+    spin_unlock(&pc->lock);
+
+    if ( !page_list_empty(&excess) )
+    {
+        page_cache_release(&excess);
+        perfc_incr(page_cache_drain);
+    }
+
+    return true;
+}
+
+/* Return all pages of a CPU's cache to the heap. */
+static bool page_cache_drain(unsigned int cpu)
+{
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    PAGE_LIST_HEAD(pages);
+
+    spin_lock(&pc->lock);
+    page_list_splice(&pc->pages, &pages);
+    INIT_PAGE_LIST_HEAD(&pc->pages);
+    pc->count = 0;
+    spin_unlock(&pc->lock);
+
+    if ( page_list_empty(&pages) )
+        return false;
+
+    page_cache_release(&pages);
+
+    return true;
+}
+
+static bool page_cache_drain_all(void)
+{
+    unsigned int cpu;
+    bool drained = false;
+
+    if ( !page_cache_enabled )
+        return false;
+
+    for_each_online_cpu ( cpu )
+        if ( per_cpu(page_cache, cpu).count && page_cache_drain(cpu) )
+            drained = true;
+
+    if ( drained )
+        perfc_incr(page_cache_drain_all);
+
+    return drained;
+}
+
+static int cf_check page_cache_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pc->lock);
+        INIT_PAGE_LIST_HEAD(&pc->pages);
+        pc->count = 0;
+        break;
+
+    case CPU_DEAD:
+        page_cache_drain(cpu);
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block page_cache_cpu_nfb = {
+    .notifier_call = page_cache_cpu_callback,
+};
+
+static int __init cf_check page_cache_init(void)
+{
+    unsigned int cpu;
+
+    for_each_online_cpu ( cpu )
+        page_cache_cpu_callback(&page_cache_cpu_nfb, CPU_UP_PREPARE,
+                                (void *)(unsigned long)cpu);
+    register_cpu_notifier(&page_cache_cpu_nfb);
+
+    page_cache_enabled = true;
+
+    return 0;
+}
+__initcall(page_cache_init);
+
 
 /*
  * Following rules applied for page offline:
@@ -2712,7 +3254,7 @@ void unprepare_staticmem_pages(struct page_info *pg, unsigned long nr_mfns,
 
     for ( i = 0; i < nr_mfns; i++ )
     {
-        mark_page_free(&pg[i], mfn_add(mfn, i));
+        mark_page_free(&pg[i], mfn_add(mfn, i), false);
 
         if ( need_scrub )
         {
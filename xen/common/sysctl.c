@@ -171,6 +171,29 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
         op->u.availheap.avail_bytes <<= PAGE_SHIFT;
         break;
 
+    case XEN_SYSCTL_scrub_op:
+    {
+        struct xen_sysctl_scrub_op *so = &op->u.scrub_op;
+        unsigned int node = so->node < 0 ? NUMA_NO_NODE : so->node;
+
+        ret = -EINVAL;
+        if ( (so->flags & ~XEN_SYSCTL_SCRUB_WAIT) ||
+             (node != NUMA_NO_NODE &&
+              (node >= MAX_NUMNODES || !node_online(node))) )
+            break;
+
+        ret = (so->flags & XEN_SYSCTL_SCRUB_WAIT) ? scrub_wait(node) : 0;
+        if ( ret == -ERESTART )
+        {
+            ret = hypercall_create_continuation(__HYPERVISOR_sysctl,
+                                                "h", u_sysctl);
+            break;
+        }
+
+        so->pending = scrub_pending_pages(node);
+        break;
+    }
+
 #if defined (CONFIG_ACPI) && defined (CONFIG_HAS_CPUFREQ)
     case XEN_SYSCTL_get_pmstat:
         ret = do_get_pm_info(&op->u.get_pmstat);
@@ -741,7 +741,8 @@ static void cf_check amd_dump_page_tables(struct domain *d)
     if ( !hd->arch.amd.root_table )
         return;
 
-    printk("AMD IOMMU %pd table has %u levels\n", d, hd->arch.amd.paging_mode);
+    printk("AMD IOMMU %pd table has %u levels, %u pages\n", d,
+           hd->arch.amd.paging_mode, hd->arch.pgtables.nr);
     amd_dump_page_table_level(hd->arch.amd.root_table,
                               hd->arch.amd.paging_mode, 0, 0);
 }
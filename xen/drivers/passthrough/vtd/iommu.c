@@ -734,7 +734,7 @@ static int __must_check cf_check iommu_flush_iotlb(struct domain *d, dfn_t dfn,
     struct vtd_iommu *iommu;
     bool_t flush_dev_iotlb;
     int iommu_domid;
-    int ret = 0;
+    int ret = 0, rc;
 
     if ( flush_flags & IOMMU_FLUSHF_all )
     {
@@ -749,12 +749,13 @@ static int __must_check cf_check iommu_flush_iotlb(struct domain *d, dfn_t dfn,
 
     /*
      * No need pcideves_lock here because we have flush
-     * when assign/deassign device
+     * when assign/deassign device.  The invalidations of all IOMMUs are
+     * waited for together at the end.
      */
+    qinval_batch_begin();
+
     for_each_drhd_unit ( drhd )
     {
-        int rc;
-
         iommu = drhd->iommu;
 
         if ( !test_bit(iommu->index, hd->arch.vtd.iommu_bitmap) )
@@ -782,6 +783,10 @@ static int __must_check cf_check iommu_flush_iotlb(struct domain *d, dfn_t dfn,
             ret = rc;
     }
 
+    rc = qinval_batch_end();
+    if ( !ret )
+        ret = rc;
+
     return ret;
 }
 
@@ -3087,8 +3092,8 @@ static void cf_check vtd_dump_page_tables(struct domain *d)
 {
     const struct domain_iommu *hd = dom_iommu(d);
 
-    printk(VTDPREFIX" %pd table has %d levels\n", d,
-           agaw_to_level(hd->arch.vtd.agaw));
+    printk(VTDPREFIX" %pd table has %d levels, %u pages\n", d,
+           agaw_to_level(hd->arch.vtd.agaw), hd->arch.pgtables.nr);
     vtd_dump_page_table_level(hd->arch.vtd.pgd_maddr,
                               agaw_to_level(hd->arch.vtd.agaw), 0, 0);
 }
@@ -20,6 +20,8 @@
 
 #include <xen/sched.h>
 #include <xen/iommu.h>
+#include <xen/irq.h>
+#include <xen/perfc.h>
 #include <xen/time.h>
 #include <xen/pci.h>
 #include <xen/pci_regs.h>
@@ -39,6 +41,27 @@
 static unsigned int __read_mostly qi_pg_order;
 static unsigned int __read_mostly qi_entry_nr;
 
+/*
+ * While a batch is open on a CPU, IOTLB and context invalidations are only
+ * queued.  Closing the batch issues one wait descriptor per IOMMU with
+ * queued invalidations, and then waits for all of them together.
+ */
+#define QINVAL_BATCH_IOMMUS 8
+/* Invalidations queued on an IOMMU before waiting for them anyway. */
+#define QINVAL_BATCH_MAX    16
+
+struct qinval_batch {
+    unsigned int depth;
+    unsigned int nr;
+    struct {
+        struct vtd_iommu *iommu;
+        unsigned int queued;
+    } ent[QINVAL_BATCH_IOMMUS];
+    uint32_t status[QINVAL_BATCH_IOMMUS];
+};
+
+static DEFINE_PER_CPU(struct qinval_batch, qinval_batch);
+
 static int __must_check invalidate_sync(struct vtd_iommu *iommu);
 
 static void print_qi_regs(const struct vtd_iommu *iommu)
@@ -86,10 +109,9 @@ static struct qinval_entry *qi_map_entry(const struct vtd_iommu *iommu,
     return &entries[index % (PAGE_SIZE / sizeof(*entries))];
 }
 
-static int __must_check queue_invalidate_context_sync(struct vtd_iommu *iommu,
-                                                      u16 did, u16 source_id,
-                                                      u8 function_mask,
-                                                      u8 granu)
+static void queue_invalidate_context(struct vtd_iommu *iommu,
+                                     u16 did, u16 source_id,
+                                     u8 function_mask, u8 granu)
 {
     unsigned long flags;
     unsigned int index;
@@ -112,14 +134,11 @@ static int __must_check queue_invalidate_context_sync(struct vtd_iommu *iommu,
     spin_unlock_irqrestore(&iommu->register_lock, flags);
 
     unmap_vtd_domain_page(qinval_entry);
-
-    return invalidate_sync(iommu);
 }
 
-static int __must_check queue_invalidate_iotlb_sync(struct vtd_iommu *iommu,
-                                                    u8 granu, u8 dr, u8 dw,
-                                                    u16 did, u8 am, u8 ih,
-                                                    u64 addr)
+static void queue_invalidate_iotlb(struct vtd_iommu *iommu,
+                                   u8 granu, u8 dr, u8 dw,
+                                   u16 did, u8 am, u8 ih, u64 addr)
 {
     unsigned long flags;
     unsigned int index;
@@ -146,22 +165,17 @@ static int __must_check queue_invalidate_iotlb_sync(struct vtd_iommu *iommu,
     spin_unlock_irqrestore(&iommu->register_lock, flags);
 
     unmap_vtd_domain_page(qinval_entry);
-
-    return invalidate_sync(iommu);
 }
 
-static int __must_check queue_invalidate_wait(struct vtd_iommu *iommu,
-                                              u8 iflag, u8 sw, u8 fn,
-                                              bool_t flush_dev_iotlb)
+static void qinval_post_wait(struct vtd_iommu *iommu, u8 iflag, u8 sw, u8 fn,
+                             uint32_t *status)
 {
-    static DEFINE_PER_CPU(uint32_t, poll_slot);
     unsigned int index;
     unsigned long flags;
     struct qinval_entry *qinval_entry;
-    uint32_t *this_poll_slot = &this_cpu(poll_slot);
 
     spin_lock_irqsave(&iommu->register_lock, flags);
-    ACCESS_ONCE(*this_poll_slot) = QINVAL_STAT_INIT;
+    ACCESS_ONCE(*status) = QINVAL_STAT_INIT;
     index = qinval_next_index(iommu);
     qinval_entry = qi_map_entry(iommu, index);
 
@@ -171,41 +185,57 @@ static int __must_check queue_invalidate_wait(struct vtd_iommu *iommu,
     qinval_entry->q.inv_wait_dsc.lo.fn = fn;
     qinval_entry->q.inv_wait_dsc.lo.res_1 = 0;
     qinval_entry->q.inv_wait_dsc.lo.sdata = QINVAL_STAT_DONE;
-    qinval_entry->q.inv_wait_dsc.hi.saddr = virt_to_maddr(this_poll_slot);
+    qinval_entry->q.inv_wait_dsc.hi.saddr = virt_to_maddr(status);
 
     qinval_update_qtail(iommu, index);
     spin_unlock_irqrestore(&iommu->register_lock, flags);
 
     unmap_vtd_domain_page(qinval_entry);
+}
 
-    /* Now we don't support interrupt method */
-    if ( sw )
-    {
-        static unsigned int __read_mostly threshold = 1;
-        s_time_t start = NOW();
-        s_time_t timeout = start + (flush_dev_iotlb
-                                    ? iommu_dev_iotlb_timeout
-                                    : 100) * MILLISECS(threshold);
+static void qinval_poll_wait(const struct vtd_iommu *iommu,
+                             const uint32_t *status, bool flush_dev_iotlb)
+{
+    static unsigned int __read_mostly threshold = 1;
+    s_time_t start = NOW();
+    s_time_t timeout = start + (flush_dev_iotlb
+                                ? iommu_dev_iotlb_timeout
+                                : 100) * MILLISECS(threshold);
 
-        while ( ACCESS_ONCE(*this_poll_slot) != QINVAL_STAT_DONE )
+    while ( ACCESS_ONCE(*status) != QINVAL_STAT_DONE )
+    {
+        if ( timeout && NOW() > timeout )
         {
-            if ( timeout && NOW() > timeout )
-            {
-                threshold |= threshold << 1;
-                printk(XENLOG_WARNING VTDPREFIX
-                       " IOMMU#%u: QI%s wait descriptor taking too long\n",
-                       iommu->index, flush_dev_iotlb ? " dev" : "");
-                print_qi_regs(iommu);
-                timeout = 0;
-            }
-            cpu_relax();
+            threshold |= threshold << 1;
+            printk(XENLOG_WARNING VTDPREFIX
+                   " IOMMU#%u: QI%s wait descriptor taking too long\n",
+                   iommu->index, flush_dev_iotlb ? " dev" : "");
+            print_qi_regs(iommu);
+            timeout = 0;
         }
+        cpu_relax();
+    }
 
-        if ( !timeout )
-            printk(XENLOG_WARNING VTDPREFIX
-                   " IOMMU#%u: QI%s wait descriptor took %lums\n",
-                   iommu->index, flush_dev_iotlb ? " dev" : "",
-                   (NOW() - start) / 10000000);
+    if ( !timeout )
+        printk(XENLOG_WARNING VTDPREFIX
+               " IOMMU#%u: QI%s wait descriptor took %lums\n",
+               iommu->index, flush_dev_iotlb ? " dev" : "",
+               (NOW() - start) / 10000000);
+}
+
+static int __must_check queue_invalidate_wait(struct vtd_iommu *iommu,
+                                              u8 iflag, u8 sw, u8 fn,
+                                              bool_t flush_dev_iotlb)
+{
+    static DEFINE_PER_CPU(uint32_t, poll_slot);
+    uint32_t *this_poll_slot = &this_cpu(poll_slot);
+
+    qinval_post_wait(iommu, iflag, sw, fn, this_poll_slot);
+
+    /* Now we don't support interrupt method */
+    if ( sw )
+    {
+        qinval_poll_wait(iommu, this_poll_slot, flush_dev_iotlb);
 
         return 0;
     }
@@ -220,6 +250,77 @@ static int __must_check invalidate_sync(struct vtd_iommu *iommu)
     return queue_invalidate_wait(iommu, 0, 1, 1, 0);
 }
 
+/*
+ * Wait for a just queued invalidation to complete, or leave that to the end
+ * of the batch open on this CPU.  Interrupt context can't make use of a
+ * batch it may have interrupted.
+ */
+static int __must_check qinval_sync_or_defer(struct vtd_iommu *iommu)
+{
+    struct qinval_batch *batch = &this_cpu(qinval_batch);
+    unsigned int i;
+
+    if ( !batch->depth || in_irq() )
+        return invalidate_sync(iommu);
+
+    for ( i = 0; i < batch->nr; i++ )
+        if ( batch->ent[i].iommu == iommu )
+            break;
+
+    if ( i == batch->nr )
+    {
+        if ( i == ARRAY_SIZE(batch->ent) )
+            return invalidate_sync(iommu);
+
+        batch->ent[i].iommu = iommu;
+        batch->ent[i].queued = 0;
+        batch->nr++;
+    }
+
+    if ( ++batch->ent[i].queued < QINVAL_BATCH_MAX )
+    {
+        perfc_incr(qinval_deferred);
+        return 0;
+    }
+
+    /* Bound the number of descriptors a CPU can have in flight. */
+    batch->ent[i].queued = 0;
+
+    return invalidate_sync(iommu);
+}
+
+void qinval_batch_begin(void)
+{
+    this_cpu(qinval_batch).depth++;
+}
+
+int qinval_batch_end(void)
+{
+    struct qinval_batch *batch = &this_cpu(qinval_batch);
+    unsigned int i;
+
+    ASSERT(batch->depth);
+    if ( --batch->depth )
+        return 0;
+
+    /*
+     * Post all the wait descriptors before polling any of them, so that the
+     * IOMMUs process their queues in parallel.
+     */
+    for ( i = 0; i < batch->nr; i++ )
+        qinval_post_wait(batch->ent[i].iommu, 0, 1, 1, &batch->status[i]);
+
+    for ( i = 0; i < batch->nr; i++ )
+    {
+        perfc_incr(qinval_batch_wait);
+        qinval_poll_wait(batch->ent[i].iommu, &batch->status[i], false);
+    }
+
+    batch->nr = 0;
+
+    return 0;
+}
+
 static int __must_check dev_invalidate_sync(struct vtd_iommu *iommu,
                                             struct pci_dev *pdev, u16 did)
 {
@@ -348,8 +449,10 @@ static int __must_check cf_check flush_context_qi(
             did = 0;
     }
 
-    return queue_invalidate_context_sync(iommu, did, sid, fm,
-                                         type >> DMA_CCMD_INVL_GRANU_OFFSET);
+    queue_invalidate_context(iommu, did, sid, fm,
+                             type >> DMA_CCMD_INVL_GRANU_OFFSET);
+
+    return qinval_sync_or_defer(iommu);
 }
 
 static int __must_check cf_check flush_iotlb_qi(
@@ -374,9 +477,12 @@ static int __must_check cf_check flush_iotlb_qi(
     if (cap_read_drain(iommu->cap))
         dr = 1;
     /* Need to conside the ih bit later */
-    rc = queue_invalidate_iotlb_sync(iommu,
-                                     type >> DMA_TLB_FLUSH_GRANU_OFFSET,
-                                     dr, dw, did, size_order, 0, addr);
+    queue_invalidate_iotlb(iommu, type >> DMA_TLB_FLUSH_GRANU_OFFSET,
+                           dr, dw, did, size_order, 0, addr);
+
+    /* Device TLBs may only be invalidated once the IOTLB is. */
+    rc = flush_dev_iotlb ? invalidate_sync(iommu)
+                         : qinval_sync_or_defer(iommu);
     if ( !ret )
         ret = rc;
 
@@ -407,15 +513,19 @@ int enable_qinval(struct vtd_iommu *iommu)
         if ( !qi_entry_nr )
         {
             /*
-             * With the present synchronous model, we need two slots for every
-             * operation (the operation itself and a wait descriptor).  There
-             * can be one such pair of requests pending per CPU.  One extra
-             * entry is needed as the ring is considered full when there's
-             * only one entry left.
+             * Synchronous operations need two slots (the operation itself and
+             * a wait descriptor).  A batch can have up to QINVAL_BATCH_MAX
+             * operations followed by a wait descriptor pending per CPU.  One
+             * extra entry is needed as the ring is considered full when
+             * there's only one entry left.  Should batches not fit, CPUs
+             * merely wait for the hardware to make room.
              */
             BUILD_BUG_ON(CONFIG_NR_CPUS * 2 >= QINVAL_MAX_ENTRY_NR);
-            qi_pg_order = get_order_from_bytes((num_present_cpus() * 2 + 1) *
-                                               sizeof(struct qinval_entry));
+            qi_pg_order = get_order_from_bytes(
+                min_t(unsigned int,
+                      num_present_cpus() * (QINVAL_BATCH_MAX + 1) + 1,
+                      QINVAL_MAX_ENTRY_NR - 1) *
+                sizeof(struct qinval_entry));
             qi_entry_nr = (PAGE_SIZE << qi_pg_order) /
                           sizeof(struct qinval_entry);
 
@@ -17,6 +17,7 @@
 #include <xen/iocap.h>
 #include <xen/iommu.h>
 #include <xen/paging.h>
+#include <xen/perfc.h>
 #include <xen/guest_access.h>
 #include <xen/event.h>
 #include <xen/softirq.h>
@@ -543,6 +544,8 @@ int iommu_free_pgtables(struct domain *d)
     while ( (pg = page_list_remove_head(&hd->arch.pgtables.list)) )
     {
         free_domheap_page(pg);
+        hd->arch.pgtables.nr--;
+        perfc_incr(iommu_pt_frees);
 
         if ( !(++done & 0xff) && general_preempt_check() )
             return -ERESTART;
@@ -598,8 +601,11 @@ struct page_info *iommu_alloc_pgtable(struct domain_iommu *hd,
 
     spin_lock(&hd->arch.pgtables.lock);
     page_list_add(pg, &hd->arch.pgtables.list);
+    hd->arch.pgtables.nr++;
     spin_unlock(&hd->arch.pgtables.lock);
 
+    perfc_incr(iommu_pt_allocs);
+
     return pg;
 }
 
@@ -643,8 +649,11 @@ void iommu_queue_free_pgtable(struct domain_iommu *hd, struct page_info *pg)
 
     spin_lock(&hd->arch.pgtables.lock);
     page_list_del(pg, &hd->arch.pgtables.list);
+    hd->arch.pgtables.nr--;
     spin_unlock(&hd->arch.pgtables.lock);
 
+    perfc_incr(iommu_pt_frees);
+
     page_list_add_tail(pg, &per_cpu(free_pgt_list, cpu));
 
     tasklet_schedule(&per_cpu(free_pgt_tasklet, cpu));
@@ -28,9 +28,11 @@ struct vpci_register {
     unsigned int size;
     unsigned int offset;
     void *private;
-    struct list_head node;
 };
 
+/* Initial size of the handlers array, grown by doubling. */
+#define VPCI_HANDLERS_MIN 16
+
 #ifdef __XEN__
 extern vpci_register_init_t *const __start_vpci_array[];
 extern vpci_register_init_t *const __end_vpci_array[];
@@ -42,15 +44,9 @@ void vpci_remove_device(struct pci_dev *pdev)
         return;
 
     spin_lock(&pdev->vpci->lock);
-    while ( !list_empty(&pdev->vpci->handlers) )
-    {
-        struct vpci_register *r = list_first_entry(&pdev->vpci->handlers,
-                                                   struct vpci_register,
-                                                   node);
-
-        list_del(&r->node);
-        xfree(r);
-    }
+    xfree(pdev->vpci->handlers);
+    pdev->vpci->handlers = NULL;
+    pdev->vpci->nr_handlers = pdev->vpci->max_handlers = 0;
     spin_unlock(&pdev->vpci->lock);
     if ( pdev->vpci->msix )
     {
@@ -82,7 +78,6 @@ int vpci_add_handlers(struct pci_dev *pdev)
     if ( !pdev->vpci )
         return -ENOMEM;
 
-    INIT_LIST_HEAD(&pdev->vpci->handlers);
     spin_lock_init(&pdev->vpci->lock);
 
     for ( i = 0; i < NUM_VPCI_INIT; i++ )
@@ -99,6 +94,30 @@ int vpci_add_handlers(struct pci_dev *pdev)
 }
 #endif /* __XEN__ */
 
+/*
+ * Return the index of the first handler not ending at or below offset, i.e.
+ * the first one an access starting at offset can touch.  The handlers don't
+ * overlap, so they are sorted by their end offsets too.
+ */
+static unsigned int vpci_find_register(const struct vpci *vpci,
+                                       unsigned int offset)
+{
+    unsigned int lo = 0, hi = vpci->nr_handlers;
+
+    while ( lo < hi )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        const struct vpci_register *r = &vpci->handlers[mid];
+
+        if ( r->offset + r->size <= offset )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
 static int vpci_register_cmp(const struct vpci_register *r1,
                              const struct vpci_register *r2)
 {
@@ -143,8 +162,14 @@ int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
                       vpci_write_t *write_handler, unsigned int offset,
                       unsigned int size, void *data)
 {
-    struct list_head *prev;
-    struct vpci_register *r;
+    const struct vpci_register r = {
+        .read = read_handler ?: vpci_ignored_read,
+        .write = write_handler ?: vpci_ignored_write,
+        .size = size,
+        .offset = offset,
+        .private = data,
+    };
+    unsigned int i;
 
     /* Some sanity checks. */
     if ( (size != 1 && size != 2 && size != 4) ||
@@ -152,36 +177,42 @@ int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
          (!read_handler && !write_handler) )
         return -EINVAL;
 
-    r = xmalloc(struct vpci_register);
-    if ( !r )
-        return -ENOMEM;
-
-    r->read = read_handler ?: vpci_ignored_read;
-    r->write = write_handler ?: vpci_ignored_write;
-    r->size = size;
-    r->offset = offset;
-    r->private = data;
-
     spin_lock(&vpci->lock);
 
-    /* The list of handlers must be kept sorted at all times. */
-    list_for_each ( prev, &vpci->handlers )
+    /* The array of handlers must be kept sorted at all times. */
+    i = vpci_find_register(vpci, offset);
+    if ( i < vpci->nr_handlers && !vpci_register_cmp(&r, &vpci->handlers[i]) )
     {
-        const struct vpci_register *this =
-            list_entry(prev, const struct vpci_register, node);
-        int cmp = vpci_register_cmp(r, this);
+        spin_unlock(&vpci->lock);
+        return -EEXIST;
+    }
 
-        if ( cmp < 0 )
-            break;
-        if ( cmp == 0 )
+    if ( vpci->nr_handlers == vpci->max_handlers )
+    {
+        unsigned int nr = vpci->max_handlers ? vpci->max_handlers * 2
+                                             : VPCI_HANDLERS_MIN;
+        struct vpci_register *handlers = xmalloc_array(struct vpci_register,
+                                                       nr);
+
+        if ( !handlers )
         {
             spin_unlock(&vpci->lock);
-            xfree(r);
-            return -EEXIST;
+            return -ENOMEM;
         }
+
+        if ( vpci->nr_handlers )
+            memcpy(handlers, vpci->handlers,
+                   vpci->nr_handlers * sizeof(*handlers));
+        xfree(vpci->handlers);
+        vpci->handlers = handlers;
+        vpci->max_handlers = nr;
     }
 
-    list_add_tail(&r->node, prev);
+    memmove(&vpci->handlers[i + 1], &vpci->handlers[i],
+            (vpci->nr_handlers - i) * sizeof(*vpci->handlers));
+    vpci->handlers[i] = r;
+    vpci->nr_handlers++;
+
     spin_unlock(&vpci->lock);
 
     return 0;
@@ -190,28 +221,21 @@ int vpci_add_register(struct vpci *vpci, vpci_read_t *read_handler,
 int vpci_remove_register(struct vpci *vpci, unsigned int offset,
                          unsigned int size)
 {
-    const struct vpci_register r = { .offset = offset, .size = size };
-    struct vpci_register *rm;
+    unsigned int i;
 
     spin_lock(&vpci->lock);
-    list_for_each_entry ( rm, &vpci->handlers, node )
-    {
-        int cmp = vpci_register_cmp(&r, rm);
 
-        /*
-         * NB: do not use a switch so that we can use break to
-         * get out of the list loop earlier if required.
-         */
-        if ( !cmp && rm->offset == offset && rm->size == size )
-        {
-            list_del(&rm->node);
-            spin_unlock(&vpci->lock);
-            xfree(rm);
-            return 0;
-        }
-        if ( cmp <= 0 )
-            break;
+    i = vpci_find_register(vpci, offset);
+    if ( i < vpci->nr_handlers && vpci->handlers[i].offset == offset &&
+         vpci->handlers[i].size == size )
+    {
+        vpci->nr_handlers--;
+        memmove(&vpci->handlers[i], &vpci->handlers[i + 1],
+                (vpci->nr_handlers - i) * sizeof(*vpci->handlers));
+        spin_unlock(&vpci->lock);
+        return 0;
     }
+
     spin_unlock(&vpci->lock);
 
     return -ENOENT;
@@ -323,7 +347,7 @@ uint32_t vpci_read(pci_sbdf_t sbdf, unsigned int reg, unsigned int size)
     const struct domain *d = current->domain;
     const struct pci_dev *pdev;
     const struct vpci_register *r;
-    unsigned int data_offset = 0;
+    unsigned int i, data_offset = 0;
     uint32_t data = ~(uint32_t)0;
 
     if ( !size )
@@ -340,20 +364,22 @@ uint32_t vpci_read(pci_sbdf_t sbdf, unsigned int reg, unsigned int size)
     spin_lock(&pdev->vpci->lock);
 
     /* Read from the hardware or the emulated register handlers. */
-    list_for_each_entry ( r, &pdev->vpci->handlers, node )
+    for ( i = vpci_find_register(pdev->vpci, reg);
+          i < pdev->vpci->nr_handlers; i++ )
     {
         const struct vpci_register emu = {
             .offset = reg + data_offset,
             .size = size - data_offset
         };
-        int cmp = vpci_register_cmp(&emu, r);
+        int cmp;
         uint32_t val;
         unsigned int read_size;
 
+        r = &pdev->vpci->handlers[i];
+        cmp = vpci_register_cmp(&emu, r);
         if ( cmp < 0 )
             break;
-        if ( cmp > 0 )
-            continue;
+        ASSERT(!cmp);
 
         if ( emu.offset < r->offset )
         {
@@ -426,7 +452,7 @@ void vpci_write(pci_sbdf_t sbdf, unsigned int reg, unsigned int size,
     const struct domain *d = current->domain;
     const struct pci_dev *pdev;
     const struct vpci_register *r;
-    unsigned int data_offset = 0;
+    unsigned int i, data_offset = 0;
     const unsigned long *ro_map = pci_get_ro_map(sbdf.seg);
 
     if ( !size )
@@ -453,19 +479,21 @@ void vpci_write(pci_sbdf_t sbdf, unsigned int reg, unsigned int size,
     spin_lock(&pdev->vpci->lock);
 
     /* Write the value to the hardware or emulated registers. */
-    list_for_each_entry ( r, &pdev->vpci->handlers, node )
+    for ( i = vpci_find_register(pdev->vpci, reg);
+          i < pdev->vpci->nr_handlers; i++ )
     {
         const struct vpci_register emu = {
             .offset = reg + data_offset,
             .size = size - data_offset
         };
-        int cmp = vpci_register_cmp(&emu, r);
+        int cmp;
         unsigned int write_size;
 
+        r = &pdev->vpci->handlers[i];
+        cmp = vpci_register_cmp(&emu, r);
         if ( cmp < 0 )
             break;
-        if ( cmp > 0 )
-            continue;
+        ASSERT(!cmp);
 
         if ( emu.offset < r->offset )
         {
@@ -21,7 +21,7 @@
 #include "hvm/save.h"
 #include "memory.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x00000015
+#define XEN_DOMCTL_INTERFACE_VERSION 0x00000016
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -197,6 +197,30 @@ struct xen_domctl_getpageframeinfo3 {
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
 
+/*
+ * Per-vCPU dirty rings (HAP only, log-dirty mode must be enabled).
+ *
+ * ENABLE allocates a ring of `pages' entries for each vCPU, which must be a
+ * power of two between XEN_DIRTY_RING_MIN_ENTRIES and
+ * XEN_DIRTY_RING_MAX_ENTRIES.  The rings are mapped with
+ * XENMEM_acquire_resource (XENMEM_resource_dirty_ring, id == vcpu), and
+ * are freed when log-dirty mode is disabled.
+ *
+ * Each page newly marked in the log-dirty bitmap is also appended to the
+ * ring of the vCPU which dirtied it.  Once the consumer has processed
+ * entries, it advances cons and issues RESET, which clears the reported
+ * pages in the bitmap and write-protects them again.  The page
+ * contents must only be read after the RESET covering them, so that later
+ * writes are reported again.  A vCPU whose ring is close to full is paused
+ * until RESET frees up space.  Pages which Xen failed to append, as signalled by
+ * XEN_DIRTY_RING_OVERFLOW, are still recorded in the bitmap, and are
+ * collected with CLEAN, which clears the flag.  Pages dirtied on behalf of
+ * the domain (e.g. by device models) are never appended: they set the flag
+ * in vCPU0's ring.
+ */
+#define XEN_DOMCTL_SHADOW_OP_DIRTY_RING_ENABLE 13
+#define XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET  14
+
 /*
  * Memory allocation accessors.  These APIs are broken and will be removed.
  * Use XEN_DOMCTL_{get,set}_paging_mempool_size instead.
@@ -242,6 +266,13 @@ struct xen_domctl_getpageframeinfo3 {
   * writably by the hypervisor in the dirty bitmap.
   */
 #define XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL   (1 << 0)
+ /*
+  * Return the dirty pages as a list of pfns in dirty_pfns rather than as a
+  * bitmap, provided there are no more than nr_dirty_pfns of them.  Xen
+  * clears this flag from mode on return if it filled dirty_bitmap instead,
+  * which is therefore required as well.
+  */
+#define XEN_DOMCTL_SHADOW_LOGDIRTY_PFN_LIST (1 << 1)
 
 struct xen_domctl_shadow_op_stats {
     uint32_t fault_count;
@@ -263,7 +294,36 @@ struct xen_domctl_shadow_op {
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
+
+    /* OP_PEEK / OP_CLEAN with XEN_DOMCTL_SHADOW_LOGDIRTY_PFN_LIST */
+    XEN_GUEST_HANDLE_64(uint64) dirty_pfns;
+    /* IN: Capacity of dirty_pfns.  OUT: Number of pfns returned. */
+    uint32_t       nr_dirty_pfns;
+    uint32_t       pad;
+};
+
+/*
+ * Layout of a dirty ring: a header frame followed by the ring of entries,
+ * which XEN_DIRTY_RING_ENTRIES() returns given a mapping of the whole ring.
+ * Each entry is a guest frame number.  The pointers are free running, and
+ * index the entries modulo nr_entries.
+ */
+struct xen_dirty_ring {
+    /* Written by Xen. */
+    uint32_t prod;
+    uint32_t nr_entries;
+#define _XEN_DIRTY_RING_OVERFLOW 0
+#define XEN_DIRTY_RING_OVERFLOW  (1u << _XEN_DIRTY_RING_OVERFLOW)
+    uint32_t flags;
+    uint8_t  pad0[52];
+    /* Written by the consumer. */
+    uint32_t cons;
+    uint8_t  pad1[4096 - 68];
 };
+typedef struct xen_dirty_ring xen_dirty_ring_t;
+#define XEN_DIRTY_RING_ENTRIES(ring) ((uint64_t *)((ring) + 1))
+#define XEN_DIRTY_RING_MIN_ENTRIES (2 * 4096 / 8)
+#define XEN_DIRTY_RING_MAX_ENTRIES (64 * 4096 / 8)
 
 
 /* XEN_DOMCTL_max_mem */
@@ -60,6 +60,7 @@
 #ifdef __XEN__
 #define EVTCHNOP_reset_cont      14
 #endif
+#define EVTCHNOP_send_batch      15
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -298,6 +299,25 @@ struct evtchn_set_priority {
 };
 typedef struct evtchn_set_priority evtchn_set_priority_t;
 
+/*
+ * EVTCHNOP_send_batch: As EVTCHNOP_send, for each port of an array of local
+ * ports, in order.  Processing stops at the first port which can't be sent
+ * to, with the error of EVTCHNOP_send for that port being returned.
+ * NOTES:
+ *  1. <done> must be zero on entry.  On return it holds the number of ports
+ *     notified, so the port which failed (if any) is <ports>[<done>].
+ */
+struct evtchn_send_batch {
+    /* IN parameters. */
+    uint32_t nr_ports;
+    /* IN/OUT parameters. */
+    uint32_t done;
+    /* IN parameters. */
+    evtchn_port_t ports[XEN_FLEX_ARRAY_DIM];
+};
+typedef struct evtchn_send_batch evtchn_send_batch_t;
+DEFINE_XEN_GUEST_HANDLE(evtchn_send_batch_t);
+
 /*
  * ` enum neg_errnoval
  * ` HYPERVISOR_event_channel_op_compat(struct evtchn_op *op)
@@ -44,13 +44,19 @@ typedef uint16_t ioservid_t;
  * hvm_op.h. If the value is HVM_IOREQSRV_BUFIOREQ_OFF then  the buffered
  * ioreq ring will not be allocated and hence all emulation requests to
  * this server will be synchronous.
+ *
+ * If the value is HVM_IOREQSRV_BUFIOREQ_RING, the ring has
+ * (1 << <bufioreq_order>) frames of slots, following its header frame.
+ * <bufioreq_order> must be zero for all other values.
  */
 #define XEN_DMOP_create_ioreq_server 1
 
 struct xen_dm_op_create_ioreq_server {
     /* IN - should server handle buffered ioreqs */
     uint8_t handle_bufioreq;
-    uint8_t pad[3];
+    /* IN - size of a HVM_IOREQSRV_BUFIOREQ_RING ring */
+    uint8_t bufioreq_order;
+    uint8_t pad[2];
     /* OUT - server id */
     ioservid_t id;
 };
@@ -181,6 +181,12 @@ DEFINE_XEN_GUEST_HANDLE(xen_hvm_get_mem_type_t);
  * the pointer pair gets read atomically:
  */
 #define HVM_IOREQSRV_BUFIOREQ_ATOMIC 2
+/*
+ * Use a multi-frame buffered_ioreq_ring (see ioreq.h) with notification
+ * suppression, instead of a single buffered_iopage.  The ring can only be
+ * mapped using XENMEM_acquire_resource.
+ */
+#define HVM_IOREQSRV_BUFIOREQ_RING   3
 
 #endif /* defined(__XEN__) || defined(__XEN_TOOLS__) */
 
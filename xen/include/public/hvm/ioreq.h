@@ -81,6 +81,35 @@ struct buffered_iopage {
 }; /* NB. Size of this structure must be no greater than one page. */
 typedef struct buffered_iopage buffered_iopage_t;
 
+/*
+ * Multi-frame buffered ioreq ring, used by HVM_IOREQSRV_BUFIOREQ_RING.
+ *
+ * The first frame holds the header, and is followed by (1 << order) frames
+ * of slots, which IOREQ_BUFFER_RING_SLOTS() returns given a mapping of the
+ * whole ring.  Slots are as above, with 8-byte requests taking two slots.
+ * The pointers are free running, and index the slots modulo nr_slots, which
+ * is a power of two.
+ *
+ * Xen only signals the buffered event channel when write_pointer moves past
+ * event_pointer.  Before waiting for the event channel, a consumer which
+ * found the ring empty sets event_pointer to read_pointer + 1, and checks
+ * write_pointer once more (cf. RING_FINAL_CHECK_FOR_REQUESTS() in
+ * io/ring.h).
+ */
+#define IOREQ_BUFFER_RING_MAX_ORDER 4
+struct buffered_ioreq_ring {
+    /* Written by the consumer. */
+    uint32_t read_pointer;
+    uint32_t event_pointer;
+    uint8_t  pad0[56];
+    /* Written by Xen. */
+    uint32_t write_pointer;
+    uint32_t nr_slots;
+    uint8_t  pad1[4096 - 72];
+};
+typedef struct buffered_ioreq_ring buffered_ioreq_ring_t;
+#define IOREQ_BUFFER_RING_SLOTS(ring) ((buf_ioreq_t *)((ring) + 1))
+
 /*
  * ACPI Control/Event register locations. Location is controlled by a
  * version number in HVM_PARAM_ACPI_IOPORTS_LOCATION.
@@ -618,6 +618,7 @@ struct xen_mem_acquire_resource {
 #define XENMEM_resource_ioreq_server 0
 #define XENMEM_resource_grant_table 1
 #define XENMEM_resource_vmtrace_buf 2
+#define XENMEM_resource_dirty_ring 3
 
     /*
      * IN - a type-specific resource identifier, which must be zero
@@ -625,6 +626,7 @@ struct xen_mem_acquire_resource {
      *
      * type == XENMEM_resource_ioreq_server -> id == ioreq server id
      * type == XENMEM_resource_grant_table -> id defined below
+     * type == XENMEM_resource_dirty_ring -> id == vcpu
      */
     uint32_t id;
 
@@ -664,6 +666,8 @@ struct xen_mem_acquire_resource {
 
 #define XENMEM_resource_ioreq_server_frame_bufioreq 0
 #define XENMEM_resource_ioreq_server_frame_ioreq(n) (1 + (n))
+/* Frames of a HVM_IOREQSRV_BUFIOREQ_RING ring, starting with its header. */
+#define XENMEM_resource_ioreq_server_frame_bufring(n) (0x100 + (n))
 
     /*
      * IN/OUT - If the tools domain is PV then, upon return, frame_list
@@ -191,6 +191,22 @@ struct xen_sysctl_availheap {
     uint64_aligned_t avail_bytes;/* Bytes available in the specified region. */
 };
 
+/*
+ * XEN_SYSCTL_scrub_op
+ *
+ * Query the number of free pages still to be scrubbed, on a NUMA node or on
+ * all nodes.  With XEN_SYSCTL_SCRUB_WAIT, only return once there are none
+ * left, having helped scrubbing in the meantime.
+ */
+struct xen_sysctl_scrub_op {
+    /* IN variables. */
+#define XEN_SYSCTL_SCRUB_WAIT     (1u << 0)
+    uint32_t flags;
+    int32_t  node;          /* NUMA node of interest (-1 for all nodes). */
+    /* OUT variables. */
+    uint64_aligned_t pending; /* Pages left to scrub. */
+};
+
 /* XEN_SYSCTL_get_pmstat */
 struct pm_px_val {
     uint64_aligned_t freq;        /* Px core frequency */
@@ -1087,6 +1103,7 @@ struct xen_sysctl {
 #define XEN_SYSCTL_livepatch_op                  27
 /* #define XEN_SYSCTL_set_parameter              28 */
 #define XEN_SYSCTL_get_cpu_policy                29
+#define XEN_SYSCTL_scrub_op                      30
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -1101,6 +1118,7 @@ struct xen_sysctl {
         struct xen_sysctl_debug_keys        debug_keys;
         struct xen_sysctl_getcpuinfo        getcpuinfo;
         struct xen_sysctl_availheap         availheap;
+        struct xen_sysctl_scrub_op          scrub_op;
         struct xen_sysctl_get_pmstat        get_pmstat;
         struct xen_sysctl_cpu_hotplug       cpu_hotplug;
         struct xen_sysctl_pm_op             pm_op;
@@ -22,6 +22,7 @@
 #include <xen/sched.h>
 
 #include <public/hvm/dm_op.h>
+#include <public/hvm/ioreq.h>
 
 struct ioreq_page {
     gfn_t gfn;
@@ -38,6 +39,7 @@ struct ioreq_vcpu {
 
 #define NR_IO_RANGE_TYPES (XEN_DMOP_IO_RANGE_PCI + 1)
 #define MAX_NR_IO_RANGES  256
+#define MAX_NR_BUFRING_FRAMES (1 + (1u << IOREQ_BUFFER_RING_MAX_ORDER))
 
 struct ioreq_server {
     struct domain          *target, *emulator;
@@ -49,6 +51,11 @@ struct ioreq_server {
     struct list_head       ioreq_vcpu_list;
     struct ioreq_page      bufioreq;
 
+    /* HVM_IOREQSRV_BUFIOREQ_RING header and slot frames */
+    struct page_info       *bufring_page[MAX_NR_BUFRING_FRAMES];
+    buffered_ioreq_ring_t  *bufring;
+    unsigned int           bufring_order;
+
     /* Lock to serialize access to buffered ioreq ring */
     spinlock_t             bufioreq_lock;
     evtchn_port_t          bufioreq_evtchn;
@@ -82,6 +89,8 @@ static inline bool ioreq_needs_completion(const ioreq_t *ioreq)
 
 #define HANDLE_BUFIOREQ(s) \
     ((s)->bufioreq_handling != HVM_IOREQSRV_BUFIOREQ_OFF)
+#define HANDLE_BUFRING(s) \
+    ((s)->bufioreq_handling == HVM_IOREQSRV_BUFIOREQ_RING)
 
 bool domain_has_ioreq_server(const struct domain *d);
 
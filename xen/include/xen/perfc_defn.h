@@ -81,6 +81,33 @@ PERFCOUNTER(tickled_cpu_overwritten,"csched2: tickled_cpu_overwritten")
 PERFCOUNTER(tickled_cpu_overridden, "csched2: tickled_cpu_overridden")
 #endif
 
+PERFCOUNTER(gnttab_copy_ops,        "gnttab: copy ops")
+PERFCOUNTER(gnttab_copy_src_hit,    "gnttab: copy source already claimed")
+PERFCOUNTER(gnttab_copy_dest_hit,   "gnttab: copy dest already claimed")
+PERFCOUNTER(gnttab_copy_merged,     "gnttab: copy ops merged into runs")
+PERFCOUNTER(gnttab_copy_full_page,  "gnttab: copy full pages")
+
+PERFCOUNTER(maptrack_refill,        "maptrack: magazine refills")
+PERFCOUNTER(maptrack_drain,         "maptrack: magazine drains")
+PERFCOUNTER(maptrack_grow,          "maptrack: frames allocated")
+PERFCOUNTER(maptrack_steal,         "maptrack: magazines stolen")
+PERFCOUNTER(maptrack_steal_failed,  "maptrack: steal failures")
+
+PERFCOUNTER(page_cache_hit,         "page cache: hits")
+PERFCOUNTER(page_cache_miss,        "page cache: misses")
+PERFCOUNTER(page_cache_refill,      "page cache: refills")
+PERFCOUNTER(page_cache_drain,       "page cache: drains")
+PERFCOUNTER(page_cache_drain_all,   "page cache: drains of all CPUs")
+
+PERFCOUNTER(ioreq_bufring_sent,     "ioreq: buffered ring requests")
+PERFCOUNTER(ioreq_bufring_notify,   "ioreq: buffered ring notifications")
+
+PERFCOUNTER(ioreq_select_hit,       "ioreq: server selection cache hits")
+PERFCOUNTER(ioreq_select_miss,      "ioreq: server selection cache misses")
+
+PERFCOUNTER(qinval_deferred,        "qinval: invalidation waits deferred")
+PERFCOUNTER(qinval_batch_wait,      "qinval: batch wait descriptors")
+
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
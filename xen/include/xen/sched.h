@@ -156,6 +156,17 @@ enum vio_completion {
 #endif
 };
 
+/* Lookaside cache entry of ioreq_server_select() */
+struct ioreq_select_entry {
+    unsigned long gen;      /* 0 if unused */
+    unsigned long start;    /* Accessed range, or SBDF for PCI */
+    unsigned long end;
+    uint8_t type;           /* XEN_DMOP_IO_RANGE_* */
+    uint8_t id;             /* MAX_NR_IOREQ_SERVERS if none matched */
+};
+
+#define NR_IOREQ_SELECT_ENTRIES 8
+
 struct vcpu_io {
     /* I/O request in flight to device model. */
     enum vio_completion  completion;
@@ -167,6 +178,9 @@ struct vcpu_io {
     ioreq_t              req;
     /* Arch specific info pertaining to the io request */
     struct arch_vcpu_io  info;
+    /* Recent ioreq server selections, replaced round robin */
+    struct ioreq_select_entry select[NR_IOREQ_SELECT_ENTRIES];
+    unsigned int         select_next;
 };
 
 struct vcpu
@@ -263,15 +277,13 @@ struct vcpu
     int              controller_pause_count;
 
     /*
-     * Grant table map tracking. The lock maptrack_freelist_lock
-     * protects:
-     *  - entries in the freelist
-     *  - maptrack_head
-     *  - maptrack_tail
+     * Grant table map tracking: magazine of free maptrack entries.  Only
+     * the vCPU itself updates these, except for other vCPUs stealing the
+     * whole magazine by atomically resetting maptrack_head.
      */
-    spinlock_t       maptrack_freelist_lock;
     unsigned int     maptrack_head;
-    unsigned int     maptrack_tail;
+    unsigned int     maptrack_nr;    /* Approximate, due to stealing. */
+    unsigned int     maptrack_batch; /* Refill/drain batch size. */
 
     /* IRQ-safe virq_lock protects against delivering VIRQ to stale evtchn. */
     evtchn_port_t    virq_to_evtchn[NR_VIRQS];
@@ -420,6 +432,12 @@ struct domain
     struct evtchn  **evtchn_group[NR_EVTCHN_GROUPS]; /* all other buckets */
     unsigned int     max_evtchn_port; /* max permitted port number */
     unsigned int     valid_evtchns;   /* number of allocated event channels */
+    /*
+     * Bitmap of ports in use, plus one bit per bitmap word with all bits
+     * set, to find free ports without probing.  Protected by event_lock.
+     */
+    unsigned long   *evtchn_used;
+    unsigned long   *evtchn_used_full;
     /*
      * Number of in-use event channels.  Writers should use write_atomic().
      * Readers need to use read_atomic() only when not holding event_lock.
@@ -597,6 +615,8 @@ struct domain
     struct {
         spinlock_t              lock;
         struct ioreq_server     *server[MAX_NR_IOREQ_SERVERS];
+        /* Bumped to invalidate the vCPUs' ioreq_server_select() caches */
+        unsigned long           select_gen;
     } ioreq_server;
 #endif
 
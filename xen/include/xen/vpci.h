@@ -58,8 +58,10 @@ uint32_t cf_check vpci_hw_read32(
 bool __must_check vpci_process_pending(struct vcpu *v);
 
 struct vpci {
-    /* List of vPCI handlers for a device. */
-    struct list_head handlers;
+    /* vPCI handlers for a device, sorted by offset. */
+    struct vpci_register *handlers;
+    unsigned int nr_handlers;
+    unsigned int max_handlers;
     spinlock_t lock;
 
 #ifdef __XEN__
@@ -863,6 +863,7 @@ static int cf_check flask_sysctl(int cmd)
         return domain_has_xen(current->domain, XEN__GETCPUINFO);
 
     case XEN_SYSCTL_availheap:
+    case XEN_SYSCTL_scrub_op:
         return domain_has_xen(current->domain, XEN__HEAP);
 
     case XEN_SYSCTL_get_pmstat:
@@ -1587,6 +1588,8 @@ static int cf_check flask_shadow_control(struct domain *d, uint32_t op)
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_ENABLE:
+    case XEN_DOMCTL_SHADOW_OP_DIRTY_RING_RESET:
         perm = SHADOW__LOGDIRTY;
         break;
     default: